@@ -55,6 +55,36 @@
 #endif
 
 #define U8_CONNPOOL_REGISTERED 1
+#define U8_CONNPOOL_CLOSING 2
+#define U8_CONNPOOL_MAINTAINED 4
+
+/* Connection slots are kept in chunks indexed by socket number,
+   which covers socket numbers up to Linux's default fs.nr_open */
+#define U8_CONNSLOT_CHUNK 1024
+#define U8_CONNSLOT_CHUNKS 1024
+
+/* The states of a connection slot; cached connections keep
+   the id of the caching thread in the higher bits. Idle connections
+   being checked by u8_connpool_maintain can still be taken. */
+#define U8_CONNSLOT_NONE     0
+#define U8_CONNSLOT_INUSE    1
+#define U8_CONNSLOT_IDLE     2
+#define U8_CONNSLOT_CACHED   3
+#define U8_CONNSLOT_CHECKING 4
+#define U8_CONNSLOT_STATE(state) ((state)&0x7)
+
+/* How many idle connections (across all pools) a thread
+   keeps for itself */
+#define U8_CONNPOOL_THREAD_CACHE 8
+
+/** struct U8_CONNSLOT
+    describes a socket belonging to a connection pool
+**/
+typedef struct U8_CONNSLOT {
+  unsigned int u8cs_state; /* U8_CONNSLOT_* (and caching thread) */
+  unsigned int u8cs_next; /* next idle socket (plus one) on the free stack */
+  u8_utime u8cs_idle_since; /* when the connection was last returned */
+} *u8_connslot;
 
 #define U8_LOOKUP_HOST_FLAGS 0
 #define U8_LOOKUP_HOST_SETERR 1
@@ -66,22 +96,36 @@ typedef struct U8_CONNPOOL {
   u8_string u8cp_id; /* The string passed to u8_connect to create connections for this block */
   unsigned int u8cp_bits;
   u8_mutex u8cp_lock; /* The lock used to coordinate access to the connection block */
-  u8_condvar u8cp_drained; /* This is signalled whenever the "drained" status of the
-			      connection block changes. */
-  /* How long to wait for an initial connection. Not currently used */
+  u8_condvar u8cp_drained; /* This is waited on (with u8cp_lock) when the pool
+                              is at its cap and signalled when a connection
+                              is returned to a pool with waiters */
+  /* How long to wait for a new connection; zero means to
+     use u8_connect_timeout */
   struct timespec u8cp_timeout;
   int u8cp_n_open;  /* how many open sockets in the block */
   int u8cp_n_inuse; /* how many sockets currently being used */
   int u8cp_n_waiting; /* requestors waiting for connections */
+  int u8cp_n_cached; /* idle sockets kept in thread caches */
+  int u8cp_n_checking; /* idle sockets being checked */
   int u8cp_reserve; /* how many open sockets to keep as a reserve */
   int u8cp_cap;	    /* the maximum number of open sockets allowed */
   int u8cp_reconnect_wait1; /* how long to wait before starting to try to reconnect */
   int u8cp_reconnect_wait; /* how long to wait between reconnect attempts */
   int u8cp_reconnect_tries; /* how many reconnect attempts to make */
   int u8cp_loglevel; /* Specify a log level for the connection pool */
-  u8_socket *u8cp_inuse; /* array of all sockets in use */
-  u8_socket *u8cp_free;	 /* array of all sockets available to use */
-  struct U8_CONNPOOL *u8cp_next;
+  int u8cp_check_interval; /* how often (secs) to check idle connections */
+  int u8cp_max_idle; /* close connections idle longer than this (secs), if > 0 */
+  u8_condvar u8cp_maintenance; /* wakes the maintenance thread */
+  pthread_t u8cp_maintainer; /* checks idle connections every u8cp_check_interval */
+  /* The slots for the pool's sockets, allocated on demand */
+  struct U8_CONNSLOT *u8cp_slots[U8_CONNSLOT_CHUNKS];
+  /* The free stack, with the top socket (plus one) in the low
+     32 bits and a count of updates (to avoid ABA) in the high bits */
+  unsigned long long u8cp_idle;
+  /* Identifies this pool (as opposed to others at the same address)
+     in thread caches; zero once the pool is closed */
+  unsigned int u8cp_generation;
+  struct U8_CONNPOOL *u8cp_next, *u8cp_live_next;
 } *u8_connpool;
 
 U8_EXPORT u8_condition u8_NetworkError;
@@ -92,6 +136,16 @@ U8_EXPORT int u8_warn_waitlevel;
 U8_EXPORT int u8_reconnect_wait1;
 U8_EXPORT int u8_reconnect_wait;
 U8_EXPORT int u8_reconnect_tries;
+/* Defaults for how often (secs) pools check their idle connections
+   (never if <= 0, the default) and how long (secs) connections may sit idle
+   (forever if <= 0) */
+U8_EXPORT int u8_connpool_check_interval;
+U8_EXPORT int u8_connpool_max_idle;
+/* How long (msecs) u8_connect waits before giving up (no limit if <= 0) */
+U8_EXPORT int u8_connect_timeout;
+/* How long (msecs) u8_connect waits on one address before also
+   trying the next */
+U8_EXPORT int u8_connect_stagger;
 
 /** Parses a variety of host/port syntaxes
     @param spec the address specification (a utf-8 string)
@@ -158,6 +212,37 @@ U8_EXPORT char **u8_lookup_host_x
 U8_EXPORT char **u8_lookup_host
 (u8_string hostname,int *n_addrsp,unsigned int *addr_familyp);
 
+/* Host lookups (including those for u8_connect) are cached */
+typedef struct U8_DNS_STATS {
+  long long hits; /* lookups answered from the cache */
+  long long negative_hits; /* cached failures returned */
+  long long misses; /* lookups which went to the resolver */
+  long long refreshes; /* entries renewed in the background */
+  long long temp_failures; /* temporary resolver failures (not cached) */
+  int n_entries; /* names currently in the cache */
+} U8_DNS_STATS;
+
+/* How long (secs) successful lookups are cached; no caching if <= 0 */
+U8_EXPORT int u8_dns_ttl;
+/* How long (secs) failed lookups are cached (temporary failures aren't) */
+U8_EXPORT int u8_dns_negative_ttl;
+/* How long (secs) before expiring a used entry is renewed in the
+   background (at most half of u8_dns_ttl) */
+U8_EXPORT int u8_dns_refresh;
+
+/** Gets statistics for the host lookup cache
+    @param into a pointer to a U8_DNS_STATS struct to fill in
+    @returns the number of names currently cached
+**/
+U8_EXPORT int u8_dns_stats(struct U8_DNS_STATS *into);
+
+/** Removes names from the host lookup cache, so that they will
+    be looked up again
+    @param hostname a hostname to flush, or NULL to flush all names
+    @returns the number of entries removed
+**/
+U8_EXPORT int u8_dns_flush(u8_string hostname);
+
 /** Converts a connection spec (e.g. port\@host) into canonical form,
     converting the port into a number and the host into a primary
     hostname.
@@ -175,6 +260,22 @@ U8_EXPORT u8_string u8_canonical_addr(u8_string spec);
 **/
 U8_EXPORT u8_socket u8_connect_x(u8_string spec,u8_string *addrp);
 
+/** Opens a socket to a specified port and host, giving up after
+    a specified interval. When the host has several addresses,
+    connections are attempted in parallel (alternating between
+    IPv6 and IPv4), starting a new attempt whenever one fails or
+    u8_connect_stagger milliseconds pass, and the first to succeed
+    is returned.
+    @param spec (a utf-8 string of the form port\@host)
+    @param addrp a pointer to a pointer to a utf-8 string, in
+    which is deposited identifying information for the host contacted
+    @param msecs how long to wait (in milliseconds) before
+    giving up, with no limit if this is zero or negative
+    @returns a u8_socket (int) which is a socket_id or -1 on error
+**/
+U8_EXPORT u8_socket u8_connect_within(u8_string spec,u8_string *addrp,
+                                      int msecs);
+
 /** Opens a socket to a specified port and host
     @param spec (a utf-8 string of the form port\@host)
     @returns a u8_socket (int) which is a socket_id
@@ -251,10 +352,9 @@ U8_EXPORT u8_socket u8_return_connection(u8_connpool cb,u8_socket c);
     for a connection block.  This removes it from inuse queue but
     does not add it back to the free queue.  It is intended to be used
     for connections which have been closed or are in error states.
-    If there are requests pending on the connection block, this will attempt
-    to open a new connection and add it to the block.
-    Zero is returned if the connection was closed and no new connection made,
-    -1 is returned on error, and otherwise the new connection is returned.
+    If there are requests pending on the connection block, one of them
+    will open a new connection to replace it.
+    Zero is returned if the connection was closed and -1 on error.
     @param cb a pointer to a connection block structure
     @param c a u8_socket (integer socket id)
     @returns a u8_socket (integer socket id)
@@ -299,6 +399,31 @@ U8_EXPORT u8_connpool u8_open_connpool(u8_string id,int reserve,int cap,int init
 **/
 U8_EXPORT u8_connpool u8_close_connpool(u8_connpool cb,int dowarn);
 
+/** Checks the idle connections of a connection block, closing
+    those which the other end has closed (or which have been idle
+    for more than the block's u8cp_max_idle seconds) and then
+    opening connections to bring the block back up to its reserve.
+    Connections stay available to u8_get_connection while they're
+    checked. Pools with a u8cp_check_interval (see
+    u8_connpool_maintenance) do this on their own.
+    @param cb a pointer to a connection block structure
+    @returns the number of connections closed
+**/
+U8_EXPORT int u8_connpool_maintain(u8_connpool cb);
+
+/** Configures the checking of idle connections for a connection block.
+    When a block is checked on its own (with a positive interval), it
+    has a thread which u8_close_connpool stops, so blocks passed to
+    u8_init_connpool should be closed before they're freed.
+    @param cb a pointer to a connection block structure
+    @param interval how often (in seconds) to check idle connections,
+     never if zero or negative
+    @param max_idle how long (in seconds) a connection can be idle
+     before it's closed, forever if zero or negative
+    @returns the previous interval
+**/
+U8_EXPORT int u8_connpool_maintenance(u8_connpool cb,int interval,int max_idle);
+
 /** Sets the session identifier
     This sets the global process session identifier
     @param newid a utf-8 string
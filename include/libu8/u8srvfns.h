@@ -39,11 +39,38 @@ U8_EXPORT int u8_server_loglevel;
 #define U8_CLIENT_LOG_TRANSACT 16
 #define U8_CLIENT_LOG_TRANSFER 32
 #define U8_CLIENT_LOG_QUEUE 64
-#define U8_CLIENT_FLAG_MAX 64
+#define U8_CLIENT_URING 128
+#define U8_CLIENT_PAUSED 256
+#define U8_CLIENT_SENDFILE 512
+#define U8_CLIENT_WRITEV 1024
+#define U8_CLIENT_POOLED 2048
+#define U8_CLIENT_FLAG_MAX 2048
 
 typedef struct U8_CLIENT *u8_client;
 typedef int (*u8_client_callback)(u8_client,void *);
 
+/* How a client's input is split into frames (see u8_client_framing) */
+#define U8_CLIENT_FRAME_NONE 0
+#define U8_CLIENT_FRAME_DELIM 1
+#define U8_CLIENT_FRAME_LENGTH 2
+#define U8_CLIENT_FRAME_FIXED 3
+
+/* The largest frame a client accepts by default */
+#ifndef DEFAULT_MAX_FRAME
+#define DEFAULT_MAX_FRAME (1024*1024)
+#endif
+
+/** struct U8_CLIENT_SEGMENT
+    is one piece of a response written with u8_client_writev(). When
+    the segment has been written (or the write is abandoned), its
+    freefn (if any) is called on its data and freestate.
+**/
+typedef void (*u8_segment_freefn)(unsigned char *data,void *state);
+typedef struct U8_CLIENT_SEGMENT {
+  unsigned char *data; size_t len;
+  u8_segment_freefn freefn; void *freestate;} U8_CLIENT_SEGMENT;
+typedef struct U8_CLIENT_SEGMENT *u8_client_segment;
+
 /** struct U8_CLIENT_STATS
     records client activity information for the u8srv library.
 **/
@@ -58,6 +85,71 @@ typedef struct U8_CLIENT_STATS {
   long long wsum, wsum2, wmax; int wcount;
   /* Tracking total spent in handler (clock time) */
   long long xsum, xsum2, xmax; int xcount;} U8_CLIENT_STATS;
+
+/* Latency histograms */
+
+/** struct U8_HISTOGRAM
+    is a fixed size log-linear (HDR-style) histogram of latencies in
+    microseconds. Values below 2^U8_HISTOGRAM_SUB_BITS are counted
+    exactly; above that, each power of two is split into
+    2^U8_HISTOGRAM_SUB_BITS buckets (about 3% precision). Values of
+    2^U8_HISTOGRAM_MAX_BITS (about 19 hours) or more go into the last
+    bucket. Recording is a single atomic increment, so any thread can
+    record without a lock.
+**/
+#define U8_HISTOGRAM_SUB_BITS 5
+#define U8_HISTOGRAM_MAX_BITS 36
+#define U8_HISTOGRAM_BUCKETS \
+  ((U8_HISTOGRAM_MAX_BITS-U8_HISTOGRAM_SUB_BITS+1)<<U8_HISTOGRAM_SUB_BITS)
+typedef struct U8_HISTOGRAM {
+  long long buckets[U8_HISTOGRAM_BUCKETS];} U8_HISTOGRAM;
+typedef struct U8_HISTOGRAM *u8_histogram;
+
+/* The phases which servers keep latency histograms for */
+#define U8_LATENCY_TRANSACT 0
+#define U8_LATENCY_QUEUE 1
+#define U8_LATENCY_READ 2
+#define U8_LATENCY_WRITE 3
+#define U8_LATENCY_EXEC 4
+#define U8_N_LATENCIES 5
+
+/** struct U8_SERVER_METRICS
+    holds a server's counters (connections accepted and transactions
+    completed and failed) and the count, total and maximum (in
+    microseconds) of each U8_LATENCY_* phase. Each pool thread keeps
+    its own copy (in its U8_SERVER_THREAD), which only it adds to,
+    and the listener and other threads share the server's, so that
+    u8_server_metrics() can add them up without taking any locks.
+    The gauges at the end are only filled in by u8_server_metrics().
+**/
+typedef struct U8_SERVER_METRICS {
+  long long n_accepted, n_trans, n_errs;
+  long long counts[U8_N_LATENCIES], sums[U8_N_LATENCIES];
+  long long maxes[U8_N_LATENCIES];
+  int n_busy, n_queued, n_clients, n_threads;} U8_SERVER_METRICS;
+typedef struct U8_SERVER_METRICS *u8_metrics;
+
+/** struct U8_TRACE_RECORD
+    describes a single transaction, as kept in a server's trace ring
+    (see U8_SERVER_TRACE). Times are in microseconds; started is when
+    the transaction was first taken from the queue (or, for a
+    pipelined request, when its frame arrived) and the durations are
+    its total and its time in each U8_LATENCY_* phase. The result is
+    negative if it failed. seq numbers records in the order they were
+    made, from 1.
+**/
+typedef struct U8_TRACE_RECORD {
+  unsigned long long seq;
+  int clientid, threadnum, result;
+  unsigned int n_trans;
+  u8_utime started;
+  long long durations[U8_N_LATENCIES];
+  size_t bytes;} U8_TRACE_RECORD;
+typedef struct U8_TRACE_RECORD *u8_trace_record;
+
+/* Formats for u8_server_metrics_text() */
+#define U8_METRICS_PROMETHEUS 0
+#define U8_METRICS_JSON 1
 typedef struct U8_CLIENT_STATS *u8_client_stats;
 
 #define U8_CLIENT_FIELDS				       \
@@ -67,13 +159,33 @@ typedef struct U8_CLIENT_STATS *u8_client_stats;
   unsigned int flags, n_trans, n_errs;			       \
   u8_utime started, queued, active;			       \
   u8_utime reading, writing, running;			       \
+  u8_utime idled;					       \
+  u8_utime timer; int timer_slot;			       \
+  struct U8_CLIENT *next_timer, *prev_timer;		       \
+  struct U8_CLIENT *next_idle, *prev_idle;		       \
   u8_string idstring, status;				       \
+  struct sockaddr_storage addr; size_t addrlen;		       \
   unsigned char *buf;					       \
   size_t off, len, buflen, delta;			       \
+  int sendfd; off_t sendoff;				       \
+  struct U8_CLIENT_SEGMENT *segs;			       \
+  int n_segs, segs_len, seg_next; size_t seg_off;	       \
   unsigned int ownsbuf, grows;				       \
+  int framing, frame_delim_len;				       \
+  unsigned char frame_delim[8];				       \
+  size_t frame_size, max_frame, frame_len;		       \
+  unsigned char *inbuf;					       \
+  size_t in_off, in_fill, in_len, in_scan;		       \
+  struct U8_CLIENT_REQUEST *requests, *last_request;	       \
+  int n_requests, n_inflight;				       \
+  /* For tracing, the bytes moved and, as of the start of the  \
+     transaction, its errors and phase totals */	       \
+  size_t n_moved; unsigned int trace_errs;		       \
+  long long trace_marks[4];				       \
   struct U8_CLIENT_STATS stats;				       \
   u8_client_callback callback;				       \
   void *cbstate;					       \
+  struct U8_SERVER_COROUTINE *coroutine;		       \
   struct U8_SERVER *server
 
 /** struct U8_CLIENT This structure represents a particular live
@@ -82,7 +194,9 @@ typedef struct U8_CLIENT_STATS *u8_client_stats;
     configuration and state of the client, the idstring field and
     statestring fields are strings identifying the client for logging
     and debugging, and the server field is the server (a U8_SERVER
-    struct) to which the client is connected. **/
+    struct) to which the client is connected. The idstring is only
+    generated (from the addr field) when it's first needed, so it
+    should be fetched with u8_client_idstring(). **/
 typedef struct U8_CLIENT {
   u8_socket socket;
   int clientid, threadnum;
@@ -90,19 +204,39 @@ typedef struct U8_CLIENT {
   unsigned int flags, n_trans, n_errs;
   u8_utime started, queued, active;
   u8_utime reading, writing, running;
+  u8_utime idled;
+  u8_utime timer; int timer_slot;
+  struct U8_CLIENT *next_timer, *prev_timer;
+  struct U8_CLIENT *next_idle, *prev_idle;
   u8_string idstring, status;
+  struct sockaddr_storage addr; size_t addrlen;
   unsigned char *buf;
   size_t off, len, buflen, delta;
+  int sendfd; off_t sendoff;
+  struct U8_CLIENT_SEGMENT *segs;
+  int n_segs, segs_len, seg_next; size_t seg_off;
   unsigned int ownsbuf, grows;
+  int framing, frame_delim_len;
+  unsigned char frame_delim[8];
+  size_t frame_size, max_frame, frame_len;
+  unsigned char *inbuf;
+  size_t in_off, in_fill, in_len, in_scan;
+  struct U8_CLIENT_REQUEST *requests, *last_request;
+  int n_requests, n_inflight;
+  size_t n_moved; unsigned int trace_errs;
+  long long trace_marks[4];
   struct U8_CLIENT_STATS stats;
   u8_client_callback callback;
   void *cbstate;
+  struct U8_SERVER_COROUTINE *coroutine;
   struct U8_SERVER *server;} U8_CLIENT;
 
 /* u8_init_client:
    Initializes the client structure.
    @param client a pointer to a client stucture, or NULL if one is to be consed
    @param len the length of the structure, as allocated or to be consed
+   @param addrbuf the client's address (or NULL), which is copied
+   @param addrlen the length of addrbuf
    @param sock a socket (or -1) for the client
    @param srv a pointer to the server launching the client
    Returns: a pointer to a client structure, consed if not provided.
@@ -112,6 +246,13 @@ U8_EXPORT u8_client u8_init_client(u8_client client,size_t len,
 				   u8_socket sock,u8_server srv);
 #define u8_client_init u8_init_client
 
+/** Returns a string identifying the client (by default, its address),
+    generating it from the client's address on first use.
+    @param cl a pointer to a U8_CLIENT struct
+    @returns a string (owned by the client) or NULL
+**/
+U8_EXPORT u8_string u8_client_idstring(u8_client cl);
+
 /* u8_close_client:
    Arguments: a pointer to a client
    Returns: int
@@ -164,7 +305,24 @@ typedef struct U8_SERVER_THREAD {
   long u8st_threadid;
   int u8st_slotno;
   int u8st_client;
-  void *u8st_data;}
+  void *u8st_data;
+  /* Each thread has its own queue of tasks (which other threads
+     can steal from) and sleeps on its own condvar */
+  u8_mutex u8st_lock;
+  u8_condvar u8st_wakeup;
+  u8_client *u8st_queue;
+  int u8st_queue_len, u8st_queue_head, u8st_n_queued;
+  int u8st_sleeping, u8st_woken;
+  /* With U8_SERVER_COROUTINES, the thread's idle coroutines and how
+     many of its coroutines are parked awaiting I/O */
+  struct U8_SERVER_COROUTINE *u8st_coroutines;
+  int u8st_n_coroutines, u8st_n_parked;
+  /* The CPU and NUMA node the thread is kept to (or -1) */
+  int u8st_cpu, u8st_node;
+  /* The thread's shard of the server's metrics and latency
+     histograms, which only it writes */
+  struct U8_SERVER_METRICS u8st_metrics;
+  struct U8_HISTOGRAM u8st_latencies[U8_N_LATENCIES];}
   U8_SERVER_THREAD;
 typedef struct U8_SERVER_THREAD *u8_server_thread;
 
@@ -178,7 +336,13 @@ typedef struct U8_SERVER_THREAD *u8_server_thread;
 #define U8_SERVER_LOG_TRANSACT	32
 #define U8_SERVER_LOG_TRANSFER	64
 #define U8_SERVER_LOG_QUEUE    128
-#define U8_SERVER_FLAG_MAX     128
+#define U8_SERVER_EPOLL        256
+#define U8_SERVER_IO_URING     512
+#define U8_SERVER_NONBLOCK    1024
+#define U8_SERVER_INLINE      2048
+#define U8_SERVER_COROUTINES  4096
+#define U8_SERVER_PIPELINE    8192
+#define U8_SERVER_FLAG_MAX    8192
 
 /* Argument names to u8_init_server */
 
@@ -192,17 +356,67 @@ typedef struct U8_SERVER_THREAD *u8_server_thread;
 #define U8_SERVER_BACKLOG (6)
 #define U8_SERVER_LOGLEVEL (7)
 #define U8_SERVER_TIMEOUT (8)
+#define U8_SERVER_SHARDS (9)
+#define U8_SERVER_OVERLOAD (10)
+#define U8_SERVER_IDLE_TIMEOUT (11)
+#define U8_SERVER_READ_TIMEOUT (12)
+#define U8_SERVER_WRITE_TIMEOUT (13)
+#define U8_SERVER_MIN_THREADS (14)
+#define U8_SERVER_MAX_THREADS (15)
+#define U8_SERVER_QUEUE_TARGET (16)
+#define U8_SERVER_THREAD_IDLE (17)
+#define U8_SERVER_POOL_SIZE (18)
+#define U8_SERVER_STACK_SIZE (19)
+#define U8_SERVER_PIPELINE_DEPTH (20)
+#define U8_SERVER_AFFINITY (21)
+#define U8_SERVER_CPUS (22)
+#define U8_SERVER_TRACE (23)
+#define U8_SERVER_TRACE_THRESHOLD (24)
+
+/* Thread placement policies (for U8_SERVER_AFFINITY) */
+
+/* Leave threads to the scheduler (within U8_SERVER_CPUS, if given) */
+#define U8_AFFINITY_NONE 0
+/* Pin the listener and each pool thread to its own CPU, in turn */
+#define U8_AFFINITY_CPU 1
+/* Keep each shard (by default, one per NUMA node) to a node's CPUs */
+#define U8_AFFINITY_NODE 2
+
+/* Overload policies (bits for U8_SERVER_OVERLOAD), which say what
+   to do when a ready client can't be queued because the queue is
+   full. Without any, the listener just tries again on its next pass. */
+
+/* Stop listening to the client until the queue has drained */
+#define U8_OVERLOAD_PAUSE 1
+/* Accept and immediately close new connections while overloaded */
+#define U8_OVERLOAD_REJECT 2
+/* Close the connection which has been idle the longest (at most
+   U8_SERVER_SHED_MAX every U8_SERVER_SHED_INTERVAL microseconds) and
+   stop listening to the client until the queue has drained */
+#define U8_OVERLOAD_SHED 4
 
 /* Default values */
 
 #ifndef MAX_BACKLOG
-#define MAX_BACKLOG 16
+#define MAX_BACKLOG 128
 #endif
 
 #ifndef DEFAULT_NTHREADS
 #define DEFAULT_NTHREADS 4
 #endif
 
+/* How long (in microseconds) tasks can wait in the queue, on
+   average, before a growable pool adds a thread */
+#ifndef DEFAULT_QUEUE_TARGET
+#define DEFAULT_QUEUE_TARGET 2000
+#endif
+
+/* How long (in milliseconds) a thread above the minimum can sit idle
+   before it exits */
+#ifndef DEFAULT_THREAD_IDLE
+#define DEFAULT_THREAD_IDLE 30000
+#endif
+
 #ifndef DEFAULT_INIT_CLIENTS
 #define DEFAULT_INIT_CLIENTS 32
 #endif
@@ -215,6 +429,23 @@ typedef struct U8_SERVER_THREAD *u8_server_thread;
 #define DEFAULT_MAX_QUEUE 128
 #endif
 
+/* How many freed client structs (and buffers of each size) a server
+   keeps for reuse */
+#ifndef DEFAULT_POOL_SIZE
+#define DEFAULT_POOL_SIZE 256
+#endif
+
+/* How big (in bytes) the stacks of U8_SERVER_COROUTINES handlers are */
+#ifndef DEFAULT_STACK_SIZE
+#define DEFAULT_STACK_SIZE (256*1024)
+#endif
+
+/* How many of a U8_SERVER_PIPELINE client's requests can be waiting
+   to be handled or to have their responses written */
+#ifndef DEFAULT_PIPELINE_DEPTH
+#define DEFAULT_PIPELINE_DEPTH 16
+#endif
+
 /* Argument names to u8_init_server */
 
 #define U8_SERVER_END_ARGS (-1)
@@ -230,7 +461,7 @@ typedef struct U8_SERVER_THREAD *u8_server_thread;
 /* Default values */
 
 #ifndef MAX_BACKLOG
-#define MAX_BACKLOG 16
+#define MAX_BACKLOG 128
 #endif
 
 #ifndef DEFAULT_NTHREADS
@@ -263,25 +494,56 @@ typedef struct U8_SERVER_INFO *u8_server_info;
 #define U8_SERVER_FIELDS						\
   u8_string serverid;							\
   /* Server-wide flags, whether we're shutting down, and		\
-     how many connections to start with/grow by. */			\
+     how many connections to start with (and never shrink below). */	\
   int flags, shutdown, init_clients, max_clients;			\
   /* The server addreses we're listening to for new connections */	\
   struct U8_SERVER_INFO *server_info; int n_servers;			\
   /* The connections (clients) we are currently serving */		\
   struct U8_CLIENT **clients; int n_clients, clients_len;		\
-  /* free_slot is the first slot where a new client can be stored */	\
-  int free_slot, max_slot;						\
+  /* max_slot is one past the last slot in use and free_slots is a	\
+     stack of the empty slots below it (the lowest on top after a	\
+     compaction); slots_checked is when we last considered shrinking */ \
+  int *free_slots; int n_free_slots, max_slot;			\
+  long long slots_checked;						\
   /* All sockets: n_sockets=n_servers+n_clients				\
      To simplify things, sockets_len is always the same as clients_len, \
      and we just have NULL entries for server sockets. */		\
   struct pollfd *sockets;						\
+  /* With U8_SERVER_EPOLL, sockets are registered once with this	\
+     descriptor and clients are re-armed with EPOLLONESHOT; it is -1	\
+     when we're using poll() over the sockets array. */			\
+  int epoll_fd;								\
+  /* With U8_SERVER_IO_URING, the remainder of partial client reads	\
+     and writes is handed to this ring (or NULL) */			\
+  struct U8_SERVER_URING *uring;					\
   long poll_timeout; /* Timeout value to use when selecting */		\
+  /* Idle, read and write timeouts (in msecs, none if <= 0) after	\
+     which clients are closed, and the wheel tracking deadlines */	\
+  long idle_timeout, read_timeout, write_timeout, n_timeouts;		\
+  struct U8_TIMER_WHEEL *timers;					\
+  /* Freed client structs and client buffers kept for reuse */		\
+  struct U8_CLIENT_POOL *client_pool;					\
+  /* With U8_SERVER_COROUTINES, the size of handlers' stacks */	\
+  size_t stack_size;							\
+  /* With U8_SERVER_PIPELINE, how many requests each client can have	\
+     outstanding */							\
+  int pipeline_depth;							\
+  /* The U8_AFFINITY_* policy and the CPUs and nodes it places		\
+     threads on (NULL unless threads are placed) */			\
+  int affinity; struct U8_SERVER_TOPOLOGY *topology;			\
+  /* With U8_SERVER_TRACE, the ring of recent transactions (or NULL) */ \
+  struct U8_TRACE_RING *trace;						\
   int n_busy; /* How many clients are currently active */		\
   long n_accepted; /* # of connections accepted to date */		\
   long n_trans; /* How many transactions have been completed to date */	\
   long n_errs; /* How many transactions yielded errors */		\
   int server_loglevel; /* Loglevel for transactions */			\
   struct U8_CLIENT_STATS aggrestats;					\
+  /* Latency histograms for each U8_LATENCY_* phase, for threads	\
+     outside of the pool */						\
+  struct U8_HISTOGRAM latencies[U8_N_LATENCIES];			\
+  /* The shard of metrics for threads outside of the pool */		\
+  struct U8_SERVER_METRICS metrics;					\
   /* Handling functions */						\
   u8_client (*acceptfn)(struct U8_SERVER *,u8_socket sock,		\
 			struct sockaddr *,size_t);			\
@@ -296,18 +558,38 @@ typedef struct U8_SERVER_INFO *u8_server_info;
   void *serverdata;							\
   u8_mutex lock;							\
   u8_condvar empty, full;						\
-  /* n_queued is the number of waiting requests in ->queue */		\
+  /* n_queued is the number of waiting requests, across all of	\
+     the thread queues */						\
   int n_queued;								\
-  /* max_tasks is the space available in ->queue */			\
+  /* max_queued is the most requests which can be waiting */		\
   int max_queued;							\
+  /* What to do when the queue is full (U8_OVERLOAD_* bits), how	\
+     often it's happened, and the slots of clients it paused */	\
+  int overload; long n_overloads, n_rejected, n_shed;			\
+  int *paused; int n_paused, paused_len;				\
+  /* Clients waiting for requests, the longest idle first, and how	\
+     many have been shed since shed_since */				\
+  struct U8_CLIENT *idle_head, *idle_tail;				\
+  u8_utime shed_since; int n_shed_since;				\
   /* n_threads is the number of threads in the pool */			\
   int n_threads;							\
+  /* The pool grows (up to max_threads) while tasks wait longer than	\
+     queue_target usecs on average and shrinks (down to min_threads)	\
+     as threads sit idle for thread_idle msecs. */			\
+  int min_threads, max_threads; long queue_target, thread_idle;	\
+  long long pool_qsum; long pool_qcount, n_grown, n_retired;		\
+  long long pool_checked;						\
   /* max_backlog is the number of requests which can be kept waiting */	\
   int max_backlog;							\
-  /* The threadpool, a vector of n_threads thread objects */		\
+  /* The threadpool, a vector of max_threads thread objects */	\
   struct U8_SERVER_THREAD *thread_pool;					\
-  u8_client *queue;							\
-  int queue_len, queue_head, queue_tail
+  /* Where to start looking when picking a thread for a new task */	\
+  int next_thread;							\
+  /* With U8_SERVER_SHARDS, this server is a front for n_shards	\
+     complete servers, each with its own SO_REUSEPORT listeners,	\
+     clients and threads; shard_of points back from each shard. */	\
+  struct U8_SERVER *shards; int n_shards;				\
+  struct U8_SERVER *shard_of
 
 
 /** struct U8_SERVER
@@ -327,6 +609,55 @@ U8_EXPORT
     This initializes a server object, allocating one if server is NULL.	 To
     actually start listening for requests, u8_add_server must be called
     at least once to add a listening address.
+    With U8_SERVER_SHARDS n (n>1), the server is split into n shards
+    which each listen (with SO_REUSEPORT) on every address added and
+    run their own listener loop (all started by u8_server_loop) and
+    their own share of the threads.
+    U8_SERVER_OVERLOAD takes a combination of U8_OVERLOAD_* bits saying
+    what to do when the request queue fills up.
+    U8_SERVER_IDLE_TIMEOUT, U8_SERVER_READ_TIMEOUT and
+    U8_SERVER_WRITE_TIMEOUT (in milliseconds) close clients which have
+    been idle, or spent too long on a u8_client_read or u8_client_write.
+    U8_SERVER_BACKLOG sets the listen() backlog (MAX_BACKLOG by
+    default); each wakeup on a listening socket accepts everything
+    pending, up to the backlog. With the U8_SERVER_NONBLOCK flag,
+    client sockets are accepted in non-blocking mode.
+    With the U8_SERVER_INLINE flag, the listener thread calls the
+    servefn itself (after each pass over the ready sockets) and no
+    worker threads are started; combined with U8_SERVER_SHARDS, each
+    shard is a single thread (pinned to its own CPU) with its own
+    listening sockets, readiness set and clients.
+    With the U8_SERVER_COROUTINES flag, each servefn call runs on its
+    own stack (of U8_SERVER_STACK_SIZE bytes), so that it can call
+    u8_client_await_read() or u8_client_await_write() to wait for its
+    socket without tying up a thread.
+    With the U8_SERVER_PIPELINE flag, a framed client (see
+    u8_client_framing) can have up to U8_SERVER_PIPELINE_DEPTH requests
+    outstanding: each complete frame is handled by its own servefn call
+    (possibly at the same time as the client's other requests, on other
+    threads), which answers it with u8_client_respond(), and the event
+    loop writes the responses in the order the requests arrived.
+    U8_SERVER_AFFINITY takes a U8_AFFINITY_* policy for placing the
+    listener and pool threads on the CPUs named by U8_SERVER_CPUS (a
+    string such as "0-7,16-23") or, by default, those the process can
+    run on. With U8_AFFINITY_CPU, the listener and each pool thread
+    are pinned to CPUs in turn. With U8_AFFINITY_NODE, the server is
+    split into a shard per NUMA node (unless U8_SERVER_SHARDS says
+    otherwise), with each shard's threads kept to its node's CPUs, so
+    that the client structs and buffers each shard pools are allocated
+    and used on one node. u8_server_status() reports the placement.
+    U8_SERVER_TRACE is the number of records (rounded up to a power of
+    two) in a ring of the most recent transactions, each recorded as
+    it finishes; with U8_SERVER_TRACE_THRESHOLD, only transactions
+    taking at least that many milliseconds are recorded. See
+    u8_server_trace() and u8_server_trace_dump().
+    U8_SERVER_POOL_SIZE is how many freed client structs (as allocated
+    by u8_init_client) and buffers of each size (see u8_client_getbuf)
+    the server keeps for reuse; zero turns pooling off.
+    U8_SERVER_MIN_THREADS and U8_SERVER_MAX_THREADS let the pool of
+    U8_SERVER_NTHREADS threads grow when tasks wait in the queue longer
+    than U8_SERVER_QUEUE_TARGET microseconds on average, and shrink
+    when threads have been idle for U8_SERVER_THREAD_IDLE milliseconds.
 **/
 struct U8_SERVER *u8_init_server
 (struct U8_SERVER *server,
@@ -453,6 +784,11 @@ U8_EXPORT u8_string u8_server_status(struct U8_SERVER *server,u8_byte *buf,int b
 
 /** Returns a machine readable (tab-separated) string describing the server's status,
     including active and pending tasks, total transactions, etc.
+    These are followed by the overload counts (full/rejected/shed), the
+    number of clients closed by timeouts, the number of threads the pool
+    has started and retired since it was created, and then the 50th,
+    99th and 99.9th percentile latencies (in microseconds) of each of
+    the U8_LATENCY_* phases, in order.
     @param server a pointer to a U8_SERVER struct
     @param buf NULL or a pointer to a buffer for the report
     @param buflen the size of buf if non NULL
@@ -462,6 +798,106 @@ U8_EXPORT u8_string u8_server_status(struct U8_SERVER *server,u8_byte *buf,int b
 **/
 U8_EXPORT u8_string u8_server_status_raw(struct U8_SERVER *server,u8_byte *buf,int buflen);
 
+/** Records a value (in microseconds) in a histogram
+    @param h a pointer to a U8_HISTOGRAM struct
+    @param value the value to record
+**/
+U8_EXPORT void u8_histogram_record(struct U8_HISTOGRAM *h,long long value);
+
+/** Adds the counts from one histogram into another
+    @param into a pointer to the U8_HISTOGRAM struct to add to
+    @param from a pointer to the U8_HISTOGRAM struct to add from
+**/
+U8_EXPORT void u8_histogram_merge(struct U8_HISTOGRAM *into,
+				  struct U8_HISTOGRAM *from);
+
+/** Returns the number of values recorded in a histogram
+    @param h a pointer to a U8_HISTOGRAM struct
+    @returns a count
+**/
+U8_EXPORT long long u8_histogram_count(struct U8_HISTOGRAM *h);
+
+/** Returns the value at a percentile of a histogram
+    @param h a pointer to a U8_HISTOGRAM struct
+    @param pct a percentile (e.g. 99.9)
+    @returns the highest value equivalent (within the histogram's
+     precision) to the value at the percentile, or 0 if it's empty
+**/
+U8_EXPORT long long u8_histogram_percentile(struct U8_HISTOGRAM *h,double pct);
+
+/** Gets the latency histogram for a phase of a server (combining
+    those of all of its threads and shards)
+    @param server a pointer to a U8_SERVER struct
+    @param phase one of the U8_LATENCY_* phases
+    @param into a pointer to a U8_HISTOGRAM struct, or NULL
+    @returns a pointer to a U8_HISTOGRAM struct (allocated if necessary),
+     or NULL if phase isn't valid
+**/
+U8_EXPORT u8_histogram u8_server_latencies
+(u8_server server,int phase,struct U8_HISTOGRAM *into);
+
+/** Returns the latency (in microseconds) at a percentile for a
+    phase of a server
+    @param server a pointer to a U8_SERVER struct
+    @param phase one of the U8_LATENCY_* phases
+    @param pct a percentile (e.g. 99.9)
+    @returns a latency in microseconds, or -1 if phase isn't valid
+**/
+U8_EXPORT long long u8_server_percentile(u8_server server,int phase,double pct);
+
+/** Gets a server's metrics (combining all of its threads and shards)
+    without taking any locks, so it won't hold up the server
+    @param server a pointer to a U8_SERVER struct
+    @param into a pointer to a U8_SERVER_METRICS struct, or NULL
+    @returns a pointer to a U8_SERVER_METRICS struct (allocated if
+     necessary)
+**/
+U8_EXPORT u8_metrics u8_server_metrics
+(u8_server server,struct U8_SERVER_METRICS *into);
+
+/** Renders a server's metrics, along with the 50th, 99th and 99.9th
+    percentile latencies of each phase, for a scraper
+    @param server a pointer to a U8_SERVER struct
+    @param format U8_METRICS_PROMETHEUS (the Prometheus text
+     exposition format) or U8_METRICS_JSON (a single JSON object)
+    @param buf NULL or a pointer to a buffer for the report
+    @param buflen the size of buf if non NULL
+    @returns the string of metrics; if BUF was NULL, this was mallocd;
+    otherwise, it is BUF with the output truncated to buflen
+**/
+U8_EXPORT u8_string u8_server_metrics_text
+(u8_server server,int format,u8_byte *buf,int buflen);
+
+/** Copies the most recent records from a server's trace ring (which
+    a sharded server's shards share), without locking
+    @param server a pointer to a U8_SERVER struct
+    @param into an array of U8_TRACE_RECORD structs
+    @param n the size of the into array
+    @returns the number of records copied (oldest first), or -1 if
+     the server isn't tracing
+**/
+U8_EXPORT int u8_server_trace(u8_server server,struct U8_TRACE_RECORD *into,int n);
+
+/** Writes a server's trace records to a file descriptor, a line for
+    each (tab-separated) after a header line starting with '#'. This
+    neither allocates nor locks, so it can be called from a signal
+    handler.
+    @param server a pointer to a U8_SERVER struct
+    @param fd a file descriptor
+    @returns the number of records written, or -1 if the server isn't
+     tracing
+**/
+U8_EXPORT int u8_server_trace_dump(u8_server server,int fd);
+
+/** Arranges for a signal to dump a server's trace records with
+    u8_server_trace_dump()
+    @param server a pointer to a U8_SERVER struct, or NULL to stop
+    @param signum a signal number (e.g. SIGUSR2)
+    @param fd the file descriptor to dump to
+    @returns 0 on success, or -1 if the handler couldn't be installed
+**/
+U8_EXPORT int u8_server_trace_signal(u8_server server,int signum,int fd);
+
 U8_EXPORT
 /** Returns a machine readable (tab-separated) string describing each of the
     current clients
@@ -472,6 +908,7 @@ U8_EXPORT
 u8_string u8_list_clients(struct U8_OUTPUT *out,struct U8_SERVER *server);
 
 #define U8_CLIENT_WRITE_OWNBUF 1
+#define U8_CLIENT_WRITE_POOLBUF 2
 
 U8_EXPORT unsigned char *u8_client_write_x
 (u8_client cl,unsigned char *buf,size_t n,size_t off,int flags);
@@ -483,4 +920,131 @@ U8_EXPORT unsigned char *u8_client_read
 
 U8_EXPORT int u8_client_finished(u8_client cl);
 
+/** Has the event loop split the client's input into frames, calling
+    the servefn only when a complete frame has arrived. The event loop
+    reads whatever is available into a buffer (which grows as needed)
+    and, when the servefn finishes a transaction (by returning 0), the
+    frame is consumed; if another complete frame was read with it, the
+    client is queued again right away, without waiting on its socket.
+    This is usually called by the acceptfn. With U8_CLIENT_FRAME_DELIM,
+    frames end with *delim* (e.g. "\r\n", up to 8 bytes); with
+    U8_CLIENT_FRAME_LENGTH, frames start with a big-endian length of
+    *size* (1, 2, 4, or 8) bytes; and with U8_CLIENT_FRAME_FIXED, frames
+    are *size* bytes long. A client whose input runs past *max_frame*
+    bytes (DEFAULT_MAX_FRAME if zero) without a frame ending is closed.
+    @param cl a pointer to a U8_CLIENT struct
+    @param mode one of the U8_CLIENT_FRAME_* modes
+    @param size the size of the length prefix or of fixed frames
+    @param delim the delimiter (a NUL-terminated string) or NULL
+    @param max_frame the largest frame accepted, or zero
+    @returns 0 on success and -1 if the arguments aren't valid (or
+     framing is being turned off with input still buffered)
+**/
+U8_EXPORT int u8_client_framing(u8_client cl,int mode,size_t size,
+                                const char *delim,size_t max_frame);
+
+/** Gets the client's current frame (without any length prefix or
+    delimiter), which stays valid until the servefn finishes the
+    transaction. On a U8_SERVER_PIPELINE server, this is the frame of
+    the request being handled by the calling thread.
+    @param cl a pointer to a U8_CLIENT struct
+    @param lenp a pointer to a size_t for the frame's length, or NULL
+    @returns a pointer to the frame's data, or NULL if the client
+     doesn't have a complete frame
+**/
+U8_EXPORT unsigned char *u8_client_frame(u8_client cl,size_t *lenp);
+
+/** Answers the request (on a U8_SERVER_PIPELINE server) which the
+    calling thread's servefn is handling. The response is written once
+    the responses to the client's earlier requests have been, so a
+    servefn handling a pipelined request shouldn't write to the client
+    itself. Unless the buffer is handed over with
+    U8_CLIENT_WRITE_OWNBUF (to be freed with u8_free) or
+    U8_CLIENT_WRITE_POOLBUF (to be returned with u8_client_putbuf), it
+    is copied. Since the servefn may be running for several of the
+    client's requests at once, it shouldn't otherwise change the client
+    without its own locking.
+    @param cl a pointer to a U8_CLIENT struct
+    @param buf the response
+    @param len the length of the response
+    @param flags a combination of U8_CLIENT_WRITE_* flags
+    @returns 0 on success and -1 if the calling thread isn't handling
+     one of the client's requests (or has already answered it)
+**/
+U8_EXPORT int u8_client_respond(u8_client cl,unsigned char *buf,size_t len,
+                                int flags);
+
+/** Waits until the client's socket is readable. Called from a servefn
+    on a U8_SERVER_COROUTINES server, this parks the servefn's stack
+    and frees its thread for other clients; the servefn resumes (on
+    the same thread) when the socket is readable or the server's read
+    timeout passes. Anywhere else, it just blocks in poll().
+    @param cl a pointer to a U8_CLIENT struct
+    @returns 1 when the socket is readable (or has been closed), 0 if
+     the read timeout passed first, and -1 on error (for instance, if
+     the client is in the middle of a u8_client_read or u8_client_write)
+**/
+U8_EXPORT int u8_client_await_read(u8_client cl);
+
+/** Waits until the client's socket is writable, just like
+    u8_client_await_read(), but using the server's write timeout.
+    @param cl a pointer to a U8_CLIENT struct
+    @returns 1 when the socket is writable (or has been closed), 0 if
+     the write timeout passed first, and -1 on error
+**/
+U8_EXPORT int u8_client_await_write(u8_client cl);
+
+/** Gets a buffer of at least *size* bytes from the server's buffer
+    pool. Passing it to u8_client_write_x() with
+    U8_CLIENT_WRITE_POOLBUF gives it to the client, which returns it
+    to the pool when it's done with it; otherwise, it should be
+    returned with u8_client_putbuf().
+    @param cl a pointer to a U8_CLIENT struct
+    @param size the number of bytes needed
+    @returns a pointer to a buffer or NULL
+**/
+U8_EXPORT unsigned char *u8_client_getbuf(u8_client cl,size_t size);
+
+/** Returns a buffer from u8_client_getbuf() to the server's pool.
+    @param cl a pointer to a U8_CLIENT struct
+    @param buf a buffer returned by u8_client_getbuf()
+**/
+U8_EXPORT void u8_client_putbuf(u8_client cl,unsigned char *buf);
+
+/** Starts sending *len* bytes of the file *fd*, beginning at *off*,
+    to the client. The data is sent (with sendfile() when available)
+    as the client's socket becomes writable, just like a buffer
+    passed to u8_client_write(), and its completion is counted in the
+    client's write stats. The client takes over *fd* and closes it when
+    the transfer is finished or abandoned. The servefn should return 1
+    and will be called again when the file has been sent.
+    @param cl a pointer to a U8_CLIENT struct
+    @param fd an open file descriptor
+    @param off the offset in the file to start from
+    @param len the number of bytes to send
+    @returns 1 if the transfer was started, 0 if *len* is zero, and -1
+     if the client is busy with another transfer or *fd* is invalid
+     (in either of which cases the caller still owns *fd*)
+**/
+U8_EXPORT int u8_client_sendfile(u8_client cl,int fd,off_t off,size_t len);
+
+/** Starts writing a chain of segments (a header, a body, and a
+    trailer, for instance) to the client without first copying them
+    into one buffer. The segments are written with writev() as the
+    client's socket becomes writable, just like a buffer passed to
+    u8_client_write(), and each segment's freefn is called as soon as
+    it has been written (or when the transfer is abandoned). The
+    segment descriptors are copied, so *segs* can be on the stack. The
+    servefn should return 1 and will be called again when the whole
+    chain has been written.
+    @param cl a pointer to a U8_CLIENT struct
+    @param segs a pointer to an array of U8_CLIENT_SEGMENT structs
+    @param n_segs the number of segments
+    @returns 1 if the transfer was started, 0 if the segments are all
+     empty (and have been freed), and -1 if the client is busy with
+     another transfer (in which case the caller still owns the segments)
+**/
+U8_EXPORT int u8_client_writev(u8_client cl,struct U8_CLIENT_SEGMENT *segs,
+                               int n_segs);
+
 #endif /* U8_U8SRVFNS_H */
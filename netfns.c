@@ -48,6 +48,16 @@
 #include <sys/socket.h>
 #endif
 
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#if HAVE_POLL_H
+#include <poll.h>
+#elif HAVE_SYS_POLL_H
+#include <sys/poll.h>
+#endif
+
 #if U8_THREADS_ENABLED
 static u8_mutex netfns_lock;
 #endif
@@ -66,6 +76,12 @@ int u8_reconnect_wait1=1;
 int u8_reconnect_wait=5;
 int u8_reconnect_tries=5;
 
+int u8_connect_timeout=30000;
+int u8_connect_stagger=250;
+
+int u8_connpool_check_interval=0;
+int u8_connpool_max_idle=0;
+
 int u8_warn_waitlevel=4;
 
 int u8_cpdebug=0;
@@ -227,44 +243,394 @@ static struct hostent *copy_hostent(struct hostent *he)
   else return copy;
 }
 
-U8_EXPORT struct hostent *u8_gethostbyname(u8_string hname,int type)
+/* Resolver cache
+
+   Host lookups are cached by name and address family, keeping
+   successful lookups for u8_dns_ttl seconds and failed ones for
+   u8_dns_negative_ttl seconds (the libc resolver interfaces don't
+   report record TTLs). Temporary failures (when the resolver can't
+   be reached, say) aren't cached at all, so that a blip doesn't
+   make a name fail for everyone until the entry expires. A hit
+   within u8_dns_refresh seconds of expiring (or in the second half
+   of its TTL, whichever is later) starts a background thread which
+   looks the name up again, so busy names don't wait on the resolver
+   when they expire. If that lookup fails, the next refresh waits
+   u8_dns_negative_ttl seconds.
+
+   Entries are reference counted and never change once they're in
+   the table, so callers can use them without holding dns_lock. That
+   lock is only held to find, add, or remove entries (never while
+   resolving), so lookups are safe while holding other locks, such as
+   a connection pool's. */
+
+int u8_dns_ttl=60;
+int u8_dns_negative_ttl=5;
+int u8_dns_refresh=10;
+
+#define DNS_N_BUCKETS 64
+/* Families for gethostbyname_r() (no family) and getaddrinfo() lookups */
+#define DNS_ANY (-1)
+#define DNS_ADDRINFO (-2)
+
+struct U8_CONNECT_ADDR {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;};
+
+struct U8_DNS_ENTRY {
+  u8_string dns_name;
+  int dns_family;
+  int dns_refcount;
+  int dns_refreshing;
+  /* Set for failed gethostbyname lookups */
+  int dns_herrno;
+  /* The getaddrinfo() error code for failed getaddrinfo lookups */
+  int dns_error;
+  /* Set for successful gethostbyname lookups */
+  struct hostent *dns_hostent;
+  /* Set for getaddrinfo lookups, without port numbers */
+  struct U8_CONNECT_ADDR *dns_addrs;
+  int dns_n_addrs;
+  u8_utime dns_expires, dns_refresh_at;
+  struct U8_DNS_ENTRY *dns_next;};
+
+static struct U8_DNS_ENTRY *dns_table[DNS_N_BUCKETS];
+static struct U8_DNS_STATS dns_stats;
+#if U8_THREADS_ENABLED
+static u8_mutex dns_lock;
+#endif
+
+#define DNS_POSITIVEP(e) (((e)->dns_hostent)||((e)->dns_n_addrs>0))
+#if HAVE_GETADDRINFO
+#define DNS_TRANSIENTP(e) \
+  (((e)->dns_herrno==TRY_AGAIN)||((e)->dns_error==EAI_AGAIN)|| \
+   ((e)->dns_error==EAI_SYSTEM)||((e)->dns_error==EAI_MEMORY))
+#else
+#define DNS_TRANSIENTP(e) ((e)->dns_herrno==TRY_AGAIN)
+#endif
+
+static unsigned int dns_hash(u8_string name,int family)
+{
+  unsigned int hash=(unsigned int)family;
+  const unsigned char *scan=(const unsigned char *)name;
+  while (*scan) {
+    hash=(hash*31)+tolower(*scan); scan++;}
+  return hash%DNS_N_BUCKETS;
+}
+
+static struct hostent *fetch_hostent(u8_string hname,int type,int *herrnop)
 {
   char *name=u8_tolibc(hname);
-  struct hostent *fetched, *copied;
+  struct hostent *fetched, *copied=NULL;
   char U8_MAYBE_UNUSED _buf[1024], *buf=_buf;
-  int U8_MAYBE_UNUSED bufsiz=0, herrno=0, retval;
+  int U8_MAYBE_UNUSED bufsiz=1024, herrno=0, retval;
+  int retries=0;
 #if HAVE_GETHOSTBYNAME2_R
   struct hostent _fetched, *result; fetched=&_fetched;
   if (type>0)
     retval=
-      gethostbyname2_r(name,type,fetched,buf,1024,&result,&herrno);
-  else retval=gethostbyname_r(name,fetched,buf,1024,&result,&herrno);
-  while (retval==ERANGE) {
-    if (bufsiz) {
-      u8_free(buf);
-      bufsiz=bufsiz*2;}
-    else bufsiz=2048;
-    buf=u8_malloc(bufsiz);
+      gethostbyname2_r(name,type,fetched,buf,bufsiz,&result,&herrno);
+  else retval=gethostbyname_r(name,fetched,buf,bufsiz,&result,&herrno);
+  while ((retries<7)&&((retval==ERANGE)||(herrno==ERANGE)||(herrno==EINTR))) {
+    if ((retval==ERANGE)||(herrno==ERANGE)) {
+      if (buf!=_buf) u8_free(buf);
+      bufsiz=bufsiz*2;
+      buf=u8_malloc(bufsiz);}
     if (type>0)
       retval=
-        gethostbyname2_r(name,type,fetched,buf,1024,&result,&herrno);
-    else retval=gethostbyname_r(name,fetched,buf,1024,&result,&herrno);}
-  if (result==NULL) {
-    if (bufsiz) u8_free(buf);
-    u8_graberr(herrno,"u8_gethostbyname",u8_strdup(hname));
-    return NULL;}
-  copied=((fetched==NULL) ? (NULL) :(copy_hostent(fetched)));
-  if (bufsiz) u8_free(buf);
+	gethostbyname2_r(name,type,fetched,buf,bufsiz,&result,&herrno);
+    else retval=gethostbyname_r(name,fetched,buf,bufsiz,&result,&herrno);
+    retries++;}
+  if (result) copied=copy_hostent(fetched);
+  if (buf!=_buf) u8_free(buf);
 #else
   u8_lock_mutex(&netfns_lock);
   fetched=gethostbyname(name);
-  if (fetched==NULL) {
-    u8_unlock_mutex(&netfns_lock);
-    return u8err(NULL,UnknownHost,"u8_gethostbyname",name);}
-  copied=copy_hostent(fetched);
+  if (fetched) copied=copy_hostent(fetched);
+  else herrno=h_errno;
   u8_unlock_mutex(&netfns_lock);
 #endif
-  u8_free(name);
+  if (name!=(char *)hname) u8_free(name);
+  if ((copied==NULL)&&(herrno==0)) herrno=HOST_NOT_FOUND;
+  *herrnop=herrno;
+  return copied;
+}
+
+/* Returns the addresses for a host, interleaving address families
+   (starting with the family of the first), so that connecting in order
+   doesn't spend too long on a family which doesn't work. When there
+   aren't any, this stores the getaddrinfo() error in *errp (or, without
+   getaddrinfo(), the gethostbyname error in *herrnop). */
+static int fetch_addrinfo(u8_string hostname,struct U8_CONNECT_ADDR **addrsp,
+                          int *errp,int *herrnop)
+{
+  struct U8_CONNECT_ADDR *addrs;
+  int n=0;
+#if HAVE_GETADDRINFO
+  struct addrinfo hints, *info=NULL, *scan;
+  char *name=u8_tolibc(hostname);
+  int n_infos=0, retval, first_family;
+  struct addrinfo **v6, **v4; int n_v6=0, n_v4=0, i6=0, i4=0;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_flags=AI_ADDRCONFIG;
+  retval=getaddrinfo(name,NULL,&hints,&info);
+  if (name!=(char *)hostname) u8_free(name);
+  if ((retval)||(info==NULL)) {
+    if (info) freeaddrinfo(info);
+    *errp=((retval)?(retval):(EAI_NONAME));
+    *addrsp=NULL;
+    return 0;}
+  scan=info; while (scan) {n_infos++; scan=scan->ai_next;}
+  v6=u8_alloc_n(n_infos,struct addrinfo *);
+  v4=u8_alloc_n(n_infos,struct addrinfo *);
+  scan=info; while (scan) {
+    if (scan->ai_addrlen<=sizeof(struct sockaddr_storage)) {
+      if (scan->ai_family==AF_INET) v4[n_v4++]=scan;
+#ifdef AF_INET6
+      else if (scan->ai_family==AF_INET6) v6[n_v6++]=scan;
+#endif
+      else NO_ELSE;}
+    scan=scan->ai_next;}
+  first_family=info->ai_family;
+  addrs=u8_alloc_n(n_v4+n_v6+1,struct U8_CONNECT_ADDR);
+  memset(addrs,0,sizeof(struct U8_CONNECT_ADDR)*(n_v4+n_v6+1));
+  while ((i4<n_v4)||(i6<n_v6)) {
+    int v6_turn=(i6<n_v6)&&((i4>=n_v4)||((n%2)==(first_family==AF_INET)));
+    struct addrinfo *ai=(v6_turn)?(v6[i6++]):(v4[i4++]);
+    memcpy(&(addrs[n].addr),ai->ai_addr,ai->ai_addrlen);
+    addrs[n].addr_len=ai->ai_addrlen;
+    n++;}
+  u8_free(v6); u8_free(v4);
+  freeaddrinfo(info);
+#else
+  struct hostent *he=fetch_hostent(hostname,AF_INET,herrnop);
+  char **scan;
+  if (he==NULL) {
+    *addrsp=NULL;
+    return 0;}
+  scan=he->h_addr_list; while (*scan) scan++;
+  addrs=u8_alloc_n((scan-he->h_addr_list)+1,struct U8_CONNECT_ADDR);
+  memset(addrs,0,sizeof(struct U8_CONNECT_ADDR)*
+         ((scan-he->h_addr_list)+1));
+  scan=he->h_addr_list; while (*scan) {
+    struct sockaddr_in *sockaddr=(struct sockaddr_in *)&(addrs[n].addr);
+    if (he->h_length!=sizeof(sockaddr->sin_addr)) {
+      scan++; continue;}
+    sockaddr->sin_family=AF_INET;
+    memcpy(&(sockaddr->sin_addr),*scan++,he->h_length);
+    addrs[n].addr_len=sizeof(struct sockaddr_in);
+    n++;}
+  u8_free(he);
+#endif
+  *addrsp=addrs;
+  return n;
+}
+
+/* Does an actual lookup, returning a new entry with one reference */
+static struct U8_DNS_ENTRY *dns_fetch(u8_string name,int family)
+{
+  struct U8_DNS_ENTRY *entry=u8_alloc(struct U8_DNS_ENTRY);
+  u8_utime now;
+  memset(entry,0,sizeof(struct U8_DNS_ENTRY));
+  entry->dns_name=u8_strdup(name);
+  entry->dns_family=family;
+  entry->dns_refcount=1;
+  if (family==DNS_ADDRINFO)
+    entry->dns_n_addrs=fetch_addrinfo(name,&(entry->dns_addrs),
+                                      &(entry->dns_error),
+                                      &(entry->dns_herrno));
+  else entry->dns_hostent=fetch_hostent(name,family,&(entry->dns_herrno));
+  now=u8_microtime();
+  if (DNS_POSITIVEP(entry)) {
+    u8_utime ttl=((u8_utime)u8_dns_ttl)*1000000;
+    u8_utime window=((u8_utime)u8_dns_refresh)*1000000;
+    /* Keep entries for at least half their TTL before refreshing, so
+       that a long refresh window doesn't refresh on every hit */
+    if (window>(ttl/2)) window=ttl/2;
+    else if (window<0) window=0;
+    else NO_ELSE;
+    entry->dns_expires=now+ttl;
+    entry->dns_refresh_at=now+(ttl-window);}
+  else entry->dns_expires=entry->dns_refresh_at=
+         now+(((u8_utime)u8_dns_negative_ttl)*1000000);
+  return entry;
+}
+
+static void dns_free(struct U8_DNS_ENTRY *entry)
+{
+  u8_free(entry->dns_name);
+  if (entry->dns_hostent) u8_free(entry->dns_hostent);
+  if (entry->dns_addrs) u8_free(entry->dns_addrs);
+  u8_free(entry);
+}
+
+static void dns_release(struct U8_DNS_ENTRY *entry)
+{
+  int refcount;
+  u8_lock_mutex(&dns_lock);
+  refcount=--(entry->dns_refcount);
+  u8_unlock_mutex(&dns_lock);
+  if (refcount==0) dns_free(entry);
+}
+
+/* Adds a new entry (with one reference for the table), dropping any
+   other entry with the same key. Call with dns_lock held; returns the
+   dropped entry if it needs to be freed. */
+static struct U8_DNS_ENTRY *dns_store(struct U8_DNS_ENTRY *entry)
+{
+  unsigned int bucket=dns_hash(entry->dns_name,entry->dns_family);
+  struct U8_DNS_ENTRY **scan=&(dns_table[bucket]), *dropped=NULL;
+  while (*scan) {
+    struct U8_DNS_ENTRY *e=*scan;
+    if ((e->dns_family==entry->dns_family)&&
+        (strcasecmp(e->dns_name,entry->dns_name)==0)) {
+      *scan=e->dns_next;
+      if (--(e->dns_refcount)==0) dropped=e;
+      dns_stats.n_entries--;
+      break;}
+    else scan=&(e->dns_next);}
+  entry->dns_refcount++;
+  entry->dns_next=dns_table[bucket];
+  dns_table[bucket]=entry;
+  dns_stats.n_entries++;
+  return dropped;
+}
+
+#if U8_THREADS_ENABLED
+static void *dns_refresh(void *arg)
+{
+  struct U8_DNS_ENTRY *old=(struct U8_DNS_ENTRY *)arg, *dropped=NULL;
+  struct U8_DNS_ENTRY *fresh=dns_fetch(old->dns_name,old->dns_family);
+  u8_lock_mutex(&dns_lock);
+  /* If the name doesn't resolve now, keep the old entry until it
+     expires, allowing another refresh after a backoff (so that every
+     hit doesn't start another one) */
+  if (DNS_POSITIVEP(fresh)) {
+    dropped=dns_store(fresh);
+    dns_stats.refreshes++;}
+  else {
+    int backoff=(u8_dns_negative_ttl>0)?(u8_dns_negative_ttl):(1);
+    old->dns_refresh_at=u8_microtime()+(((u8_utime)backoff)*1000000);
+    old->dns_refreshing=0;}
+  u8_unlock_mutex(&dns_lock);
+  if (dropped) dns_free(dropped);
+  dns_release(fresh);
+  dns_release(old);
+  return NULL;
+}
+#endif
+
+/* Returns a (possibly negative) entry for a name, which the caller
+   should release with dns_release() */
+static struct U8_DNS_ENTRY *dns_get(u8_string name,int family)
+{
+  struct U8_DNS_ENTRY **scan, *found=NULL, *expired=NULL, *dropped=NULL;
+  u8_utime now;
+  int refresh=0;
+  if (u8_dns_ttl<=0) {
+    u8_lock_mutex(&dns_lock);
+    dns_stats.misses++;
+    u8_unlock_mutex(&dns_lock);
+    return dns_fetch(name,family);}
+  now=u8_microtime();
+  u8_lock_mutex(&dns_lock);
+  scan=&(dns_table[dns_hash(name,family)]);
+  while (*scan) {
+    struct U8_DNS_ENTRY *e=*scan;
+    if (e->dns_expires<=now) {
+      /* Drop expired entries as we go */
+      *scan=e->dns_next; dns_stats.n_entries--;
+      if (--(e->dns_refcount)==0) {
+        e->dns_next=expired; expired=e;}}
+    else if ((e->dns_family==family)&&
+             (strcasecmp(e->dns_name,name)==0)) {
+      found=e; break;}
+    else scan=&(e->dns_next);}
+  if (found) {
+    found->dns_refcount++;
+    if (DNS_POSITIVEP(found)) {
+      dns_stats.hits++;
+#if U8_THREADS_ENABLED
+      if ((found->dns_refresh_at<=now)&&(!(found->dns_refreshing))) {
+        found->dns_refreshing=1;
+        found->dns_refcount++;
+        refresh=1;}
+#endif
+    }
+    else dns_stats.negative_hits++;}
+  else dns_stats.misses++;
+  u8_unlock_mutex(&dns_lock);
+  while (expired) {
+    struct U8_DNS_ENTRY *next=expired->dns_next;
+    dns_free(expired);
+    expired=next;}
+#if U8_THREADS_ENABLED
+  if (refresh) {
+    pthread_t thread; pthread_attr_t attr;
+    int rv=pthread_attr_init(&attr);
+    if (rv==0) {
+      pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+      rv=pthread_create(&thread,&attr,dns_refresh,(void *)found);
+      pthread_attr_destroy(&attr);}
+    if (rv) {
+      /* It'll just get looked up again when it expires */
+      u8_lock_mutex(&dns_lock);
+      found->dns_refcount--;
+      u8_unlock_mutex(&dns_lock);}}
+#endif
+  if (found) return found;
+  found=dns_fetch(name,family);
+  u8_lock_mutex(&dns_lock);
+  if (DNS_TRANSIENTP(found))
+    /* Try the resolver again next time */
+    dns_stats.temp_failures++;
+  else dropped=dns_store(found);
+  u8_unlock_mutex(&dns_lock);
+  if (dropped) dns_free(dropped);
+  return found;
+}
+
+U8_EXPORT int u8_dns_stats(struct U8_DNS_STATS *into)
+{
+  u8_lock_mutex(&dns_lock);
+  memcpy(into,&dns_stats,sizeof(struct U8_DNS_STATS));
+  u8_unlock_mutex(&dns_lock);
+  return into->n_entries;
+}
+
+U8_EXPORT int u8_dns_flush(u8_string name)
+{
+  struct U8_DNS_ENTRY *flushed=NULL;
+  int i=0, n_flushed=0;
+  u8_lock_mutex(&dns_lock);
+  while (i<DNS_N_BUCKETS) {
+    struct U8_DNS_ENTRY **scan=&(dns_table[i]);
+    while (*scan) {
+      struct U8_DNS_ENTRY *e=*scan;
+      if ((name==NULL)||(strcasecmp(e->dns_name,name)==0)) {
+        *scan=e->dns_next; n_flushed++;
+        if (--(e->dns_refcount)==0) {
+          e->dns_next=flushed; flushed=e;}}
+      else scan=&(e->dns_next);}
+    i++;}
+  dns_stats.n_entries-=n_flushed;
+  u8_unlock_mutex(&dns_lock);
+  while (flushed) {
+    struct U8_DNS_ENTRY *next=flushed->dns_next;
+    dns_free(flushed);
+    flushed=next;}
+  return n_flushed;
+}
+
+U8_EXPORT struct hostent *u8_gethostbyname(u8_string hname,int type)
+{
+  struct U8_DNS_ENTRY *entry=dns_get(hname,(type>0)?(type):(DNS_ANY));
+  struct hostent *copied=NULL;
+  if (entry->dns_hostent)
+    copied=copy_hostent(entry->dns_hostent);
+  else u8_graberr(entry->dns_herrno,"u8_gethostbyname",u8_strdup(hname));
+  dns_release(entry);
   return copied;
 }
 
@@ -327,48 +693,16 @@ U8_EXPORT u8_string u8_host_primary(u8_string hostname)
 U8_EXPORT char **u8_lookup_host_x
 (u8_string hname,int *addr_len,unsigned int *typep,int flags)
 {
-  char *name=u8_tolibc(hname);
-  struct hostent *fetched;
-  char U8_MAYBE_UNUSED _buf[1024], *buf=_buf, **addrs;
-  int U8_MAYBE_UNUSED bufsiz=0, herrno=0, retval, type=((typep)?(*typep):(-1));
-  int retries=0;
-#if HAVE_GETHOSTBYNAME2_R
-  struct hostent _fetched, *result; fetched=&_fetched;
-  if (type>=0)
-    retval=
-      gethostbyname2_r(name,type,fetched,buf,1024,&result,&herrno);
-  else retval=gethostbyname_r(name,fetched,buf,1024,&result,&herrno);
-  while ((retries<7)&&((retval==ERANGE)||(herrno==ERANGE)||(herrno==EINTR))) {
-    if ((retval==ERANGE)||(herrno==ERANGE)) {
-      if (bufsiz) {
-	u8_free(buf);
-	bufsiz=bufsiz*2;}
-      else bufsiz=2048;
-      buf=u8_malloc(bufsiz);}
-    if (type>=0)
-      retval=
-	gethostbyname2_r(name,type,fetched,buf,bufsiz,&result,&herrno);
-    else retval=gethostbyname_r(name,fetched,buf,bufsiz,&result,&herrno);
-    retries++;}
-  if (result==NULL) {
-    if ((flags)&(U8_LOOKUP_HOST_SETERR))
-      u8_graberr(herrno,"u8_lookup_host",u8_strdup(hname));
-    u8_free(name);
-    if (bufsiz) u8_free(buf);
-    return NULL;}
-  addrs=copy_addrs(fetched,addr_len,NULL);
-  if (typep) *typep=fetched->h_addrtype;
-  if (bufsiz) u8_free(buf);
-#else
-  u8_lock_mutex(&netfns_lock);
-  fetched=gethostbyname(name);
-  if (fetched==NULL) {
-    u8_unlock_mutex(&netfns_lock);
-    return u8err(NULL,UnknownHost,"u8_lookup_host",name);}
-  addrs=copy_addrs(fetched,addr_len,NULL);
-  u8_unlock_mutex(&netfns_lock);
-#endif
-  u8_free(name);
+  int type=((typep)?((int)*typep):(-1));
+  struct U8_DNS_ENTRY *entry=dns_get(hname,(type>0)?(type):(DNS_ANY));
+  char **addrs=NULL;
+  if (entry->dns_hostent) {
+    addrs=copy_addrs(entry->dns_hostent,addr_len,NULL);
+    if (typep) *typep=entry->dns_hostent->h_addrtype;}
+  else if ((flags)&(U8_LOOKUP_HOST_SETERR))
+    u8_graberr(entry->dns_herrno,"u8_lookup_host",u8_strdup(hname));
+  else NO_ELSE;
+  dns_release(entry);
   return addrs;
 }
 
@@ -437,54 +771,181 @@ U8_EXPORT u8_string u8_canonical_addr(u8_string spec)
 
 static  u8_socket file_socket_connect(u8_string spec,u8_string *addrp);
 
-U8_EXPORT u8_socket u8_connect_x(u8_string spec,u8_string *addrp)
+/* Connecting to the addresses of a host
+
+   The addresses are tried in the order getaddrinfo() returns them,
+   except that IPv6 and IPv4 addresses take turns (starting with the
+   family of the first), so that a broken family doesn't hold things
+   up. Each attempt is a non-blocking connect(), and another attempt
+   starts whenever one fails or u8_connect_stagger msecs pass without
+   any answering. The first to connect wins and the others are closed,
+   and if none has connected by the deadline, the connect fails with
+   ETIMEDOUT. */
+
+/* Returns the number of addresses for a host, storing them
+   (interleaved by family) in *addrsp */
+static int get_connect_addrs(u8_string hostname,int portno,
+                             struct U8_CONNECT_ADDR **addrsp)
+{
+  struct U8_DNS_ENTRY *entry=dns_get(hostname,DNS_ADDRINFO);
+  struct U8_CONNECT_ADDR *addrs;
+  int n=entry->dns_n_addrs;
+  if (n==0) {
+#if HAVE_GETADDRINFO
+    if (DNS_TRANSIENTP(entry))
+      u8_seterr(gai_strerror(entry->dns_error),"u8_connect",
+                u8_strdup(hostname));
+    else
+#endif
+      u8_seterr(UnknownHost,"u8_connect",u8_strdup(hostname));
+    dns_release(entry);
+    return -1;}
+  addrs=u8_alloc_n(n,struct U8_CONNECT_ADDR);
+  memcpy(addrs,entry->dns_addrs,sizeof(struct U8_CONNECT_ADDR)*n);
+  dns_release(entry);
+  /* Fill in the port */
+  int i=0; while (i<n) {
+    struct sockaddr *sa=(struct sockaddr *)&(addrs[i].addr);
+    if (sa->sa_family==AF_INET)
+      ((struct sockaddr_in *)sa)->sin_port=htons((short)portno);
+#ifdef AF_INET6
+    else if (sa->sa_family==AF_INET6)
+      ((struct sockaddr_in6 *)sa)->sin6_port=htons((short)portno);
+#endif
+    else NO_ELSE;
+    i++;}
+  *addrsp=addrs;
+  return n;
+}
+
+/* Starts connecting to an address, returning the socket or -1 if the
+   attempt failed right away. *donep is set if it's already connected. */
+static u8_socket start_connect(struct U8_CONNECT_ADDR *addr,int *donep)
+{
+  struct sockaddr *sa=(struct sockaddr *)&(addr->addr);
+  long socket_id=socket(sa->sa_family,SOCK_STREAM,0);
+  *donep=0;
+  if (socket_id<0) return -1;
+#if ((defined(F_SETFL))&&(defined(O_NONBLOCK)))
+  fcntl(socket_id,F_SETFL,fcntl(socket_id,F_GETFL)|O_NONBLOCK);
+#endif
+  if (connect(socket_id,sa,addr->addr_len)==0) {
+    *donep=1; return socket_id;}
+  else if ((errno==EINPROGRESS)||(errno==EINTR))
+    return socket_id;
+  else {
+    int saved_errno=errno;
+    close(socket_id); errno=saved_errno;
+    return -1;}
+}
+
+/* Puts a socket started by start_connect() back into blocking mode,
+   which is what callers expect */
+static void restore_blocking(u8_socket sock)
+{
+#if ((defined(F_SETFL))&&(defined(O_NONBLOCK)))
+  fcntl(sock,F_SETFL,fcntl(sock,F_GETFL)&(~O_NONBLOCK));
+#endif
+}
+
+/* Races connections to addrs, returning the connected socket (and
+   its index in *winp) or -1 with errno set */
+static u8_socket race_connect(struct U8_CONNECT_ADDR *addrs,int n,int msecs,
+                              int *winp)
+{
+  struct pollfd *fds=u8_alloc_n(n,struct pollfd);
+  int *which=u8_alloc_n(n,int);
+  int n_live=0, next=0, last_error=ECONNREFUSED, i;
+  u8_utime now=u8_microtime(), next_start=now;
+  u8_utime deadline=(msecs>0)?(now+((u8_utime)msecs)*1000):(-1);
+  u8_socket winner=-1;
+  while (winner<0) {
+    int wait, ready;
+    if ((next<n)&&((n_live==0)||(now>=next_start))) {
+      int done=0;
+      u8_socket sock=start_connect(&(addrs[next]),&done);
+      if ((sock>=0)&&(done)) {
+        winner=sock; *winp=next; break;}
+      else if (sock>=0) {
+        fds[n_live].fd=sock; fds[n_live].events=POLLOUT;
+        fds[n_live].revents=0;
+        which[n_live++]=next;}
+      else last_error=errno;
+      next++;
+      next_start=now+((u8_utime)u8_connect_stagger)*1000;
+      continue;}
+    if (n_live==0) break;
+    if ((deadline>0)&&(now>=deadline)) {
+      last_error=ETIMEDOUT; break;}
+    /* Wait until the deadline or until it's time for another attempt */
+    if ((next<n)&&((deadline<0)||(next_start<deadline)))
+      wait=(int)((next_start-now+999)/1000);
+    else if (deadline>0)
+      wait=(int)((deadline-now+999)/1000);
+    else wait=-1;
+    ready=poll(fds,n_live,wait);
+    if ((ready<0)&&(errno!=EINTR)) {
+      last_error=errno; break;}
+    i=0; while ((ready>0)&&(i<n_live)) {
+      if (fds[i].revents) {
+        int err=0; socklen_t errlen=sizeof(err);
+        if (getsockopt(fds[i].fd,SOL_SOCKET,SO_ERROR,&err,&errlen)<0)
+          err=errno;
+        if (err==0) {
+          winner=fds[i].fd; *winp=which[i];
+          fds[i]=fds[n_live-1]; which[i]=which[n_live-1]; n_live--;
+          break;}
+        /* This one failed, so try another right away */
+        last_error=err; close(fds[i].fd);
+        fds[i]=fds[n_live-1]; which[i]=which[n_live-1]; n_live--;
+        next_start=now;}
+      else i++;}
+    now=u8_microtime();}
+  i=0; while (i<n_live) close(fds[i++].fd);
+  u8_free(fds); u8_free(which);
+  if (winner>=0) {
+    restore_blocking(winner);
+    return winner;}
+  errno=last_error;
+  return -1;
+}
+
+U8_EXPORT u8_socket u8_connect_within(u8_string spec,u8_string *addrp,
+                                      int msecs)
 {
   if ( (strchr(spec,'@') == NULL) && (strchr(spec,':') == NULL) ) {
     if ( (u8_file_existsp(spec)) && (u8_socketp(spec)) )
       return file_socket_connect(spec,addrp);
     else return u8err(-1,"BadFileSocket","u8_connect_x",u8_strdup(spec));}
   else {
-    long socket_id;
     u8_byte _hostname[128]; int portno=-1;
     u8_string hostname=u8_parse_addr(spec,&portno,_hostname,128);
     if (portno<0) return ((u8_socket)(-1));
     else if (!(hostname)) return ((u8_socket)(-1));
     else if (portno) {
-      struct sockaddr_in sockaddr;
-      int addr_len, family=AF_INET;
-      /* Lookup the host */
-      char **addrs=u8_lookup_host(hostname,&addr_len,&family), **scan=addrs;
-      if (addrs==NULL) {
-        if (hostname!=_hostname) u8_free(hostname);
-        return -1;}
-      /* Get a socket */
-      if ((socket_id=socket(family,SOCK_STREAM,0))<0) {
-        u8_graberrno("u8_connect:socket",u8_strdup(spec));
-        u8_free(addrs);
-        if (hostname!=_hostname) u8_free(hostname);
-        return ((u8_socket)(-1));}
-      while (*scan) {
-        char *addr=*scan++;
-        sockaddr.sin_port=htons((short)portno);
-        memcpy(&(sockaddr.sin_addr),addr,addr_len);
-        sockaddr.sin_family=family;
-        if (connect(socket_id,saddr(sockaddr),sizeof(struct sockaddr_in))<0) {
-          if (*scan==NULL) {
-            u8_graberrno("u8_connect:connect",u8_strdup(spec));
-            close(socket_id);
-            u8_free(addrs);
-            if (hostname!=_hostname) u8_free(hostname);
-            return ((u8_socket)(-1));}
-          else errno=0;} /* Try the next address */
-        else {
-          if (addrp) *addrp=u8_sockaddr_string((struct sockaddr *)&sockaddr);
-          if (hostname!=_hostname) u8_free(hostname);
-          u8_free(addrs);
-          return (u8_socket)socket_id;}}
+      struct U8_CONNECT_ADDR *addrs=NULL;
+      int n_addrs=get_connect_addrs(hostname,portno,&addrs), win=-1;
+      u8_socket socket_id=-1;
+      if (hostname!=_hostname) u8_free(hostname);
+      if (n_addrs<0) return ((u8_socket)(-1));
+      socket_id=race_connect(addrs,n_addrs,msecs,&win);
+      if (socket_id<0) {
+        if (errno==ETIMEDOUT)
+          u8_seterr(SocketTimeout,"u8_connect:connect",u8_strdup(spec));
+        else u8_graberrno("u8_connect:connect",u8_strdup(spec));}
+      else if (addrp)
+        *addrp=u8_sockaddr_string((struct sockaddr *)&(addrs[win].addr));
+      else NO_ELSE;
       u8_free(addrs);
+      return socket_id;}
+    else {
       if (hostname!=_hostname) u8_free(hostname);
-      return ((u8_socket)(-1));}
-    else return file_socket_connect(spec,addrp);}
+      return file_socket_connect(spec,addrp);}}
+}
+
+U8_EXPORT u8_socket u8_connect_x(u8_string spec,u8_string *addrp)
+{
+  return u8_connect_within(spec,addrp,u8_connect_timeout);
 }
 
 static  u8_socket file_socket_connect(u8_string spec,u8_string *addrp)
@@ -540,8 +1001,482 @@ U8_EXPORT int u8_set_nodelay(u8_socket c,int flag)
 
 /* Connection pools
    These maintain a pool of connections to a particular address,
-   adding new ones if neccessary.  A smarter version of this might
-   wait in some cases. */
+   adding new ones if neccessary.
+
+   Getting and returning connections doesn't take the pool's lock.
+   Each socket in the pool has a slot (found by its socket number)
+   whose state changes by compare-and-swap, so returning a connection
+   is O(1). Idle connections are kept on a lock-free stack threaded
+   through the slots, except that each thread keeps a few of the
+   connections it returns (see THREAD_CACHE_PER_POOL), which it can
+   reuse without touching anything shared. Other threads only take
+   those cached connections when the pool is at its cap, and u8cp_lock
+   and u8cp_drained are only used to wait when the pool is at its cap
+   and nothing can be taken. */
+
+#define CP_LOAD(field) (__atomic_load_n(&(field),__ATOMIC_SEQ_CST))
+#define CP_INCR(field) (__atomic_add_fetch(&(field),1,__ATOMIC_SEQ_CST))
+#define CP_DECR(field) (__atomic_sub_fetch(&(field),1,__ATOMIC_SEQ_CST))
+#define CP_CAS(field,expect,value)                      \
+  (__atomic_compare_exchange_n(&(field),&(expect),(value),0,    \
+                               __ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST))
+
+/* The most connections from a single pool a thread keeps */
+#define THREAD_CACHE_PER_POOL 2
+
+static u8_condition BadPoolSocket=
+  _("Socket number too large for a connection pool");
+
+/* Incremented whenever a pool is closed, telling threads to check
+   that the pools in their caches are still open */
+static unsigned int connpool_epoch=0;
+/* Numbers the pools, for the generations which tell them apart */
+static unsigned int connpool_generations=0;
+
+#if U8_THREADS_ENABLED
+/* All the open pools (registered or not), so that threads can check
+   their caches against them */
+static struct U8_CONNPOOL *live_connpools=NULL;
+static u8_mutex live_connpools_lock;
+
+struct U8_CACHED_CONNECTION {
+  u8_connpool pool;
+  unsigned int generation;
+  u8_socket socket;};
+
+static __thread struct U8_CACHED_CONNECTION
+thread_connections[U8_CONNPOOL_THREAD_CACHE];
+static __thread unsigned int thread_cache_id=0;
+static __thread unsigned int thread_cache_epoch=0;
+static u8_tld_key thread_cache_key;
+static unsigned int n_thread_cache_ids=0;
+
+#define CACHED_STATE(id) (((id)<<3)|(U8_CONNSLOT_CACHED))
+#endif
+
+static struct U8_CONNSLOT *connslot(u8_connpool cp,u8_socket c,int add)
+{
+  struct U8_CONNSLOT *chunk;
+  int chunk_no=c/U8_CONNSLOT_CHUNK;
+  if ((c<0)||(chunk_no>=U8_CONNSLOT_CHUNKS)) return NULL;
+  chunk=__atomic_load_n(&(cp->u8cp_slots[chunk_no]),__ATOMIC_ACQUIRE);
+  if ((chunk==NULL)&&(add)) {
+    struct U8_CONNSLOT *fresh=u8_alloc_n(U8_CONNSLOT_CHUNK,struct U8_CONNSLOT);
+    memset(fresh,0,sizeof(struct U8_CONNSLOT)*U8_CONNSLOT_CHUNK);
+    if (__atomic_compare_exchange_n(&(cp->u8cp_slots[chunk_no]),&chunk,fresh,0,
+                                    __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+      chunk=fresh;
+    else u8_free(fresh);}
+  if (chunk)
+    return &(chunk[c%U8_CONNSLOT_CHUNK]);
+  else return NULL;
+}
+
+static void free_connslots(u8_connpool cp)
+{
+  int i=0; while (i<U8_CONNSLOT_CHUNKS) {
+    if (cp->u8cp_slots[i]) {
+      u8_free(cp->u8cp_slots[i]);
+      cp->u8cp_slots[i]=NULL;}
+    i++;}
+}
+
+#define STAMP_IDLE(slot)                                \
+  (__atomic_store_n(&((slot)->u8cs_idle_since),u8_microtime(),__ATOMIC_RELAXED))
+
+static void push_idle(u8_connpool cp,u8_socket c,struct U8_CONNSLOT *slot)
+{
+  unsigned long long top=CP_LOAD(cp->u8cp_idle), next;
+  __atomic_store_n(&(slot->u8cs_state),U8_CONNSLOT_IDLE,__ATOMIC_SEQ_CST);
+  do {
+    __atomic_store_n(&(slot->u8cs_next),(unsigned int)(top&0xFFFFFFFF),
+                     __ATOMIC_RELAXED);
+    next=(((top>>32)+1)<<32)|((unsigned long long)(c+1));}
+  while (!(CP_CAS(cp->u8cp_idle,top,next)));
+}
+
+static u8_socket pop_idle(u8_connpool cp)
+{
+  unsigned long long top=CP_LOAD(cp->u8cp_idle), next;
+  while ((top&0xFFFFFFFF)!=0) {
+    u8_socket c=(u8_socket)((top&0xFFFFFFFF)-1);
+    struct U8_CONNSLOT *slot=connslot(cp,c,0);
+    /* The update count in the top half keeps this from succeeding
+       if c was popped and pushed again since we looked */
+    next=(((top>>32)+1)<<32)|
+      ((unsigned long long)__atomic_load_n(&(slot->u8cs_next),__ATOMIC_RELAXED));
+    if (CP_CAS(cp->u8cp_idle,top,next)) {
+      __atomic_store_n(&(slot->u8cs_state),U8_CONNSLOT_INUSE,__ATOMIC_SEQ_CST);
+      return c;}}
+  return -1;
+}
+
+/* Thread caches */
+
+static void wake_waiters(u8_connpool cp);
+
+#if U8_THREADS_ENABLED
+static void live_connpool(u8_connpool cp)
+{
+  u8_lock_mutex(&live_connpools_lock);
+  cp->u8cp_live_next=live_connpools;
+  live_connpools=cp;
+  u8_unlock_mutex(&live_connpools_lock);
+}
+
+static void dead_connpool(u8_connpool cp)
+{
+  struct U8_CONNPOOL **scan;
+  u8_lock_mutex(&live_connpools_lock);
+  scan=&live_connpools;
+  while (*scan)
+    if (*scan==cp) {
+      *scan=cp->u8cp_live_next;
+      break;}
+    else scan=&((*scan)->u8cp_live_next);
+  cp->u8cp_live_next=NULL;
+  __atomic_store_n(&(cp->u8cp_generation),0,__ATOMIC_SEQ_CST);
+  u8_unlock_mutex(&live_connpools_lock);
+}
+
+/* Returns 1 if a cached connection's pool is still open. Call with
+   live_connpools_lock held, which keeps it open. */
+static int cached_livep(struct U8_CACHED_CONNECTION *cached)
+{
+  struct U8_CONNPOOL *scan=live_connpools;
+  while (scan)
+    if (scan==cached->pool)
+      return (scan->u8cp_generation==cached->generation);
+    else scan=scan->u8cp_live_next;
+  return 0;
+}
+
+static void check_thread_cache()
+{
+  unsigned int epoch=CP_LOAD(connpool_epoch);
+  if (thread_cache_id==0) {
+    thread_cache_id=CP_INCR(n_thread_cache_ids);
+    u8_tld_set(thread_cache_key,(void *)thread_connections);}
+  if (thread_cache_epoch!=epoch) {
+    /* A pool has closed (along with its connections), so forget
+       anything cached from a pool which is gone */
+    int i=0;
+    u8_lock_mutex(&live_connpools_lock);
+    while (i<U8_CONNPOOL_THREAD_CACHE) {
+      struct U8_CACHED_CONNECTION *cached=&(thread_connections[i++]);
+      if ((cached->pool)&&(!(cached_livep(cached))))
+        cached->pool=NULL;}
+    u8_unlock_mutex(&live_connpools_lock);
+    thread_cache_epoch=epoch;}
+}
+
+#define CACHED_FROM(cached,cp,generation) \
+  (((cached)->pool==(cp))&&((cached)->generation==(generation)))
+
+static u8_socket take_cached(u8_connpool cp)
+{
+  unsigned int state, generation=CP_LOAD(cp->u8cp_generation);
+  int i=0;
+  check_thread_cache();
+  state=CACHED_STATE(thread_cache_id);
+  while (i<U8_CONNPOOL_THREAD_CACHE) {
+    struct U8_CACHED_CONNECTION *cached=&(thread_connections[i++]);
+    if (CACHED_FROM(cached,cp,generation)) {
+      u8_socket c=cached->socket;
+      struct U8_CONNSLOT *slot=connslot(cp,c,0);
+      unsigned int expect=state;
+      cached->pool=NULL;
+      /* This fails if someone else took it */
+      if ((slot)&&(CP_CAS(slot->u8cs_state,expect,U8_CONNSLOT_INUSE))) {
+        CP_DECR(cp->u8cp_n_cached);
+        return c;}}}
+  return -1;
+}
+
+/* Returns where to cache a connection from cp, or -1 */
+static int thread_cache_index(u8_connpool cp)
+{
+  unsigned int generation=CP_LOAD(cp->u8cp_generation);
+  int i=0, n_cached=0, open=-1;
+  check_thread_cache();
+  while (i<U8_CONNPOOL_THREAD_CACHE) {
+    struct U8_CACHED_CONNECTION *cached=&(thread_connections[i]);
+    if (CACHED_FROM(cached,cp,generation)) n_cached++;
+    else if (((cached->pool==NULL)||(cached->pool==cp))&&(open<0))
+      /* An entry for cp from another generation is stale */
+      open=i;
+    else NO_ELSE;
+    i++;}
+  if (n_cached>=THREAD_CACHE_PER_POOL) return -1;
+  else return open;
+}
+
+/* When a thread exits, put its cached connections back */
+static void release_thread_cache(void *ignored)
+{
+  unsigned int state=CACHED_STATE(thread_cache_id);
+  int i=0;
+  /* Keeps the pools from closing while we use them */
+  u8_lock_mutex(&live_connpools_lock);
+  while (i<U8_CONNPOOL_THREAD_CACHE) {
+    struct U8_CACHED_CONNECTION *cached=&(thread_connections[i++]);
+    u8_connpool cp=cached->pool;
+    if ((cp)&&(cached_livep(cached))) {
+      struct U8_CONNSLOT *slot=connslot(cp,cached->socket,0);
+      unsigned int expect=state;
+      if ((slot)&&(CP_CAS(slot->u8cs_state,expect,U8_CONNSLOT_IDLE))) {
+        CP_DECR(cp->u8cp_n_cached);
+        push_idle(cp,cached->socket,slot);
+        wake_waiters(cp);}}
+    cached->pool=NULL;}
+  u8_unlock_mutex(&live_connpools_lock);
+}
+#else
+#define take_cached(cp) (-1)
+#define thread_cache_index(cp) (-1)
+#define live_connpool(cp)
+#define dead_connpool(cp)
+#endif
+
+/* Takes a connection in a given state (counted by *count), which
+   isn't on the free stack */
+static u8_socket claim_slot(u8_connpool cp,unsigned int want,int *count)
+{
+  int i=0;
+  /* Don't look unless there's something to find */
+  if (__atomic_load_n(count,__ATOMIC_SEQ_CST)<=0) return -1;
+  while (i<U8_CONNSLOT_CHUNKS) {
+    struct U8_CONNSLOT *chunk=
+      __atomic_load_n(&(cp->u8cp_slots[i]),__ATOMIC_ACQUIRE);
+    if (chunk) {
+      int j=0; while (j<U8_CONNSLOT_CHUNK) {
+        unsigned int state=CP_LOAD(chunk[j].u8cs_state);
+        if ((U8_CONNSLOT_STATE(state)==want)&&
+            (CP_CAS(chunk[j].u8cs_state,state,U8_CONNSLOT_INUSE))) {
+          __atomic_sub_fetch(count,1,__ATOMIC_SEQ_CST);
+          return (i*U8_CONNSLOT_CHUNK)+j;}
+        j++;}}
+    i++;}
+  return -1;
+}
+
+/* Takes a connection cached by another thread */
+#define steal_cached(cp) \
+  (claim_slot((cp),U8_CONNSLOT_CACHED,&((cp)->u8cp_n_cached)))
+/* Takes an idle connection which is being checked */
+#define take_checking(cp) \
+  (claim_slot((cp),U8_CONNSLOT_CHECKING,&((cp)->u8cp_n_checking)))
+
+/* Opening and waiting */
+
+/* Opens a new connection for a pool, giving up after the pool's
+   timeout (or u8_connect_timeout if that's zero) */
+static int pool_timeout(u8_connpool cp)
+{
+  int msecs=(cp->u8cp_timeout.tv_sec*1000)+
+    (cp->u8cp_timeout.tv_nsec/1000000);
+  if (msecs<=0) return u8_connect_timeout;
+  else return msecs;
+}
+
+static u8_socket pool_connect(u8_connpool cp)
+{
+  return u8_connect_within(cp->u8cp_id,NULL,pool_timeout(cp));
+}
+
+/* Counts a connection we're about to open, unless we're at the cap */
+static int reserve_open(u8_connpool cp)
+{
+  int n_open=CP_LOAD(cp->u8cp_n_open), cap=CP_LOAD(cp->u8cp_cap);
+  while ((cap<=0)||(n_open<cap)) {
+    if (CP_CAS(cp->u8cp_n_open,n_open,n_open+1)) return 1;}
+  return 0;
+}
+
+static void wake_waiters(u8_connpool cp)
+{
+  if (CP_LOAD(cp->u8cp_n_waiting)>0) {
+    u8_lock_mutex(&(cp->u8cp_lock));
+    u8_condvar_signal(&(cp->u8cp_drained));
+    u8_unlock_mutex(&(cp->u8cp_lock));}
+}
+
+/* Opens a connection counted by reserve_open(), returning it in use */
+static u8_socket open_connection(u8_connpool cp)
+{
+  u8_socket c=pool_connect(cp);
+  struct U8_CONNSLOT *slot=(c<0)?(NULL):(connslot(cp,c,1));
+  if ((c>=0)&&(slot==NULL)) {
+    close(c);
+    c=u8err(-1,BadPoolSocket,"u8_get_connection",u8_strdup(cp->u8cp_id));}
+  if (c<0) {
+    CP_DECR(cp->u8cp_n_open);
+    /* A waiter might have better luck */
+    wake_waiters(cp);
+    return c;}
+  __atomic_store_n(&(slot->u8cs_state),U8_CONNSLOT_INUSE,__ATOMIC_SEQ_CST);
+  return c;
+}
+
+static u8_socket wait_for_connection(u8_connpool cp)
+{
+  int local_loglevel = (cp->u8cp_loglevel>0) ? (cp->u8cp_loglevel) : (-1);
+  u8_socket c=-1; int opening=0, n_waiting;
+  u8_lock_mutex(&(cp->u8cp_lock));
+  /* Returning threads check n_waiting after making a connection
+     available, so checking again after bumping it can't miss one */
+  n_waiting=CP_INCR(cp->u8cp_n_waiting);
+  if (n_waiting>u8_warn_waitlevel)
+    u8_logf(LOG_WARNING,ConnPools,
+            "(%s/%d/%d) %d requests currently waiting",
+            cp->u8cp_id,cp->u8cp_n_inuse,cp->u8cp_n_open,n_waiting);
+  CPDBG0(cp,"(%s/%d/%d) Waiting for free connection");
+  while (1) {
+    if ((c=pop_idle(cp))>=0) break;
+    else if ((c=take_checking(cp))>=0) break;
+    else if (reserve_open(cp)) {
+      opening=1; break;}
+    else if ((c=steal_cached(cp))>=0) break;
+    else u8_condvar_wait(&(cp->u8cp_drained),&(cp->u8cp_lock));}
+  CP_DECR(cp->u8cp_n_waiting);
+  u8_unlock_mutex(&(cp->u8cp_lock));
+  CPDBG0(cp,"(%s/%d/%d) Stopped waiting for free connection");
+  if (opening) c=open_connection(cp);
+  return c;
+}
+
+/* Warming up pools
+
+   This opens a batch of connections at once, starting a non-blocking
+   connect() for each and waiting on all of them with a single poll().
+   Each connection goes onto the free stack (waking a waiter) as soon
+   as it's connected, so nobody waits for the whole batch. The first
+   connection is made the way u8_connect does (racing the host's
+   addresses) and the rest start with whichever address it used,
+   moving on to the host's other addresses if that fails. Connections
+   which haven't connected by the pool's timeout are given up. */
+
+/* Makes a newly connected socket available */
+static int add_idle(u8_connpool cp,u8_socket c)
+{
+  struct U8_CONNSLOT *slot=connslot(cp,c,1);
+  if (slot==NULL) {
+    close(c);
+    return 0;}
+  restore_blocking(c);
+  STAMP_IDLE(slot);
+  push_idle(cp,c,slot);
+  wake_waiters(cp);
+  return 1;
+}
+
+/* Starts connecting to addrs[*addr_at] or the addresses after it */
+static u8_socket start_warming(u8_connpool cp,struct U8_CONNECT_ADDR *addrs,
+                               int n_addrs,int *addr_at,int *n_opened)
+{
+  while (*addr_at<n_addrs) {
+    int done=0;
+    u8_socket c=start_connect(&(addrs[*addr_at]),&done);
+    if ((c>=0)&&(done)) {
+      *n_opened+=add_idle(cp,c);
+      return -1;}
+    else if (c>=0) return c;
+    else (*addr_at)++;}
+  return -1;
+}
+
+/* Opens up to n new connections for cp (fewer if that would go over
+   the cap), returning the number opened. If any fail, errno is left
+   describing the last failure. */
+static int warm_connpool(u8_connpool cp,int n)
+{
+  u8_byte _hostname[128]; int portno=-1;
+  u8_string hostname;
+  struct U8_CONNECT_ADDR *addrs=NULL;
+  struct pollfd *fds; int *addr_at;
+  int n_reserved=0, n_opened=0, n_live=0, n_addrs, i, last_error=0, win=0;
+  u8_socket first;
+  u8_utime deadline;
+  while ((n_reserved<n)&&(reserve_open(cp))) n_reserved++;
+  if (n_reserved==0) return 0;
+  hostname=u8_parse_addr(cp->u8cp_id,&portno,_hostname,128);
+  if ((hostname==NULL)||(portno<=0)) {
+    /* Bad addresses get their error from open_connection() and
+       file sockets connect right away anyway */
+    if ((hostname)&&(hostname!=_hostname)) u8_free(hostname);
+    i=0; while (i<n_reserved) {
+      u8_socket c=open_connection(cp);
+      if (c<0) {
+        /* Uncount the ones we won't try */
+        __atomic_sub_fetch(&(cp->u8cp_n_open),n_reserved-(i+1),
+                           __ATOMIC_SEQ_CST);
+        break;}
+      STAMP_IDLE(connslot(cp,c,0));
+      push_idle(cp,c,connslot(cp,c,0));
+      wake_waiters(cp);
+      n_opened++; i++;}
+    return n_opened;}
+  n_addrs=get_connect_addrs(hostname,portno,&addrs);
+  if (hostname!=_hostname) u8_free(hostname);
+  if (n_addrs<0) {
+    __atomic_sub_fetch(&(cp->u8cp_n_open),n_reserved,__ATOMIC_SEQ_CST);
+    wake_waiters(cp);
+    return 0;}
+  first=race_connect(addrs,n_addrs,pool_timeout(cp),&win);
+  if (first<0) {
+    last_error=errno;
+    u8_free(addrs);
+    __atomic_sub_fetch(&(cp->u8cp_n_open),n_reserved,__ATOMIC_SEQ_CST);
+    wake_waiters(cp);
+    errno=last_error;
+    return 0;}
+  n_opened+=add_idle(cp,first);
+  if (win>0) {
+    struct U8_CONNECT_ADDR tmp=addrs[0];
+    addrs[0]=addrs[win]; addrs[win]=tmp;}
+  fds=u8_alloc_n(n_reserved,struct pollfd);
+  addr_at=u8_alloc_n(n_reserved,int);
+  i=1; while (i<n_reserved) {
+    int at=0;
+    u8_socket c=start_warming(cp,addrs,n_addrs,&at,&n_opened);
+    if (c>=0) {
+      fds[n_live].fd=c; fds[n_live].events=POLLOUT; fds[n_live].revents=0;
+      addr_at[n_live++]=at;}
+    i++;}
+  deadline=u8_microtime()+(((u8_utime)pool_timeout(cp))*1000);
+  while (n_live>0) {
+    u8_utime now=u8_microtime();
+    int ready=(now>=deadline)?(0):
+      (poll(fds,n_live,(int)((deadline-now+999)/1000)));
+    if ((ready<0)&&(errno==EINTR)) continue;
+    else if (ready<=0) break;
+    i=0; while (i<n_live) {
+      u8_socket c=fds[i].fd, next=-1;
+      int err=0; socklen_t errlen=sizeof(err);
+      if (fds[i].revents==0) {i++; continue;}
+      if (getsockopt(c,SOL_SOCKET,SO_ERROR,&err,&errlen)<0) err=errno;
+      if (err==0)
+        n_opened+=add_idle(cp,c);
+      else {
+        close(c); last_error=err;
+        addr_at[i]++;
+        next=start_warming(cp,addrs,n_addrs,&(addr_at[i]),&n_opened);}
+      if (next>=0) {
+        fds[i].fd=next; fds[i].revents=0; i++;}
+      else {
+        fds[i]=fds[n_live-1]; addr_at[i]=addr_at[n_live-1];
+        n_live--;}}}
+  if (n_live>0) last_error=ETIMEDOUT;
+  i=0; while (i<n_live) close(fds[i++].fd);
+  u8_free(fds); u8_free(addr_at); u8_free(addrs);
+  if (n_opened<n_reserved) {
+    if (last_error) errno=last_error;
+    /* Uncount the ones which failed, which may let waiters open them */
+    __atomic_sub_fetch(&(cp->u8cp_n_open),n_reserved-n_opened,
+                       __ATOMIC_SEQ_CST);
+    wake_waiters(cp);}
+  return n_opened;
+}
 
 U8_EXPORT u8_connpool
   u8_init_connpool(u8_connpool cp_arg,u8_string id,int reserve,int cap,int init)
@@ -557,32 +1492,35 @@ U8_EXPORT u8_connpool
   cp->u8cp_n_open=0;
   cp->u8cp_n_inuse=0;
   cp->u8cp_n_waiting=0;
-  cp->u8cp_inuse=u8_alloc_n(cap,u8_socket);
-  cp->u8cp_free=u8_alloc_n(cap,u8_socket);
+  cp->u8cp_n_cached=cp->u8cp_n_checking=0;
+  memset(cp->u8cp_slots,0,sizeof(cp->u8cp_slots));
+  cp->u8cp_idle=0;
   cp->u8cp_reconnect_wait1=-1;
   cp->u8cp_reconnect_wait=-1;
   cp->u8cp_reconnect_tries=-1;
-  cp->u8cp_next=NULL;
+  cp->u8cp_timeout.tv_sec=0;
+  cp->u8cp_timeout.tv_nsec=0;
+  cp->u8cp_check_interval=0;
+  cp->u8cp_max_idle=0;
+  cp->u8cp_next=cp->u8cp_live_next=NULL;
+  /* Skipping zero, which marks closed pools */
+  while ((cp->u8cp_generation=CP_INCR(connpool_generations))==0) {}
   u8_init_mutex(&(cp->u8cp_lock));
   u8_init_condvar(&(cp->u8cp_drained));
+  u8_init_condvar(&(cp->u8cp_maintenance));
   if (init>0) {
-    int i=0;
     if (init>cap) init=cap;
-    while (i<init) {
-      int conn=u8_connect(id);
-      if (conn<0) {
-        u8_socket *opened=cp->u8cp_free;
-        int j=0, lim=cp->u8cp_n_open;
-        u8_graberr(errno,"u8_init_connblock",cp->u8cp_id);
-        while (j<lim) {
-          close(opened[j]); j++;}
-        u8_free(cp->u8cp_free);
-        u8_free(cp->u8cp_inuse);
-        if (cp_arg==NULL) u8_free(cp);
-        return NULL;}
-      else {
-        cp->u8cp_free[i++]=conn;
-        cp->u8cp_n_open++;}}}
+    if (warm_connpool(cp,init)<init) {
+      u8_socket opened;
+      if (!(u8_current_exception))
+        u8_graberr(errno,"u8_init_connblock",u8_strdup(cp->u8cp_id));
+      while ((opened=pop_idle(cp))>=0) close(opened);
+      free_connslots(cp);
+      u8_free(cp->u8cp_id);
+      if (cp_arg==NULL) u8_free(cp);
+      return NULL;}}
+  live_connpool(cp);
+  u8_connpool_maintenance(cp,u8_connpool_check_interval,u8_connpool_max_idle);
   return cp;
 }
 
@@ -590,186 +1528,306 @@ U8_EXPORT u8_connpool
    init.  */
 static int grow_connpool(u8_connpool cp,int newcap,int newinit)
 {
-  /* If thew newcap is greater than the current cap, you need to
-     grow the connection vectors. */
   u8_lock_mutex(&(cp->u8cp_lock));
   CPDBG2(cp,"(%s/%d/%d) growing connection pool to %d/%d",newinit,newcap);
   if (newcap>cp->u8cp_cap) {
-    u8_socket *newfree, *newinuse;
-    newfree=u8_realloc_n(cp->u8cp_free,newcap,u8_socket);
-    if (newfree) cp->u8cp_free=newfree;
-    newinuse=u8_realloc_n(cp->u8cp_inuse,newcap,u8_socket);
-    if (newinuse) cp->u8cp_inuse=newinuse;
-    if ((newfree==NULL) || (newinuse==NULL)) {
-      u8_graberr(errno,"grow_connpool",cp->u8cp_id);
-      u8_unlock_mutex(&(cp->u8cp_lock));
-      return -1;}
-    cp->u8cp_cap=newcap;}
+    __atomic_store_n(&(cp->u8cp_cap),newcap,__ATOMIC_SEQ_CST);
+    /* Waiters can open new connections now */
+    u8_condvar_broadcast(&(cp->u8cp_drained));}
+  u8_unlock_mutex(&(cp->u8cp_lock));
   /* Truncate newinit to the cap */
   if (newinit>cp->u8cp_cap) newinit=cp->u8cp_cap;
   /* If the newinit is greater than the number of open connections,
      you need to open some new connections. */
-  if (newinit>cp->u8cp_n_open) {
-    int have=cp->u8cp_n_open, need=newinit-have;
-    while (have<need) {
-      u8_socket c=u8_connect(cp->u8cp_id);
-      if (c<0) {
+  if (newinit>CP_LOAD(cp->u8cp_n_open)) {
+    warm_connpool(cp,newinit-CP_LOAD(cp->u8cp_n_open));
+    /* Other threads may have opened some (or failed to) meanwhile */
+    if (CP_LOAD(cp->u8cp_n_open)<newinit) {
+      if (!(u8_current_exception))
         u8_graberr(errno,"grow_connpool",u8_strdup(cp->u8cp_id));
-        u8_unlock_mutex(&(cp->u8cp_lock));
-        return -1;}
-      cp->u8cp_free[have++]=c; cp->u8cp_n_open++;}}
-  u8_unlock_mutex(&(cp->u8cp_lock));
+      return -1;}}
   return cp->u8cp_cap;
 }
 
 U8_EXPORT u8_socket u8_get_connection(u8_connpool cp)
 {
-  u8_socket retval=-1;
-  u8_lock_mutex(&(cp->u8cp_lock));
+  u8_socket c;
   int local_loglevel = (cp->u8cp_loglevel>0) ? (cp->u8cp_loglevel) : (-1);
   CPDBG0(cp,"(%s/%d/%d) Getting connection");
   if (cp->u8cp_reserve<1) {
-    /* If we're not really maintaining a pool, just connect. */
-    u8_socket c;
-    if ((c=u8_connect(cp->u8cp_id))<0) {
-      u8_unlock_mutex(&(cp->u8cp_lock));
+    /* If we're not really maintaining a pool, just connect,
+       but track n_open */
+    if ((c=pool_connect(cp))>=0) CP_INCR(cp->u8cp_n_open);
+    return c;}
+  else if ((c=take_cached(cp))>=0) {
+    CPDBG1(cp,"(%s/%d/%d) Using thread's connection %d",c);}
+  else if ((c=pop_idle(cp))>=0) {
+    CPDBG1(cp,"(%s/%d/%d) Using existing connection %d",c);}
+  else if ((c=take_checking(cp))>=0) {
+    CPDBG1(cp,"(%s/%d/%d) Using existing connection %d",c);}
+  else if (reserve_open(cp)) {
+    /* Make a new connection. */
+    CPDBG0(cp,"(%s/%d/%d) Opening new connection");
+    if ((c=open_connection(cp))<0) {
+      CPDBG0(cp,"(%s/%d/%d) Couldn't open new connection");
       return c;}
-    else {
-      /* But just track n_open */
-      cp->u8cp_n_open++;
-      u8_unlock_mutex(&(cp->u8cp_lock));
-      return c;}}
-  else {
-    int n_open=cp->u8cp_n_open, n_inuse=cp->u8cp_n_inuse;
-    int n_free=n_open-n_inuse;    if (n_free>0) {
-      /* Use an existing connection */
-      retval=cp->u8cp_free[n_free-1];
-      cp->u8cp_inuse[cp->u8cp_n_inuse]=retval;
-      cp->u8cp_n_inuse++;
-      CPDBG2(cp,"(%s/%d/%d) Using existing connection %d at %d",
-             retval,n_free-1);}
-    else if (((cp->u8cp_cap)>0) && ((cp->u8cp_n_open)>=(cp->u8cp_cap))) {
-      /* If there's a cap and we're at it, start waiting. */
-      cp->u8cp_n_waiting++;
-      if (cp->u8cp_n_waiting>u8_warn_waitlevel)
-        u8_logf(LOG_WARNING,ConnPools,
-                "(%s/%d/%d) %d requests currently waiting",
-                cp->u8cp_id,cp->u8cp_n_inuse,cp->u8cp_n_open,
-                cp->u8cp_n_waiting);
-      CPDBG0(cp,"(%s/%d/%d) Waiting for free connection");
-      while (1) {
-        u8_condvar_wait(&(cp->u8cp_drained),&(cp->u8cp_lock));
-        if ((cp->u8cp_n_inuse)<(cp->u8cp_n_open)) {
-          CPDBG0(cp,"(%s/%d/%d) Stopped waiting for free connection");
-          n_free=cp->u8cp_n_open-cp->u8cp_n_inuse;
-          retval=cp->u8cp_free[n_free-1];
-          cp->u8cp_inuse[cp->u8cp_n_inuse]=retval;
-          cp->u8cp_n_inuse++;
-          CPDBG2(cp,"(%s/%d/%d) Using existing connection %d at %d",
-                 retval,n_free-1);
-          cp->u8cp_n_waiting--;
-          break;}}}
-    else {
-      /* Otherwise, make a new connection. */
-      CPDBG0(cp,"(%s/%d/%d) Opening new connection");
-      retval=u8_connect(cp->u8cp_id);
-      if (retval<0) {
-        CPDBG0(cp,"(%s/%d/%d) Couldn't open new connection");
-        u8_unlock_mutex(&(cp->u8cp_lock));
-        return retval;}
-      cp->u8cp_inuse[cp->u8cp_n_inuse]=retval;
-      cp->u8cp_n_inuse++; cp->u8cp_n_open++;
-      u8_logf(LOG_NOTICE,ConnPools,"(%s/%d/%d) Added new connection %d",
-              cp->u8cp_id,cp->u8cp_n_inuse,cp->u8cp_n_open,retval);
-      CPDBG2(cp,"(%s/%d/%d) Stored new connection %d at %d",
-             retval,cp->u8cp_n_inuse-1);}
-    u8_unlock_mutex(&(cp->u8cp_lock));
-    return retval;}
+    u8_logf(LOG_NOTICE,ConnPools,"(%s/%d/%d) Added new connection %d",
+            cp->u8cp_id,cp->u8cp_n_inuse,cp->u8cp_n_open,c);}
+  /* We're at the cap, so take one from another thread or wait */
+  else if ((c=steal_cached(cp))>=0) {
+    CPDBG1(cp,"(%s/%d/%d) Using another thread's connection %d",c);}
+  else if ((c=wait_for_connection(cp))<0)
+    return c;
+  else NO_ELSE;
+  CP_INCR(cp->u8cp_n_inuse);
+  return c;
 }
 
 /* Returns a connection to the pool, possibly discarding it. */
 static u8_socket return_connection(u8_connpool cp,u8_socket c,int discard)
 {
-  u8_lock_mutex(&(cp->u8cp_lock));
-  CPDBG1(cp,"(%s/%d/%d) Freeing (returning) connection %d",c);
   int local_loglevel = (cp->u8cp_loglevel>0) ? (cp->u8cp_loglevel) : (-1);
+  CPDBG1(cp,"(%s/%d/%d) Freeing (returning) connection %d",c);
   if (cp->u8cp_reserve<1) {
     /* non-pooling mode */
-    close(c); cp->u8cp_n_open--;
-    u8_unlock_mutex(&(cp->u8cp_lock));
+    close(c); CP_DECR(cp->u8cp_n_open);
     return 0;}
   else {
-    int retval=-1;
-    int n_open=cp->u8cp_n_open, n_inuse=cp->u8cp_n_inuse;
-    int n_free=n_open-n_inuse;
-    u8_socket *scan=cp->u8cp_inuse, *limit=scan+n_inuse;
-    /* Find the connection */
-    while (scan<limit) if (*scan==c) break; else scan++;
-    if (scan>=limit) {
-      /* Didn't find connection */
-      u8_unlock_mutex(&(cp->u8cp_lock));
+    struct U8_CONNSLOT *slot=connslot(cp,c,0);
+    int cache_at=((discard)||(CP_LOAD(cp->u8cp_n_waiting)>0)) ? (-1) :
+      (thread_cache_index(cp));
+    unsigned int expect=U8_CONNSLOT_INUSE, newstate=
+      (discard) ? (U8_CONNSLOT_NONE) :
+#if U8_THREADS_ENABLED
+      (cache_at>=0) ? (CACHED_STATE(thread_cache_id)) :
+#endif
+      (U8_CONNSLOT_IDLE);
+    /* This also checks that c is a connection in use */
+    if ((slot==NULL)||(!(CP_CAS(slot->u8cs_state,expect,newstate)))) {
       if (discard)
         return u8err(-1,_("Connection not in block"),"u8_discard_connection",
-                  u8_mkstring("%d",c));
+                     u8_mkstring("%d",c));
       else return u8err(-1,_("Connection not in block"),"u8_return_connection",
                         u8_mkstring("%d",c));}
-    CPDBG2(cp,"(%s/%d/%d) Found connection %d at %d",c,scan-cp->u8cp_inuse);
-    /* Move the inuse records down */
-    memmove(scan,scan+1,sizeof(u8_socket)*(limit-(scan+1)));
-    /* Bump the inuse pointer */
-    cp->u8cp_n_inuse--;
-    CPDBG1(cp,"(%s/%d/%d) Removed %d from inuse",c);
-    if (discard)
+    CP_DECR(cp->u8cp_n_inuse);
+    if (discard) {
       u8_logf(LOG_NOTICE,ConnPools,"(%s/%d/%d) Discarding %d",
               cp->u8cp_id,cp->u8cp_n_inuse,cp->u8cp_n_open,c);
-    /* Now either discard the connection or add it to the free vector. */
-    if (discard)
-      /* If we're discarding this connection but there are still waiting
-         requests, we generate a new connection to put back into the pool. */
-      if ((cp->u8cp_n_waiting)>0) {
-        CPDBG0(cp,"(%s/%d/%d) Opening replacement connection");
-        c=u8_connect(cp->u8cp_id);
-        if (c<0) {
-          cp->u8cp_n_open--; close(c);
-          /* Couldn't open the connection, bump n_open down */
-          CPDBG0(cp,"(%s/%d/%d) Couldn't open replacement connection");
-          u8_logf(LOG_WARNING,ConnPools,
-                  "(%s/%d/%d) Couldn't open replacement connection",
-                  cp->u8cp_id,cp->u8cp_n_inuse,cp->u8cp_n_open);
-          u8_unlock_mutex(&(cp->u8cp_lock));
-          return c;}
-        /* We don't bump n_open because we're doing a replacement.
-           But do add the new connection to the free vector.  */
-        CPDBG2(cp,"(%s/%d/%d) Stored replacement connection %d at %d",
-               c,n_free);
-        retval=cp->u8cp_free[n_free]=c;}
-      else {
-        close(c);
-        cp->u8cp_n_open--;
-        CPDBG1(cp,"(%s/%d/%d) Closed discarded connection %d",c);
-        u8_unlock_mutex(&(cp->u8cp_lock));
-        return 0;}
-#if 0
-    /* We've commented this out because it is too eager.
-       It turns out that the 'load' when you return a connection
-       isn't a good guide for whether or not to keep it.
-       This might eventually be address by some kind of
-       external process. */
-    else if ((cp->u8cp_n_waiting==0) &&
-             (((cp->u8cp_n_open)-(cp->u8cp_n_inuse))>(cp->u8cp_reserve))) {
-      /* Close the connection if no one is waiting and if the
-         number of free connections is greater than the reserve. */
-      close(c); cp->u8cp_n_open--; retval=0;
-      CPDBG1(cp,"(%s/%d/%d) Closed discarded connection %d",c);}
+      close(c);
+      CP_DECR(cp->u8cp_n_open);
+      CPDBG1(cp,"(%s/%d/%d) Closed discarded connection %d",c);
+      /* Any waiter can open a replacement */
+      wake_waiters(cp);
+      return 0;}
+#if U8_THREADS_ENABLED
+    else if (cache_at>=0) {
+      STAMP_IDLE(slot);
+      CP_INCR(cp->u8cp_n_cached);
+      thread_connections[cache_at].pool=cp;
+      thread_connections[cache_at].generation=CP_LOAD(cp->u8cp_generation);
+      thread_connections[cache_at].socket=c;
+      CPDBG1(cp,"(%s/%d/%d) Kept free connection %d for this thread",c);
+      /* Someone may have started waiting (and can take it) since we
+         checked */
+      wake_waiters(cp);
+      return c;}
 #endif
-    /* if not discarding, add the returned connection to the free vector. */
     else {
-      CPDBG2(cp,"(%s/%d/%d) Stored free connection %d at %d",
-             c,n_free);
-      retval=cp->u8cp_free[n_free]=c;}
-    u8_condvar_signal(&(cp->u8cp_drained));
-    u8_unlock_mutex(&(cp->u8cp_lock));
-    return retval;}
+      STAMP_IDLE(slot);
+      push_idle(cp,c,slot);
+      CPDBG1(cp,"(%s/%d/%d) Stored free connection %d",c);
+      wake_waiters(cp);
+      return c;}}
+}
+
+/* Maintaining pools
+
+   Idle connections can be closed by the other end (or by something in
+   between) while they wait, and callers would otherwise only find out
+   when using them. Every u8cp_check_interval seconds, a pool's
+   maintenance thread moves the idle connections on the free stack
+   (along with any connections threads have kept but not used since
+   the last check) into the CHECKING state, checks them with a poll()
+   for hangups and a peek for EOF, and puts back the ones which are
+   still good and haven't been idle for more than u8cp_max_idle
+   seconds. Getters take CHECKING connections before opening new ones,
+   so the check doesn't make the pool grow; the check just skips any
+   which are taken. It then opens connections to bring the pool back
+   up to u8cp_reserve. */
+
+/* Moves a connection we've taken into the CHECKING state */
+static void start_checking(u8_connpool cp,u8_socket c)
+{
+  struct U8_CONNSLOT *slot=connslot(cp,c,0);
+  /* Count it first, so that taking it can't make the count negative */
+  CP_INCR(cp->u8cp_n_checking);
+  __atomic_store_n(&(slot->u8cs_state),U8_CONNSLOT_CHECKING,__ATOMIC_SEQ_CST);
+}
+
+/* Takes back a connection being checked, unless someone took it */
+static int stop_checking(u8_connpool cp,u8_socket c)
+{
+  struct U8_CONNSLOT *slot=connslot(cp,c,0);
+  unsigned int expect=U8_CONNSLOT_CHECKING;
+  if (CP_CAS(slot->u8cs_state,expect,U8_CONNSLOT_INUSE)) {
+    CP_DECR(cp->u8cp_n_checking);
+    return 1;}
+  else return 0;
+}
+
+/* Returns 1 if a socket which should be quiet has been closed (or
+   has something unexpected waiting) */
+static int idle_deadp(struct pollfd *pfd)
+{
+  if ((pfd->revents)&(POLLERR|POLLHUP|POLLNVAL))
+    return 1;
+#ifdef POLLRDHUP
+  else if ((pfd->revents)&(POLLRDHUP))
+    return 1;
+#endif
+  else if ((pfd->revents)&(POLLIN)) {
+    /* Either EOF or data nobody asked for */
+    char byte;
+    ssize_t n=recv(pfd->fd,&byte,1,MSG_PEEK|MSG_DONTWAIT);
+    if ((n<0)&&((errno==EAGAIN)||(errno==EWOULDBLOCK)||(errno==EINTR)))
+      return 0;
+    else return 1;}
+  else return 0;
+}
+
+U8_EXPORT int u8_connpool_maintain(u8_connpool cp)
+{
+  int local_loglevel = (cp->u8cp_loglevel>0) ? (cp->u8cp_loglevel) : (-1);
+  u8_utime now=u8_microtime();
+  u8_utime max_idle=((u8_utime)(cp->u8cp_max_idle))*1000000;
+  u8_utime unused=((u8_utime)(cp->u8cp_check_interval))*1000000;
+  int n_idle=0, max_n=16, n_closed=0, i, reserve=cp->u8cp_reserve;
+  u8_socket *idle, c;
+  struct pollfd *fds;
+  if (reserve<1) return 0;
+  idle=u8_alloc_n(max_n,u8_socket);
+  /* Move everything on the free stack to CHECKING */
+  while ((c=pop_idle(cp))>=0) {
+    if (n_idle>=max_n) {
+      max_n=max_n*2;
+      idle=u8_realloc_n(idle,max_n,u8_socket);}
+    start_checking(cp,c);
+    idle[n_idle++]=c;}
+  /* And take connections threads have kept without using */
+  i=(CP_LOAD(cp->u8cp_n_cached)>0)?(0):(U8_CONNSLOT_CHUNKS);
+  while (i<U8_CONNSLOT_CHUNKS) {
+    struct U8_CONNSLOT *chunk=
+      __atomic_load_n(&(cp->u8cp_slots[i]),__ATOMIC_ACQUIRE);
+    if (chunk) {
+      int j=0; while (j<U8_CONNSLOT_CHUNK) {
+        unsigned int state=CP_LOAD(chunk[j].u8cs_state);
+        u8_utime since=
+          __atomic_load_n(&(chunk[j].u8cs_idle_since),__ATOMIC_RELAXED);
+        if ((U8_CONNSLOT_STATE(state)==U8_CONNSLOT_CACHED)&&
+            ((now-since)>=unused)&&
+            (CP_CAS(chunk[j].u8cs_state,state,U8_CONNSLOT_INUSE))) {
+          CP_DECR(cp->u8cp_n_cached);
+          if (n_idle>=max_n) {
+            max_n=max_n*2;
+            idle=u8_realloc_n(idle,max_n,u8_socket);}
+          c=(i*U8_CONNSLOT_CHUNK)+j;
+          start_checking(cp,c);
+          idle[n_idle++]=c;}
+        j++;}}
+    i++;}
+  fds=u8_alloc_n(n_idle+1,struct pollfd);
+  i=0; while (i<n_idle) {
+    fds[i].fd=idle[i];
+    fds[i].events=POLLIN
+#ifdef POLLRDHUP
+      |POLLRDHUP
+#endif
+      ;
+    fds[i].revents=0;
+    i++;}
+  if ((n_idle>0)&&(poll(fds,n_idle,0)<0)) {
+    /* Couldn't check, so just keep them */
+    i=0; while (i<n_idle) fds[i++].revents=0;}
+  /* Put back the ones nobody took, in the order they came off the
+     stack, so the most recently used stays on top */
+  i=n_idle-1; while (i>=0) {
+    struct U8_CONNSLOT *slot=connslot(cp,idle[i],0);
+    u8_utime since; int dead;
+    if (!(stop_checking(cp,idle[i]))) {
+      /* Someone's using it, so it isn't ours to close or put back */
+      n_idle--; i--;
+      continue;}
+    since=__atomic_load_n(&(slot->u8cs_idle_since),__ATOMIC_RELAXED);
+    dead=idle_deadp(&(fds[i]));
+    if ((dead)||((max_idle>0)&&((now-since)>max_idle))) {
+      u8_logf(LOG_INFO,ConnPools,"(%s/%d/%d) Closing %s connection %d",
+              cp->u8cp_id,cp->u8cp_n_inuse,cp->u8cp_n_open,
+              ((dead)?("dead"):("idle")),idle[i]);
+      __atomic_store_n(&(slot->u8cs_state),U8_CONNSLOT_NONE,__ATOMIC_SEQ_CST);
+      close(idle[i]);
+      CP_DECR(cp->u8cp_n_open);
+      n_closed++;}
+    else push_idle(cp,idle[i],slot);
+    i--;}
+  u8_free(fds); u8_free(idle);
+  if (n_idle>n_closed) wake_waiters(cp);
+  /* Top up to the reserve */
+  if (CP_LOAD(cp->u8cp_n_open)<reserve) {
+    int need=reserve-CP_LOAD(cp->u8cp_n_open);
+    if (warm_connpool(cp,need)<need)
+      u8_logf(LOG_WARN,ConnPools,
+              "(%s/%d/%d) Couldn't reopen %d connection(s) for the reserve",
+              cp->u8cp_id,cp->u8cp_n_inuse,cp->u8cp_n_open,need);}
+  return n_closed;
+}
+
+#if U8_THREADS_ENABLED
+static void *connpool_maintainer(void *arg)
+{
+  u8_connpool cp=(u8_connpool)arg;
+  u8_lock_mutex(&(cp->u8cp_lock));
+  while (!((CP_LOAD(cp->u8cp_bits))&(U8_CONNPOOL_CLOSING))) {
+    int interval=cp->u8cp_check_interval;
+    if (interval<=0)
+      u8_condvar_wait(&(cp->u8cp_maintenance),&(cp->u8cp_lock));
+    else {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME,&until);
+      until.tv_sec=until.tv_sec+interval;
+      if (u8_condvar_timedwait(&(cp->u8cp_maintenance),&(cp->u8cp_lock),
+                               &until)==ETIMEDOUT) {
+        u8_unlock_mutex(&(cp->u8cp_lock));
+        u8_connpool_maintain(cp);
+        /* Errors were logged (or will be tried again) */
+        u8_clear_errors(0);
+        u8_lock_mutex(&(cp->u8cp_lock));}}}
+  u8_unlock_mutex(&(cp->u8cp_lock));
+  return NULL;
+}
+#endif
+
+U8_EXPORT int u8_connpool_maintenance(u8_connpool cp,int interval,int max_idle)
+{
+  int old_interval;
+  u8_lock_mutex(&(cp->u8cp_lock));
+  old_interval=cp->u8cp_check_interval;
+  cp->u8cp_check_interval=interval;
+  cp->u8cp_max_idle=max_idle;
+#if U8_THREADS_ENABLED
+  if ((CP_LOAD(cp->u8cp_bits))&(U8_CONNPOOL_MAINTAINED))
+    /* Have it pick up the new interval */
+    u8_condvar_signal(&(cp->u8cp_maintenance));
+  else if ((interval>0)&&(cp->u8cp_reserve>0)) {
+    if (pthread_create(&(cp->u8cp_maintainer),pthread_attr_default,
+                       connpool_maintainer,(void *)cp)==0)
+      __atomic_or_fetch(&(cp->u8cp_bits),U8_CONNPOOL_MAINTAINED,
+                        __ATOMIC_SEQ_CST);
+    else u8_logf(LOG_WARN,ConnPools,
+                 "Couldn't start the maintenance thread for %s",cp->u8cp_id);}
+  else NO_ELSE;
+#endif
+  u8_unlock_mutex(&(cp->u8cp_lock));
+  return old_interval;
 }
 
 #if 0
@@ -853,9 +1911,11 @@ U8_EXPORT u8_connpool u8_open_connpool
     else conn=conn->u8cp_next;
   if (conn==NULL) {
     conn=u8_init_connpool(NULL,id,reserve,cap,init);
-    if (conn==NULL) return conn;
+    if (conn==NULL) {
+      u8_unlock_mutex(&connpools_lock);
+      return conn;}
     conn->u8cp_next=connpools;
-    conn->u8cp_bits=conn->u8cp_bits|U8_CONNPOOL_REGISTERED;
+    __atomic_or_fetch(&(conn->u8cp_bits),U8_CONNPOOL_REGISTERED,__ATOMIC_SEQ_CST);
     connpools=conn;}
   if ((reserve>0) && (reserve>(conn->u8cp_reserve)))
     conn->u8cp_reserve=reserve;
@@ -872,6 +1932,20 @@ U8_EXPORT u8_connpool u8_open_connpool
  (with a timeout) for live connections to finish. */
 U8_EXPORT u8_connpool u8_close_connpool(u8_connpool cp,int dolog)
 {
+  int maintained;
+  u8_lock_mutex(&(cp->u8cp_lock));
+  __atomic_or_fetch(&(cp->u8cp_bits),U8_CONNPOOL_CLOSING,__ATOMIC_SEQ_CST);
+  maintained=((CP_LOAD(cp->u8cp_bits))&(U8_CONNPOOL_MAINTAINED));
+  if (maintained) u8_condvar_signal(&(cp->u8cp_maintenance));
+  u8_unlock_mutex(&(cp->u8cp_lock));
+#if U8_THREADS_ENABLED
+  if (maintained) pthread_join(cp->u8cp_maintainer,NULL);
+#endif
+  /* Once it's gone from the live pools, exiting threads won't put
+     connections back. This takes live_connpools_lock, which is held
+     while taking the pool's lock (to wake waiters), so we mustn't
+     hold the pool's lock here. */
+  dead_connpool(cp);
   u8_lock_mutex(&(cp->u8cp_lock));
   if (cp->u8cp_n_inuse)
     u8_logf(LOG_WARN,"Connpool/BadClose",
@@ -882,20 +1956,32 @@ U8_EXPORT u8_connpool u8_close_connpool(u8_connpool cp,int dolog)
             "Closing the connection pool %s",cp->u8cp_n_inuse);
   else NO_ELSE;
   {
-    int n_open=cp->u8cp_n_open, n_inuse=cp->u8cp_n_inuse;
-    int i, n_free=n_open-n_inuse;
-    i=0; while (i<n_free) {close(cp->u8cp_free[i]); i++;}
-    i=0; while (i<n_inuse) {close(cp->u8cp_inuse[i]); i++;}
-    u8_free(cp->u8cp_inuse); u8_free(cp->u8cp_free);
+    /* Close every socket with a slot, in use or not */
+    int i=0; while (i<U8_CONNSLOT_CHUNKS) {
+      struct U8_CONNSLOT *chunk=cp->u8cp_slots[i];
+      if (chunk) {
+        int j=0; while (j<U8_CONNSLOT_CHUNK) {
+          if (chunk[j].u8cs_state!=U8_CONNSLOT_NONE)
+            close((i*U8_CONNSLOT_CHUNK)+j);
+          j++;}}
+      i++;}
+    free_connslots(cp);
+    cp->u8cp_idle=0;
     cp->u8cp_n_inuse=cp->u8cp_n_open=0;
+    cp->u8cp_n_cached=cp->u8cp_n_checking=0;
     u8_free(cp->u8cp_id);
+    /* Threads may have this pool's connections cached */
+    CP_INCR(connpool_epoch);
   }
-  u8_lock_mutex(&(cp->u8cp_lock));
+  u8_unlock_mutex(&(cp->u8cp_lock));
   u8_destroy_mutex(&(cp->u8cp_lock));
+  u8_destroy_condvar(&(cp->u8cp_drained));
+  u8_destroy_condvar(&(cp->u8cp_maintenance));
   if ((cp->u8cp_bits)&(U8_CONNPOOL_REGISTERED)) {
     u8_lock_mutex(&connpools_lock);
     if (connpools==cp) {
       connpools=cp->u8cp_next;
+      u8_unlock_mutex(&connpools_lock);
       u8_free(cp);
       return NULL;}
     else {
@@ -905,8 +1991,10 @@ U8_EXPORT u8_connpool u8_close_connpool(u8_connpool cp,int dolog)
         else {last=scan; scan=last->u8cp_next;}
       if (scan) {
         last->u8cp_next=scan->u8cp_next;
+        u8_unlock_mutex(&connpools_lock);
         u8_free(scan);
         return NULL;}
+      u8_unlock_mutex(&connpools_lock);
       u8_logf(LOG_WARN,"BADCLOSE",
               "Internal inconsistency: can't find registered connpool",
               cp->u8cp_id);
@@ -1211,6 +2299,9 @@ void init_netfns_c()
 #if U8_THREADS_ENABLED
   u8_init_mutex(&connpools_lock);
   u8_init_mutex(&netfns_lock);
+  u8_init_mutex(&dns_lock);
+  u8_init_mutex(&live_connpools_lock);
+  u8_new_threadkey(&thread_cache_key,release_thread_cache);
 #endif
   u8_register_source_file(_FILEINFO);
 }
@@ -30,6 +30,7 @@ int u8_server_loglevel = -1;
 static int local_loglevel = -1;
 
 #include "libu8/libu8io.h"
+#include "libu8/u8stringfns.h"
 #include "libu8/u8filefns.h"
 #include "libu8/u8netfns.h"
 #include "libu8/u8srvfns.h"
@@ -37,6 +38,7 @@ static int local_loglevel = -1;
 #include "libu8/u8logging.h"
 #include <unistd.h>
 #include <limits.h>
+#include <signal.h>
 #if HAVE_POLL_H
 #include <poll.h>
 #elif HAVE_SYS_POLL_H
@@ -52,6 +54,149 @@ static int local_loglevel = -1;
 #define POLLIN_EVENTS (POLLIN|POLLPRI|HUPFLAGS)
 #define POLLOUT_EVENTS (POLLOUT|POLLPRI|HUPFLAGS)
 
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#if ((HAVE_SYS_EPOLL_H) && (defined(EPOLLONESHOT)))
+#define U8_USE_EPOLL 1
+#else
+#define U8_USE_EPOLL 0
+#endif
+
+/* Counters which threads update without holding the server lock */
+#define SERVER_INCR(field) (__atomic_add_fetch(&(field),1,__ATOMIC_RELAXED))
+#define SERVER_DECR(field) (__atomic_sub_fetch(&(field),1,__ATOMIC_RELAXED))
+
+/* Counting in the calling thread's shard of the server's metrics */
+#define METRIC_INCR(server,field) \
+  (__atomic_add_fetch(&(metrics_shard(server)->field),1,__ATOMIC_RELAXED))
+
+/* Recording latencies in the server's histograms and metrics */
+#define RECORD_LATENCY(cl,phase,value) \
+  record_latency((cl)->server,phase,value)
+
+/* How long (in milliseconds) the listener waits at most while
+   clients are paused because the queue is full */
+#ifndef U8_SERVER_PAUSED_TIMEOUT
+#define U8_SERVER_PAUSED_TIMEOUT 10
+#endif
+
+/* With U8_OVERLOAD_SHED, the most idle clients closed in each
+   interval (in microseconds), and how many clients from the front of
+   the idle list are looked at for each one */
+#ifndef U8_SERVER_SHED_MAX
+#define U8_SERVER_SHED_MAX 8
+#endif
+#ifndef U8_SERVER_SHED_INTERVAL
+#define U8_SERVER_SHED_INTERVAL 100000
+#endif
+#define U8_SERVER_SHED_CHECK 8
+
+/* How often (in microseconds) the listener considers growing the
+   thread pool */
+#ifndef U8_SERVER_POOL_INTERVAL
+#define U8_SERVER_POOL_INTERVAL 100000
+#endif
+
+/* How many ready events to take from each epoll_wait() */
+#ifndef U8_SERVER_MAX_EVENTS
+#define U8_SERVER_MAX_EVENTS 256
+#endif
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+/* IORING_FEAT_FAST_POLL arrived with the kernels (5.7) which also
+   have IORING_OP_SEND and IORING_OP_RECV */
+#if ((U8_THREADS_ENABLED) && (HAVE_LINUX_IO_URING_H) && \
+     (defined(IORING_FEAT_FAST_POLL)) && (defined(__NR_io_uring_setup)))
+#define U8_USE_IO_URING 1
+#else
+#define U8_USE_IO_URING 0
+#endif
+
+/* How many submission entries to ask for when setting up a ring */
+#ifndef U8_SERVER_URING_ENTRIES
+#define U8_SERVER_URING_ENTRIES 256
+#endif
+
+#include <sys/uio.h>
+#if HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+/* The buffer used to copy file data when sendfile() isn't available */
+#ifndef U8_SENDFILE_BUFSIZE
+#define U8_SENDFILE_BUFSIZE 16384
+#endif
+
+/* How many segments to pass to each writev() */
+#ifndef U8_CLIENT_MAX_IOV
+#define U8_CLIENT_MAX_IOV 64
+#endif
+
+#if HAVE_UCONTEXT_H
+#include <ucontext.h>
+#endif
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#if HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
+/* Coroutines never leave the thread which started them, so they
+   need threads as well as ucontext */
+#if ((U8_THREADS_ENABLED) && (HAVE_UCONTEXT_H))
+#define U8_USE_COROUTINES 1
+#else
+#define U8_USE_COROUTINES 0
+#endif
+
+/* How many idle coroutines (and their stacks) each thread keeps */
+#ifndef U8_SERVER_KEEP_COROUTINES
+#define U8_SERVER_KEEP_COROUTINES 64
+#endif
+
+/* A servefn call running on its own stack, which is parked while it
+   awaits I/O on its client. The listener only looks at awaiting,
+   revents and since (see "Coroutines" below). */
+struct U8_SERVER_COROUTINE {
+  u8_client client;
+  struct U8_SERVER_THREAD *thread;
+  short awaiting, revents; u8_utime since;
+  int result, finished;
+  unsigned char *stack; size_t stack_size, map_size;
+  void *stack_base;
+#if U8_USE_COROUTINES
+  ucontext_t context, caller;
+#endif
+  struct U8_SERVER_COROUTINE *next;};
+
+/* Returns the events a client's parked servefn is waiting for */
+#define client_awaiting(cl) \
+  (((cl)->coroutine)?((cl)->coroutine->awaiting):(0))
+
+/* A frame read from a U8_SERVER_PIPELINE client, which is handled on
+   its own (see "Pipelining requests" below). The request and a copy
+   of its frame share one buffer from u8_client_getbuf(). */
+struct U8_CLIENT_REQUEST {
+  u8_client client;
+  unsigned char *data; size_t len;
+  unsigned char *response; size_t response_len; int response_flags;
+  int done; u8_utime queued;
+  struct U8_CLIENT_REQUEST *next;};
+
+/* Requests go on the same queues as clients, with their low bit set */
+#define REQUEST_TASK(req) ((u8_client)(((uintptr_t)(req))|1))
+#define TASK_REQUEST(task) \
+  ((((uintptr_t)(task))&1)? \
+   ((struct U8_CLIENT_REQUEST *)(((uintptr_t)(task))-1)):(NULL))
+
 static u8_condition ClosedClient=_("ClientClosed");
 static u8_condition ServerShutdown=_("ServerShutdown");
 static u8_condition NewServer=_("NewListenerPort");
@@ -64,14 +209,71 @@ static u8_condition Inconsistency=_("InternalInconsistency");
 
 static int close_client_core(u8_client cl,int server_locked,u8_context caller);
 static int finish_closing_client(u8_client cl);
+static void release_transfer(u8_client cl);
 
 static void update_client_stats(u8_client cl,long long cur,int done);
 static void update_server_stats(u8_client cl);
 
 static int push_task(struct U8_SERVER *server,u8_client cl,u8_context cxt);
+#if U8_THREADS_ENABLED
+static int dispatch_client(struct U8_SERVER *server,u8_client cl,
+                           u8_context cxt);
+#endif
 
 static int add_client(struct U8_SERVER *server,u8_client client);
 static int free_client(struct U8_SERVER *server,u8_client cl,u8_context caller);
+static void release_client(struct U8_SERVER *server,u8_client cl);
+
+static void listen_for(struct U8_SERVER *server,u8_client cl,short events);
+static void unregister_socket(struct U8_SERVER *server,u8_socket sock);
+static void link_idle(struct U8_SERVER *server,u8_client cl);
+static void unlink_idle(struct U8_SERVER *server,u8_client cl);
+
+static struct U8_TIMER_WHEEL *new_timer_wheel(void);
+static void remove_timer(struct U8_TIMER_WHEEL *wheel,u8_client cl);
+static void schedule_client(struct U8_SERVER *server,u8_client cl);
+
+static int uring_transfer(struct U8_SERVER *server,u8_client cl);
+#if U8_THREADS_ENABLED
+static struct U8_SERVER *init_shards
+  (struct U8_SERVER *server,int n_shards,
+   u8_client (*acceptfn)(u8_server,u8_socket,struct sockaddr *,size_t),
+   int (*servefn)(u8_client),int (*donefn)(u8_client),
+   int (*closefn)(u8_client),int flags,int n_threads,int init_clients,
+   int max_queue,int max_clients,int max_backlog,int timeout,
+   int pool_size);
+static void run_shards(struct U8_SERVER *server);
+#endif
+static void resume_client(struct U8_SERVER *server,u8_client cl);
+#if ((U8_THREADS_ENABLED) && (defined(CPU_SET)))
+struct U8_SERVER_TOPOLOGY {
+  int n_cpus, n_nodes;
+  /* The CPUs, the node of each, and the distinct nodes */
+  int *cpus, *cpu_nodes, *nodes;
+  int listener_cpu, listener_node;};
+static struct U8_SERVER_TOPOLOGY *get_topology(const char *spec);
+static void free_topology(struct U8_SERVER_TOPOLOGY *topo);
+static int place_thread(struct U8_SERVER *server,
+                        struct U8_SERVER_THREAD *u8st,
+                        void *(*fn)(void *));
+static void place_listener(struct U8_SERVER *server);
+static u8_string shard_cpus(struct U8_SERVER *server,int shard,int n_shards);
+#endif
+static void output_placement(struct U8_OUTPUT *out,struct U8_SERVER *server);
+static struct U8_SERVER_METRICS *metrics_shard(struct U8_SERVER *server);
+static void record_latency(struct U8_SERVER *server,int phase,long long value);
+static struct U8_TRACE_RING *new_trace_ring(int size,long long threshold);
+static void free_trace_ring(struct U8_TRACE_RING *ring);
+static void trace_client(struct U8_SERVER *server,u8_client cl,u8_utime now);
+static void trace_request(struct U8_SERVER *server,struct U8_SERVER_THREAD *st,
+                          struct U8_CLIENT_REQUEST *req,
+                          u8_utime cur,u8_utime now,int result);
+static void drop_coroutine(u8_client cl);
+#if U8_USE_IO_URING
+static struct U8_SERVER_URING *open_uring
+  (struct U8_SERVER *server,unsigned int entries);
+static void close_uring(struct U8_SERVER *server);
+#endif
 
 /* Helpful functions */
 
@@ -85,6 +287,7 @@ static char *get_client_state(u8_client cl,char *buf)
   if (cl->reading>0) *write++='r';
   if (cl->writing>0) *write++='w';
   if (cl->running>0) *write++='x';
+  if (client_awaiting(cl)) *write++='p';
   *write++='\0';
   return buf;
 }
@@ -157,6 +360,145 @@ static int sockaddr_samep(struct sockaddr *s1,struct sockaddr *s2)
 
 static void init_server_socket(u8_socket socket_id);
 
+/* Client and buffer pools */
+
+/* Freed client structs of the size a server normally conses (the
+   first one requested from u8_init_client) are kept on a free list
+   and reused for new connections. Buffers from u8_client_getbuf come
+   in power-of-two size classes, each with its own free list; a small
+   header in front of each buffer records its class. Free entries are
+   chained through their first word. */
+
+#define U8_POOL_MIN_BITS 10
+#define U8_POOL_MAX_BITS 20
+#define U8_POOL_CLASSES (U8_POOL_MAX_BITS-U8_POOL_MIN_BITS+1)
+#define U8_POOL_MAGIC 0x8B0FFE4
+
+struct U8_POOLBUF_HEADER {
+  int magic, bufclass; size_t size;};
+#define U8_POOLBUF_HEADER_SIZE \
+  ((sizeof(struct U8_POOLBUF_HEADER)+15)&(~((size_t)15)))
+
+struct U8_CLIENT_POOL {
+  u8_mutex lock; int max_free;
+  size_t client_len; void *clients; int n_clients;
+  void *bufs[U8_POOL_CLASSES]; int n_bufs[U8_POOL_CLASSES];
+  long n_reused, n_bufs_reused;};
+
+static struct U8_CLIENT_POOL *new_client_pool(int max_free)
+{
+  struct U8_CLIENT_POOL *pool=u8_alloc(struct U8_CLIENT_POOL);
+  memset(pool,0,sizeof(struct U8_CLIENT_POOL));
+  u8_init_mutex(&(pool->lock));
+  pool->max_free=max_free;
+  return pool;
+}
+
+static void free_client_pool(struct U8_CLIENT_POOL *pool)
+{
+  void *scan=pool->clients; int i=0;
+  while (scan) {
+    void *next=*((void **)scan);
+    u8_free(scan); scan=next;}
+  while (i<U8_POOL_CLASSES) {
+    scan=pool->bufs[i++];
+    while (scan) {
+      void *next=*((void **)scan);
+      u8_free(scan); scan=next;}}
+  u8_destroy_mutex(&(pool->lock));
+  u8_free(pool);
+}
+
+/* Returns a freed client struct of *len* bytes, or NULL. The first
+   request fixes the size of the structs which are pooled. */
+static u8_client pop_client(struct U8_CLIENT_POOL *pool,size_t len)
+{
+  void *cl=NULL;
+  u8_lock_mutex(&(pool->lock));
+  if (pool->client_len==0) pool->client_len=len;
+  if ((len==pool->client_len)&&(pool->clients)) {
+    cl=pool->clients; pool->clients=*((void **)cl);
+    pool->n_clients--; pool->n_reused++;}
+  u8_unlock_mutex(&(pool->lock));
+  return (u8_client)cl;
+}
+
+/* Keeps a freed client for reuse, returning 0 if the pool is full */
+static int push_client(struct U8_CLIENT_POOL *pool,u8_client cl)
+{
+  int pushed=0;
+  u8_lock_mutex(&(pool->lock));
+  if (pool->n_clients<pool->max_free) {
+    *((void **)cl)=pool->clients; pool->clients=cl;
+    pool->n_clients++; pushed=1;}
+  u8_unlock_mutex(&(pool->lock));
+  return pushed;
+}
+
+static int buf_class(size_t size)
+{
+  int bits=U8_POOL_MIN_BITS;
+  while ((bits<=U8_POOL_MAX_BITS)&&(size>(((size_t)1)<<bits))) bits++;
+  if (bits>U8_POOL_MAX_BITS) return -1;
+  else return bits-U8_POOL_MIN_BITS;
+}
+
+U8_EXPORT unsigned char *u8_client_getbuf(u8_client cl,size_t size)
+{
+  struct U8_CLIENT_POOL *pool=cl->server->client_pool;
+  int bufclass=buf_class(size);
+  struct U8_POOLBUF_HEADER *head=NULL;
+  if (bufclass>=0) size=((size_t)1)<<(bufclass+U8_POOL_MIN_BITS);
+  if ((pool)&&(bufclass>=0)) {
+    u8_lock_mutex(&(pool->lock));
+    if (pool->bufs[bufclass]) {
+      head=pool->bufs[bufclass];
+      pool->bufs[bufclass]=*((void **)head);
+      pool->n_bufs[bufclass]--; pool->n_bufs_reused++;}
+    u8_unlock_mutex(&(pool->lock));}
+  if (head==NULL) {
+    head=u8_malloc(U8_POOLBUF_HEADER_SIZE+size);
+    if (head==NULL) {
+      u8_seterr(u8_MallocFailed,"u8_client_getbuf",NULL);
+      return NULL;}}
+  head->magic=U8_POOL_MAGIC; head->bufclass=bufclass; head->size=size;
+  return ((unsigned char *)head)+U8_POOLBUF_HEADER_SIZE;
+}
+
+U8_EXPORT void u8_client_putbuf(u8_client cl,unsigned char *buf)
+{
+  struct U8_CLIENT_POOL *pool=cl->server->client_pool;
+  struct U8_POOLBUF_HEADER *head=(struct U8_POOLBUF_HEADER *)
+    (buf-U8_POOLBUF_HEADER_SIZE);
+  int bufclass=head->bufclass;
+  if (head->magic!=U8_POOL_MAGIC) {
+    u8_logf(LOG_CRIT,"u8_client_putbuf",
+            "The buffer 0x%lx didn't come from u8_client_getbuf",
+            (unsigned long)buf);
+    return;}
+  head->magic=0;
+  if ((pool)&&(bufclass>=0)) {
+    u8_lock_mutex(&(pool->lock));
+    if (pool->n_bufs[bufclass]<pool->max_free) {
+      *((void **)head)=pool->bufs[bufclass];
+      pool->bufs[bufclass]=head;
+      pool->n_bufs[bufclass]++;
+      head=NULL;}
+    u8_unlock_mutex(&(pool->lock));}
+  if (head) u8_free(head);
+}
+
+/* Lets go of the client's buffer, freeing it or returning it to the
+   pool if the client owns it. */
+static void release_buf(u8_client cl)
+{
+  if ((cl->buf)&&((cl->ownsbuf)&(U8_CLIENT_WRITE_POOLBUF)))
+    u8_client_putbuf(cl,cl->buf);
+  else if ((cl->buf)&&(cl->ownsbuf))
+    u8_free(cl->buf);
+  cl->buf=NULL; cl->ownsbuf=0;
+}
+
 U8_EXPORT
 /* u8_init_client:
     Arguments: a pointer to a client
@@ -167,24 +509,53 @@ U8_EXPORT
  @arg sock a socket (or -1) for the client
  @arg server the server of which the client will be a part
  Returns: a pointer to a client structure, consed if not provided.
+ Consed clients may be reused ones from the server's client pool.
 */
 u8_client u8_init_client(u8_client client,size_t len,
                          struct sockaddr *addrbuf,size_t addrlen,
                          u8_socket sock,u8_server srv)
 {
-  if (!(client)) client=u8_malloc(len);
+  int pooled=0;
+  if (!(client)) {
+    struct U8_CLIENT_POOL *pool=(srv) ? (srv->client_pool) : (NULL);
+    if (pool) {
+      client=pop_client(pool,len);
+      pooled=(len==pool->client_len);}
+    if (!(client)) client=u8_malloc(len);}
   memset(client,0,len);
+  if (pooled) client->flags|=U8_CLIENT_POOLED;
   client->socket=sock;
   client->server=srv;
+  if ((addrbuf)&&(addrlen>0)&&(addrlen<=sizeof(client->addr))) {
+    memcpy(&(client->addr),addrbuf,addrlen);
+    client->addrlen=addrlen;}
   client->started=client->queued=client->active=0;
   client->reading=client->writing=-1;
+  client->idled=u8_microtime();
   client->off=client->len=client->buflen=client->delta=0;
+  client->sendfd=-1;
   if ((srv->flags)&U8_SERVER_ASYNC)
     client->flags=client->flags|U8_CLIENT_ASYNC;
   client->client_loglevel = -1;
   return client;
 }
 
+/* Generating the idstring (which can be costly) is put off until
+   someone wants it, which is often never. */
+U8_EXPORT u8_string u8_client_idstring(u8_client cl)
+{
+  u8_string idstring=__atomic_load_n(&(cl->idstring),__ATOMIC_ACQUIRE);
+  if ((idstring)||(cl->addrlen==0)) return idstring;
+  else {
+    u8_string fresh=u8_sockaddr_string((struct sockaddr *)&(cl->addr));
+    /* Someone else may have gotten there first */
+    if (__atomic_compare_exchange_n(&(cl->idstring),&idstring,fresh,0,
+                                    __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+      return fresh;
+    u8_free(fresh);
+    return idstring;}
+}
+
 /* Reading and writing from clients */
 
 U8_EXPORT int u8_client_finished(u8_client cl)
@@ -194,6 +565,7 @@ U8_EXPORT int u8_client_finished(u8_client cl)
     else if (cl->reading>0) {
       long long rtime=u8_microtime()-cl->reading;
       cl->stats.rsum+=rtime; cl->stats.rsum2+=(rtime*rtime);
+      RECORD_LATENCY(cl,U8_LATENCY_READ,rtime);
       if (rtime>cl->stats.rmax) cl->stats.rmax=rtime;
       cl->stats.rcount++;
       cl->reading=0;
@@ -201,9 +573,11 @@ U8_EXPORT int u8_client_finished(u8_client cl)
     else if (cl->writing>0) {
       long long wtime=u8_microtime()-cl->writing;
       cl->stats.wsum+=wtime; cl->stats.wsum2+=(wtime*wtime);
+      RECORD_LATENCY(cl,U8_LATENCY_WRITE,wtime);
       if (wtime>cl->stats.wmax) cl->stats.wmax=wtime;
       cl->stats.wcount++;
       cl->writing=0;
+      release_transfer(cl);
       return 1;}
     else return 1;
   else return 1;
@@ -222,7 +596,7 @@ U8_EXPORT unsigned char *u8_client_read
             "%d bytes for @x%lx#%d.%d[%s/%d](%s%:hs) 0x%lx+%d<%d",
             n,((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status,
+            cl->n_trans,u8_client_idstring(cl),cl->status,
             (unsigned long)cl->buf,cl->off,cl->len);
   if ((cl->reading>0)&&
       (cl->buf==buf)&&(cl->len==n)&&(cl->off>=cl->len)) {
@@ -232,7 +606,7 @@ U8_EXPORT unsigned char *u8_client_read
             "Client @x%lx#%d.%d[%s/%d](%s%:hs) is already reading %ld bytes",
             ((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status,
+            cl->n_trans,u8_client_idstring(cl),cl->status,
             ((long)cl->len));
     return NULL;}
   else if (cl->writing>0) {
@@ -240,10 +614,11 @@ U8_EXPORT unsigned char *u8_client_read
             "Client @x%lx#%d.%d[%s/%d](%s%:hs) is still writing %ld bytes",
             ((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status,
+            cl->n_trans,u8_client_idstring(cl),cl->status,
             ((long)cl->len));
     return NULL;}
   else if (off<n) {
+    if (buf!=cl->buf) release_buf(cl);
     cl->reading=u8_microtime();
     cl->buflen=cl->len=n; cl->buf=buf; cl->off=off;
     return NULL;}
@@ -263,7 +638,7 @@ U8_EXPORT unsigned char *u8_client_write_x
             "%d bytes for @x%lx#%d.%d[%s/%d](%s%:hs) 0x%lx+%d<%d",
             n,((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status,
+            cl->n_trans,u8_client_idstring(cl),cl->status,
             (unsigned long)cl->buf,cl->off,cl->len);
   if ((cl->writing>0)&&(cl->buf==buf)&&(cl->len==n)) {
     /* We're already writing this */
@@ -276,7 +651,7 @@ U8_EXPORT unsigned char *u8_client_write_x
             "Client @x%lx#%d.%d[%s/%d](%s%:hs) is already writing %ld bytes",
             ((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status,
+            cl->n_trans,u8_client_idstring(cl),cl->status,
             ((long)cl->len));
     return NULL;}
   else if (cl->reading>0) {
@@ -284,16 +659,15 @@ U8_EXPORT unsigned char *u8_client_write_x
             "Write to @x%lx#%d.%d[%s/%d](%s%:hs) with %d unread bytes",
             ((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status,
+            cl->n_trans,u8_client_idstring(cl),cl->status,
             ((long)cl->len));
     cl->reading=0;
     return NULL;}
   else if (off<n) {
-    if ((cl->buf)&&(cl->ownsbuf)&&(buf!=cl->buf)) {
-      u8_free(cl->buf); cl->buf=NULL; cl->ownsbuf=0;}
+    if (buf!=cl->buf) release_buf(cl);
     cl->writing=u8_microtime(); cl->reading=-1;
     cl->buflen=cl->len=n; cl->buf=buf; cl->off=off;
-    cl->ownsbuf=((flags&U8_CLIENT_WRITE_OWNBUF)!=0);
+    cl->ownsbuf|=(flags&(U8_CLIENT_WRITE_OWNBUF|U8_CLIENT_WRITE_POOLBUF));
     return NULL;}
   else return buf;
 }
@@ -303,125 +677,816 @@ U8_EXPORT unsigned char *u8_client_write
   return u8_client_write_x(cl,buf,n,off,0);
 }
 
-/* Declaring a client done with a transaction (and available for another) */
+/* Coroutines */
 
-U8_EXPORT
-/* u8_client_done:
-    Arguments: a pointer to a client
-    Returns: void
- Marks the client's current task as done, updating server data structures
- appropriately. */
-int u8_client_done(u8_client cl)
+/* With U8_SERVER_COROUTINES, each servefn call runs on a stack of its
+   own, taken from the thread's idle coroutines (or newly mapped).
+   When the servefn calls u8_client_await_read() or
+   u8_client_await_write(), its stack is parked and the thread goes
+   back to the event loop as though the servefn had returned 1; the
+   listener then waits for the client's socket (or the read or write
+   timeout) and queues the client again, and the thread resumes the
+   servefn where it left off. A parked servefn is only ever resumed by
+   the thread which started it, because thread-local state (including
+   libu8's own) may be cached across the switch. */
+
+#if U8_USE_COROUTINES
+static __thread struct U8_SERVER_COROUTINE *current_coroutine=NULL;
+
+/* Switching stacks means switching the base used by u8_stack_depth() */
+static void set_stack_base(void *base,ssize_t size)
 {
-  U8_SERVER *server=cl->server; char statebuf[16];
+#if ((U8_USE_TLS) || (!(HAVE_THREAD_STORAGE_CLASS)))
+  u8_tld_set(u8_stack_base_key,base);
+  u8_tld_set(u8_stack_size_key,(void *)size);
+#else
+  u8_stack_base=base; u8_stack_size=size;
+#endif
+}
+
+static struct U8_SERVER_COROUTINE *new_coroutine
+  (struct U8_SERVER *server,struct U8_SERVER_THREAD *st)
+{
+  struct U8_SERVER_COROUTINE *co=u8_alloc(struct U8_SERVER_COROUTINE);
+  size_t size=server->stack_size;
+  int local_loglevel = server->server_loglevel;
+  if (co==NULL) return NULL;
+  memset(co,0,sizeof(struct U8_SERVER_COROUTINE));
+#if ((HAVE_MMAP) && (defined(MAP_ANONYMOUS)))
+  {
+    /* The stack gets a guard page below it and is only backed by
+       memory as it's touched */
+    long page=sysconf(_SC_PAGESIZE);
+    int mapflags=MAP_PRIVATE|MAP_ANONYMOUS;
+    unsigned char *map;
+#ifdef MAP_NORESERVE
+    mapflags|=MAP_NORESERVE;
+#endif
+#ifdef MAP_STACK
+    mapflags|=MAP_STACK;
+#endif
+    if (page<=0) page=4096;
+    size=((size+page-1)/page)*page;
+    map=mmap(NULL,size+page,PROT_READ|PROT_WRITE,mapflags,-1,0);
+    if (map==MAP_FAILED) {
+      u8_logf(LOG_WARN,"new_coroutine",
+              "Couldn't map a %lld byte stack (%s)",
+              (long long)size,strerror(errno));
+      errno=0; u8_free(co);
+      return NULL;}
+    if (mprotect(map,page,PROT_NONE)<0) errno=0;
+    co->stack=map+page; co->map_size=size+page;}
+#else
+  co->stack=u8_malloc(size);
+  if (co->stack==NULL) {u8_free(co); return NULL;}
+#endif
+  co->stack_size=size;
+  co->thread=st;
+  return co;
+}
+
+static void free_coroutine(struct U8_SERVER_COROUTINE *co)
+{
+#if ((HAVE_MMAP) && (defined(MAP_ANONYMOUS)))
+  munmap(co->stack-(co->map_size-co->stack_size),co->map_size);
+#else
+  u8_free(co->stack);
+#endif
+  u8_free(co);
+}
+
+/* Returns a coroutine for a servefn call, or NULL if we can't get a
+   stack for one (in which case the servefn just runs on the thread's
+   stack, and its awaits block) */
+static struct U8_SERVER_COROUTINE *get_coroutine
+  (struct U8_SERVER *server,struct U8_SERVER_THREAD *st)
+{
+  struct U8_SERVER_COROUTINE *co=st->u8st_coroutines;
+  if (co) {
+    st->u8st_coroutines=co->next; co->next=NULL;
+    st->u8st_n_coroutines--;
+    return co;}
+  else return new_coroutine(server,st);
+}
+
+static void put_coroutine(struct U8_SERVER_THREAD *st,
+                          struct U8_SERVER_COROUTINE *co)
+{
+  co->client=NULL; co->awaiting=co->revents=0;
+  if (st->u8st_n_coroutines>=U8_SERVER_KEEP_COROUTINES)
+    free_coroutine(co);
+  else {
+    co->next=st->u8st_coroutines;
+    st->u8st_coroutines=co;
+    st->u8st_n_coroutines++;}
+}
+
+/* Frees a thread's idle coroutines, when it exits */
+static void free_coroutines(struct U8_SERVER_THREAD *st)
+{
+  struct U8_SERVER_COROUTINE *co=st->u8st_coroutines;
+  while (co) {
+    struct U8_SERVER_COROUTINE *next=co->next;
+    free_coroutine(co);
+    co=next;}
+  st->u8st_coroutines=NULL;
+  st->u8st_n_coroutines=0;
+}
+
+/* Frees the coroutine of a client whose servefn is parked (which is
+   abandoned) when the client itself is freed */
+static void drop_coroutine(u8_client cl)
+{
+  struct U8_SERVER_COROUTINE *co=cl->coroutine;
+  struct U8_SERVER_THREAD *st=co->thread;
+  cl->coroutine=NULL;
+  __atomic_sub_fetch(&(st->u8st_n_parked),1,__ATOMIC_SEQ_CST);
+  free_coroutine(co);
+}
+
+static void coroutine_main(void)
+{
+  struct U8_SERVER_COROUTINE *co=current_coroutine;
+  u8_client cl=co->client;
+  U8_SET_STACK_BASE();
+  co->stack_base=u8_stack_base;
+  co->result=cl->server->servefn(cl);
+  co->finished=1;
+  /* This returns to co->caller (in run_coroutine) */
+}
+
+/* Starts or resumes the client's servefn on its coroutine, returning
+   its result once it's finished and 1 if it's parked */
+static int run_coroutine(struct U8_SERVER *server,
+                         struct U8_SERVER_THREAD *st,
+                         u8_client cl)
+{
+  struct U8_SERVER_COROUTINE *co=cl->coroutine;
+  void *stack_base=u8_stack_base;
+  ssize_t stack_size=u8_stack_size;
+  if (co) {
+    __atomic_sub_fetch(&(st->u8st_n_parked),1,__ATOMIC_SEQ_CST);
+    set_stack_base(co->stack_base,co->stack_size);}
+  else if ((co=get_coroutine(server,st))==NULL)
+    return server->servefn(cl);
+  else {
+    co->client=cl; co->finished=0; co->result=0;
+    getcontext(&(co->context));
+    co->context.uc_stack.ss_sp=co->stack;
+    co->context.uc_stack.ss_size=co->stack_size;
+    co->context.uc_link=&(co->caller);
+    makecontext(&(co->context),coroutine_main,0);
+    cl->coroutine=co;}
+  current_coroutine=co;
+  swapcontext(&(co->caller),&(co->context));
+  current_coroutine=NULL;
+  set_stack_base(stack_base,stack_size);
+  if (co->finished) {
+    int result=co->result;
+    cl->coroutine=NULL;
+    put_coroutine(st,co);
+    return result;}
+  else {
+    __atomic_add_fetch(&(st->u8st_n_parked),1,__ATOMIC_SEQ_CST);
+    return 1;}
+}
+#else
+static void drop_coroutine(u8_client cl)
+{
+  cl->coroutine=NULL;
+}
+#endif
+
+/* Awaiting I/O */
+
+static int client_await(u8_client cl,short events,u8_context caller)
+{
+  char statebuf[16];
+  u8_server server=cl->server;
+  long timeout=(events&POLLOUT)?(server->write_timeout):
+    (server->read_timeout);
+  struct pollfd pfd;
   int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
     (server->server_loglevel);
-  int clientid=cl->clientid;
-  if (cl->started>0) {
-    if (server->donefn) {
-      int retval=server->donefn(cl);
-      if (retval<0) {
-        u8_logf(LOG_ERR,"u8_client_done",
-                "Error finishing transaction on @x%lx#%d.%d[%s/%d](%s%:hs)",
-                ((unsigned long)cl),cl->clientid,cl->socket,cl->n_trans,
-                cl->idstring,cl->status);
-        u8_clear_errors(1);}}
-    update_client_stats(cl,u8_microtime(),1);
-    cl->writing=cl->reading=0;
-    if (cl->queued>0) {
-      u8_logf(LOG_WARNING,"u8_client_done",
-              "Finishing transaction on queued client @x%lx#%d.%d[%s/%d](%s%:hs)",
-              ((unsigned long)cl),cl->clientid,cl->socket,cl->n_trans,
-              cl->idstring,cl->status);
-      cl->queued=0;}
-    if (cl->socket>0) {
-      struct pollfd *pfd=&(server->sockets[clientid]);
-      cl->reading=u8_microtime();
-      pfd->events=((short)(POLLIN_EVENTS));}
-    u8_lock_mutex(&(server->lock));
-    if (cl->started>0) {
-      server->n_busy--;
-      cl->started=0;}
-     server->n_trans++;
-    u8_unlock_mutex(&(server->lock));
-    return 1;}
-  else {
-    u8_logf(LOG_WARNING,"u8_client_done",
-            "Declaring done on idle client @x%lx#%d.%d[%s/%d](%s%:hs)",
+  int retval;
+  if (((cl->reading>0)||(cl->writing>0))&&(cl->off<cl->len)) {
+    u8_logf(LOG_WARNING,caller,
+            "Client @x%lx#%d.%d[%s/%d](%s%:hs) is still %s %ld bytes",
             ((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status);
+            cl->n_trans,u8_client_idstring(cl),cl->status,
+            ((cl->writing>0)?("writing"):("reading")),
+            ((long)cl->len));
+    return -1;}
+#if U8_USE_COROUTINES
+  if ((cl->coroutine)&&(cl->coroutine==current_coroutine)) {
+    struct U8_SERVER_COROUTINE *co=cl->coroutine;
+    if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
+        ((cl->flags)&(U8_CLIENT_LOG_TRANSACT)))
+      u8_logf(LOG_DEBUG,caller,
+              "Parking servefn for @x%lx#%d.%d[%s/%d](%s%:hs)",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status);
+    co->awaiting=events; co->revents=0; co->since=u8_microtime();
+    swapcontext(&(co->context),&(co->caller));
+    /* The listener has seen our events (or a timeout) */
+    co->awaiting=0; events=co->revents;
+    if (events) return 1;
+    errno=ETIMEDOUT;
     return 0;}
+#endif
+  pfd.fd=cl->socket; pfd.events=events; pfd.revents=0;
+  while ((retval=poll(&pfd,1,((timeout>0)?(timeout):(-1))))<0) {
+    if (errno==EINTR) errno=0;
+    else return -1;}
+  if (retval==0) errno=ETIMEDOUT;
+  return retval;
 }
 
-/* Closing clients */
+U8_EXPORT int u8_client_await_read(u8_client cl)
+{
+  return client_await(cl,POLLIN,"u8_client_await_read");
+}
 
-U8_EXPORT
-/* u8_close_client:
-    Arguments: a pointer to a client
-    Returns: int
- Marks the client's current task as done, updating server data structures
- appropriately, and ending by closing the client close function.
- If a busy client is closed, it has its U8_CLIENT_CLOSING flag set.
- This tells the event loop to finish closing the client when it actually
- completes the current transaction.
-*/
-int u8_close_client(u8_client cl)
+U8_EXPORT int u8_client_await_write(u8_client cl)
 {
-  U8_SERVER *server=cl->server; char statebuf[16];
+  return client_await(cl,POLLOUT,"u8_client_await_write");
+}
+
+/* Sending files to clients */
+
+U8_EXPORT int u8_client_sendfile(u8_client cl,int fd,off_t off,size_t len)
+{
+  char statebuf[16];
+  u8_server server=cl->server;
   int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
     (server->server_loglevel);
-  if ((cl->flags&U8_CLIENT_CLOSED)==0) {
-    int retval;
-    u8_lock_mutex(&(server->lock));
-    /* Catch race conditions */
-    if (cl->flags&U8_CLIENT_CLOSED) {
-      u8_unlock_mutex(&(server->lock));
-      return 0;}
-    cl->flags|=U8_CLIENT_CLOSING;
-    u8_unlock_mutex(&(server->lock));
-    /* If the task is in the middle of a transaction,
-       don't close it right away. */
-    if (cl->started>0) {
-      if (server->flags&U8_SERVER_LOG_CONNECT)
-        u8_logf(LOG_INFO,"u8_close_client",
-                "Deferring closing of  @x%lx#%d.%d[%s/%d](%s%:hs)",
-                ((unsigned long)cl),cl->clientid,cl->socket,
-                get_client_state(cl,statebuf),
-                cl->n_trans,cl->idstring,cl->status);
-      return 0;}
-    retval=close_client_core(cl,0,"u8_close_client");
-    return retval;}
-  else {
-    u8_logf(LOG_WARNING,"u8_close_client",
-            "Closing already closed socket @x%lx#%d.%d[%s/%d](%s%:hs)",
+  if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
+      ((cl->flags)&(U8_CLIENT_LOG_TRANSACT)))
+    u8_logf(LOG_INFO,"Sendfile/request",
+            "%d bytes of file %d@%lld for @x%lx#%d.%d[%s/%d](%s%:hs)",
+            len,fd,(long long)off,((unsigned long)cl),
+            cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status);
+  if ((cl->writing>0)&&(cl->off<cl->len)) {
+    u8_logf(LOG_WARNING,"u8_client_sendfile",
+            "Client @x%lx#%d.%d[%s/%d](%s%:hs) is already writing %ld bytes",
+            ((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status,
+            ((long)cl->len));
+    return -1;}
+  else if ((cl->reading>0)&&(cl->off<cl->len)) {
+    u8_logf(LOG_WARNING,"u8_client_sendfile",
+            "Sendfile to @x%lx#%d.%d[%s/%d](%s%:hs) with %d unread bytes",
             ((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status);
+            cl->n_trans,u8_client_idstring(cl),cl->status,
+            ((long)cl->len));
+    return -1;}
+  else if ((fd<0)||(off<0)) {
+    u8_seterr(_("BadFileDescriptor"),"u8_client_sendfile",NULL);
+    return -1;}
+  else if (len==0) return 0;
+  else {
+    release_transfer(cl);
+    release_buf(cl); cl->buflen=0;
+    cl->sendfd=fd; cl->sendoff=off;
+    cl->writing=u8_microtime(); cl->reading=-1;
+    cl->len=len; cl->off=0;
+    u8_lock_mutex(&(server->lock));
+    cl->flags|=U8_CLIENT_SENDFILE;
     u8_unlock_mutex(&(server->lock));
-    return 0;}
+    return 1;}
 }
 
-U8_EXPORT
-/* u8_client_closed:
-    Arguments: a pointer to a client
-    Returns: int
-  Indicates that the other end has closed the connection.  This can generate
-    an indication of its own and then closes the client on this end
-*/
-int u8_client_closed(u8_client cl)
+/* Writing segment chains to clients */
+
+U8_EXPORT int u8_client_writev(u8_client cl,struct U8_CLIENT_SEGMENT *segs,
+                               int n_segs)
 {
   char statebuf[16];
-  U8_SERVER *server=cl->server;
+  u8_server server=cl->server;
   int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
     (server->server_loglevel);
-  if ((cl->server->flags)&(U8_SERVER_LOG_CONNECT))
-    u8_logf(LOG_INFO,"u8_client_closed",
-            "Other end closed @x%lx#%d.%d[%s/%d](%s%:hs)",
+  size_t len=0; int i=0;
+  while (i<n_segs) len=len+segs[i++].len;
+  if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
+      ((cl->flags)&(U8_CLIENT_LOG_TRANSACT)))
+    u8_logf(LOG_INFO,"Writev/request",
+            "%d bytes in %d segments for @x%lx#%d.%d[%s/%d](%s%:hs)",
+            len,n_segs,((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status);
+  if ((cl->writing>0)&&(cl->off<cl->len)) {
+    u8_logf(LOG_WARNING,"u8_client_writev",
+            "Client @x%lx#%d.%d[%s/%d](%s%:hs) is already writing %ld bytes",
             ((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status);
-  return u8_client_close(cl);
+            cl->n_trans,u8_client_idstring(cl),cl->status,
+            ((long)cl->len));
+    return -1;}
+  else if ((cl->reading>0)&&(cl->off<cl->len)) {
+    u8_logf(LOG_WARNING,"u8_client_writev",
+            "Writev to @x%lx#%d.%d[%s/%d](%s%:hs) with %d unread bytes",
+            ((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status,
+            ((long)cl->len));
+    return -1;}
+  else if (len==0) {
+    i=0; while (i<n_segs) {
+      if (segs[i].freefn) segs[i].freefn(segs[i].data,segs[i].freestate);
+      i++;}
+    return 0;}
+  else {
+    release_transfer(cl);
+    if (n_segs>cl->segs_len) {
+      struct U8_CLIENT_SEGMENT *newsegs=
+        u8_realloc_n(cl->segs,n_segs,struct U8_CLIENT_SEGMENT);
+      if (newsegs==NULL) {
+        u8_seterr(u8_MallocFailed,"u8_client_writev",NULL);
+        return -1;}
+      cl->segs=newsegs; cl->segs_len=n_segs;}
+    memcpy(cl->segs,segs,sizeof(struct U8_CLIENT_SEGMENT)*n_segs);
+    cl->n_segs=n_segs; cl->seg_next=0; cl->seg_off=0;
+    release_buf(cl); cl->buflen=0;
+    cl->writing=u8_microtime(); cl->reading=-1;
+    cl->len=len; cl->off=0;
+    u8_lock_mutex(&(server->lock));
+    cl->flags|=U8_CLIENT_WRITEV;
+    u8_unlock_mutex(&(server->lock));
+    return 1;}
+}
+
+/* Calls the free functions of the segments which haven't been written */
+static void drop_segments(u8_client cl)
+{
+  struct U8_CLIENT_SEGMENT *segs=cl->segs;
+  int i=cl->seg_next, n=cl->n_segs;
+  while (i<n) {
+    if (segs[i].freefn) segs[i].freefn(segs[i].data,segs[i].freestate);
+    i++;}
+  cl->n_segs=cl->seg_next=0; cl->seg_off=0;
+}
+
+/* Writes the next chunk of a client's segment chain, returning the
+   number of bytes written, as write() would. Segments are released
+   as soon as they're done. */
+static ssize_t writev_chunk(u8_client cl)
+{
+  struct iovec iov[U8_CLIENT_MAX_IOV];
+  struct U8_CLIENT_SEGMENT *segs=cl->segs;
+  int i=cl->seg_next, n=cl->n_segs, n_iov=0;
+  size_t skip=cl->seg_off;
+  ssize_t delta;
+  while ((i<n)&&(n_iov<U8_CLIENT_MAX_IOV)) {
+    if (segs[i].len>skip) {
+      iov[n_iov].iov_base=segs[i].data+skip;
+      iov[n_iov].iov_len=segs[i].len-skip;
+      n_iov++;}
+    skip=0; i++;}
+  delta=writev(cl->socket,iov,n_iov);
+  if (delta>0) {
+    size_t sent=delta;
+    i=cl->seg_next;
+    while (i<n) {
+      size_t left=segs[i].len-cl->seg_off;
+      if (sent<left) {
+        cl->seg_off=cl->seg_off+sent;
+        break;}
+      sent=sent-left; cl->seg_off=0;
+      if (segs[i].freefn) segs[i].freefn(segs[i].data,segs[i].freestate);
+      i++;}
+    cl->seg_next=i;}
+  return delta;
+}
+
+/* Releases whatever a finished (or abandoned) sendfile or writev
+   transfer was holding onto */
+static void release_transfer(u8_client cl)
+{
+  if ((cl->flags)&(U8_CLIENT_SENDFILE|U8_CLIENT_WRITEV)) {
+    u8_server server=cl->server;
+    if ((cl->flags)&(U8_CLIENT_SENDFILE)) close(cl->sendfd);
+    if ((cl->flags)&(U8_CLIENT_WRITEV)) drop_segments(cl);
+    u8_lock_mutex(&(server->lock));
+    cl->flags&=~(U8_CLIENT_SENDFILE|U8_CLIENT_WRITEV);
+    u8_unlock_mutex(&(server->lock));
+    cl->sendfd=-1; cl->sendoff=0;}
+}
+
+/* Sends the next chunk of a file to a client, returning the number of
+   bytes written, as write() would. */
+static ssize_t sendfile_chunk(u8_client cl)
+{
+  size_t n=cl->len-cl->off;
+  off_t pos=cl->sendoff+cl->off;
+  ssize_t delta=-1;
+#if HAVE_SYS_SENDFILE_H
+  delta=sendfile(cl->socket,cl->sendfd,&pos,n);
+  if (delta>0) return delta;
+  else if ((delta<0)&&((errno==EINVAL)||(errno==ENOSYS)))
+    /* Some files (and sockets) can't be sent this way, so we copy */
+    errno=0;
+  else if (delta<0) return delta;
+#endif
+  if (delta<0) {
+    unsigned char buf[U8_SENDFILE_BUFSIZE];
+    if (n>U8_SENDFILE_BUFSIZE) n=U8_SENDFILE_BUFSIZE;
+    delta=pread(cl->sendfd,buf,n,pos);
+    if (delta>0) return write(cl->socket,buf,delta);}
+  if (delta==0) {
+    /* The file ended early, and nothing more will come, so we
+       hang up and let the listener close the client. */
+    u8_server server=cl->server;
+    int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
+      (server->server_loglevel);
+    u8_logf(LOG_WARNING,"u8_client_sendfile",
+            "File %d ended %ld bytes short for @x%lx#%d.%d",
+            cl->sendfd,((long)(cl->len-cl->off)),
+            ((unsigned long)cl),cl->clientid,cl->socket);
+    shutdown(cl->socket,SHUT_RDWR);}
+  return delta;
+}
+
+/* Reads or writes the next chunk of a client's current transfer */
+static ssize_t client_transfer(u8_client cl)
+{
+  ssize_t delta;
+  if ((cl->flags)&(U8_CLIENT_SENDFILE))
+    delta=sendfile_chunk(cl);
+  else if ((cl->flags)&(U8_CLIENT_WRITEV))
+    delta=writev_chunk(cl);
+  else if (cl->writing>0)
+    delta=write(cl->socket,cl->buf+cl->off,cl->len-cl->off);
+  else delta=read(cl->socket,cl->buf+cl->off,cl->len-cl->off);
+  if (delta>0) cl->n_moved+=delta;
+  return delta;
+}
+
+/* Framing client input */
+
+/* A framed client's input is read into its inbuf, where the bytes
+   from in_off to in_fill haven't been consumed yet. frame_len is the
+   length (with any prefix or delimiter) of the complete frame at
+   in_off, or zero if there isn't one yet, and in_scan is where to
+   resume looking for a delimiter. */
+
+/* The initial size of a framed client's input buffer */
+#ifndef U8_CLIENT_INBUF_SIZE
+#define U8_CLIENT_INBUF_SIZE 4096
+#endif
+
+#if U8_THREADS_ENABLED
+/* The pipelined request whose servefn this thread is running */
+static __thread struct U8_CLIENT_REQUEST *current_request=NULL;
+#endif
+
+U8_EXPORT int u8_client_framing(u8_client cl,int mode,size_t size,
+                                const char *delim,size_t max_frame)
+{
+  size_t delim_len=(delim)?(strlen(delim)):(0);
+  if (max_frame<=0) max_frame=DEFAULT_MAX_FRAME;
+  switch (mode) {
+  case U8_CLIENT_FRAME_NONE:
+    if (cl->in_fill>cl->in_off) return -1;
+    else break;
+  case U8_CLIENT_FRAME_DELIM:
+    if ((delim_len==0)||(delim_len>sizeof(cl->frame_delim))) return -1;
+    memcpy(cl->frame_delim,delim,delim_len);
+    cl->frame_delim_len=delim_len;
+    break;
+  case U8_CLIENT_FRAME_LENGTH:
+    if ((size!=1)&&(size!=2)&&(size!=4)&&(size!=8)) return -1;
+    else break;
+  case U8_CLIENT_FRAME_FIXED:
+    if ((size<=0)||(size>max_frame)) return -1;
+    else break;
+  default:
+    return -1;}
+  cl->framing=mode; cl->frame_size=size; cl->max_frame=max_frame;
+  if (cl->frame_len==0) cl->in_scan=cl->in_off;
+  return 0;
+}
+
+U8_EXPORT unsigned char *u8_client_frame(u8_client cl,size_t *lenp)
+{
+  size_t skip=0, len=cl->frame_len;
+#if U8_THREADS_ENABLED
+  if ((current_request)&&(current_request->client==cl)) {
+    if (lenp) *lenp=current_request->len;
+    return current_request->data;}
+#endif
+  if ((cl->framing==U8_CLIENT_FRAME_NONE)||(len==0)) {
+    if (lenp) *lenp=0;
+    return NULL;}
+  else if (cl->framing==U8_CLIENT_FRAME_DELIM)
+    len=len-cl->frame_delim_len;
+  else if (cl->framing==U8_CLIENT_FRAME_LENGTH) {
+    skip=cl->frame_size; len=len-skip;}
+  else NO_ELSE;
+  if (lenp) *lenp=len;
+  return cl->inbuf+cl->in_off+skip;
+}
+
+/* Sets frame_len if there's a complete frame in the buffer, returning
+   1 if there is, 0 if there isn't yet, and -1 if it's too big */
+static int find_frame(u8_client cl)
+{
+  unsigned char *data=cl->inbuf+cl->in_off;
+  size_t avail=cl->in_fill-cl->in_off;
+  if (cl->frame_len>0) return 1;
+  else if (cl->inbuf==NULL) return 0;
+  switch (cl->framing) {
+  case U8_CLIENT_FRAME_FIXED:
+    if (avail<cl->frame_size) return 0;
+    cl->frame_len=cl->frame_size;
+    return 1;
+  case U8_CLIENT_FRAME_LENGTH: {
+    unsigned long long n=0; int i=0, width=cl->frame_size;
+    if (avail<width) return 0;
+    while (i<width) n=(n<<8)|data[i++];
+    if (n>cl->max_frame) return -1;
+    else if (avail<(width+n)) return 0;
+    cl->frame_len=width+n;
+    return 1;}
+  case U8_CLIENT_FRAME_DELIM: {
+    unsigned char *delim=cl->frame_delim;
+    size_t delim_len=cl->frame_delim_len;
+    unsigned char *scan=cl->inbuf+cl->in_scan;
+    unsigned char *limit=cl->inbuf+cl->in_fill;
+    if (scan<data) scan=data;
+    while ((scan=memchr(scan,delim[0],limit-scan))) {
+      if ((scan+delim_len)>limit) break;
+      else if (memcmp(scan,delim,delim_len)==0) {
+        cl->frame_len=(scan-data)+delim_len;
+        return 1;}
+      else scan++;}
+    /* The delimiter may start in the last delim_len-1 bytes */
+    cl->in_scan=(avail<delim_len)?(cl->in_off):
+      (cl->in_fill-(delim_len-1));
+    if (avail>(cl->max_frame+delim_len)) return -1;
+    else return 0;}
+  default:
+    return -1;}
+}
+
+/* Makes room for more input, moving unconsumed input to the start of
+   the buffer or (if it's already there) doubling the buffer */
+static int grow_inbuf(u8_client cl)
+{
+  size_t avail=cl->in_fill-cl->in_off;
+  if (cl->inbuf==NULL) {
+    size_t len=U8_CLIENT_INBUF_SIZE;
+    if (cl->framing==U8_CLIENT_FRAME_FIXED)
+      while (len<cl->frame_size) len=len*2;
+    if ((cl->inbuf=u8_client_getbuf(cl,len))==NULL) return 0;
+    cl->in_len=len; cl->in_off=cl->in_fill=cl->in_scan=0;}
+  else if (cl->in_fill<cl->in_len)
+    return 1;
+  else if (cl->in_off>0) {
+    memmove(cl->inbuf,cl->inbuf+cl->in_off,avail);
+    cl->in_scan=(cl->in_scan>cl->in_off)?(cl->in_scan-cl->in_off):(0);
+    cl->in_fill=avail; cl->in_off=0;}
+  else if (cl->in_len>(2*cl->max_frame+16))
+    return 0;
+  else {
+    unsigned char *bigger=u8_client_getbuf(cl,cl->in_len*2);
+    if (bigger==NULL) return 0;
+    memcpy(bigger,cl->inbuf,avail);
+    u8_client_putbuf(cl,cl->inbuf);
+    cl->inbuf=bigger; cl->in_len=cl->in_len*2;}
+  return 1;
+}
+
+/* Reads whatever is available into the client's input buffer,
+   returning 1 once it holds a complete frame, 0 if it doesn't yet,
+   and -1 at EOF, on errors, or when the frame is too big */
+static int read_frame(u8_client cl)
+{
+  while (1) {
+    ssize_t delta; size_t space;
+    int found=find_frame(cl);
+    if (found) return found;
+    else if (!(grow_inbuf(cl))) return -1;
+    else space=cl->in_len-cl->in_fill;
+#ifdef MSG_DONTWAIT
+    delta=recv(cl->socket,cl->inbuf+cl->in_fill,space,MSG_DONTWAIT);
+#else
+    delta=recv(cl->socket,cl->inbuf+cl->in_fill,space,0);
+#endif
+    if (delta>0) {
+      cl->in_fill+=delta; cl->n_moved+=delta;
+      /* If it didn't fill the buffer, there's probably nothing more
+         to read yet */
+      if ((delta<space)&&(find_frame(cl)==0)) return 0;}
+    else if (delta==0) return -1;
+    else if ((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+      errno=0; return 0;}
+    else if (errno==EINTR) errno=0;
+    else return -1;}
+}
+
+/* Consumes the current frame */
+static void next_frame(u8_client cl)
+{
+  if (cl->frame_len==0) return;
+  cl->in_off+=cl->frame_len; cl->frame_len=0;
+  if (cl->in_off>=cl->in_fill) cl->in_off=cl->in_fill=0;
+  cl->in_scan=cl->in_off;
+}
+
+/* Lets go of a client's input buffer */
+static void release_inbuf(u8_client cl)
+{
+  if (cl->inbuf) u8_client_putbuf(cl,cl->inbuf);
+  cl->inbuf=NULL; cl->frame_len=0;
+  cl->in_len=cl->in_off=cl->in_fill=cl->in_scan=0;
+}
+
+/* Pipelining requests */
+
+/* With U8_SERVER_PIPELINE, the servefn isn't called on a framed
+   client itself. Instead, pump_client() takes each complete frame as
+   a request (with a copy of the frame), which is queued to be handled
+   by whichever thread gets to it, and writes the responses of handled
+   requests once the responses to all of the requests before them
+   have been written. A client's requests are kept on its requests
+   list in the order they arrived; the list, n_requests (its length)
+   and n_inflight (how many haven't been handled yet) are protected by
+   the server lock. A client isn't freed while it has requests in
+   flight, and isn't closed by u8_close_client() until they're done. */
+
+/* Frees a request and its response (this is the freefn of the
+   response's segment, so it's called once the response is written) */
+static void free_request(unsigned char *data,void *state)
+{
+  struct U8_CLIENT_REQUEST *req=(struct U8_CLIENT_REQUEST *)state;
+  u8_client cl=req->client;
+  if ((req->response)&&((req->response_flags)&(U8_CLIENT_WRITE_POOLBUF)))
+    u8_client_putbuf(cl,req->response);
+  else if (req->response) u8_free(req->response);
+  u8_client_putbuf(cl,(unsigned char *)req);
+}
+
+/* Frees all of a client's requests, once none are in flight */
+static void free_requests(u8_client cl)
+{
+  struct U8_CLIENT_REQUEST *req=cl->requests;
+  while (req) {
+    struct U8_CLIENT_REQUEST *next=req->next;
+    free_request(NULL,req);
+    req=next;}
+  cl->requests=cl->last_request=NULL;
+  cl->n_requests=0;
+}
+
+U8_EXPORT int u8_client_respond(u8_client cl,unsigned char *buf,size_t len,
+                                int flags)
+{
+#if U8_THREADS_ENABLED
+  struct U8_CLIENT_REQUEST *req=current_request;
+  if ((req==NULL)||(req->client!=cl)||(req->response)) return -1;
+  else if (!((flags)&(U8_CLIENT_WRITE_OWNBUF|U8_CLIENT_WRITE_POOLBUF))) {
+    unsigned char *copy=u8_client_getbuf(cl,len);
+    if (copy==NULL) return -1;
+    memcpy(copy,buf,len);
+    buf=copy; flags=U8_CLIENT_WRITE_POOLBUF;}
+  req->response=buf; req->response_len=len; req->response_flags=flags;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* Declaring a client done with a transaction (and available for another) */
+
+U8_EXPORT
+/* u8_client_done:
+    Arguments: a pointer to a client
+    Returns: void
+ Marks the client's current task as done, updating server data structures
+ appropriately. */
+int u8_client_done(u8_client cl)
+{
+  U8_SERVER *server=cl->server; char statebuf[16];
+  int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
+    (server->server_loglevel);
+  if (cl->started>0) {
+    if (server->donefn) {
+      int retval=server->donefn(cl);
+      if (retval<0) {
+        u8_logf(LOG_ERR,"u8_client_done",
+                "Error finishing transaction on @x%lx#%d.%d[%s/%d](%s%:hs)",
+                ((unsigned long)cl),cl->clientid,cl->socket,cl->n_trans,
+                u8_client_idstring(cl),cl->status);
+        u8_clear_errors(1);}}
+    u8_utime now=u8_microtime();
+    update_client_stats(cl,now,1);
+    if (server->trace) trace_client(server,cl,now);
+    cl->writing=cl->reading=0;
+    release_transfer(cl);
+    if (cl->queued>0) {
+      u8_logf(LOG_WARNING,"u8_client_done",
+              "Finishing transaction on queued client @x%lx#%d.%d[%s/%d](%s%:hs)",
+              ((unsigned long)cl),cl->clientid,cl->socket,cl->n_trans,
+              u8_client_idstring(cl),cl->status);
+      cl->queued=0;}
+    u8_lock_mutex(&(server->lock));
+    if (cl->socket>0) {
+      cl->idled=cl->reading=u8_microtime();
+      link_idle(server,cl);
+      listen_for(server,cl,POLLIN_EVENTS);}
+    if (cl->started>0) {
+      SERVER_DECR(server->n_busy);
+      cl->started=0;}
+     server->n_trans++;
+    /* A pipelining client's requests are counted as they finish */
+    if (!((cl->framing)&&((server->flags)&(U8_SERVER_PIPELINE))))
+      METRIC_INCR(server,n_trans);
+    if (cl->socket>0) schedule_client(server,cl);
+    u8_unlock_mutex(&(server->lock));
+    return 1;}
+  else {
+    u8_logf(LOG_WARNING,"u8_client_done",
+            "Declaring done on idle client @x%lx#%d.%d[%s/%d](%s%:hs)",
+            ((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status);
+    return 0;}
+}
+
+/* Closing clients */
+
+U8_EXPORT
+/* u8_close_client:
+    Arguments: a pointer to a client
+    Returns: int
+ Marks the client's current task as done, updating server data structures
+ appropriately, and ending by closing the client close function.
+ If a busy client is closed, it has its U8_CLIENT_CLOSING flag set.
+ This tells the event loop to finish closing the client when it actually
+ completes the current transaction.
+*/
+int u8_close_client(u8_client cl)
+{
+  U8_SERVER *server=cl->server; char statebuf[16];
+  int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
+    (server->server_loglevel);
+  if ((cl->flags&U8_CLIENT_CLOSED)==0) {
+    int retval;
+    u8_lock_mutex(&(server->lock));
+    /* Catch race conditions */
+    if (cl->flags&U8_CLIENT_CLOSED) {
+      u8_unlock_mutex(&(server->lock));
+      return 0;}
+    cl->flags|=U8_CLIENT_CLOSING;
+    u8_unlock_mutex(&(server->lock));
+    /* If the task is in the middle of a transaction (or has pipelined
+       requests in flight), don't close it right away. */
+    if ((cl->started>0)||(cl->n_inflight>0)) {
+      if (server->flags&U8_SERVER_LOG_CONNECT)
+        u8_logf(LOG_INFO,"u8_close_client",
+                "Deferring closing of  @x%lx#%d.%d[%s/%d](%s%:hs)",
+                ((unsigned long)cl),cl->clientid,cl->socket,
+                get_client_state(cl,statebuf),
+                cl->n_trans,u8_client_idstring(cl),cl->status);
+      return 0;}
+    retval=close_client_core(cl,0,"u8_close_client");
+    return retval;}
+  else {
+    u8_logf(LOG_WARNING,"u8_close_client",
+            "Closing already closed socket @x%lx#%d.%d[%s/%d](%s%:hs)",
+            ((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status);
+    u8_unlock_mutex(&(server->lock));
+    return 0;}
+}
+
+U8_EXPORT
+/* u8_client_closed:
+    Arguments: a pointer to a client
+    Returns: int
+  Indicates that the other end has closed the connection.  This can generate
+    an indication of its own and then closes the client on this end
+*/
+int u8_client_closed(u8_client cl)
+{
+  char statebuf[16];
+  U8_SERVER *server=cl->server;
+  int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
+    (server->server_loglevel);
+  if ((cl->server->flags)&(U8_SERVER_LOG_CONNECT))
+    u8_logf(LOG_INFO,"u8_client_closed",
+            "Other end closed @x%lx#%d.%d[%s/%d](%s%:hs)",
+            ((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status);
+  return u8_client_close(cl);
 }
 
 U8_EXPORT
@@ -453,7 +1518,7 @@ int u8_shutdown_client(u8_client cl)
             "Closing already closed socket @x%lx#%d.%d[%s/%d](%s%:hs)",
             ((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status);
+            cl->n_trans,u8_client_idstring(cl),cl->status);
     u8_unlock_mutex(&(server->lock));
     return 0;}
 }
@@ -487,13 +1552,14 @@ static int close_client_core(u8_client cl,int server_locked,u8_context caller)
     char statebuf[16];
 
     if (!(server_locked)) u8_lock_mutex(&(server->lock));
+    unlink_idle(server,cl);
 
     if (server->flags&U8_SERVER_LOG_CONNECT)
       u8_logf(LOG_INFO,"u8_close_client",
               "Closing (%s)  @x%lx#%d.%d[%s/%d](%s%:hs)",
               caller,((unsigned long)cl),cl->clientid,cl->socket,
               get_client_state(cl,statebuf),
-              cl->n_trans,cl->idstring,cl->status);
+              cl->n_trans,u8_client_idstring(cl),cl->status);
 
     /* Update run stats for one last time */
     if (cl->started>0) {
@@ -501,18 +1567,29 @@ static int close_client_core(u8_client cl,int server_locked,u8_context caller)
               "Closing (%s) running client @x%lx#%d.%d[%s/%d](%s%:hs)",
               caller,((unsigned long)cl),cl->clientid,cl->socket,
               get_client_state(cl,statebuf),
-              cl->n_trans,cl->idstring,cl->status);
-      server->n_busy--;}
+              cl->n_trans,u8_client_idstring(cl),cl->status);
+      SERVER_DECR(server->n_busy);}
     update_client_stats(cl,cur,1);
 
     cl->running=cl->reading=cl->writing=cl->started=0;
 
+    /* Stop listening before the socket is closed, so that a reused
+       descriptor can't be dropped from the epoll set */
+    if (cl->socket>=0) unregister_socket(server,cl->socket);
+
     if (server->closefn)
       retval=server->closefn(cl);
     else if (cl->socket>0)
       retval=close(cl->socket);
     else retval=0;
 
+    if ((cl->flags)&(U8_CLIENT_SENDFILE)) {
+      close(cl->sendfd); cl->sendfd=-1;}
+    if ((cl->flags)&(U8_CLIENT_WRITEV)) drop_segments(cl);
+    if (cl->segs) {
+      u8_free(cl->segs); cl->segs=NULL; cl->segs_len=0;}
+    release_buf(cl);
+
     cl->flags|=U8_CLIENT_CLOSED;
     cl->socket=-1;
 
@@ -520,7 +1597,7 @@ static int close_client_core(u8_client cl,int server_locked,u8_context caller)
       u8_logf(LOG_INFO,ClosedClient,"Closed (%s) @x%lx#%d.%d[%s/%d](%s%:hs)",
               caller,((unsigned long)cl),cl->clientid,cl->socket,
               get_client_state(cl,statebuf),
-              cl->n_trans,cl->idstring,cl->status);
+              cl->n_trans,u8_client_idstring(cl),cl->status);
 
     if (cl->queued>0) {
       long long interval=cur-cl->queued;
@@ -529,9 +1606,10 @@ static int close_client_core(u8_client cl,int server_locked,u8_context caller)
                 "Closing (%s) a queued client @x%lx#%d.%d[%s/%d](%s%:hs)",
                 caller,((unsigned long)cl),cl->clientid,cl->socket,
                 get_client_state(cl,statebuf),
-                cl->n_trans,cl->idstring,cl->status);
+                cl->n_trans,u8_client_idstring(cl),cl->status);
       cl->stats.qsum+=interval;
       cl->stats.qsum2+=(interval*interval);
+      RECORD_LATENCY(cl,U8_LATENCY_QUEUE,interval);
       if (interval>cl->stats.qmax) cl->stats.qmax=interval;
       cl->stats.qcount++;}
 
@@ -566,6 +1644,7 @@ static void update_client_stats(u8_client cl,long long cur,int done)
     interval=cur-cl->running;
     cl->stats.xsum+=interval;
     cl->stats.xsum2+=(interval*interval);
+    RECORD_LATENCY(cl,U8_LATENCY_EXEC,interval);
     if (interval>cl->stats.xmax) cl->stats.xmax=interval;
     cl->stats.xcount++;}
   if (done) {
@@ -573,6 +1652,7 @@ static void update_client_stats(u8_client cl,long long cur,int done)
       interval=cur-cl->started;
       cl->stats.tsum+=interval;
       cl->stats.tsum2+=(interval*interval);
+      RECORD_LATENCY(cl,U8_LATENCY_TRANSACT,interval);
       if (interval>cl->stats.tmax) cl->stats.tmax=interval;
       cl->stats.tcount++;}}
 }
@@ -615,36 +1695,465 @@ static void update_server_stats(u8_client cl)
   server->n_errs+=cl->n_errs;
 }
 
+/* Client timeouts */
+
+/* Clients' idle, read and write deadlines are kept on a hierarchical
+   timer wheel, with U8_TIMER_LEVELS levels of U8_TIMER_SLOTS slots,
+   where a slot on level n covers U8_TIMER_SLOTS^n ticks. A client is
+   added to the slot covering its deadline and moved down a level
+   (cascaded) as the deadline gets closer, so adding, removing and
+   expiring a client are all O(1). The deadline itself is worked out
+   from the client's state when its slot comes up, so the wheel only
+   needs to be told when a deadline might have moved earlier; if it
+   has moved later, the client is just added again. The wheel is
+   protected by the server lock and advanced by the listener. */
+
+#define U8_TIMER_LEVELS 4
+#define U8_TIMER_BITS 6
+#define U8_TIMER_SLOTS (1<<U8_TIMER_BITS)
+#define U8_TIMER_MASK (U8_TIMER_SLOTS-1)
+#define U8_TIMER_SPAN (1LL<<(U8_TIMER_BITS*U8_TIMER_LEVELS))
+
+/* How long (in microseconds) a tick of the wheel is */
+#ifndef U8_TIMER_TICK
+#define U8_TIMER_TICK 10000
+#endif
+
+/* How long (in microseconds) to wait before checking again on a
+   client which was busy when its deadline passed */
+#define U8_TIMER_RECHECK (U8_TIMER_TICK*U8_TIMER_SLOTS)
+
+#define TIMER_TICKS(utime) (((utime)+U8_TIMER_TICK-1)/U8_TIMER_TICK)
+
+struct U8_TIMER_WHEEL {
+  long long now; /* The last tick processed */
+  int n_timers;
+  u8_client slots[U8_TIMER_LEVELS*U8_TIMER_SLOTS];};
+
+static struct U8_TIMER_WHEEL *new_timer_wheel(void)
+{
+  struct U8_TIMER_WHEEL *wheel=u8_alloc(struct U8_TIMER_WHEEL);
+  memset(wheel,0,sizeof(struct U8_TIMER_WHEEL));
+  wheel->now=u8_microtime()/U8_TIMER_TICK;
+  return wheel;
+}
+
+static void add_timer(struct U8_TIMER_WHEEL *wheel,u8_client cl,
+                      u8_utime deadline)
+{
+  long long tick=TIMER_TICKS(deadline), delta;
+  int level=0, slot;
+  /* The current tick has already been processed */
+  if (tick<=wheel->now) tick=wheel->now+1;
+  /* If it's past the top level, we park it there and add it again
+     when that comes up */
+  else if ((tick-wheel->now)>=U8_TIMER_SPAN)
+    tick=wheel->now+U8_TIMER_SPAN-1;
+  delta=tick-wheel->now;
+  while ((level<(U8_TIMER_LEVELS-1))&&
+         (delta>=(1LL<<(U8_TIMER_BITS*(level+1)))))
+    level++;
+  slot=(level*U8_TIMER_SLOTS)+((tick>>(U8_TIMER_BITS*level))&U8_TIMER_MASK);
+  cl->timer=tick*U8_TIMER_TICK; cl->timer_slot=slot;
+  cl->prev_timer=NULL; cl->next_timer=wheel->slots[slot];
+  if (cl->next_timer) cl->next_timer->prev_timer=cl;
+  wheel->slots[slot]=cl;
+  wheel->n_timers++;
+}
+
+static void remove_timer(struct U8_TIMER_WHEEL *wheel,u8_client cl)
+{
+  if (cl->timer<=0) return;
+  if (cl->prev_timer) cl->prev_timer->next_timer=cl->next_timer;
+  else wheel->slots[cl->timer_slot]=cl->next_timer;
+  if (cl->next_timer) cl->next_timer->prev_timer=cl->prev_timer;
+  cl->next_timer=cl->prev_timer=NULL;
+  cl->timer=0; cl->timer_slot=-1;
+  wheel->n_timers--;
+}
+
+/* Moves the clients in the current slot of a level down the wheel */
+static void cascade_timers(struct U8_TIMER_WHEEL *wheel,int level)
+{
+  int slot=(level*U8_TIMER_SLOTS)+
+    ((wheel->now>>(U8_TIMER_BITS*level))&U8_TIMER_MASK);
+  u8_client cl;
+  while ((cl=wheel->slots[slot])) {
+    u8_utime due=cl->timer;
+    remove_timer(wheel,cl);
+    add_timer(wheel,cl,due);}
+}
+
+/* Returns when a client should be closed given its current state, or
+   zero if it has no deadline */
+static u8_utime client_deadline(struct U8_SERVER *server,u8_client cl)
+{
+  short awaiting=client_awaiting(cl);
+  if (awaiting) {
+    long timeout=(awaiting&POLLOUT)?(server->write_timeout):
+      (server->read_timeout);
+    if (timeout<=0) timeout=server->idle_timeout;
+    return (timeout>0) ? (cl->coroutine->since+(timeout*1000)) : (0);}
+  else if (cl->writing>0)
+    return (server->write_timeout>0) ?
+      (cl->writing+(server->write_timeout*1000)) : (0);
+  else if ((cl->reading>0)&&(cl->off<cl->len))
+    return (server->read_timeout>0) ?
+      (cl->reading+(server->read_timeout*1000)) : (0);
+  else if (server->idle_timeout>0)
+    return cl->idled+(server->idle_timeout*1000);
+  else return 0;
+}
+
+/* Makes sure that the client will come up on the wheel no later than
+   its deadline. This is called with the server lock held. */
+static void schedule_client(struct U8_SERVER *server,u8_client cl)
+{
+  u8_utime deadline;
+  if (server->timers==NULL) return;
+  else deadline=client_deadline(server,cl);
+  if (deadline<=0) return;
+  else if ((cl->timer>0)&&
+           (cl->timer<=(TIMER_TICKS(deadline)*U8_TIMER_TICK)))
+    return;
+  remove_timer(server->timers,cl);
+  add_timer(server->timers,cl,deadline);
+}
+
+/* Idle clients (waiting for their next request) are kept in a list,
+   with the longest idle at the front. Clients join at the back when
+   they're added or finish a transaction and leave when they're
+   queued, paused or closed. */
+
+static void link_idle(struct U8_SERVER *server,u8_client cl)
+{
+  unlink_idle(server,cl);
+  cl->prev_idle=server->idle_tail; cl->next_idle=NULL;
+  if (server->idle_tail) server->idle_tail->next_idle=cl;
+  else server->idle_head=cl;
+  server->idle_tail=cl;
+}
+
+static void unlink_idle(struct U8_SERVER *server,u8_client cl)
+{
+  if ((cl->prev_idle==NULL)&&(server->idle_head!=cl)) return;
+  if (cl->prev_idle) cl->prev_idle->next_idle=cl->next_idle;
+  else server->idle_head=cl->next_idle;
+  if (cl->next_idle) cl->next_idle->prev_idle=cl->prev_idle;
+  else server->idle_tail=cl->prev_idle;
+  cl->prev_idle=cl->next_idle=NULL;
+}
+
+static int expire_client(struct U8_SERVER *server,u8_client cl,u8_utime now)
+{
+  u8_utime deadline=client_deadline(server,cl);
+  int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
+    (server->server_loglevel);
+  char statebuf[16];
+  if (deadline<=0) return 0;
+  else if (deadline>now) {
+    add_timer(server->timers,cl,deadline);
+    return 0;}
+  else if ((((cl->flags)&(U8_CLIENT_URING))||(cl->active>0))&&
+           ((cl->writing>0)||((cl->reading>0)&&(cl->off<cl->len)))&&
+           (cl->socket>=0)&&
+           (!((cl->flags)&(U8_CLIENT_CLOSING|U8_CLIENT_CLOSED)))) {
+    /* The ring or a worker is stuck on the transfer, so we shut the
+       socket down, which ends the transfer with an error or EOF and
+       leaves closing the client to whoever sees that */
+    if (server->flags&U8_SERVER_LOG_CONNECT)
+      u8_logf(LOG_NOTICE,ClosedClient,
+              "Shutting down @x%lx#%d.%d[%s/%d](%s%:hs) after %s timeout",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status,
+              ((cl->writing>0)?("write"):("read")));
+    shutdown(cl->socket,SHUT_RDWR);
+    server->n_timeouts++;
+    add_timer(server->timers,cl,now+U8_TIMER_RECHECK);
+    return 0;}
+  else if ((cl->queued>0)||(cl->active>0)||
+           ((cl->flags)&
+            (U8_CLIENT_URING|U8_CLIENT_PAUSED|
+             U8_CLIENT_CLOSING|U8_CLIENT_CLOSED))) {
+    /* Someone else is working on it, so we check back later */
+    add_timer(server->timers,cl,now+U8_TIMER_RECHECK);
+    return 0;}
+#if U8_USE_COROUTINES
+  else if (client_awaiting(cl)) {
+    /* A parked servefn is waiting on the client, so we resume it
+       with nothing ready and let it deal with the timeout */
+    if (server->flags&U8_SERVER_LOG_CONNECT)
+      u8_logf(LOG_NOTICE,ClosedClient,
+              "Timing out await on @x%lx#%d.%d[%s/%d](%s%:hs)",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status);
+    cl->coroutine->revents=0;
+    if (dispatch_client(server,cl,"expire_client/await"))
+      server->n_timeouts++;
+    else add_timer(server->timers,cl,now+U8_TIMER_RECHECK);
+    return 0;}
+#endif
+  if (server->flags&U8_SERVER_LOG_CONNECT)
+    u8_logf(LOG_NOTICE,ClosedClient,
+            "Closing @x%lx#%d.%d[%s/%d](%s%:hs) after %s timeout (%lldus late)",
+            ((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status,
+            ((cl->writing>0)?("write"):
+             ((cl->reading>0)&&(cl->off<cl->len))?("read"):("idle")),
+            (long long)(now-deadline));
+  server->n_timeouts++;
+  close_client_core(cl,1,"expire_client");
+  return 1;
+}
+
+/* Advances the wheel to now, closing clients whose deadlines have
+   passed. This is called with the server lock held. */
+static int run_timers(struct U8_SERVER *server,u8_utime now)
+{
+  struct U8_TIMER_WHEEL *wheel=server->timers;
+  long long target=now/U8_TIMER_TICK; int n_expired=0;
+  if (wheel->n_timers==0) {
+    if (target>wheel->now) wheel->now=target;
+    return 0;}
+  while (wheel->now<target) {
+    int level=1, slot; u8_client cl;
+    wheel->now++;
+    while ((level<U8_TIMER_LEVELS)&&
+           ((wheel->now&((1LL<<(U8_TIMER_BITS*level))-1))==0))
+      cascade_timers(wheel,level++);
+    slot=(wheel->now&U8_TIMER_MASK);
+    while ((cl=wheel->slots[slot])) {
+      remove_timer(wheel,cl);
+      n_expired+=expire_client(server,cl,now);}}
+  return n_expired;
+}
+
+/* Returns how many ticks until the wheel next needs to be advanced,
+   or -1 if there are no timers */
+static long long next_timer(struct U8_TIMER_WHEEL *wheel)
+{
+  long long i=1, lim=U8_TIMER_SLOTS-(wheel->now&U8_TIMER_MASK);
+  if (wheel->n_timers==0) return -1;
+  while (i<lim) {
+    if (wheel->slots[(wheel->now+i)&U8_TIMER_MASK]) return i;
+    else i++;}
+  return lim;
+}
+
+/* Called by the listener before it waits, this closes clients whose
+   deadlines have passed and returns how long to wait (no longer than
+   until the next tick which has timers). */
+static int check_timers(struct U8_SERVER *server,int timeout)
+{
+  long long ticks; u8_utime now;
+  if (server->timers==NULL) return timeout;
+  u8_lock_mutex(&(server->lock));
+  now=u8_microtime();
+  run_timers(server,now);
+  ticks=next_timer(server->timers);
+  if (ticks>=0) {
+    u8_utime due=(server->timers->now+ticks)*U8_TIMER_TICK;
+    int wait=((due>now)?((due-now)/1000):(0))+1;
+    if ((timeout<0)||(wait<timeout)) timeout=wait;}
+  u8_unlock_mutex(&(server->lock));
+  return timeout;
+}
+
 /* Maintaining the task/event/client queue */
 
+/* Each thread in the pool has its own queue of tasks, with its own
+   lock, so that worker threads never need the server lock to find
+   work. A new task goes to a sleeping thread if there is one and
+   otherwise round-robin, except that a task pushed by a worker goes
+   onto its own queue. A thread takes tasks from the front of its own
+   queue and, when that's empty, steals from the back of the other
+   threads' queues before going to sleep. Pushes still happen under
+   the server lock (which also protects the sockets), so
+   server->n_queued, the total across all the queues, never exceeds
+   max_queued, which is the size of each queue. A client whose
+   servefn is parked in a coroutine goes back to the queue of the
+   thread it's parked on, and isn't stolen. The requests of
+   U8_SERVER_PIPELINE clients share the queues (see TASK_REQUEST). */
+
 #if U8_THREADS_ENABLED
-static u8_client pop_task(struct U8_SERVER *server)
+static __thread struct U8_SERVER_THREAD *current_worker=NULL;
+
+static u8_client take_task(struct U8_SERVER_THREAD *st,int steal)
 {
-  u8_client task=NULL; char statebuf[16]; int slot;
-  int local_loglevel = server->server_loglevel;
-  if ( (server->flags) & (U8_SERVER_CLOSED|U8_SERVER_CLOSING) )
+  u8_client task=NULL;
+  if (__atomic_load_n(&(st->u8st_n_queued),__ATOMIC_SEQ_CST)==0)
     return NULL;
+  u8_lock_mutex(&(st->u8st_lock));
+  if (st->u8st_n_queued>0) {
+    int slot;
+    if (steal) {
+      slot=(st->u8st_queue_head+st->u8st_n_queued-1)%(st->u8st_queue_len);
+      u8_client last=st->u8st_queue[slot];
+      if ((TASK_REQUEST(last)==NULL)&&(last->coroutine)) {
+        /* It has to be resumed by its own thread */
+        u8_unlock_mutex(&(st->u8st_lock));
+        return NULL;}}
+    else {
+      slot=st->u8st_queue_head;
+      st->u8st_queue_head=(slot+1)%(st->u8st_queue_len);}
+    task=st->u8st_queue[slot];
+    st->u8st_queue[slot]=NULL;
+    st->u8st_n_queued--;}
+  u8_unlock_mutex(&(st->u8st_lock));
+  if (task) SERVER_DECR(st->u8st_server->n_queued);
+  return task;
+}
+
+static u8_client find_task(struct U8_SERVER *server,
+                           struct U8_SERVER_THREAD *st)
+{
+  u8_client task=take_task(st,0);
+  int i=1, n_threads=server->n_threads, self=st->u8st_slotno;
+  while ((task==NULL)&&(i<n_threads)) {
+    task=take_task(&(server->thread_pool[(self+i)%n_threads]),1);
+    i++;}
+  return task;
+}
+
+static void wake_thread(struct U8_SERVER_THREAD *st)
+{
+  u8_lock_mutex(&(st->u8st_lock));
+  st->u8st_woken=1;
+  /* So that wake_sleeper() moves on to another thread */
+  __atomic_store_n(&(st->u8st_sleeping),0,__ATOMIC_SEQ_CST);
+  u8_condvar_signal(&(st->u8st_wakeup));
+  u8_unlock_mutex(&(st->u8st_lock));
+}
+
+static void wake_all_threads(struct U8_SERVER *server)
+{
+  int i=0, n_threads=server->n_threads;
+  while (i<n_threads) wake_thread(&(server->thread_pool[i++]));
+}
+
+/* Wakes up one sleeping thread (if any) to steal a task which was
+   queued for a busy thread */
+static void wake_sleeper(struct U8_SERVER *server,
+                         struct U8_SERVER_THREAD *except)
+{
+  int i=0, n_threads=server->n_threads;
+  while (i<n_threads) {
+    struct U8_SERVER_THREAD *st=&(server->thread_pool[i++]);
+    if ((st!=except)&&
+        (__atomic_load_n(&(st->u8st_sleeping),__ATOMIC_SEQ_CST))) {
+      wake_thread(st);
+      return;}}
+}
+
+/* A thread above the pool's minimum which has been idle for a while
+   exits, but only if it's the last one, so that the pool stays
+   contiguous. Tasks are only pushed under the server lock, so none
+   can be pushed onto its (empty) queue once n_threads doesn't
+   include it. Once the server lock is released, check_pool() may
+   start another thread in the same slot and do_shutdown() may free
+   the pool, so a retired thread finishes with its struct (and the
+   server) before then. */
+static int retire_thread(struct U8_SERVER *server,
+                         struct U8_SERVER_THREAD *st)
+{
+  int retired=0;
+  int local_loglevel = server->server_loglevel;
   u8_lock_mutex(&(server->lock));
-  while ((server->n_queued == 0) &&
-         (((server->flags)&(U8_SERVER_CLOSED|U8_SERVER_CLOSING))==0))
-    u8_condvar_wait(&(server->empty),&(server->lock));
-  if ((server->flags)&(U8_SERVER_CLOSED|U8_SERVER_CLOSING)) {}
-  else if (server->n_queued) {
-    slot=server->queue_head;
-    task=server->queue[server->queue_head];
-    server->queue[server->queue_head]=NULL;
-    server->queue_head++;
-    if (server->queue_head>=server->queue_len) server->queue_head=0;
-    server->n_queued--;}
-  else NO_ELSE;
-  if (!(task)) {}
+  if ((st->u8st_slotno==(server->n_threads-1))&&
+      (server->n_threads>server->min_threads)&&
+      (((server->flags)&(U8_SERVER_CLOSED|U8_SERVER_CLOSING))==0)) {
+    u8_lock_mutex(&(st->u8st_lock));
+    if ((st->u8st_n_queued==0)&&
+        (__atomic_load_n(&(st->u8st_n_parked),__ATOMIC_SEQ_CST)==0)) {
+      server->n_threads--;
+      server->n_retired++;
+      retired=1;}
+    u8_unlock_mutex(&(st->u8st_lock));}
+  if (retired) {
+    u8_logf(LOG_INFO,"retire_thread",
+            "Retiring idle thread %d (%ld), leaving %d threads",
+            st->u8st_slotno,st->u8st_threadid,server->n_threads);
+    /* In case we were woken to steal a task */
+    if (__atomic_load_n(&(server->n_queued),__ATOMIC_SEQ_CST)>0)
+      wake_sleeper(server,st);
+#if U8_USE_COROUTINES
+    free_coroutines(st);
+#endif
+    /* Nobody waits for a retired thread */
+    pthread_detach(pthread_self());}
+  u8_unlock_mutex(&(server->lock));
+  return retired;
+}
+
+static u8_client start_task(struct U8_SERVER *server,
+                            struct U8_SERVER_THREAD *st,
+                            u8_client task);
+static void run_request(struct U8_SERVER *server,
+                        struct U8_SERVER_THREAD *st,
+                        struct U8_CLIENT_REQUEST *req);
+
+static u8_client pop_task(struct U8_SERVER *server,
+                          struct U8_SERVER_THREAD *st)
+{
+  u8_client task=NULL;
+  int growable=(server->min_threads<server->max_threads);
+  while (task==NULL) {
+    int idle=0;
+    if ( (server->flags) & (U8_SERVER_CLOSED|U8_SERVER_CLOSING) )
+      return NULL;
+    else task=find_task(server,st);
+    if (task) break;
+    /* Say that we're going to sleep before looking one last time, so
+       that anyone pushing a task after we've looked will wake us. */
+    __atomic_store_n(&(st->u8st_sleeping),1,__ATOMIC_SEQ_CST);
+    task=find_task(server,st);
+    u8_lock_mutex(&(st->u8st_lock));
+    while ((task==NULL)&&(st->u8st_n_queued==0)&&(!(st->u8st_woken))&&
+           (((server->flags)&(U8_SERVER_CLOSED|U8_SERVER_CLOSING))==0)) {
+      if (growable) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME,&until);
+        until.tv_sec+=server->thread_idle/1000;
+        until.tv_nsec+=(server->thread_idle%1000)*1000000;
+        if (until.tv_nsec>=1000000000) {
+          until.tv_sec++; until.tv_nsec-=1000000000;}
+        if (u8_condvar_timedwait(&(st->u8st_wakeup),&(st->u8st_lock),
+                                 &until)==ETIMEDOUT) {
+          idle=1; break;}}
+      else u8_condvar_wait(&(st->u8st_wakeup),&(st->u8st_lock));}
+    st->u8st_woken=0;
+    __atomic_store_n(&(st->u8st_sleeping),0,__ATOMIC_SEQ_CST);
+    u8_unlock_mutex(&(st->u8st_lock));
+    if ((idle)&&(task==NULL)&&(retire_thread(server,st))) {
+      /* This tells event_loop() that the thread is done */
+      current_worker=NULL;
+      return NULL;}}
+  return start_task(server,st,task);
+}
+
+/* Takes a task off the queue, returning NULL if it's closed (and
+   freed) or unexpectedly active, or if it was a pipelined request
+   (which is handled here). */
+static u8_client start_task(struct U8_SERVER *server,
+                            struct U8_SERVER_THREAD *st,
+                            u8_client task)
+{
+  char statebuf[16];
+  int local_loglevel = server->server_loglevel;
+  int growable=(server->min_threads<server->max_threads);
+  if (TASK_REQUEST(task)) {
+    run_request(server,st,TASK_REQUEST(task));
+    task=NULL;}
   else if (task->active>0) {
     /* This should probably never happen */
     u8_logf(LOG_CRIT,"pop_task(u8)",
             "popping (%d) active task @x%lx#%d.%d[%s/%d](%s%:hs)",
-            slot,((unsigned long)task),task->clientid,task->socket,
+            st->u8st_slotno,((unsigned long)task),task->clientid,task->socket,
             get_client_state(task,statebuf),
-            task->n_trans,task->idstring,task->status);
+            task->n_trans,u8_client_idstring(task),task->status);
     /* If this ever happened, not freeing the client would be a leak.  However,
        if it did happen, we'd screw up other logic, so we risk the leak. */
     task->queued=-1; task=NULL;}
@@ -653,307 +2162,859 @@ static u8_client pop_task(struct U8_SERVER *server)
         ((task->flags)&(U8_CLIENT_LOG_QUEUE)))
       u8_logf(LOG_DEBUG,"pop_task(u8)",
               "Final pop (%d) of closed task @x%lx#%d.%d[%s/%d](%s%:hs)",
-              slot,((unsigned long)task),task->clientid,task->socket,
+              st->u8st_slotno,((unsigned long)task),task->clientid,task->socket,
               get_client_state(task,statebuf),
-              task->n_trans,task->idstring,task->status);
+              task->n_trans,u8_client_idstring(task),task->status);
+    u8_lock_mutex(&(server->lock));
     free_client(task->server,task,"pop_task/closed");
+    u8_unlock_mutex(&(server->lock));
     task=NULL;}
   else {
     u8_utime curtime=u8_microtime();
     long long qtime=curtime-task->queued;
     task->stats.qsum+=qtime; task->stats.qsum2+=(qtime*qtime);
+    RECORD_LATENCY(task,U8_LATENCY_QUEUE,qtime);
     task->stats.qcount++;
+    if (growable) {
+      /* For check_pool() */
+      __atomic_add_fetch(&(server->pool_qsum),qtime,__ATOMIC_RELAXED);
+      __atomic_add_fetch(&(server->pool_qcount),1,__ATOMIC_RELAXED);}
     if (qtime>task->stats.qmax) task->stats.qmax=qtime;
-    task->queued=0; task->active=curtime;
+    /* The listener leaves clients which are either queued or active
+       alone, so we make it active before it stops being queued. */
+    task->active=curtime; task->queued=0;
     if (((server->flags)&(U8_SERVER_LOG_QUEUE))||
         ((task->flags)&(U8_CLIENT_LOG_QUEUE)))
       u8_logf(LOG_DEBUG,"pop_task(u8)",
               "Popped (%d) task @x%lx#%d.%d[%s/%d](%s%:hs)",
-              slot,((unsigned long)task),task->clientid,task->socket,
+              st->u8st_slotno,((unsigned long)task),task->clientid,task->socket,
               get_client_state(task,statebuf),
-              task->n_trans,task->idstring,task->status);
+              task->n_trans,u8_client_idstring(task),task->status);
     if (task->started<=0) {
       task->started=curtime;
-      server->n_busy++;}}
-  u8_unlock_mutex(&(server->lock));
+      if (server->trace) {
+        /* So that the trace gets just this transaction's share */
+        task->trace_marks[0]=task->stats.qsum-qtime;
+        task->trace_marks[1]=task->stats.rsum;
+        task->trace_marks[2]=task->stats.wsum;
+        task->trace_marks[3]=task->stats.xsum;
+        task->trace_errs=task->n_errs; task->n_moved=0;}
+      SERVER_INCR(server->n_busy);}}
   return task;
 }
 
+/* Picks the thread whose queue gets a new task */
+static struct U8_SERVER_THREAD *choose_thread(struct U8_SERVER *server)
+{
+  struct U8_SERVER_THREAD *pool=server->thread_pool;
+  int i=0, n_threads=server->n_threads, start=server->next_thread;
+  if ((current_worker)&&(current_worker->u8st_server==server))
+    return current_worker;
+  while (i<n_threads) {
+    int slot=(start+i)%n_threads;
+    if (__atomic_load_n(&(pool[slot].u8st_sleeping),__ATOMIC_RELAXED)) {
+      server->next_thread=(slot+1)%n_threads;
+      return &(pool[slot]);}
+    i++;}
+  server->next_thread=(start+1)%n_threads;
+  return &(pool[start%n_threads]);
+}
+
+/* Adds a task to a thread's queue, waking the thread if it's asleep
+   and otherwise (unless it's for the current thread's own queue) any
+   sleeping thread which might steal it */
+static void enqueue_task(struct U8_SERVER *server,
+                         struct U8_SERVER_THREAD *st,
+                         u8_client task,int local)
+{
+  u8_lock_mutex(&(st->u8st_lock));
+  st->u8st_queue[(st->u8st_queue_head+st->u8st_n_queued)%
+                 (st->u8st_queue_len)]=task;
+  st->u8st_n_queued++;
+  SERVER_INCR(server->n_queued);
+  if (st->u8st_sleeping) {
+    st->u8st_woken=1;
+    u8_condvar_signal(&(st->u8st_wakeup));
+    u8_unlock_mutex(&(st->u8st_lock));}
+  else {
+    u8_unlock_mutex(&(st->u8st_lock));
+    if (!(local)) {
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      wake_sleeper(server,st);}}
+}
+
+/* This is called with the server lock held */
 static int push_task(struct U8_SERVER *server,u8_client cl,u8_context cxt)
 {
   u8_utime cur=u8_microtime(); char statebuf[16];
+  struct U8_SERVER_THREAD *st;
   int local_loglevel = server->server_loglevel;
-  if (server->n_queued >= server->max_queued) return 0;
+  if (__atomic_load_n(&(server->n_queued),__ATOMIC_RELAXED) >=
+      server->max_queued)
+    return 0;
   if (cl->queued>0) return 0;
   if (cl->clientid<0) return 0;
+  if ((cl->coroutine)&&(cl->coroutine->thread))
+    st=cl->coroutine->thread;
+  else st=choose_thread(server);
   if (((server->flags)&(U8_SERVER_LOG_QUEUE))||
       ((cl->flags)&(U8_CLIENT_LOG_QUEUE)))
     u8_logf(LOG_DEBUG,cxt,"Queueing (%d) client @x%lx#%d.%d[%s/%d](%s%:hs)",
-            server->queue_tail,((unsigned long)cl),cl->clientid,cl->socket,
+            st->u8st_slotno,((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status);
+            cl->n_trans,u8_client_idstring(cl),cl->status);
   cl->queued=cur;
-  server->queue[server->queue_tail++]=cl;
-  if (server->queue_tail>=server->queue_len) server->queue_tail=0;
-  server->n_queued++;
-  server->sockets[cl->clientid].events=((short)0);
-  u8_condvar_signal(&(server->empty));
+  unlink_idle(server,cl);
+  /* Stop listening before the task can be popped, because whoever
+     pops it may ask to listen again */
+  listen_for(server,cl,0);
+  enqueue_task(server,st,cl,(st==current_worker));
+  return 1;
+}
+
+/* Handling overload */
+
+/* When a ready client can't be queued because the queue is full,
+   what happens depends on server->overload. With U8_OVERLOAD_PAUSE
+   or U8_OVERLOAD_SHED, we stop listening to the client until the
+   queue has drained (to half full) and then queue it, and with
+   U8_OVERLOAD_SHED, we also close the connection which has been
+   idle longest (if we haven't closed too many lately). Otherwise,
+   the listener tries again on its next pass. (U8_OVERLOAD_REJECT is
+   handled by server_accept()). These are called with the server
+   lock held. */
+
+static void pause_client(struct U8_SERVER *server,u8_client cl)
+{
+  if ((cl->flags)&(U8_CLIENT_PAUSED)) return;
+  if (server->n_paused>=server->paused_len) {
+    int new_len=((server->paused_len)?(server->paused_len*2):(64));
+    if (server->paused)
+      server->paused=u8_realloc_n(server->paused,new_len,int);
+    else server->paused=u8_alloc_n(new_len,int);
+    server->paused_len=new_len;}
+  server->paused[server->n_paused++]=cl->clientid;
+  cl->flags|=U8_CLIENT_PAUSED;
+  unlink_idle(server,cl);
+  listen_for(server,cl,0);
+}
+
+/* Queues paused clients, in the order they were paused, keeping the
+   ones which still don't fit. Entries whose clients have since closed
+   (or been resumed) are just dropped. */
+static int resume_paused(struct U8_SERVER *server)
+{
+  int *paused=server->paused;
+  int i=0, j=0, n=server->n_paused, n_resumed=0;
+  while (i<n) {
+    int slot=paused[i++];
+    u8_client cl=((slot<server->max_slot)?(server->clients[slot]):(NULL));
+    if ((cl==NULL)||(!((cl->flags)&(U8_CLIENT_PAUSED)))) continue;
+    else if (push_task(server,cl,"resume_paused")) {
+      cl->flags&=~U8_CLIENT_PAUSED;
+      n_resumed++;}
+    else paused[j++]=slot;}
+  server->n_paused=j;
+  return n_resumed;
+}
+
+/* Closes the client at the front of the idle list. Clients there
+   which have started doing something else are dropped from the list
+   (they come back when they're idle again), looking at only a few of
+   them each time. */
+static int shed_idle_client(struct U8_SERVER *server)
+{
+  u8_client oldest=server->idle_head;
+  int checked=0;
+  int local_loglevel = server->server_loglevel;
+  u8_utime now=u8_microtime();
+  char statebuf[16];
+  if ((now-server->shed_since)>=U8_SERVER_SHED_INTERVAL) {
+    server->shed_since=now;
+    server->n_shed_since=0;}
+  if (server->n_shed_since>=U8_SERVER_SHED_MAX) return 0;
+  while ((oldest)&&(checked<U8_SERVER_SHED_CHECK)) {
+    if ((oldest->started>0)||(oldest->queued>0)||(oldest->active>0)||
+        ((oldest->flags)&
+         (U8_CLIENT_CLOSED|U8_CLIENT_CLOSING|U8_CLIENT_URING|
+          U8_CLIENT_PAUSED))) {
+      u8_client next=oldest->next_idle;
+      unlink_idle(server,oldest);
+      oldest=next;
+      checked++;}
+    else break;}
+  if ((oldest==NULL)||(checked>=U8_SERVER_SHED_CHECK)) return 0;
+  if (server->flags&U8_SERVER_LOG_CONNECT)
+    u8_logf(LOG_NOTICE,ClosedClient,
+            "Shedding @x%lx#%d.%d[%s/%d](%s%:hs), idle for %lldus, "
+            "because the server is overloaded",
+            ((unsigned long)oldest),oldest->clientid,oldest->socket,
+            get_client_state(oldest,statebuf),
+            oldest->n_trans,u8_client_idstring(oldest),oldest->status,
+            (long long)(now-oldest->idled));
+  server->n_shed++;
+  server->n_shed_since++;
+  close_client_core(oldest,1,"shed_idle_client");
+  return 1;
+}
+
+/* Queues a ready client, applying the overload policy if the queue
+   is full */
+static int dispatch_client(struct U8_SERVER *server,u8_client cl,
+                           u8_context cxt)
+{
+  if (push_task(server,cl,cxt)) return 1;
+  else if ((cl->queued>0)||(cl->clientid<0)) return 0;
+  server->n_overloads++;
+  if ((server->overload)&(U8_OVERLOAD_PAUSE|U8_OVERLOAD_SHED))
+    pause_client(server,cl);
+  if ((server->overload)&(U8_OVERLOAD_SHED))
+    shed_idle_client(server);
+  return 0;
+}
+
+/* Called by the listener before it waits, this resumes paused
+   clients once the queue has drained and returns how long to wait
+   (which is shorter while there are paused clients). */
+static int check_paused(struct U8_SERVER *server)
+{
+  int timeout=server->poll_timeout;
+  if (server->n_paused<=0) return timeout;
+  if (__atomic_load_n(&(server->n_queued),__ATOMIC_RELAXED)<=
+      (server->max_queued/2)) {
+    u8_lock_mutex(&(server->lock));
+    resume_paused(server);
+    u8_unlock_mutex(&(server->lock));}
+  if ((server->n_paused>0)&&
+      ((timeout<0)||(timeout>U8_SERVER_PAUSED_TIMEOUT)))
+    timeout=U8_SERVER_PAUSED_TIMEOUT;
+  return timeout;
+}
+
+/* Running pipelined requests (see "Pipelining requests" above) */
+
+/* Makes a request for the client's current frame */
+static struct U8_CLIENT_REQUEST *new_request(u8_client cl)
+{
+  size_t len; unsigned char *frame=u8_client_frame(cl,&len);
+  struct U8_CLIENT_REQUEST *req=(struct U8_CLIENT_REQUEST *)
+    u8_client_getbuf(cl,sizeof(struct U8_CLIENT_REQUEST)+len);
+  if (req==NULL) return NULL;
+  memset(req,0,sizeof(struct U8_CLIENT_REQUEST));
+  req->client=cl; req->queued=u8_microtime();
+  req->data=(unsigned char *)(req+1); req->len=len;
+  if (len>0) memcpy(req->data,frame,len);
+  return req;
+}
+
+
+/* This is called with the server lock held */
+static int push_request(struct U8_SERVER *server,struct U8_CLIENT_REQUEST *req)
+{
+  if (__atomic_load_n(&(server->n_queued),__ATOMIC_RELAXED) >=
+      server->max_queued)
+    return 0;
+  enqueue_task(server,choose_thread(server),REQUEST_TASK(req),0);
   return 1;
 }
 
-/* The main event loop */
-
+/* Records that a request has been handled. If its client is waiting
+   and the first of its responses is ready, the client is queued to
+   write it; if the client has been closed (or is waiting to be), and
+   this was its last request in flight, it's freed (or closed). */
+static void finish_request(struct U8_SERVER *server,
+                           struct U8_CLIENT_REQUEST *req)
+{
+  u8_client cl=req->client;
+  u8_lock_mutex(&(server->lock));
+  req->done=1; cl->n_inflight--;
+  if ((cl->flags)&(U8_CLIENT_CLOSED)) {
+    if (cl->n_inflight==0) release_client(server,cl);}
+  else if ((cl->active>0)||(cl->queued>0)||(cl->writing>0)||
+           ((cl->flags)&(U8_CLIENT_PAUSED))) {
+    /* Whatever it's doing, it will get back to its requests */}
+  else if ((cl->flags)&(U8_CLIENT_CLOSING)) {
+    if (cl->n_inflight==0)
+      close_client_core(cl,1,"finish_request");}
+  else if ((cl->requests)&&(cl->requests->done)) {
+    if (!(push_task(server,cl,"finish_request")))
+      pause_client(server,cl);}
+  else NO_ELSE;
+  u8_unlock_mutex(&(server->lock));
+}
+
+static void run_request(struct U8_SERVER *server,
+                        struct U8_SERVER_THREAD *st,
+                        struct U8_CLIENT_REQUEST *req)
+{
+  u8_client cl=req->client;
+  u8_utime cur=u8_microtime();
+  char statebuf[16];
+  int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
+    (server->server_loglevel);
+  RECORD_LATENCY(cl,U8_LATENCY_QUEUE,cur-req->queued);
+  if (((cl->flags)&(U8_CLIENT_CLOSED|U8_CLIENT_CLOSING))==0) {
+    struct U8_CLIENT_REQUEST *outer=current_request;
+    int result;
+    u8_utime now;
+    current_request=req;
+    result=server->servefn(cl);
+    current_request=outer;
+    now=u8_microtime();
+    RECORD_LATENCY(cl,U8_LATENCY_EXEC,now-cur);
+    if (server->trace) trace_request(server,st,req,cur,now,result);
+    if (result<0) {
+      u8_exception ex=u8_current_exception;
+      u8_logf(LOG_ERR,"run_request",
+              "Error handling a request from @x%lx#%d.%d[%s/%d](%s%:hs) %s",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status,
+              ((ex)?(u8_errstring(ex)):((u8_string)"")));
+      if (ex) u8_clear_errors(1);
+      SERVER_INCR(cl->n_errs);
+      METRIC_INCR(server,n_errs);}
+    else if (result>0)
+      u8_logf(LOG_WARN,"run_request",
+              "The servefn can't yield on a pipelined request from "
+              "@x%lx#%d.%d[%s/%d](%s%:hs)",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status);
+    else NO_ELSE;
+    METRIC_INCR(server,n_trans);}
+  finish_request(server,req);
+}
+
+/* Whether a pipelining client has a response ready to write, or a
+   frame it can take as another request (called with the server lock
+   held) */
+static int pipeline_ready(struct U8_SERVER *server,u8_client cl)
+{
+  if ((cl->requests)&&(cl->requests->done))
+    return 1;
+  else if (cl->n_requests<server->pipeline_depth)
+    return (find_frame(cl)!=0);
+  else return 0;
+}
+
+/* Called (instead of the servefn) on a pipelining client, this starts
+   requests for the complete frames it can read, as long as the client
+   has fewer than pipeline_depth outstanding, and writes the responses
+   which are ready, returning 1 if it started writing, 0 if there was
+   nothing to write, and -1 on errors. */
+static int pump_client(struct U8_SERVER *server,
+                       struct U8_SERVER_THREAD *st,
+                       u8_client cl)
+{
+  struct U8_CLIENT_SEGMENT segs[U8_CLIENT_MAX_IOV];
+  int found=0, n_segs=0, retval;
+  char statebuf[16];
+  while ((cl->n_requests<server->pipeline_depth)&&
+         ((found=read_frame(cl))>0)) {
+    struct U8_CLIENT_REQUEST *req=new_request(cl);
+    int queued;
+    if (req==NULL) {found=-1; break;}
+    next_frame(cl);
+    u8_lock_mutex(&(server->lock));
+    if (cl->last_request) cl->last_request->next=req;
+    else cl->requests=req;
+    cl->last_request=req;
+    cl->n_requests++; cl->n_inflight++;
+    queued=push_request(server,req);
+    u8_unlock_mutex(&(server->lock));
+    /* When the queue is full, we handle it ourselves */
+    if (!(queued)) run_request(server,st,req);}
+  if (found<0) {
+    if (server->flags&U8_SERVER_LOG_CONNECT)
+      u8_logf(LOG_INFO,"pump_client",
+              "Closing @x%lx#%d.%d[%s/%d](%s%:hs) after %s",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status,
+              ((errno)?(strerror(errno)):
+               (cl->in_fill>cl->in_off)?("an incomplete frame"):
+               ("EOF")));
+    errno=0;
+    /* This waits for the transaction (and any requests) to finish */
+    u8_close_client(cl);
+    return 0;}
+  u8_lock_mutex(&(server->lock));
+  while ((cl->requests)&&(cl->requests->done)&&(n_segs<U8_CLIENT_MAX_IOV)) {
+    struct U8_CLIENT_REQUEST *req=cl->requests;
+    cl->requests=req->next;
+    if (cl->requests==NULL) cl->last_request=NULL;
+    cl->n_requests--;
+    segs[n_segs].data=req->response;
+    segs[n_segs].len=req->response_len;
+    segs[n_segs].freefn=free_request;
+    segs[n_segs].freestate=req;
+    n_segs++;}
+  u8_unlock_mutex(&(server->lock));
+  if (n_segs==0) return 0;
+  else retval=u8_client_writev(cl,segs,n_segs);
+  if (retval<0) {
+    int i=0; while (i<n_segs) {
+      free_request(segs[i].data,segs[i].freestate);
+      i++;}}
+  return retval;
+}
+
+/* Growing the thread pool */
+
+static void *event_loop(void *thread_arg);
+
+/* This is called with the server lock held (or before the server is
+   running) */
+static int start_thread(struct U8_SERVER *server,int slot)
+{
+  struct U8_SERVER_THREAD *u8st=&(server->thread_pool[slot]);
+  u8st->u8st_server=server; u8st->u8st_slotno=slot;
+  u8st->u8st_client=u8st->u8st_threadid=-1;
+  u8st->u8st_queue_head=0;
+  u8st->u8st_sleeping=u8st->u8st_woken=0;
+#ifdef CPU_SET
+  if (server->topology)
+    return place_thread(server,u8st,event_loop);
+#endif
+  u8st->u8st_cpu=u8st->u8st_node=-1;
+  return pthread_create(&(u8st->u8st_thread),
+                        pthread_attr_default,
+                        event_loop,(void *)u8st);
+}
+
+/* Called by the listener before it waits, this adds a thread to a
+   growable pool when tasks have been waiting in the queue longer
+   than server->queue_target on average since the last check. If
+   tasks were waiting and none were taken, all the threads are stuck,
+   so the wait counts as the whole interval. */
+static void check_pool(struct U8_SERVER *server)
+{
+  long long now, interval, qsum; long qcount;
+  int local_loglevel = server->server_loglevel;
+  if (server->min_threads>=server->max_threads) return;
+  now=u8_microtime(); interval=now-server->pool_checked;
+  if (interval<U8_SERVER_POOL_INTERVAL) return;
+  server->pool_checked=now;
+  qsum=__atomic_exchange_n(&(server->pool_qsum),0,__ATOMIC_RELAXED);
+  qcount=__atomic_exchange_n(&(server->pool_qcount),0,__ATOMIC_RELAXED);
+  if (server->n_threads>=server->max_threads) return;
+  else if (qcount>0) {
+    if ((qsum/qcount)<=server->queue_target) return;}
+  else if ((__atomic_load_n(&(server->n_queued),__ATOMIC_RELAXED)==0)||
+           (interval<=server->queue_target))
+    return;
+  else qsum=interval;
+  u8_lock_mutex(&(server->lock));
+  if ((server->n_threads<server->max_threads)&&
+      (((server->flags)&(U8_SERVER_CLOSED|U8_SERVER_CLOSING))==0)) {
+    int slot=server->n_threads;
+    if (start_thread(server,slot)==0) {
+      server->n_threads++;
+      server->n_grown++;
+      u8_logf(LOG_INFO,"check_pool",
+              "Added thread %d, with tasks waiting %lldus on average",
+              slot,((qcount>0)?(qsum/qcount):(qsum)));}
+    else {
+      u8_logf(LOG_WARN,"check_pool","Couldn't add thread %d (%s)",
+              slot,strerror(errno));
+      errno=0;}}
+  u8_unlock_mutex(&(server->lock));
+}
+
+/* The main event loop */
+
+/* Handles a client which has just been taken from a queue, until it
+   finishes a transaction, waits for I/O, or is queued again. This
+   returns 1 if the server is closing. */
+static int run_task(struct U8_SERVER *server,
+                    struct U8_SERVER_THREAD *sthread,
+                    u8_client cl)
+{
+  char statebuf[16];
+  int dobreak=0, result=0, closed=0;
+  u8_utime cur;
+  if ((cl->socket<=0)||((cl->flags)&U8_CLIENT_CLOSED)) {
+    cl->active=0; cl->threadnum=-1; sthread->u8st_client=-1;
+    if (server->xclientfn) server->xclientfn(cl);
+    return 0;}
+  else cur=u8_microtime();
+  int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
+    (server->server_loglevel);
+  if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
+      ((cl->flags)&(U8_CLIENT_LOG_TRANSACT)))
+    u8_logf(LOG_DEBUG,ClientRequest,
+            "Handling activity on @x%lx#%d.%d[%s/%d](%s%:hs)",
+            ((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status);
+  cl->threadnum=sthread->u8st_slotno;
+  sthread->u8st_client=cl->clientid;
+  if ((cl->reading>0)||(cl->writing>0)) {
+    /* We're in the middle of reading or writing a chunk of data,
+       so we try to read/write another chunk. */
+    ssize_t delta;
+    if (cl->off<cl->len) { /* We're not done */
+      delta=client_transfer(cl);
+
+      if (((server->flags)&(U8_SERVER_LOG_TRANSFER))||
+          ((cl->flags)&(U8_CLIENT_LOG_TRANSFER)))
+        u8_logf(LOG_DEBUG,((cl->writing>0)?("Writing"):("Reading")),
+                "%d bytes for @x%lx#%d.%d[%s/%d](%s%:hs) 0x%lx+%d<%d",
+                delta,((unsigned long)cl),cl->clientid,cl->socket,
+                get_client_state(cl,statebuf),
+                cl->n_trans,u8_client_idstring(cl),cl->status,
+                (unsigned long)cl->buf,cl->off,cl->len);
+      if (delta>0) cl->off=cl->off+delta;}
+
+    /* If we've still got data to read/write, we update the poll
+       structure to keep listening and continue in the event loop.  */
+    if (cl->off<cl->len) {
+      /* We clear active before re-arming, because a one-shot
+         event for an active client would be dropped */
+      cl->active=0; sthread->u8st_client=-1; cl->threadnum=-1;
+      if (server->xclientfn) server->xclientfn(cl);
+      resume_client(server,cl);
+      return 0;}
+    else {
+      /* Otherwise, we're done with whatever reading or writing we
+         were doing, so we record stats. */
+      u8_utime now=u8_microtime();
+      if (cl->writing>0) {
+        long long wtime=now-cl->writing;
+        cl->stats.wsum+=wtime;
+        cl->stats.wsum2+=(wtime*wtime);
+        RECORD_LATENCY(cl,U8_LATENCY_WRITE,wtime);
+        if (wtime>cl->stats.wmax) cl->stats.wmax=wtime;
+        cl->stats.wcount++;}
+      else {
+        long long rtime=now-cl->reading;
+        cl->stats.rsum+=rtime;
+        cl->stats.rsum2+=(rtime*rtime);
+        RECORD_LATENCY(cl,U8_LATENCY_READ,rtime);
+        if (rtime>cl->stats.rmax) cl->stats.rmax=rtime;
+        cl->stats.rcount++;}
+      if ((((server->flags)&(U8_SERVER_LOG_TRANSACT))||
+           ((cl->flags)&(U8_CLIENT_LOG_TRANSACT)))&&
+          (cl->len>0))
+        u8_logf(LOG_DEBUG,
+                ((cl->writing>0)?
+                 ("event_loop/write"):
+                 (cl->reading>0)?
+                 ("event_loop/read"):
+                 ("event_loop/weird")),
+                "All %d bytes for @x%lx#%d.%d[%s/%d](%s%:hs) 0x%lx+%d<%d",
+                cl->len,((unsigned long)cl),cl->clientid,cl->socket,
+                get_client_state(cl,statebuf),
+                cl->n_trans,u8_client_idstring(cl),cl->status,
+                (unsigned long)cl->buf,cl->off,cl->len);
+      cl->off=cl->len=0;
+      release_transfer(cl);}
+  }
+  if ((cl->framing)&&(cl->frame_len==0)&&(cl->callback==NULL)&&
+      (cl->coroutine==NULL)&&(!((server->flags)&(U8_SERVER_PIPELINE)))&&
+      (!((cl->flags)&(U8_CLIENT_CLOSED|U8_CLIENT_CLOSING)))) {
+    /* The servefn is only called with a complete frame */
+    int found=read_frame(cl);
+    if (found<=0) {
+      /* So the transaction hasn't really started */
+      if (cl->started>0) {cl->started=0; SERVER_DECR(server->n_busy);}
+      sthread->u8st_client=-1; cl->threadnum=-1;
+      if (server->xclientfn) server->xclientfn(cl);
+      if (found==0) {
+        cl->active=0;
+        resume_client(server,cl);}
+      else {
+        if (server->flags&U8_SERVER_LOG_CONNECT)
+          u8_logf(LOG_INFO,"event_loop/frame",
+                  "Closing @x%lx#%d.%d[%s/%d](%s%:hs) after %s",
+                  ((unsigned long)cl),cl->clientid,cl->socket,
+                  get_client_state(cl,statebuf),
+                  cl->n_trans,u8_client_idstring(cl),cl->status,
+                  ((errno)?(strerror(errno)):
+                   (cl->in_fill>cl->in_off)?("an incomplete frame"):
+                   ("EOF")));
+        errno=0;
+        close_client_core(cl,0,"event_loop/frame");}
+      return 0;}}
+  if ((cl->framing)&&(cl->reading>0)&&(cl->len==0))
+    /* The event loop has read the frame, so the servefn isn't left
+       in the read which started when the client went idle */
+    cl->reading=0;
+  /* Unless there's an I/O error, call the handler */
+  if ((cl->flags)&(U8_CLIENT_CLOSED|U8_CLIENT_CLOSING)) {
+    u8_logf(LOG_WARN,"event_loop/closed",
+            "Client @x%lx#%d.%d[%s/%d] (%s%:hs) asynchronously closed",
+            ((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status);}
+  else if (result>=0) {
+    long long xtime;
+    cl->running=cur=u8_microtime();
+#if U8_USE_COROUTINES
+    if (cl->coroutine) {
+      /* Resume the servefn, which was parked awaiting I/O */
+      if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
+          ((cl->flags)&(U8_CLIENT_LOG_TRANSACT))) {
+        u8_logf(LOG_WARN,"event_loop/resume",
+                "Client @x%lx#%d.%d[%s/%d] (%s%:hs) resuming servefn",
+                ((unsigned long)cl),cl->clientid,cl->socket,
+                get_client_state(cl,statebuf),
+                cl->n_trans,u8_client_idstring(cl),cl->status);}
+      result=run_coroutine(server,sthread,cl);}
+    else
+#endif
+    if (cl->callback) {
+      void *state=cl->cbstate;
+      u8_client_callback callback=cl->callback;
+      cl->callback=NULL; cl->cbstate=NULL;
+      if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
+          ((cl->flags)&(U8_CLIENT_LOG_TRANSACT))) {
+        u8_logf(LOG_WARN,"event_loop/callback",
+                "Client @x%lx#%d.%d[%s/%d] (%s%:hs) callback",
+                ((unsigned long)cl),cl->clientid,cl->socket,
+                get_client_state(cl,statebuf),
+                cl->n_trans,u8_client_idstring(cl),cl->status);}
+      result=callback(cl,state);}
+    else {
+      if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
+          ((cl->flags)&(U8_CLIENT_LOG_TRANSACT))) {
+        u8_logf(LOG_WARN,"event_loop/servefn",
+                "Client @x%lx#%d.%d[%s/%d] (%s%:hs) servefn",
+                ((unsigned long)cl),cl->clientid,cl->socket,
+                get_client_state(cl,statebuf),
+                cl->n_trans,u8_client_idstring(cl),cl->status);}
+      if ((cl->framing)&&((server->flags)&(U8_SERVER_PIPELINE)))
+        result=pump_client(server,sthread,cl);
+#if U8_USE_COROUTINES
+      else if ((server->flags)&(U8_SERVER_COROUTINES))
+        result=run_coroutine(server,sthread,cl);
+#endif
+      else result=server->servefn(cl);}
+    cl->running=0;
+    /* Record execution stats */
+    xtime=u8_microtime()-cur;
+    cl->stats.xsum+=xtime;
+    cl->stats.xsum2+=(xtime*xtime);
+    RECORD_LATENCY(cl,U8_LATENCY_EXEC,xtime);
+    if (xtime>cl->stats.xmax) cl->stats.xmax=xtime;
+    cl->stats.xcount++;}
+  if (result<0) {
+    u8_exception ex=u8_current_exception;
+    u8_logf(LOG_ERR,"event_loop",
+            "Error result from client @x%lx#%d.%d[%s/%d](%s%:hs)",
+            ((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status);
+    /* Counted first, so that the transaction's trace shows it */
+    METRIC_INCR(server,n_errs);
+    cl->n_errs++;
+    if (cl->flags&U8_CLIENT_CLOSED) closed=1;
+    else if (cl->flags&U8_CLIENT_CLOSING) {
+      update_client_stats(cl,u8_microtime(),1);
+      release_buf(cl); cl->off=cl->len=cl->buflen=0;
+      cl->active=0; finish_closing_client(cl); closed=1;}
+    else if (cl->active>0) u8_client_done(cl);
+    else NO_ELSE;
+    if (ex) {
+      u8_logf(LOG_WARN,ClientRequest,
+              "Error during activity on @x%lx#%d.%d[%s/%d](%s%:hs) %s",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status,
+              u8_errstring(ex));
+      u8_clear_errors(1);
+      close_client_core(cl,1,"event_loop/error");
+      closed=1;}
+    else if (cl->framing) next_frame(cl);}
+  else if (result==0) {
+    u8_utime cur=u8_microtime();
+    /* Request is completed */
+    if (((server->flags)&U8_SERVER_LOG_TRANSACT)||
+        ((cl->flags)&U8_CLIENT_LOG_TRANSACT))
+      u8_logf(LOG_DEBUG,ClientRequest,
+              "Completed transaction with @x%lx#%d.%d[%s/%d](%s%:hs)",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status);
+    cl->n_trans++;
+    if (server->flags&U8_SERVER_CLOSED) dobreak=1;
+    if (cl->flags&U8_CLIENT_CLOSED) {
+      u8_logf(LOG_CRIT,Inconsistency,
+              "Result returned from closed client @x%lx#%d.%d[%s/%d](%s%:hs)",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status);
+      if (cl->started>0) {
+        update_client_stats(cl,cur,1);
+        SERVER_DECR(server->n_busy); cl->started=0;}
+      closed=1; release_buf(cl); cl->off=cl->len=cl->buflen=0;}
+    else if (cl->flags&U8_CLIENT_CLOSING) {
+      if (cl->started>0) {
+        update_client_stats(cl,cur,1);
+        SERVER_DECR(server->n_busy); cl->started=0;}
+      release_buf(cl); cl->off=cl->len=cl->buflen=0;
+      cl->active=0; finish_closing_client(cl); closed=1;}
+    else {
+      if (cl->framing) next_frame(cl);
+      if (cl->active>0) u8_client_done(cl);
+      release_buf(cl); cl->off=cl->len=cl->buflen=0;}}
+  else if (((cl->reading>0)||(cl->writing>0))&&
+           ((cl->buf!=NULL)||
+            ((cl->flags)&(U8_CLIENT_SENDFILE|U8_CLIENT_WRITEV)))) {
+    /* The execution function queued some data to read or write.
+       We give it an initial try and push the task (in some cases,
+       the operating system will just take it all and we can finish
+       up. */
+    ssize_t delta;
+    if (server->timers) {
+      /* The read or write timeout may come before the idle one */
+      u8_lock_mutex(&(server->lock));
+      schedule_client(server,cl);
+      u8_unlock_mutex(&(server->lock));}
+    delta=client_transfer(cl);
+    if (((server->flags)&(U8_SERVER_LOG_TRANSFER))||
+        ((cl->flags)&(U8_CLIENT_LOG_TRANSFER)))
+      u8_logf(LOG_DEBUG,((cl->writing>0)?("Writing"):("Reading")),
+              "%d bytes for @x%lx#%d.%d[%s/%d](%s%:hs) 0x%lx+%d<%d",
+              delta,((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status,
+              (unsigned long)(cl->buf),cl->off,cl->len);
+    if (delta>0) cl->off=cl->off+delta;
+    /* If we've still got data to read/write, we continue,
+       otherwise, we fall through */
+    if (cl->off<cl->len) {
+      /* Keep listening, which happens when we release the client
+         below. */}
+    else if ((cl->len>0)&&((cl->writing>0)||(cl->reading>0))) {
+      sthread->u8st_client=-1; cl->threadnum=-1;
+      if (server->xclientfn) server->xclientfn(cl);
+      /* Once it's no longer active, the listener may close (and
+         free) it, so it's requeued under the same lock */
+      u8_lock_mutex(&(server->lock));
+      cl->active=0;
+      if (!(push_task(server,cl,((cl->writing)?("event_loop/w"):("event_loop/r"))))) {
+        /* If we couldn't queue it, let the listener retry it */
+        if (cl->writing>0)
+          listen_for(server,cl,POLLOUT|HUPFLAGS);
+        else listen_for(server,cl,POLLIN|HUPFLAGS);}
+      u8_unlock_mutex(&(server->lock));
+      return 0;}
+    else NO_ELSE;}
+  else {
+    /* Request is not yet completed, but we're not waiting
+       on input or output. */
+    if (((server->flags)&U8_SERVER_LOG_TRANSACT)||
+        ((cl->flags)&U8_CLIENT_LOG_TRANSACT))
+      u8_logf(LOG_INFO,ClientRequest,
+              "Yield during request for @x%lx#%d.%d[%s/%d](%s%:hs)",
+              ((unsigned long)cl),cl->clientid,cl->socket,
+              get_client_state(cl,statebuf),
+              cl->n_trans,u8_client_idstring(cl),cl->status);}
+  sthread->u8st_client=-1;
+  /* A closed client has been freed, and once we start listening
+     again, the listener may close (and free) it at any point, so
+     we're done with it before that. */
+  if (closed) return 0;
+  cl->threadnum=-1;
+  if (server->xclientfn) server->xclientfn(cl);
+  if (cl->active>0) {
+    if (dobreak) {
+      cl->active=0;
+      return 1;}
+    else if ((cl->framing)&&((server->flags)&(U8_SERVER_PIPELINE))&&
+             (cl->started<=0)&&(cl->writing<=0)) {
+      /* A pipelining client is queued again if a response is ready or
+         it can take another frame it has already read. Otherwise, it
+         waits for more input or, if it can't take any more requests,
+         for finish_request() to queue it. */
+      u8_lock_mutex(&(server->lock));
+      cl->active=0;
+      if (pipeline_ready(server,cl)) {
+        if (!(push_task(server,cl,"event_loop/pipeline")))
+          pause_client(server,cl);}
+      else if (cl->n_requests>=server->pipeline_depth)
+        listen_for(server,cl,0);
+      else listen_for(server,cl,POLLIN_EVENTS);
+      u8_unlock_mutex(&(server->lock));}
+    else if ((cl->framing)&&(cl->started<=0)&&(cl->writing<=0)&&
+             (find_frame(cl))) {
+      /* Another frame (or one which is too big) was read along with
+         the last one, so we queue it again (under the lock, as above)
+         rather than waiting for more input */
+      u8_lock_mutex(&(server->lock));
+      cl->active=0;
+      if (!(push_task(server,cl,"event_loop/frame")))
+        pause_client(server,cl);
+      u8_unlock_mutex(&(server->lock));}
+    else {
+      cl->active=0;
+      /* Start listening again (it was stopped by pop_task()), or
+         hand an unfinished transfer to the ring */
+      resume_client(server,cl);}}
+  return 0;
+}
+
 static void *event_loop(void *thread_arg)
 {
-  char statebuf[16];
   struct U8_SERVER_THREAD *sthread=(struct U8_SERVER_THREAD *)thread_arg;
   struct U8_SERVER *server=sthread->u8st_server;
   U8_SET_STACK_BASE();
+  current_worker=sthread;
   if (sthread->u8st_threadid<0)
     sthread->u8st_threadid=u8_threadid();
   /* Check for additional thread init functions */
   while ((server->flags&U8_SERVER_CLOSED) == 0) {
-    u8_client cl; int dobreak=0; int result=0, closed=0;
-    u8_utime cur;
+    u8_client cl;
     /* Check that this thread's init functions are up to date */
     u8_threadcheck();
-    cl=pop_task(server);
-    if (!(cl)) continue;
-    else if ((cl->socket<=0)||((cl->flags)&U8_CLIENT_CLOSED)) {
-      cl->active=0; cl->threadnum=-1; sthread->u8st_client=-1;
-      if (server->xclientfn) server->xclientfn(cl);
-      continue;}
-    else cur=u8_microtime();
-    int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
-      (server->server_loglevel);
-    if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
-        ((cl->flags)&(U8_CLIENT_LOG_TRANSACT)))
-      u8_logf(LOG_DEBUG,ClientRequest,
-              "Handling activity on @x%lx#%d.%d[%s/%d](%s%:hs)",
-              ((unsigned long)cl),cl->clientid,cl->socket,
-              get_client_state(cl,statebuf),
-              cl->n_trans,cl->idstring,cl->status);
-    cl->threadnum=sthread->u8st_slotno;
-    sthread->u8st_client=cl->clientid;
-    if ((cl->reading>0)||(cl->writing>0)) {
-      /* We're in the middle of reading or writing a chunk of data,
-         so we try to read/write another chunk. */
-      ssize_t delta;
-      if (cl->off<cl->len) { /* We're not done */
-        if (cl->writing>0)
-          delta=write(cl->socket,cl->buf+cl->off,cl->len-cl->off);
-        else delta=read(cl->socket,cl->buf+cl->off,cl->len-cl->off);
-
-        if (((server->flags)&(U8_SERVER_LOG_TRANSFER))||
-            ((cl->flags)&(U8_CLIENT_LOG_TRANSFER)))
-          u8_logf(LOG_DEBUG,((cl->writing>0)?("Writing"):("Reading")),
-                  "%d bytes for @x%lx#%d.%d[%s/%d](%s%:hs) 0x%lx+%d<%d",
-                  delta,((unsigned long)cl),cl->clientid,cl->socket,
-                  get_client_state(cl,statebuf),
-                  cl->n_trans,cl->idstring,cl->status,
-                  (unsigned long)cl->buf,cl->off,cl->len);
-        if (delta>0) cl->off=cl->off+delta;}
-
-      /* If we've still got data to read/write, we update the poll
-         structure to keep listening and continue in the event loop.  */
-      if (cl->off<cl->len) {
-        /* u8_lock_mutex(&server->lock); */
-        if (cl->writing>0)
-          server->sockets[cl->clientid].events=((short)(POLLOUT_EVENTS));
-        else server->sockets[cl->clientid].events=((short)(POLLIN_EVENTS));
-        cl->active=0; sthread->u8st_client=-1; cl->threadnum=-1;
-        if (server->xclientfn) server->xclientfn(cl);
-        continue;}
-      else {
-        /* Otherwise, we're done with whatever reading or writing we
-           were doing, so we record stats. */
-        u8_utime now=u8_microtime();
-        if (cl->writing>0) {
-          long long wtime=now-cl->writing;
-          cl->stats.wsum+=wtime;
-          cl->stats.wsum2+=(wtime*wtime);
-          if (wtime>cl->stats.wmax) cl->stats.wmax=wtime;
-          cl->stats.wcount++;}
-        else {
-          long long rtime=now-cl->reading;
-          cl->stats.rsum+=rtime;
-          cl->stats.rsum2+=(rtime*rtime);
-          if (rtime>cl->stats.rmax) cl->stats.rmax=rtime;
-          cl->stats.rcount++;}
-        if ((((server->flags)&(U8_SERVER_LOG_TRANSACT))||
-             ((cl->flags)&(U8_CLIENT_LOG_TRANSACT)))&&
-            (cl->len>0))
-          u8_logf(LOG_DEBUG,
-                  ((cl->writing>0)?
-                   ("event_loop/write"):
-                   (cl->reading>0)?
-                   ("event_loop/read"):
-                   ("event_loop/weird")),
-                  "All %d bytes for @x%lx#%d.%d[%s/%d](%s%:hs) 0x%lx+%d<%d",
-                  cl->len,((unsigned long)cl),cl->clientid,cl->socket,
-                  get_client_state(cl,statebuf),
-                  cl->n_trans,cl->idstring,cl->status,
-                  (unsigned long)cl->buf,cl->off,cl->len);
-        cl->off=cl->len=0;}
-    }
-    /* Unless there's an I/O error, call the handler */
-    if ((cl->flags)&(U8_CLIENT_CLOSED|U8_CLIENT_CLOSING)) {
-      u8_logf(LOG_WARN,"event_loop/closed",
-              "Client @x%lx#%d.%d[%s/%d] (%s%:hs) asynchronously closed",
-              ((unsigned long)cl),cl->clientid,cl->socket,
-              get_client_state(cl,statebuf),
-              cl->n_trans,cl->idstring,cl->status);}
-    else if (result>=0) {
-      long long xtime;
-      cl->running=cur=u8_microtime();
-      if (cl->callback) {
-        void *state=cl->cbstate;
-        u8_client_callback callback=cl->callback;
-        cl->callback=NULL; cl->cbstate=NULL;
-        if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
-            ((cl->flags)&(U8_CLIENT_LOG_TRANSACT))) {
-          u8_logf(LOG_WARN,"event_loop/callback",
-                  "Client @x%lx#%d.%d[%s/%d] (%s%:hs) callback",
-                  ((unsigned long)cl),cl->clientid,cl->socket,
-                  get_client_state(cl,statebuf),
-                  cl->n_trans,cl->idstring,cl->status);}
-        result=callback(cl,state);}
-      else {
-        if (((server->flags)&(U8_SERVER_LOG_TRANSACT))||
-            ((cl->flags)&(U8_CLIENT_LOG_TRANSACT))) {
-          u8_logf(LOG_WARN,"event_loop/servefn",
-                  "Client @x%lx#%d.%d[%s/%d] (%s%:hs) servefn",
-                  ((unsigned long)cl),cl->clientid,cl->socket,
-                  get_client_state(cl,statebuf),
-                  cl->n_trans,cl->idstring,cl->status);}
-        result=server->servefn(cl);}
-      cl->running=0;
-      /* Record execution stats */
-      xtime=u8_microtime()-cur;
-      cl->stats.xsum+=xtime;
-      cl->stats.xsum2+=(xtime*xtime);
-      if (xtime>cl->stats.xmax) cl->stats.xmax=xtime;
-      cl->stats.xcount++;}
-    if (result<0) {
-      u8_exception ex=u8_current_exception;
-      u8_logf(LOG_ERR,"event_loop",
-              "Error result from client @x%lx#%d.%d[%s/%d](%s%:hs)",
-              ((unsigned long)cl),cl->clientid,cl->socket,
-              get_client_state(cl,statebuf),
-              cl->n_trans,cl->idstring,cl->status);
-      if (cl->flags&U8_CLIENT_CLOSED) closed=1;
-      else if (cl->flags&U8_CLIENT_CLOSING) {
-        update_client_stats(cl,u8_microtime(),1);
-        cl->active=0; finish_closing_client(cl); closed=1;
-        if ((cl->buf)&&(cl->ownsbuf)) u8_free(cl->buf);
-        cl->buf=NULL; cl->off=cl->len=cl->buflen=0; cl->ownsbuf=0;}
-      else if (cl->active>0) u8_client_done(cl);
-      else NO_ELSE;
-      if (ex) {
-        u8_logf(LOG_WARN,ClientRequest,
-                "Error during activity on @x%lx#%d.%d[%s/%d](%s%:hs) %s",
-                ((unsigned long)cl),cl->clientid,cl->socket,
-                get_client_state(cl,statebuf),
-                cl->n_trans,cl->idstring,cl->status,
-                u8_errstring(ex));
-        u8_clear_errors(1);
-        close_client_core(cl,1,"event_loop/error");
-        closed=1;}
-      cl->n_errs++;}
-    else if (result==0) {
-      u8_utime cur=u8_microtime();
-      /* Request is completed */
-      if (((server->flags)&U8_SERVER_LOG_TRANSACT)||
-          ((cl->flags)&U8_CLIENT_LOG_TRANSACT))
-        u8_logf(LOG_DEBUG,ClientRequest,
-                "Completed transaction with @x%lx#%d.%d[%s/%d](%s%:hs)",
-                ((unsigned long)cl),cl->clientid,cl->socket,
-                get_client_state(cl,statebuf),
-                cl->n_trans,cl->idstring,cl->status);
-      cl->n_trans++;
-      if (server->flags&U8_SERVER_CLOSED) dobreak=1;
-      if (cl->flags&U8_CLIENT_CLOSED) {
-        u8_logf(LOG_CRIT,Inconsistency,
-                "Result returned from closed client @x%lx#%d.%d[%s/%d](%s%:hs)",
-                ((unsigned long)cl),cl->clientid,cl->socket,
-                get_client_state(cl,statebuf),
-                cl->n_trans,cl->idstring,cl->status);
-        if (cl->started>0) {
-          update_client_stats(cl,cur,1);
-          server->n_busy--; cl->started=0;}
-        closed=1; if ((cl->buf)&&(cl->ownsbuf)) u8_free(cl->buf);
-        cl->buf=NULL; cl->off=cl->len=cl->buflen=0; cl->ownsbuf=0;}
-      else if (cl->flags&U8_CLIENT_CLOSING) {
-        if (cl->started>0) {
-          update_client_stats(cl,cur,1);
-          server->n_busy--; cl->started=0;}
-        cl->active=0; finish_closing_client(cl); closed=1;
-        if ((cl->buf)&&(cl->ownsbuf)) u8_free(cl->buf);
-        cl->buf=NULL; cl->off=cl->len=cl->buflen=0; cl->ownsbuf=0;}
-      else {
-        if (cl->active>0) u8_client_done(cl);
-        if ((cl->buf)&&(cl->ownsbuf)) u8_free(cl->buf);
-        cl->buf=NULL; cl->off=cl->len=cl->buflen=0; cl->ownsbuf=0;}}
-    else if (((cl->reading>0)||(cl->writing>0))&&(cl->buf!=NULL)) {
-      /* The execution function queued some data to read or write.
-         We give it an initial try and push the task (in some cases,
-         the operating system will just take it all and we can finish
-         up. */
-      ssize_t delta;
-      if (cl->writing>0)
-        delta=write(cl->socket,cl->buf+cl->off,((size_t)(cl->len-cl->off)));
-      else delta=read(cl->socket,cl->buf+cl->off,((size_t)(cl->len-cl->off)));
-      if (((server->flags)&(U8_SERVER_LOG_TRANSFER))||
-          ((cl->flags)&(U8_CLIENT_LOG_TRANSFER)))
-        u8_logf(LOG_DEBUG,((cl->writing>0)?("Writing"):("Reading")),
-                "%d bytes for @x%lx#%d.%d[%s/%d](%s%:hs) 0x%lx+%d<%d",
-                delta,((unsigned long)cl),cl->clientid,cl->socket,
-                get_client_state(cl,statebuf),
-                cl->n_trans,cl->idstring,cl->status,
-                (unsigned long)(cl->buf),cl->off,cl->len);
-      if (delta>0) cl->off=cl->off+delta;
-      /* If we've still got data to read/write, we continue,
-         otherwise, we fall through */
-      if (cl->off<cl->len) {
-        /* Keep listening */
-        if (cl->writing>0)
-          server->sockets[cl->clientid].events=((short)(POLLOUT|HUPFLAGS));
-        else server->sockets[cl->clientid].events=((short)(POLLIN|HUPFLAGS));}
-      else if ((cl->len>0)&&((cl->writing>0)||(cl->reading>0))) {
-        int cid=cl->clientid;
-        cl->active=0;
-        if (cl->writing>0)
-          server->sockets[cid].events=((short)(POLLOUT|HUPFLAGS));
-        else server->sockets[cid].events=((short)(POLLIN|HUPFLAGS));
-        sthread->u8st_client=-1; cl->threadnum=-1;
-        u8_push_task(server,cl,((cl->writing)?("event_loop/w"):("event_loop/r")));
-        if (server->xclientfn) server->xclientfn(cl);
-        continue;}
-      else NO_ELSE;}
-    else {
-      /* Request is not yet completed, but we're not waiting
-         on input or output. */
-      if (((server->flags)&U8_SERVER_LOG_TRANSACT)||
-          ((cl->flags)&U8_CLIENT_LOG_TRANSACT))
-        u8_logf(LOG_INFO,ClientRequest,
-                "Yield during request for @x%lx#%d.%d[%s/%d](%s%:hs)",
-                ((unsigned long)cl),cl->clientid,cl->socket,
-                get_client_state(cl,statebuf),
-                cl->n_trans,cl->idstring,cl->status);}
-    if (cl->active>0) {
-      cl->active=0;
-      if (dobreak) break;
-      if (!(closed)) {
-        /* Start listening again (it was stopped by pop_task() */
-        if (cl->writing>0)
-          server->sockets[cl->clientid].events=((short)(POLLOUT|HUPFLAGS));
-        else server->sockets[cl->clientid].events=((short)(POLLIN|HUPFLAGS));}}
-    sthread->u8st_client=-1; cl->threadnum=-1;
-    if (server->xclientfn) server->xclientfn(cl);}
+    cl=pop_task(server,sthread);
+    if (!(cl)) {
+      /* pop_task() clears current_worker when the thread retires */
+      if (current_worker==NULL) break;
+      /* do_shutdown() waits for us to exit */
+      else if ((server->flags)&(U8_SERVER_CLOSED|U8_SERVER_CLOSING)) break;
+      else continue;}
+    else if (run_task(server,sthread,cl)) break;}
+#if U8_USE_COROUTINES
+  /* A retired thread has already freed them, and its slot may
+     have been given to another thread */
+  if (current_worker) free_coroutines(sthread);
+#endif
   u8_threadexit();
   return NULL;
 }
 
+/* With U8_SERVER_INLINE, the listener runs the clients it has queued
+   (on its own queue) after each pass, including those queued again
+   because their reads or writes finished right away. */
+static void run_inline(struct U8_SERVER *server)
+{
+  struct U8_SERVER_THREAD *st=&(server->thread_pool[0]);
+  u8_client cl;
+  if (current_worker!=st) {
+    current_worker=st;
+    st->u8st_threadid=u8_threadid();}
+  while ((server->flags&U8_SERVER_CLOSED)==0) {
+    u8_threadcheck();
+    cl=find_task(server,st);
+    if (cl==NULL) break;
+    else cl=start_task(server,st,cl);
+    if ((cl)&&(run_task(server,st,cl))) break;}
+}
+
+#else
+static int check_paused(struct U8_SERVER *server)
+{
+  return server->poll_timeout;
+}
+static void check_pool(struct U8_SERVER *server)
+{
+}
+static void run_inline(struct U8_SERVER *server)
+{
+}
 #endif
 
 /* Creating/initializing servers */
@@ -971,6 +3032,13 @@ struct U8_SERVER *u8_init_server
   int flags=0, init_clients=DEFAULT_INIT_CLIENTS, n_threads=DEFAULT_NTHREADS;
   int max_backlog=MAX_BACKLOG, max_queue=DEFAULT_MAX_QUEUE;
   int  max_clients=DEFAULT_MAX_CLIENTS, timeout=DEFAULT_TIMEOUT;
+  int n_shards=0, overload=0;
+  int idle_timeout=0, read_timeout=0, write_timeout=0;
+  int min_threads=-1, max_threads=-1, queue_target=DEFAULT_QUEUE_TARGET;
+  int thread_idle=DEFAULT_THREAD_IDLE, pool_size=DEFAULT_POOL_SIZE;
+  int stack_size=DEFAULT_STACK_SIZE, pipeline_depth=DEFAULT_PIPELINE_DEPTH;
+  int affinity=U8_AFFINITY_NONE; const char *cpus=NULL;
+  int trace_size=0, trace_threshold=0;
   va_list args; int prop;
   if (server==NULL) server=u8_alloc(struct U8_SERVER);
   memset(server,0,sizeof(struct U8_SERVER));
@@ -991,6 +3059,38 @@ struct U8_SERVER *u8_init_server
       max_backlog=(va_arg(args,int)); continue;
     case U8_SERVER_TIMEOUT:
       timeout=(va_arg(args,int)); continue;
+    case U8_SERVER_SHARDS:
+      n_shards=(va_arg(args,int)); continue;
+    case U8_SERVER_OVERLOAD:
+      overload=(va_arg(args,int)); continue;
+    case U8_SERVER_IDLE_TIMEOUT:
+      idle_timeout=(va_arg(args,int)); continue;
+    case U8_SERVER_READ_TIMEOUT:
+      read_timeout=(va_arg(args,int)); continue;
+    case U8_SERVER_WRITE_TIMEOUT:
+      write_timeout=(va_arg(args,int)); continue;
+    case U8_SERVER_MIN_THREADS:
+      min_threads=(va_arg(args,int)); continue;
+    case U8_SERVER_MAX_THREADS:
+      max_threads=(va_arg(args,int)); continue;
+    case U8_SERVER_QUEUE_TARGET:
+      queue_target=(va_arg(args,int)); continue;
+    case U8_SERVER_THREAD_IDLE:
+      thread_idle=(va_arg(args,int)); continue;
+    case U8_SERVER_POOL_SIZE:
+      pool_size=(va_arg(args,int)); continue;
+    case U8_SERVER_STACK_SIZE:
+      stack_size=(va_arg(args,int)); continue;
+    case U8_SERVER_PIPELINE_DEPTH:
+      pipeline_depth=(va_arg(args,int)); continue;
+    case U8_SERVER_AFFINITY:
+      affinity=(va_arg(args,int)); continue;
+    case U8_SERVER_CPUS:
+      cpus=(va_arg(args,const char *)); continue;
+    case U8_SERVER_TRACE:
+      trace_size=(va_arg(args,int)); continue;
+    case U8_SERVER_TRACE_THRESHOLD:
+      trace_threshold=(va_arg(args,int)); continue;
     case U8_SERVER_LOGLEVEL: {
       int level=(va_arg(args,int));
       if (level>3) flags|=U8_SERVER_LOG_TRANSFER;
@@ -1004,6 +3104,69 @@ struct U8_SERVER *u8_init_server
               "Unknown property code %d for server",prop);
       continue;}}
   va_end(args);
+  server->overload=overload;
+  server->idle_timeout=idle_timeout;
+  server->read_timeout=read_timeout;
+  server->write_timeout=write_timeout;
+  server->stack_size=((stack_size>0)?(stack_size):(DEFAULT_STACK_SIZE));
+#if (!(U8_USE_COROUTINES))
+  if (flags&U8_SERVER_COROUTINES) {
+    u8_logf(LOG_WARN,"u8_init_server",
+            "Coroutines aren't available, so servefns will block on I/O");
+    flags&=~U8_SERVER_COROUTINES;}
+#endif
+  server->pipeline_depth=
+    ((pipeline_depth>0)?(pipeline_depth):(DEFAULT_PIPELINE_DEPTH));
+#if (!(U8_THREADS_ENABLED))
+  if (flags&U8_SERVER_PIPELINE) {
+    u8_logf(LOG_WARN,"u8_init_server",
+            "Pipelining needs threads, so it's turned off");
+    flags&=~U8_SERVER_PIPELINE;}
+#endif
+  /* Without bounds, the pool stays at n_threads */
+  if (n_threads<=0) n_threads=1;
+  if (min_threads<=0) min_threads=n_threads;
+  if (max_threads<min_threads) max_threads=min_threads;
+  if (n_threads<min_threads) n_threads=min_threads;
+  else if (n_threads>max_threads) n_threads=max_threads;
+  if (thread_idle<=0) thread_idle=DEFAULT_THREAD_IDLE;
+  server->min_threads=min_threads;
+  server->max_threads=max_threads;
+  server->queue_target=queue_target;
+  server->thread_idle=thread_idle;
+  /* The listener is the only thread */
+  if (flags&U8_SERVER_INLINE)
+    n_threads=server->min_threads=server->max_threads=max_threads=1;
+  /* Run-to-completion shards each keep to their own CPU */
+  if ((n_shards>1)&&(flags&U8_SERVER_INLINE)&&
+      (affinity==U8_AFFINITY_NONE)&&(cpus==NULL))
+    affinity=U8_AFFINITY_CPU;
+  server->affinity=affinity;
+  if (trace_size>0)
+    server->trace=new_trace_ring(trace_size,((long long)trace_threshold)*1000);
+  if ((affinity!=U8_AFFINITY_NONE)||(cpus)) {
+#if ((U8_THREADS_ENABLED) && (defined(CPU_SET)))
+    server->topology=get_topology(cpus);
+    /* One shard per node, unless told otherwise */
+    if ((server->topology)&&(affinity==U8_AFFINITY_NODE)&&(n_shards==0))
+      n_shards=server->topology->n_nodes;
+#else
+    u8_logf(LOG_WARN,"u8_init_server",
+            "Threads can't be placed on particular CPUs here");
+#endif
+  }
+
+  if (n_shards>1) {
+#if ((U8_THREADS_ENABLED) && (defined(SO_REUSEPORT)))
+    return init_shards(server,n_shards,acceptfn,servefn,donefn,closefn,
+                       flags,n_threads,init_clients,max_queue,max_clients,
+                       max_backlog,timeout,pool_size);
+#else
+    u8_logf(LOG_WARN,"u8_init_server",
+            "SO_REUSEPORT isn't available, so not using %d shards",
+            n_shards);
+#endif
+  }
 
   if (init_clients<=0) init_clients=1;
   server->serverid=NULL;
@@ -1019,7 +3182,32 @@ struct U8_SERVER *u8_init_server
   server->clients_len=init_clients;
   server->sockets=u8_alloc_n(init_clients,struct pollfd);
   memset(server->sockets,0,sizeof(struct pollfd)*init_clients);
-  server->free_slot=server->max_slot=0;
+  server->free_slots=u8_alloc_n(init_clients,int);
+  server->n_free_slots=server->max_slot=0;
+  if ((idle_timeout>0)||(read_timeout>0)||(write_timeout>0))
+    server->timers=new_timer_wheel();
+  if (pool_size>0)
+    server->client_pool=new_client_pool(pool_size);
+  server->epoll_fd=-1;
+  if (flags&U8_SERVER_EPOLL) {
+#if U8_USE_EPOLL
+#ifdef EPOLL_CLOEXEC
+    server->epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+#else
+    server->epoll_fd=epoll_create(init_clients);
+#endif
+    if (server->epoll_fd<0) {
+      u8_logf(LOG_WARN,"u8_init_server",
+              "Couldn't create epoll set (%s), using poll() instead",
+              strerror(errno));
+      errno=0;
+      server->flags&=~U8_SERVER_EPOLL;}
+#else
+    u8_logf(LOG_WARN,"u8_init_server",
+            "epoll isn't available, using poll() instead");
+    server->flags&=~U8_SERVER_EPOLL;
+#endif
+  }
   server->poll_timeout=timeout;
   server->max_backlog=((max_backlog<=0) ? (MAX_BACKLOG) : (max_backlog));
   server->acceptfn=acceptfn;
@@ -1031,27 +3219,434 @@ struct U8_SERVER *u8_init_server
   u8_init_mutex(&(server->lock));
   u8_init_condvar(&(server->empty)); u8_init_condvar(&(server->full));
   server->n_threads=n_threads;
-  server->queue=u8_alloc_n(max_queue,u8_client);
+  if (max_queue<=0) max_queue=DEFAULT_MAX_QUEUE;
   server->n_queued=0; server->max_queued=max_queue;
-  server->queue_head=0; server->queue_tail=0; server->queue_len=max_queue;
-  server->thread_pool=u8_alloc_n(n_threads,struct U8_SERVER_THREAD);
-  memset(server->queue,0,sizeof(u8_client)*max_queue);
-  memset(server->thread_pool,0,sizeof(struct U8_SERVER_THREAD)*n_threads);
+  server->next_thread=0;
+  server->pool_checked=u8_microtime();
+  /* There's a slot for every thread the pool might grow to */
+  server->thread_pool=u8_alloc_n(max_threads,struct U8_SERVER_THREAD);
+  memset(server->thread_pool,0,sizeof(struct U8_SERVER_THREAD)*max_threads);
+  i=0; while (i < max_threads) {
+    /* Set up all the queues before any thread can look at them */
+    struct U8_SERVER_THREAD *u8st=&(server->thread_pool[i++]);
+    u8_init_mutex(&(u8st->u8st_lock));
+    u8_init_condvar(&(u8st->u8st_wakeup));
+    u8st->u8st_queue=u8_alloc_n(max_queue,u8_client);
+    memset(u8st->u8st_queue,0,sizeof(u8_client)*max_queue);
+    u8st->u8st_queue_len=max_queue;}
   server->n_trans=0; /* Transaction count */
   server->n_accepted=0; /* Accept count (new clients) */
-  i=0; while (i < n_threads) {
-    struct U8_SERVER_THREAD *u8st=&(server->thread_pool[i]);
-    u8st->u8st_server=server; u8st->u8st_slotno=i;
+  if (flags&U8_SERVER_INLINE) {
+    /* The listener uses the first slot itself */
+    struct U8_SERVER_THREAD *u8st=&(server->thread_pool[0]);
+    u8st->u8st_server=server; u8st->u8st_slotno=0;
     u8st->u8st_client=u8st->u8st_threadid=-1;
-    pthread_create(&(u8st->u8st_thread),
-                   pthread_attr_default,
-                   event_loop,(void *)u8st);
+    u8st->u8st_cpu=u8st->u8st_node=-1;}
+  else {
+    i=0; while (i < n_threads) start_thread(server,i++);}
+#endif
+  server->uring=NULL;
+  if ((flags&U8_SERVER_IO_URING)&&(flags&U8_SERVER_INLINE)) {
+    /* The ring's completions would have to be handed to the listener */
+    u8_logf(LOG_WARN,"u8_init_server",
+            "Not using io_uring for a U8_SERVER_INLINE server");
+    server->flags&=~U8_SERVER_IO_URING;}
+  else if (flags&U8_SERVER_IO_URING) {
+#if U8_USE_IO_URING
+    if (open_uring(server,U8_SERVER_URING_ENTRIES)==NULL) {
+      u8_logf(LOG_WARN,"u8_init_server",
+              "Couldn't set up io_uring (%s), using plain reads/writes",
+              strerror(errno));
+      errno=0;
+      server->flags&=~U8_SERVER_IO_URING;}
+#else
+    u8_logf(LOG_WARN,"u8_init_server",
+            "io_uring isn't available, using plain reads/writes");
+    server->flags&=~U8_SERVER_IO_URING;
+#endif
+  }
+
+  return server;
+}
+
+/* Thread placement */
+
+/* With U8_SERVER_AFFINITY or U8_SERVER_CPUS, the server's topology
+   lists the CPUs its threads can use (the U8_SERVER_CPUS list, or
+   else those the process could run on when the server was made) and
+   the NUMA node of each (from /sys/devices/system/node). Threads are
+   placed by number, the listener being 0 and each pool thread
+   following its slot: with U8_AFFINITY_CPU, each is pinned to the
+   next CPU; with U8_AFFINITY_NODE, each is kept to the CPUs of the
+   next node; and otherwise, all of them are kept to the whole list.
+   Pool threads are created in place; the listener places itself when
+   it starts. */
+
+#if ((U8_THREADS_ENABLED) && (defined(CPU_SET)))
+/* Parses a list of CPUs (like "0-3,8,10-11"), returning how many it
+   names or -1 if it's malformed */
+static int parse_cpulist(const char *spec,int *cpus,int max)
+{
+  const char *scan=spec; int n=0;
+  while (*scan) {
+    char *end; long from, to;
+    if ((*scan==',')||(*scan==' ')||(*scan=='\t')||(*scan=='\n')) {
+      scan++; continue;}
+    from=to=strtol(scan,&end,10);
+    if ((end==scan)||(from<0)) return -1;
+    else if (*end=='-') {
+      scan=end+1; to=strtol(scan,&end,10);
+      if ((end==scan)||(to<from)) return -1;}
+    else NO_ELSE;
+    if (to>=CPU_SETSIZE) return -1;
+    while ((from<=to)&&(n<max)) cpus[n++]=from++;
+    scan=end;}
+  return n;
+}
+
+/* Fills in the node of each of the topology's CPUs (which stay on
+   node 0 if there's no NUMA information) and the list of nodes */
+static void get_cpu_nodes(struct U8_SERVER_TOPOLOGY *topo)
+{
+  int i=0;
+#if HAVE_DIRENT_H
+  int *node_cpus=u8_alloc_n(CPU_SETSIZE,int);
+  DIR *dir=opendir("/sys/devices/system/node");
+  struct dirent *entry;
+  while ((dir)&&((entry=readdir(dir)))) {
+    char path[64], buf[1024]; FILE *f;
+    int node, n, j=0;
+    if ((strncmp(entry->d_name,"node",4))||
+        (entry->d_name[4]<'0')||(entry->d_name[4]>'9'))
+      continue;
+    node=atoi(entry->d_name+4);
+    sprintf(path,"/sys/devices/system/node/node%d/cpulist",node);
+    if ((f=fopen(path,"r"))==NULL) continue;
+    if (fgets(buf,sizeof(buf),f)==NULL) buf[0]='\0';
+    fclose(f);
+    n=parse_cpulist(buf,node_cpus,CPU_SETSIZE);
+    while (j<n) {
+      int k=0; while (k<topo->n_cpus) {
+        if (topo->cpus[k]==node_cpus[j]) topo->cpu_nodes[k]=node;
+        k++;}
+      j++;}}
+  if (dir) closedir(dir);
+  u8_free(node_cpus);
+#endif
+  while (i<topo->n_cpus) {
+    int node=topo->cpu_nodes[i++], j=0;
+    while ((j<topo->n_nodes)&&(topo->nodes[j]!=node)) j++;
+    if (j==topo->n_nodes) topo->nodes[topo->n_nodes++]=node;}
+}
+
+static struct U8_SERVER_TOPOLOGY *get_topology(const char *spec)
+{
+  struct U8_SERVER_TOPOLOGY *topo;
+  int *cpus=u8_alloc_n(CPU_SETSIZE,int), n_cpus=0;
+  if (spec) n_cpus=parse_cpulist(spec,cpus,CPU_SETSIZE);
+  else {
+    cpu_set_t allowed; int i=0;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0,sizeof(allowed),&allowed)==0)
+      while (i<CPU_SETSIZE) {
+        if (CPU_ISSET(i,&allowed)) cpus[n_cpus++]=i;
+        i++;}}
+  if (n_cpus<=0) {
+    u8_logf(LOG_WARN,"u8_init_server",
+            "Couldn't get the CPUs to place threads on from %s",
+            ((spec)?(spec):("sched_getaffinity()")));
+    u8_free(cpus);
+    return NULL;}
+  topo=u8_alloc(struct U8_SERVER_TOPOLOGY);
+  memset(topo,0,sizeof(struct U8_SERVER_TOPOLOGY));
+  topo->cpus=cpus; topo->n_cpus=n_cpus;
+  topo->cpu_nodes=u8_alloc_n(n_cpus,int);
+  memset(topo->cpu_nodes,0,sizeof(int)*n_cpus);
+  topo->nodes=u8_alloc_n(n_cpus,int);
+  topo->listener_cpu=topo->listener_node=-1;
+  get_cpu_nodes(topo);
+  return topo;
+}
+
+static void free_topology(struct U8_SERVER_TOPOLOGY *topo)
+{
+  u8_free(topo->cpus); u8_free(topo->cpu_nodes); u8_free(topo->nodes);
+  u8_free(topo);
+}
+
+/* Gets the CPUs the nth thread is kept to, along with the CPU and
+   node it's on (or -1 if it isn't kept to just one) */
+static void thread_placement(struct U8_SERVER *server,int n,
+                             cpu_set_t *set,int *cpup,int *nodep)
+{
+  struct U8_SERVER_TOPOLOGY *topo=server->topology;
+  int i=0, cpu=-1, node=-1;
+  CPU_ZERO(set);
+  if (server->affinity==U8_AFFINITY_CPU) {
+    i=n%(topo->n_cpus);
+    cpu=topo->cpus[i]; node=topo->cpu_nodes[i];
+    CPU_SET(cpu,set);}
+  else {
+    if (server->affinity==U8_AFFINITY_NODE)
+      node=topo->nodes[n%(topo->n_nodes)];
+    else if (topo->n_nodes==1)
+      node=topo->nodes[0];
+    else NO_ELSE;
+    while (i<topo->n_cpus) {
+      if ((server->affinity!=U8_AFFINITY_NODE)||
+          (topo->cpu_nodes[i]==node))
+        CPU_SET(topo->cpus[i],set);
+      i++;}}
+  *cpup=cpu; *nodep=node;
+}
+
+/* Creates a pool thread in its place */
+static int place_thread(struct U8_SERVER *server,
+                        struct U8_SERVER_THREAD *u8st,
+                        void *(*fn)(void *))
+{
+  cpu_set_t set; pthread_attr_t attr; int retval;
+  thread_placement(server,u8st->u8st_slotno+1,&set,
+                   &(u8st->u8st_cpu),&(u8st->u8st_node));
+  pthread_attr_init(&attr);
+  pthread_attr_setaffinity_np(&attr,sizeof(set),&set);
+  retval=pthread_create(&(u8st->u8st_thread),&attr,fn,(void *)u8st);
+  pthread_attr_destroy(&attr);
+  if (retval) {
+    /* Probably CPUs we aren't allowed to use, so let it run anywhere */
+    u8_logf(LOG_WARN,"u8_init_server",
+            "Couldn't place thread %d (%s)",u8st->u8st_slotno,
+            strerror(retval));
+    u8st->u8st_cpu=u8st->u8st_node=-1;
+    retval=pthread_create(&(u8st->u8st_thread),pthread_attr_default,
+                          fn,(void *)u8st);}
+  return retval;
+}
+
+/* Keeps the calling thread, which is about to run the server's
+   listener loop, to its place */
+static void place_listener(struct U8_SERVER *server)
+{
+  struct U8_SERVER_TOPOLOGY *topo=server->topology;
+  cpu_set_t set; int retval;
+  thread_placement(server,0,&set,&(topo->listener_cpu),&(topo->listener_node));
+  if ((retval=pthread_setaffinity_np(pthread_self(),sizeof(set),&set)))
+    u8_logf(LOG_WARN,"u8_server_loop",
+            "Couldn't place the listener thread (%s)",strerror(retval));
+  if (server->flags&U8_SERVER_INLINE) {
+    /* The listener is also the pool's only thread */
+    server->thread_pool[0].u8st_cpu=topo->listener_cpu;
+    server->thread_pool[0].u8st_node=topo->listener_node;}
+}
+
+/* Makes the list of CPUs (given to U8_SERVER_CPUS) for one of a
+   server's shards: with U8_AFFINITY_NODE, the CPUs of a node; with
+   U8_AFFINITY_CPU, a share of the CPUs; and otherwise, all of them */
+static u8_string shard_cpus(struct U8_SERVER *server,int shard,int n_shards)
+{
+  struct U8_SERVER_TOPOLOGY *topo=server->topology;
+  struct U8_OUTPUT out;
+  int i, from=0, to=topo->n_cpus, node=-1;
+  U8_INIT_STATIC_OUTPUT(out,64);
+  if (server->affinity==U8_AFFINITY_NODE)
+    node=topo->nodes[shard%(topo->n_nodes)];
+  else if ((server->affinity==U8_AFFINITY_CPU)&&(topo->n_cpus<n_shards)) {
+    from=shard%(topo->n_cpus); to=from+1;}
+  else if (server->affinity==U8_AFFINITY_CPU) {
+    from=(shard*topo->n_cpus)/n_shards;
+    to=((shard+1)*topo->n_cpus)/n_shards;}
+  else NO_ELSE;
+  i=from; while (i<to) {
+    if ((node<0)||(topo->cpu_nodes[i]==node))
+      u8_printf(&out,"%s%d",((u8_outbuf_len(&out)>0)?(","):("")),
+                topo->cpus[i]);
     i++;}
+  return out.u8_outbuf;
+}
+
+static void output_place(struct U8_OUTPUT *out,u8_string sep,
+                         int cpu,int node)
+{
+  if (cpu>=0) u8_printf(out,"%sc%d",sep,cpu);
+  else if (node>=0) u8_printf(out,"%sn%d",sep,node);
+  else u8_printf(out,"%s*",sep);
+}
+
+/* Describes where a server's (or each shard's) threads are, as a
+   group for each shard starting with its listener, with "c" and a
+   CPU number for a pinned thread, "n" and a node number for a thread
+   kept to a node, and "*" otherwise */
+static void output_placement(struct U8_OUTPUT *out,struct U8_SERVER *server)
+{
+  static u8_string policies[]={"none","cpu","node"};
+  struct U8_SERVER *shards=server->shards;
+  struct U8_SERVER_TOPOLOGY *topo=server->topology;
+  int i=0, n_shards=((shards)?(server->n_shards):(1));
+  if (topo==NULL) return;
+  u8_printf(out," Affinity: %s over %d CPUs on %d nodes",
+            policies[server->affinity%3],topo->n_cpus,topo->n_nodes);
+  while (i<n_shards) {
+    struct U8_SERVER *s=((shards)?(&(shards[i])):(server));
+    int j=0, n_threads=((s->flags&U8_SERVER_INLINE)?(0):(s->n_threads));
+    i++;
+    if (s->topology==NULL) continue;
+    output_place(out," (",s->topology->listener_cpu,
+                 s->topology->listener_node);
+    while (j<n_threads) {
+      struct U8_SERVER_THREAD *st=&(s->thread_pool[j++]);
+      output_place(out," ",st->u8st_cpu,st->u8st_node);}
+    u8_putc(out,')');}
+  u8_putc(out,';');
+}
+#else
+static void output_placement(struct U8_OUTPUT *out,struct U8_SERVER *server)
+{
+}
 #endif
 
+/* Sharded servers */
+
+/* With U8_SERVER_SHARDS, the server is just a front for a number of
+   complete servers (shards). Each shard has its own listening
+   sockets (bound to the same addresses with SO_REUSEPORT, so that
+   the kernel spreads new connections among them), its own clients,
+   lock and threads, and its own listener loop. The threads are
+   divided among the shards. */
+
+#if U8_THREADS_ENABLED
+static struct U8_SERVER *init_shards
+  (struct U8_SERVER *server,int n_shards,
+   u8_client (*acceptfn)(u8_server,u8_socket,struct sockaddr *,size_t),
+   int (*servefn)(u8_client),int (*donefn)(u8_client),
+   int (*closefn)(u8_client),int flags,int n_threads,int init_clients,
+   int max_queue,int max_clients,int max_backlog,int timeout,
+   int pool_size)
+{
+  int i=0, shard_threads=n_threads/n_shards;
+  int shard_min=server->min_threads/n_shards;
+  int shard_max=server->max_threads/n_shards;
+  if (shard_threads<1) shard_threads=1;
+  if (shard_min<1) shard_min=1;
+  if (shard_max<shard_min) shard_max=shard_min;
+  server->flags=flags;
+  server->init_clients=init_clients;
+  server->max_clients=max_clients;
+  server->epoll_fd=-1;
+  server->uring=NULL;
+  server->poll_timeout=timeout;
+  server->max_backlog=((max_backlog<=0) ? (MAX_BACKLOG) : (max_backlog));
+  server->acceptfn=acceptfn;
+  server->servefn=servefn;
+  server->closefn=closefn;
+  server->donefn=donefn;
+  server->server_loglevel = -1;
+  server->n_threads=shard_threads*n_shards;
+  server->max_queued=max_queue*n_shards;
+  u8_init_mutex(&(server->lock));
+  u8_init_condvar(&(server->empty)); u8_init_condvar(&(server->full));
+  server->shards=u8_alloc_n(n_shards,struct U8_SERVER);
+  server->n_shards=n_shards;
+  while (i<n_shards) {
+    struct U8_SERVER *shard=&(server->shards[i]);
+    u8_string cpus=NULL;
+#ifdef CPU_SET
+    if (server->topology) cpus=shard_cpus(server,i,n_shards);
+#endif
+    i++;
+    u8_init_server(shard,acceptfn,servefn,donefn,closefn,
+                   U8_SERVER_FLAGS,flags,
+                   U8_SERVER_NTHREADS,shard_threads,
+                   U8_SERVER_INIT_CLIENTS,init_clients,
+                   U8_SERVER_MAX_QUEUE,max_queue,
+                   U8_SERVER_MAX_CLIENTS,max_clients,
+                   U8_SERVER_BACKLOG,max_backlog,
+                   U8_SERVER_TIMEOUT,timeout,
+                   U8_SERVER_OVERLOAD,server->overload,
+                   U8_SERVER_IDLE_TIMEOUT,(int)server->idle_timeout,
+                   U8_SERVER_READ_TIMEOUT,(int)server->read_timeout,
+                   U8_SERVER_WRITE_TIMEOUT,(int)server->write_timeout,
+                   U8_SERVER_MIN_THREADS,shard_min,
+                   U8_SERVER_MAX_THREADS,shard_max,
+                   U8_SERVER_QUEUE_TARGET,(int)server->queue_target,
+                   U8_SERVER_THREAD_IDLE,(int)server->thread_idle,
+                   U8_SERVER_POOL_SIZE,pool_size,
+                   U8_SERVER_STACK_SIZE,(int)server->stack_size,
+                   U8_SERVER_PIPELINE_DEPTH,server->pipeline_depth,
+                   U8_SERVER_AFFINITY,server->affinity,
+                   U8_SERVER_CPUS,cpus,
+                   U8_SERVER_END_INIT);
+    if (cpus) u8_free(cpus);
+    /* The shards all write to the same trace ring */
+    shard->trace=server->trace;
+    shard->shard_of=server;}
   return server;
 }
 
+static void *shard_loop(void *arg)
+{
+  struct U8_SERVER *shard=(struct U8_SERVER *)arg;
+  U8_SET_STACK_BASE();
+  u8_server_loop(shard);
+  u8_threadexit();
+  return NULL;
+}
+
+/* Runs the first shard's loop in this thread and the others in their
+   own threads, returning when all of them have shut down. Inline or
+   placed shards all get their own threads, so that this thread
+   isn't placed. */
+static void run_shards(struct U8_SERVER *server)
+{
+  int i=0, n_shards=server->n_shards, own_threads;
+  struct U8_SERVER *shards=server->shards;
+  pthread_t *threads=u8_alloc_n(n_shards,pthread_t);
+  while (i<n_shards) {
+    struct U8_SERVER *shard=&(shards[i++]);
+    /* Pass along anything set up since u8_init_server() */
+    shard->xserverfn=server->xserverfn;
+    shard->xclientfn=server->xclientfn;
+    shard->serverdata=server->serverdata;
+    shard->server_loglevel=server->server_loglevel;
+    if ((server->serverid)&&(shard->serverid==NULL))
+      shard->serverid=u8_strdup(server->serverid);
+    if (server->shutdown) shard->shutdown=server->shutdown;}
+  own_threads=((server->flags&U8_SERVER_INLINE)||(server->topology));
+  i=((own_threads)?(0):(1));
+  while (i<n_shards) {
+    pthread_create(&(threads[i]),pthread_attr_default,
+                   shard_loop,(void *)&(shards[i]));
+    i++;}
+  if (own_threads)
+    pthread_join(threads[0],NULL);
+  else u8_server_loop(&(shards[0]));
+  i=1; while (i<n_shards) pthread_join(threads[i++],NULL);
+  u8_free(threads);
+  /* The shards have shut down, but leave what they share with the
+     front to be freed here */
+  u8_lock_mutex(&server->lock);
+#ifdef CPU_SET
+  if (server->topology) {
+    free_topology(server->topology); server->topology=NULL;}
+#endif
+  if (server->serverid) {
+    u8_free(server->serverid);
+    server->serverid=NULL;}
+  /* Unless threads stuck in servefns will still use their shard (and
+     the trace ring) */
+  i=0; while ((i<n_shards)&&(shards[i].thread_pool==NULL)) i++;
+  if (i==n_shards) {
+    if (server->trace) {
+      free_trace_ring(server->trace); server->trace=NULL;}
+    server->shards=NULL; server->n_shards=0;
+    u8_free(shards);}
+  u8_unlock_mutex(&server->lock);
+  u8_destroy_mutex(&server->lock);
+  u8_destroy_condvar(&(server->empty));
+  u8_destroy_condvar(&(server->full));
+  server->flags |= U8_SERVER_CLOSED;
+}
+#endif
+
 U8_EXPORT
 int u8_server_init(struct U8_SERVER *server,
                    /* max_clients is currently ignored */
@@ -1074,7 +3669,7 @@ int u8_server_init(struct U8_SERVER *server,
 
 static int do_shutdown(struct U8_SERVER *server,int grace)
 {
-  int i=0, n_servers=server->n_servers;
+  int i=0, n_servers=server->n_servers, stuck=0;
   int n_errs=0, idle_clients=0, active_clients=0, clients_len;
   u8_utime deadline=u8_microtime()+grace;
   struct pollfd *sockets; u8_client *clients;
@@ -1138,7 +3733,7 @@ static int do_shutdown(struct U8_SERVER *server,int grace)
 #if U8_THREADS_ENABLED
   /* The busy clients will decrement server->n_busy when they're finished.
      We wait for this to happen, sleeping for one second intervals. */
-  u8_condvar_broadcast(&server->empty);
+  wake_all_threads(server);
   u8_unlock_mutex(&server->lock); sleep(1);
   if (server->n_busy) {
     /* Wait for the busy connections to finish or a timeout */
@@ -1148,10 +3743,16 @@ static int do_shutdown(struct U8_SERVER *server,int grace)
       sleep(1);
       u8_lock_mutex(&server->lock);}}
   u8_unlock_mutex(&server->lock);
+#if U8_USE_IO_URING
+  /* Stop the ring before forcing clients closed, so that it won't
+     touch them after they're freed */
+  close_uring(server);
+#endif
   if (server->n_busy) {
     u8_logf(LOG_CRIT,ServerShutdown,
             "Forcing %d active socket(s) closed after %dus",
             server->n_busy,grace);
+    stuck=server->n_busy;
     i=0; while (i<clients_len) {
       u8_client client=clients[i];
       if (client) {
@@ -1164,14 +3765,53 @@ static int do_shutdown(struct U8_SERVER *server,int grace)
 #endif
   u8_free(server->clients); server->clients=NULL;
   u8_free(server->sockets); server->sockets=NULL;
+  u8_free(server->free_slots); server->free_slots=NULL;
+  server->n_free_slots=server->max_slot=0;
+  server->idle_head=server->idle_tail=NULL;
+  if (server->epoll_fd>=0) {
+    close(server->epoll_fd);
+    server->epoll_fd=-1;}
   if (server->serverid) {
     u8_free(server->serverid);
     server->serverid=NULL;}
   server->clients_len=0;
 #if U8_THREADS_ENABLED
-  u8_free(server->thread_pool); server->thread_pool=NULL;
-  u8_free(server->queue); server->queue=NULL;
+  if (stuck)
+    /* Threads still in their servefns will use their structs (and
+       the server) when they return, so leave them be */
+    u8_logf(LOG_CRIT,ServerShutdown,
+            "Leaving %d thread(s) which didn't finish",stuck);
+  else {
+    /* The threads exit when they see U8_SERVER_CLOSING, and retired
+       threads (past n_threads) don't need waiting for */
+    if ((server->flags&U8_SERVER_INLINE)==0) {
+      i=0; while (i<server->n_threads)
+        pthread_join(server->thread_pool[i++].u8st_thread,NULL);}
+    i=0; while (i<server->max_threads) {
+      struct U8_SERVER_THREAD *u8st=&(server->thread_pool[i]);
+#if U8_USE_COROUTINES
+      /* Joined threads have freed theirs, and retired ones (past
+         n_threads) did so before giving up the server lock, so this
+         only frees the listener's, with U8_SERVER_INLINE */
+      if (i<server->n_threads) free_coroutines(u8st);
+#endif
+      u8_free(u8st->u8st_queue); u8st->u8st_queue=NULL;
+      i++;}
+    u8_free(server->thread_pool); server->thread_pool=NULL;}
 #endif
+  if (server->paused) {
+    u8_free(server->paused); server->paused=NULL;
+    server->n_paused=server->paused_len=0;}
+  if (server->timers) {
+    u8_free(server->timers); server->timers=NULL;}
+  if (server->client_pool) {
+    free_client_pool(server->client_pool); server->client_pool=NULL;}
+#if ((U8_THREADS_ENABLED) && (defined(CPU_SET)))
+  if (server->topology) {
+    free_topology(server->topology); server->topology=NULL;}
+#endif
+  if ((server->trace)&&(server->shard_of==NULL)) {
+    free_trace_ring(server->trace); server->trace=NULL;}
   if (server->server_info) {
     u8_free(server->server_info);
     server->server_info=NULL;}
@@ -1189,9 +3829,12 @@ static int do_shutdown(struct U8_SERVER *server,int grace)
 
 U8_EXPORT int u8_shutdown_server(struct U8_SERVER *server,int grace)
 {
+  int i=0;
   if (grace)
     server->shutdown=grace;
   else server->shutdown=-1;
+  while (i<server->n_shards)
+    u8_shutdown_server(&(server->shards[i++]),grace);
   return 0;
 }
 #define u8_server_shutdown u8_shutdown_server
@@ -1219,7 +3862,8 @@ static void init_server_socket(u8_socket socket_id)
 #endif
 }
 
-static u8_socket open_server_socket(struct sockaddr *sockaddr,int max_backlog)
+static u8_socket open_server_socket(struct sockaddr *sockaddr,int max_backlog,
+                                    int reuseport)
 {
   u8_socket socket_id=-1, on=1, addrsize, family;
   if (sockaddr->sa_family==AF_INET) {
@@ -1243,6 +3887,13 @@ static u8_socket open_server_socket(struct sockaddr *sockaddr,int max_backlog)
                       (void *) &on, sizeof(on)) < 0) {
     u8_graberrno("open_server_socket:setsockopt",u8_sockaddr_string(sockaddr));
     return -1;}
+#ifdef SO_REUSEPORT
+  else if ((reuseport) &&
+           (setsockopt(socket_id, SOL_SOCKET, SO_REUSEPORT,
+                       (void *) &on, sizeof(on)) < 0)) {
+    u8_graberrno("open_server_socket:setsockopt",u8_sockaddr_string(sockaddr));
+    return -1;}
+#endif
   if ((bind(socket_id,(struct sockaddr *) sockaddr,addrsize)) < 0) {
     u8_graberrno("open_server_socket:bind",u8_sockaddr_string(sockaddr));
     return -1;}
@@ -1254,45 +3905,479 @@ static u8_socket open_server_socket(struct sockaddr *sockaddr,int max_backlog)
     return socket_id;}
 }
 
+/* Event backends */
+
+/* Sockets are always recorded in server->sockets, which poll() uses
+   directly. With U8_SERVER_EPOLL, they are also registered (once)
+   with server->epoll_fd, listeners level-triggered and clients with
+   EPOLLONESHOT. A client's one-shot registration is consumed when
+   its event is delivered, and listen_for() re-arms it when the
+   client is idle again. The events field of the pollfd is kept up to
+   date in either case, and is zero while a client is disarmed. */
+
+#if U8_USE_EPOLL
+static unsigned int get_epoll_events(short events)
+{
+  unsigned int epoll_events=0;
+  if (events&POLLIN) epoll_events|=EPOLLIN;
+  if (events&POLLOUT) epoll_events|=EPOLLOUT;
+  if (events&POLLPRI) epoll_events|=EPOLLPRI;
+#ifdef EPOLLRDHUP
+  if (events&(HUPFLAGS)) epoll_events|=EPOLLRDHUP;
+#endif
+  return epoll_events;
+}
+
+static short get_poll_events(unsigned int epoll_events)
+{
+  short events=0;
+  if (epoll_events&EPOLLIN) events|=POLLIN;
+  if (epoll_events&EPOLLOUT) events|=POLLOUT;
+  if (epoll_events&EPOLLPRI) events|=POLLPRI;
+  /* With one-shot events, errors need to close the client or it
+     would never be heard from again, so we treat them as hangups. */
+  if (epoll_events&(EPOLLHUP|EPOLLERR)) events|=POLLHUP;
+#if ((defined(EPOLLRDHUP)) && (defined(POLLRDHUP)))
+  if (epoll_events&EPOLLRDHUP) events|=POLLRDHUP;
+#endif
+  return events;
+}
+#endif
+
+static int register_socket(struct U8_SERVER *server,int slot,int oneshot)
+{
+#if U8_USE_EPOLL
+  if (server->epoll_fd>=0) {
+    struct pollfd *pfd=&(server->sockets[slot]);
+    struct epoll_event event;
+    int local_loglevel = server->server_loglevel;
+    memset(&event,0,sizeof(event));
+    event.events=get_epoll_events(pfd->events);
+    if (oneshot) event.events|=EPOLLONESHOT;
+    event.data.u64=(((uint64_t)(pfd->fd))<<32)|((uint64_t)slot);
+    if (epoll_ctl(server->epoll_fd,EPOLL_CTL_ADD,pfd->fd,&event)<0) {
+      u8_logf(LOG_CRIT,"register_socket",
+              "Couldn't add socket %d (slot %d) to epoll set: %s",
+              pfd->fd,slot,strerror(errno));
+      errno=0;
+      return -1;}}
+#endif
+  return slot;
+}
+
+static void unregister_socket(struct U8_SERVER *server,u8_socket sock)
+{
+#if U8_USE_EPOLL
+  if (server->epoll_fd>=0) {
+    struct epoll_event event;
+    memset(&event,0,sizeof(event));
+    if (epoll_ctl(server->epoll_fd,EPOLL_CTL_DEL,sock,&event)<0) errno=0;}
+#endif
+}
+
+/* Declares which events we're waiting for on a client, with zero
+   meaning that we're not listening at all (because it's queued or a
+   thread is working on it). */
+static void listen_for(struct U8_SERVER *server,u8_client cl,short events)
+{
+  int slot=cl->clientid;
+  struct pollfd *pfd;
+  if ((slot<0)||(slot>=server->clients_len)) return;
+  else pfd=&(server->sockets[slot]);
+#if U8_USE_EPOLL
+  if (server->epoll_fd>=0) {
+    /* If a one-shot event has been delivered (or we've already
+       disarmed it), there's nothing to disarm */
+    if ((events==0)&&(pfd->events==0)) return;
+    else if (pfd->fd<0) return;
+    else {
+      struct epoll_event event;
+      memset(&event,0,sizeof(event));
+      event.events=get_epoll_events(events)|EPOLLONESHOT;
+      event.data.u64=(((uint64_t)(pfd->fd))<<32)|((uint64_t)slot);
+      pfd->events=events;
+      if (epoll_ctl(server->epoll_fd,EPOLL_CTL_MOD,pfd->fd,&event)<0)
+        errno=0;
+      return;}}
+#endif
+  pfd->events=events;
+}
+
+/* io_uring transfers */
+
+/* With U8_SERVER_IO_URING, when a worker can't finish a client's
+   read or write on its first try, it submits the remainder to a ring
+   as a single IORING_OP_RECV or IORING_OP_SEND with MSG_WAITALL,
+   rather than going back to the listener to wait for readiness. A
+   completion thread reaps the results and queues the client once its
+   buffer is complete, so the next worker to look at it goes straight
+   to the servefn. While a transfer is in the ring, the client has
+   U8_CLIENT_URING set and the listener leaves it alone. We use the
+   system calls directly rather than depending on liburing. */
+
+#if U8_USE_IO_URING
+struct U8_SERVER_URING {
+  int ring_fd, n_pending, max_pending, closing;
+  /* The submission ring */
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  /* The completion ring */
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* What we've mapped */
+  unsigned char *sq_ptr, *cq_ptr; void *sqes_ptr;
+  size_t sq_size, cq_size, sqes_size;
+  u8_mutex lock;
+  pthread_t thread; int started;};
+
+static void *uring_loop(void *arg);
+
+static void *uring_map(int fd,size_t size,off_t offset)
+{
+  void *ptr=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+                 fd,offset);
+  if (ptr==MAP_FAILED) return NULL;
+  else return ptr;
+}
+
+static void free_uring(struct U8_SERVER_URING *ring)
+{
+  if (ring->sqes_ptr) munmap(ring->sqes_ptr,ring->sqes_size);
+  if ((ring->cq_ptr)&&(ring->cq_ptr!=ring->sq_ptr))
+    munmap(ring->cq_ptr,ring->cq_size);
+  if (ring->sq_ptr) munmap(ring->sq_ptr,ring->sq_size);
+  if (ring->ring_fd>=0) close(ring->ring_fd);
+  u8_destroy_mutex(&(ring->lock));
+  u8_free(ring);
+}
+
+static struct U8_SERVER_URING *open_uring
+  (struct U8_SERVER *server,unsigned int entries)
+{
+  struct io_uring_params params;
+  struct U8_SERVER_URING *ring;
+  int fd;
+  memset(&params,0,sizeof(params));
+  fd=(int)syscall(__NR_io_uring_setup,entries,&params);
+  if (fd<0) return NULL;
+  ring=u8_alloc(struct U8_SERVER_URING);
+  memset(ring,0,sizeof(struct U8_SERVER_URING));
+  u8_init_mutex(&(ring->lock));
+  ring->ring_fd=fd;
+  ring->sq_size=params.sq_off.array+params.sq_entries*sizeof(unsigned int);
+  ring->cq_size=params.cq_off.cqes+
+    params.cq_entries*sizeof(struct io_uring_cqe);
+  ring->sqes_size=params.sq_entries*sizeof(struct io_uring_sqe);
+  if (params.features&IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size>ring->sq_size) ring->sq_size=ring->cq_size;
+    ring->cq_size=ring->sq_size;}
+  ring->sq_ptr=uring_map(fd,ring->sq_size,IORING_OFF_SQ_RING);
+  if (ring->sq_ptr==NULL) {}
+  else if (params.features&IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr=ring->sq_ptr;
+  else ring->cq_ptr=uring_map(fd,ring->cq_size,IORING_OFF_CQ_RING);
+  if (ring->cq_ptr)
+    ring->sqes_ptr=uring_map(fd,ring->sqes_size,IORING_OFF_SQES);
+  if (ring->sqes_ptr==NULL) {
+    free_uring(ring);
+    return NULL;}
+  ring->sq_head=(unsigned int *)(ring->sq_ptr+params.sq_off.head);
+  ring->sq_tail=(unsigned int *)(ring->sq_ptr+params.sq_off.tail);
+  ring->sq_mask=(unsigned int *)(ring->sq_ptr+params.sq_off.ring_mask);
+  ring->sq_array=(unsigned int *)(ring->sq_ptr+params.sq_off.array);
+  ring->sqes=(struct io_uring_sqe *)ring->sqes_ptr;
+  ring->cq_head=(unsigned int *)(ring->cq_ptr+params.cq_off.head);
+  ring->cq_tail=(unsigned int *)(ring->cq_ptr+params.cq_off.tail);
+  ring->cq_mask=(unsigned int *)(ring->cq_ptr+params.cq_off.ring_mask);
+  ring->cqes=(struct io_uring_cqe *)(ring->cq_ptr+params.cq_off.cqes);
+  /* Never have more in flight than the completion ring can hold */
+  ring->max_pending=params.cq_entries;
+  server->uring=ring;
+  if (pthread_create(&(ring->thread),pthread_attr_default,
+                     uring_loop,(void *)server)) {
+    server->uring=NULL;
+    free_uring(ring);
+    return NULL;}
+  ring->started=1;
+  return ring;
+}
+
+/* Submits one operation, returning 1 if the kernel took it and 0 if
+   the ring was full or the submission failed. */
+static int uring_submit(struct U8_SERVER_URING *ring,int opcode,
+                        u8_socket sock,unsigned char *addr,size_t len,
+                        u8_client cl)
+{
+  unsigned int tail, head, index; int retval;
+  struct io_uring_sqe *sqe;
+  if (len>INT_MAX) len=INT_MAX;
+  u8_lock_mutex(&(ring->lock));
+  tail=*(ring->sq_tail);
+  head=__atomic_load_n(ring->sq_head,__ATOMIC_ACQUIRE);
+  if (((tail-head)>*(ring->sq_mask))||
+      (ring->n_pending>=ring->max_pending)) {
+    u8_unlock_mutex(&(ring->lock));
+    return 0;}
+  index=tail&(*(ring->sq_mask));
+  sqe=&(ring->sqes[index]);
+  memset(sqe,0,sizeof(struct io_uring_sqe));
+  sqe->opcode=opcode; sqe->fd=sock;
+  sqe->addr=(unsigned long)addr; sqe->len=(unsigned int)len;
+  if (opcode!=IORING_OP_NOP) sqe->msg_flags=MSG_WAITALL;
+  sqe->user_data=(unsigned long)cl;
+  ring->sq_array[index]=index;
+  __atomic_store_n(ring->sq_tail,tail+1,__ATOMIC_RELEASE);
+  retval=(int)syscall(__NR_io_uring_enter,ring->ring_fd,1,0,0,NULL,0);
+  if (retval>0) ring->n_pending++;
+  else {
+    /* Take the entry back, since the kernel didn't */
+    __atomic_store_n(ring->sq_tail,tail,__ATOMIC_RELEASE);
+    errno=0;}
+  u8_unlock_mutex(&(ring->lock));
+  return (retval>0);
+}
+
+/* This is called by a worker (on a client it's active on) to hand the
+   rest of the current transfer to the ring. */
+static int uring_transfer(struct U8_SERVER *server,u8_client cl)
+{
+  struct U8_SERVER_URING *ring=server->uring;
+  if (ring==NULL) return 0;
+  else if ((cl->buf==NULL)||(cl->off>=cl->len)||(cl->socket<0))
+    return 0;
+  /* Files and segment chains are sent by the workers */
+  else if ((cl->flags)&(U8_CLIENT_SENDFILE|U8_CLIENT_WRITEV)) return 0;
+  else if (!((cl->reading>0)||(cl->writing>0))) return 0;
+  u8_lock_mutex(&(server->lock));
+  if ((cl->flags)&(U8_CLIENT_CLOSED|U8_CLIENT_CLOSING)) {
+    u8_unlock_mutex(&(server->lock));
+    return 0;}
+  cl->flags|=U8_CLIENT_URING;
+  u8_unlock_mutex(&(server->lock));
+  if (uring_submit(ring,((cl->writing>0)?(IORING_OP_SEND):(IORING_OP_RECV)),
+                   cl->socket,cl->buf+cl->off,cl->len-cl->off,cl))
+    /* The completion may already have been handled, so we don't
+       touch the client again */
+    return 1;
+  u8_lock_mutex(&(server->lock));
+  cl->flags&=~U8_CLIENT_URING;
+  u8_unlock_mutex(&(server->lock));
+  return 0;
+}
+
+static void uring_complete(struct U8_SERVER *server,u8_client cl,int res)
+{
+  char statebuf[16];
+  int local_loglevel = (cl->client_loglevel>=0) ? (cl->client_loglevel) :
+    (server->server_loglevel);
+  if (res>0) {cl->off=cl->off+res; cl->n_moved+=res;}
+  if (((server->flags)&(U8_SERVER_LOG_TRANSFER))||
+      ((cl->flags)&(U8_CLIENT_LOG_TRANSFER)))
+    u8_logf(LOG_DEBUG,((cl->writing>0)?("uring/write"):("uring/read")),
+            "%d bytes for @x%lx#%d.%d[%s/%d](%s%:hs) 0x%lx+%d<%d",
+            res,((unsigned long)cl),cl->clientid,cl->socket,
+            get_client_state(cl,statebuf),
+            cl->n_trans,u8_client_idstring(cl),cl->status,
+            (unsigned long)cl->buf,cl->off,cl->len);
+  /* MSG_WAITALL can still come up short (after a signal, for
+     instance), in which case we just go again */
+  if ((res>0)&&(cl->off<cl->len)&&
+      (!((cl->flags)&(U8_CLIENT_CLOSED|U8_CLIENT_CLOSING)))&&
+      (uring_submit(server->uring,
+                    ((cl->writing>0)?(IORING_OP_SEND):(IORING_OP_RECV)),
+                    cl->socket,cl->buf+cl->off,cl->len-cl->off,cl)))
+    return;
+  u8_lock_mutex(&(server->lock));
+  cl->flags&=~U8_CLIENT_URING;
+  if ((cl->off>=cl->len)&&
+      (push_task(server,cl,((cl->writing>0)?("uring/w"):("uring/r"))))) {}
+  else if ((cl->off>=cl->len)||(cl->writing>0))
+    /* If the queue is full, the listener will queue it (a socket is
+       almost always writable); errors and EOF are also left to the
+       listener, which will see the hangup. */
+    listen_for(server,cl,POLLOUT_EVENTS);
+  else listen_for(server,cl,POLLIN_EVENTS);
+  u8_unlock_mutex(&(server->lock));
+}
+
+static void *uring_loop(void *arg)
+{
+  struct U8_SERVER *server=(struct U8_SERVER *)arg;
+  struct U8_SERVER_URING *ring=server->uring;
+  int local_loglevel = server->server_loglevel;
+  while (1) {
+    unsigned int head, tail;
+    int retval=(int)syscall(__NR_io_uring_enter,ring->ring_fd,0,1,
+                            IORING_ENTER_GETEVENTS,NULL,0);
+    if ((retval<0)&&(errno!=EINTR)&&(!(ring->closing))) {
+      u8_logf(LOG_ERR,"uring_loop","Error (%s) waiting on ring %d",
+              strerror(errno),ring->ring_fd);
+      errno=0; u8_sleep(0.1);}
+    else if (retval<0) errno=0;
+    head=*(ring->cq_head);
+    tail=__atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE);
+    while (head!=tail) {
+      struct io_uring_cqe *cqe=&(ring->cqes[head&(*(ring->cq_mask))]);
+      u8_client cl=(u8_client)((unsigned long)(cqe->user_data));
+      int res=cqe->res;
+      head++;
+      __atomic_store_n(ring->cq_head,head,__ATOMIC_RELEASE);
+      u8_lock_mutex(&(ring->lock));
+      ring->n_pending--;
+      u8_unlock_mutex(&(ring->lock));
+      if ((cl)&&(res<0)&&(res!=(-ECONNRESET))&&(res!=(-EPIPE)))
+        u8_logf(LOG_WARN,"uring_loop",
+                "Transfer error (%s) for @x%lx#%d.%d",
+                strerror(-res),((unsigned long)cl),
+                cl->clientid,cl->socket);
+      if (cl) uring_complete(server,cl,res);}
+    if (ring->closing) break;}
+  return NULL;
+}
+
+/* Stops the completion thread (by submitting a no-op it will notice)
+   and releases the ring. Transfers still in flight are abandoned. */
+static void close_uring(struct U8_SERVER *server)
+{
+  struct U8_SERVER_URING *ring=server->uring;
+  if (ring==NULL) return;
+  ring->closing=1;
+  if (ring->started) {
+    uring_submit(ring,IORING_OP_NOP,-1,NULL,0,NULL);
+    pthread_join(ring->thread,NULL);}
+  server->uring=NULL;
+  free_uring(ring);
+}
+#else
+static int uring_transfer(struct U8_SERVER *server,u8_client cl)
+{
+  return 0;
+}
+#endif
+
+/* Called on a client a worker is done with for now, which is waiting
+   to read or write more data. */
+static void resume_client(struct U8_SERVER *server,u8_client cl)
+{
+  short awaiting;
+  if ((cl->off<cl->len)&&(uring_transfer(server,cl))) return;
+  /* The listener may be moving the sockets table */
+  u8_lock_mutex(&(server->lock));
+  if ((awaiting=client_awaiting(cl))) {
+    /* The await may time out before the idle timer */
+    schedule_client(server,cl);
+    if (awaiting&POLLOUT)
+      listen_for(server,cl,POLLOUT_EVENTS);
+    else listen_for(server,cl,POLLIN_EVENTS);}
+  else if (cl->writing>0)
+    listen_for(server,cl,POLLOUT_EVENTS);
+  else listen_for(server,cl,POLLIN_EVENTS);
+  u8_unlock_mutex(&(server->lock));
+}
+
+/* Client slots */
+
+/* Slots are handed out from the free_slots stack, or from the end of
+   the used range when it's empty, and the clients/sockets tables
+   double when they're full, so adding and freeing clients take
+   constant time. The tables are moved only by the listener thread
+   (which may be polling the sockets table without the lock), so
+   others must hold the lock to touch them. */
+
+/* How often (in microseconds) the listener considers compacting */
+#define U8_SERVER_SLOTS_INTERVAL 1000000
+
+static int grow_slots(struct U8_SERVER *server,int new_len)
+{
+  int cur_len=server->clients_len;
+  u8_client *clients=
+    u8_realloc(server->clients,sizeof(u8_client)*new_len);
+  struct pollfd *sockets=(clients) ?
+    (u8_realloc(server->sockets,sizeof(struct pollfd)*new_len)) :
+    (NULL);
+  int *free_slots=(sockets) ?
+    (u8_realloc(server->free_slots,sizeof(int)*new_len)) :
+    (NULL);
+  if (clients) server->clients=clients;
+  if (sockets) server->sockets=sockets;
+  if (free_slots) server->free_slots=free_slots;
+  if (free_slots==NULL) return -1;
+  else if (new_len>cur_len) {
+    memset(clients+cur_len,0,sizeof(u8_client)*(new_len-cur_len));
+    memset(sockets+cur_len,0,sizeof(struct pollfd)*(new_len-cur_len));}
+  server->clients_len=new_len;
+  return new_len;
+}
+
 static int add_socket(struct U8_SERVER *server,u8_socket sock,short events)
 {
-  u8_client *clients=server->clients;
-  struct pollfd *sockets=server->sockets;
-  int clients_len=server->clients_len;
   int local_loglevel = server->server_loglevel;
+  int slot; struct pollfd *pfd;
   if (sock<0) return sock;
-  else if (server->free_slot==server->clients_len) {
-    /* Grow the arrays if neccessary */
-    int cur_len=server->clients_len;
-    int grow_by=server->init_clients;
-    int new_len=cur_len+grow_by;
-    clients=u8_realloc(clients,sizeof(u8_client)*new_len);
-    sockets=u8_realloc(sockets,sizeof(struct pollfd)*new_len);
-    if ((clients)&&(sockets)) {
-      memset(clients+clients_len,0,sizeof(u8_client)*grow_by);
-      memset(sockets+clients_len,0,sizeof(struct pollfd)*grow_by);
-      server->clients=clients; server->sockets=sockets;
-      server->clients_len=new_len;}
-    else {
-      u8_logf(LOG_CRIT,"add_socket","Couldn't allocate more clients/sockets");
-      return -1;}}
-  if (server->free_slot==server->max_slot) {
-    int slot=server->free_slot;
-    struct pollfd *pfd=&(server->sockets[slot]);
-    memset(pfd,0,sizeof(struct pollfd));
-    pfd->fd=sock; pfd->events=((short)events);
-    server->free_slot++; server->max_slot++;
-    return slot;}
+  else if (server->n_free_slots>0)
+    slot=server->free_slots[--(server->n_free_slots)];
   else {
-    int slot=server->free_slot, max_slot=server->max_slot;
-    struct pollfd *pfd=&(server->sockets[slot]);
-    int i=slot+1; while (i<max_slot) {
-      if ((!(clients[i]))&&(sockets[i].fd<0)) break;
-      else i++;}
-    server->free_slot=i;
-    memset(pfd,0,sizeof(struct pollfd));
-    pfd->fd=sock; pfd->events=((short)events);
-    return slot;}
+    if (server->max_slot>=server->clients_len) {
+      /* Grow the tables if neccessary */
+      int cur_len=server->clients_len;
+      int new_len=((cur_len<server->init_clients)?
+                   (server->init_clients):(cur_len*2));
+      if (grow_slots(server,new_len)<0) {
+        u8_logf(LOG_CRIT,"add_socket",
+                "Couldn't allocate more clients/sockets");
+        return -1;}}
+    slot=server->max_slot++;}
+  pfd=&(server->sockets[slot]);
+  memset(pfd,0,sizeof(struct pollfd));
+  pfd->fd=sock; pfd->events=((short)events);
+  return slot;
+}
+
+/* Makes a slot (whose socket and client have been cleared) available
+   again. */
+static void free_slot(struct U8_SERVER *server,int slot)
+{
+  if (slot==server->max_slot-1) server->max_slot--;
+  else server->free_slots[server->n_free_slots++]=slot;
+}
+
+/* When most of the used slots have emptied out, this trims the unused
+   end of the range, restacks the free slots so that the lowest ones
+   are used first (letting the end empty out further), and shrinks
+   the tables if they're mostly unused. Clients never move, since
+   their slots are known to threads, epoll, and the paused list. It's
+   called by the listener thread. */
+static void check_slots(struct U8_SERVER *server)
+{
+  long long now=u8_microtime();
+  int max_slot, n_free=0, i, len;
+  if (server->max_slot<=server->init_clients) return;
+  else if ((now-server->slots_checked)<U8_SERVER_SLOTS_INTERVAL) return;
+  else server->slots_checked=now;
+  u8_lock_mutex(&(server->lock));
+  if ((server->n_free_slots*4)<(server->max_slot*3)) {
+    u8_unlock_mutex(&(server->lock));
+    return;}
+  max_slot=server->max_slot;
+  while ((max_slot>0)&&(server->clients[max_slot-1]==NULL)&&
+         (server->sockets[max_slot-1].fd<0))
+    max_slot--;
+  i=max_slot-1; while (i>=0) {
+    if ((server->clients[i]==NULL)&&(server->sockets[i].fd<0))
+      server->free_slots[n_free++]=i;
+    i--;}
+  server->max_slot=max_slot; server->n_free_slots=n_free;
+  len=server->clients_len;
+  while (((len/2)>=server->init_clients)&&((len/2)>=(max_slot*2)))
+    len=len/2;
+  if (len<server->clients_len) {
+    int local_loglevel = server->server_loglevel;
+    if (server->flags&U8_SERVER_LOG_CONNECT)
+      u8_logf(LOG_INFO,"check_slots",
+              "Shrinking the client tables from %d to %d slots (%d in use)",
+              server->clients_len,len,max_slot-n_free);
+    grow_slots(server,len);}
+  u8_unlock_mutex(&(server->lock));
 }
 
 static struct U8_SERVER_INFO *add_server
@@ -1311,6 +4396,7 @@ static struct U8_SERVER_INFO *add_server
     server->n_servers++;}
   info->socket=sock; info->addr=addr;
   info->poll_index=add_socket(server,sock,POLLIN);
+  if (info->poll_index>=0) register_socket(server,info->poll_index,0);
   return info;
 }
 
@@ -1346,7 +4432,18 @@ static int add_server_from_spec(struct U8_SERVER *server,u8_string spec)
 U8_EXPORT
 int u8_add_server(struct U8_SERVER *server,u8_string hostname,int port)
 {
-  if ( (hostname==NULL) ||
+  if (server->n_shards>0) {
+    /* Every shard listens on every address */
+    int i=1, n_servers=u8_add_server(&(server->shards[0]),hostname,port);
+    if (n_servers<0) return n_servers;
+    while (i<server->n_shards) {
+      if (u8_add_server(&(server->shards[i]),hostname,port)<0) {
+        u8_logf(LOG_WARN,NewServer,"Shard %d couldn't listen at %s:%d",
+                i,hostname,port);
+        u8_clear_errors(1);}
+      i++;}
+    return n_servers;}
+  else if ( (hostname==NULL) ||
        (strcmp(hostname,".")==0) || 
        (strcmp(hostname,"*")==0) ) {
     if (port<=0)
@@ -1368,6 +4465,10 @@ int u8_add_server(struct U8_SERVER *server,u8_string hostname,int port)
       return n_servers;}}
   else if (port==0)
     return add_server_from_spec(server,hostname);
+  else if ((port<0)&&(server->shard_of)&&
+           (server!=&(server->shard_of->shards[0])))
+    /* File sockets can't be shared, so only the first shard has them */
+    return 0;
   else if (port<0) {
     /* Open a file socket */
     struct sockaddr *addr=get_sockaddr_file(hostname);
@@ -1379,7 +4480,7 @@ int u8_add_server(struct U8_SERVER *server,u8_string hostname,int port)
       u8_unlock_mutex(&(server->lock));
       return 0;}
     else {
-      u8_socket sock=open_server_socket(addr,server->max_backlog);
+      u8_socket sock=open_server_socket(addr,server->max_backlog,0);
       if (sock<0) {
         u8_free(addr);
         u8_unlock_mutex(&(server->lock));
@@ -1406,7 +4507,9 @@ int u8_add_server(struct U8_SERVER *server,u8_string hostname,int port)
         else {
           struct U8_SERVER_INFO *info;
           u8_string addr_string=u8_sockaddr_string(sockaddr);
-          u8_socket sock=open_server_socket(sockaddr,server->max_backlog);
+          u8_socket sock=
+            open_server_socket(sockaddr,server->max_backlog,
+                               (server->shard_of!=NULL));
           if (sock>=0) {
             u8_lock_mutex(&(server->lock));
             info=add_server(server,sock,sockaddr);
@@ -1441,6 +4544,15 @@ static int add_client(struct U8_SERVER *server,u8_client client)
   if (slot<0) return slot;
   server->clients[slot]=client; client->clientid=slot;
   client->threadnum=-1; client->server=server; server->n_clients++;
+  if (register_socket(server,slot,1)<0) {
+    struct pollfd *pfd=&(server->sockets[slot]);
+    memset(pfd,0,sizeof(struct pollfd)); pfd->fd=-1;
+    server->clients[slot]=NULL; client->clientid=-1;
+    server->n_clients--;
+    free_slot(server,slot);
+    return -1;}
+  link_idle(server,client);
+  schedule_client(server,client);
   return slot;
 }
 
@@ -1457,77 +4569,163 @@ static int free_client(struct U8_SERVER *server,u8_client cl,u8_context caller)
             "Freeing (%s) client/task @x%lx#%d.%d[%s/%d](%s%:hs)",
             caller,((unsigned long)cl),cl->clientid,cl->socket,
             get_client_state(cl,statebuf),
-            cl->n_trans,cl->idstring,cl->status);
+            cl->n_trans,u8_client_idstring(cl),cl->status);
   memset(pfd,0,sizeof(struct pollfd)); pfd->fd=-1;
+  if (server->timers) remove_timer(server->timers,cl);
+  unlink_idle(server,cl);
   server->n_clients--;
   update_server_stats(cl);
   server->clients[clientid]=NULL;
-  /* If the newly empty slot is before the current free_slot,
-     make it the free_slot. */
-  if (clientid<server->free_slot) server->free_slot=clientid;
-  if (cl->idstring) u8_free(cl->idstring); cl->idstring=NULL;
-  if (cl->status) u8_free(cl->status); cl->status=NULL;
-
-  u8_free(cl);
+  free_slot(server,clientid);
+  /* A servefn still parked (at shutdown) is abandoned */
+  if (cl->coroutine) drop_coroutine(cl);
+  if (cl->inbuf) release_inbuf(cl);
+  /* Pipelined requests still in flight refer to the client, so the
+     last of them to finish releases it */
+  if (cl->n_inflight>0) {
+    cl->clientid=-1;
+    return 1;}
+  release_client(server,cl);
   return 1;
 }
 
-static int server_accept(u8_server server,u8_socket i)
+/* Frees a client struct (or keeps it for reuse), once nothing refers
+   to it */
+static void release_client(struct U8_SERVER *server,u8_client cl)
+{
+  if (cl->requests) free_requests(cl);
+  if (cl->idstring) {
+    u8_free(cl->idstring); cl->idstring=NULL;}
+  if (cl->status) {
+    u8_free(cl->status); cl->status=NULL;}
+  if (!((server->client_pool)&&((cl->flags)&(U8_CLIENT_POOLED))&&
+        (push_client(server->client_pool,cl))))
+    u8_free(cl);
+}
+
+/* This takes a new connection (sock) from one of the listening
+   sockets and adds it as a client. It's called with the server lock
+   held. */
+static int accept_client(u8_server server,u8_socket sock,
+                         struct sockaddr *addr,size_t addrlen)
 {
-  /* If the activity is on the server socket, open a new socket */
-  char addrbuf[1024]; char statebuf[16];
-  int addrlen=1024; u8_socket sock;
+  char statebuf[16]; int retval;
   int local_loglevel = server->server_loglevel;
   /* This should possibly close the listening socket when we've
      reached max_clients, but it doesn't currently, instead it accepts
      and immediately closes.  */
-  memset(addrbuf,0,1024);
-  sock=accept(i,(struct sockaddr *)addrbuf,&addrlen);
-  if (sock < 0) {
-    u8_logf(LOG_ERR,u8_NetworkError,_("Failed accept on socket %d"),i);
-    errno=0;
-    return -1;}
-  else if ((server->max_clients>0)&&
-           (server->n_clients>server->max_clients)) {
+  if ((server->max_clients>0)&&
+      (server->n_clients>server->max_clients)) {
     u8_string serverid = (server->serverid) ? (server->serverid) :
       ( (server->server_info) && (server->server_info->idstring) ) ?
       (server->server_info->idstring) :
       U8S("srv");
-    u8_string connid = u8_sockaddr_string((struct sockaddr *)addrbuf);
+    u8_string connid = u8_sockaddr_string(addr);
     u8_logf(LOG_NOTICE,RejectedConnection,
             "Rejected (closed) connection %s/%s, nclients=%d>%d=max_clients",
             serverid,connid,server->n_clients,server->max_clients);
     u8_free(connid);
     close(sock);
     return 0;}
+  else if (((server->overload)&(U8_OVERLOAD_REJECT))&&
+           ((server->n_paused>0)||
+            (server->n_queued>=server->max_queued))) {
+    server->n_rejected++;
+    if (server->flags&U8_SERVER_LOG_CONNECT) {
+      u8_string connid = u8_sockaddr_string(addr);
+      u8_logf(LOG_NOTICE,RejectedConnection,
+              "Rejected (closed) connection %s while overloaded, "
+              "n_queued=%d/%d, n_paused=%d",
+              connid,server->n_queued,server->max_queued,
+              server->n_paused);
+      u8_free(connid);}
+    close(sock);
+    return 0;}
   else {
-    u8_client cl=server->acceptfn
-      (server,sock,(struct sockaddr *)addrbuf,addrlen);
+    u8_client cl=server->acceptfn(server,sock,addr,addrlen);
     if (cl) {
-      u8_string idstring=
-        ((cl->idstring)?(cl->idstring):
-         (u8_sockaddr_string((struct sockaddr *)addrbuf)));
       server->n_accepted++;
-      if (!(cl->idstring)) cl->idstring=idstring;
+      METRIC_INCR(server,n_accepted);
+      /* The idstring is generated from this when it's needed */
+      if ((cl->addrlen==0)&&(addrlen<=sizeof(cl->addr))) {
+        memcpy(&(cl->addr),addr,addrlen);
+        cl->addrlen=addrlen;}
       cl->status=NULL;
-      u8_lock_mutex(&(server->lock));
-      add_client(server,cl);
-      u8_unlock_mutex(&(server->lock));
+      retval=add_client(server,cl);
+      if (retval<0) {
+        u8_logf(LOG_ERR,RejectedConnection,
+                "Couldn't add client @x%lx.%d(%s) to the server",
+                ((unsigned long)cl),cl->socket,u8_client_idstring(cl));
+        if (server->closefn) server->closefn(cl);
+        else close(cl->socket);
+        if (cl->idstring) u8_free(cl->idstring);
+        u8_free(cl);
+        return -1;}
       if (server->flags&U8_SERVER_LOG_CONNECT)
         u8_logf(LOG_INFO,NewClient,"Opened @x%lx#%d.%d[%s/%d](%s)",
                 ((unsigned long)cl),cl->clientid,cl->socket,
                 get_client_state(cl,statebuf),
-                cl->n_trans,cl->idstring);
+                cl->n_trans,u8_client_idstring(cl));
       return 1;}
     else if (server->flags&U8_SERVER_LOG_CONNECT) {
-      u8_string connid=
-        u8_sockaddr_string((struct sockaddr *)addrbuf);
-      u8_logf(LOG_NOTICE,RejectedConnection,"Rejected connection from %s");
+      u8_string connid=u8_sockaddr_string(addr);
+      u8_logf(LOG_NOTICE,RejectedConnection,"Rejected connection from %s",
+              connid);
       u8_free(connid);
       return 0;}
     else return 0;}
 }
 
+/* This accepts all of the connections waiting on a listening socket
+   (which is non-blocking), up to the listen backlog, returning the
+   number of clients added. It's called with the server lock held, so
+   the whole batch is added under one acquisition. */
+static int server_accept(u8_server server,u8_socket i)
+{
+  int n_accepted=0, n_added=0, limit=server->max_backlog;
+  int local_loglevel = server->server_loglevel;
+#if HAVE_ACCEPT4
+  int accept_flags=SOCK_CLOEXEC|
+    (((server->flags)&(U8_SERVER_NONBLOCK))?(SOCK_NONBLOCK):(0));
+#endif
+  if (limit<=0) limit=MAX_BACKLOG;
+  while (n_accepted<limit) {
+    struct sockaddr_storage addrbuf;
+    socklen_t addrlen=sizeof(addrbuf);
+    u8_socket sock;
+    memset(&addrbuf,0,sizeof(addrbuf));
+#if HAVE_ACCEPT4
+    sock=accept4(i,(struct sockaddr *)&addrbuf,&addrlen,accept_flags);
+#else
+    sock=accept(i,(struct sockaddr *)&addrbuf,&addrlen);
+    if (sock>=0) {
+#ifdef FD_CLOEXEC
+      fcntl(sock,F_SETFD,FD_CLOEXEC);
+#endif
+      if ((server->flags)&(U8_SERVER_NONBLOCK))
+        fcntl(sock,F_SETFL,fcntl(sock,F_GETFL)|O_NONBLOCK);}
+#endif
+    if (sock<0) {
+      if ((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+        /* That's all of them */
+        errno=0; break;}
+      else if ((errno==EINTR)||(errno==ECONNABORTED)) {
+        /* Try the next one */
+        errno=0; continue;}
+      u8_logf(LOG_ERR,u8_NetworkError,_("Failed accept (%s) on socket %d"),
+              strerror(errno),i);
+      errno=0;
+      if (n_accepted==0) return -1;
+      else break;}
+    n_accepted++;
+    if (accept_client(server,sock,(struct sockaddr *)&addrbuf,addrlen)>0)
+      n_added++;}
+  if ((n_accepted>1)&&(server->flags&U8_SERVER_LOG_CONNECT))
+    u8_logf(LOG_INFO,NewClient,"Accepted %d connections on socket %d",
+            n_accepted,i);
+  return n_added;
+}
+
 static int socket_peek(u8_socket sock)
 {
   unsigned char buf[5];
@@ -1559,6 +4757,9 @@ static struct pollfd *update_socketbuf
 static int server_handle_poll(struct U8_SERVER *server,
                               struct pollfd *sockets,
                               int n_socks);
+#if U8_USE_EPOLL
+static int server_listen_epoll(struct U8_SERVER *server);
+#endif
 
 /* This listens for connections and pushes tasks (unless we're not
    threaded, in which case it dispatches to the servefn right
@@ -1566,7 +4767,12 @@ static int server_handle_poll(struct U8_SERVER *server,
 static int server_listen(struct U8_SERVER *server)
 {
   struct pollfd *sockets=NULL;
-  int n_socks=0, retval, timeout=server->poll_timeout;
+  int n_socks=0, retval, timeout;
+#if U8_USE_EPOLL
+  if (server->epoll_fd>=0) return server_listen_epoll(server);
+#endif
+  check_pool(server); check_slots(server);
+  timeout=check_timers(server,check_paused(server));
   update_socketbuf(server,&sockets,&n_socks);
   /* Wait for activity on one of your open sockets */
   while ((retval=poll(sockets,n_socks,timeout)) == 0) {
@@ -1578,6 +4784,8 @@ static int server_listen(struct U8_SERVER *server)
         u8_free(sockets);
       return 0;}
     if (server->flags&U8_SERVER_CLOSED) return 0;
+    check_pool(server); check_slots(server);
+    timeout=check_timers(server,check_paused(server));
     update_socketbuf(server,&sockets,&n_socks);
     if (server->xserverfn) {
       u8_lock_mutex(&(server->lock));
@@ -1589,102 +4797,195 @@ static int server_listen(struct U8_SERVER *server)
         (sockets!=server->sockets))
       u8_free(sockets);
     return 0;}
-  return server_handle_poll(server,sockets,n_socks);
+  retval=server_handle_poll(server,sockets,n_socks);
+  if (server->flags&U8_SERVER_INLINE) run_inline(server);
+  return retval;
+}
+
+/* This handles the events reported for one socket (by either poll()
+   or epoll), returning 1 if it did something. It's called with the
+   server lock held. */
+static int handle_socket_event(struct U8_SERVER *server,int i,short events)
+{
+  u8_client client=server->clients[i];
+  struct pollfd *pfd=&(server->sockets[i]);
+  char statebuf[16];
+  int local_loglevel = -1;
+  if ( (client) && (client->client_loglevel>0) )
+    local_loglevel = client->client_loglevel;
+  if ((client==NULL)&&(events&POLLIN)) {
+    /* Server connection */
+    int retval=server_accept(server,pfd->fd);
+    if (retval<0) u8_clear_errors(1);
+    return 0;}
+  else if (client==NULL) {
+    /* Error on server socket? */
+    return 0;}
+#if U8_THREADS_ENABLED
+  else if ((client->active>0)||(client->queued>0)) {
+    /* A thread is working on this client (or will be, since it's
+       been queued).  Don't touch it. */
+    return 0;}
+  else if ((client->flags)&(U8_CLIENT_URING)) {
+    /* The ring is working on this client, and will queue it or
+       listen for it again when it's done. */
+    return 0;}
+  else if (client_awaiting(client)) {
+    /* Its servefn is parked awaiting this, and gets any hangup or
+       error along with everything else */
+    client->coroutine->revents=events;
+    if (dispatch_client(server,client,"server_listen/await")) return 1;
+    else return 0;}
+  else if (events&(HUPFLAGS)) {
+    if ((client->server->flags)&(U8_SERVER_LOG_CONNECT)&&
+        (client->socket>=0))
+      u8_logf(LOG_INFO,"server_handle_poll",
+              "Other end closed (HUP) @x%lx#%d.%d[%s/%d](%s%:hs)",
+              ((unsigned long)client),client->clientid,client->socket,
+              get_client_state(client,statebuf),
+              client->n_trans,u8_client_idstring(client),client->status);
+    if (client->started>0) {client->started=0; SERVER_DECR(server->n_busy);}
+    close_client_core(client,1,"server_handle_poll/HUP");
+    return 0;}
+  else if ((client->len>0)&&(client->off>=client->len)&&
+           (((client->reading)>0)||((client->writing)>0))) {
+    /* A transfer finished (in the ring) but couldn't be queued then */
+    if (dispatch_client(server,client,"server_listen/done")) return 1;
+    else return 0;}
+  else if (((events&POLLOUT)&&((client->writing)>0))||
+           ((events&POLLIN)&&((client->reading)>0))) {
+    if (dispatch_client(server,client,
+                        (((client->writing)>0)?
+                         ("server_listen/write"):
+                         ("server_listen/read"))))
+      /* push_task() has stopped us listening to the client, and a
+         worker may already have asked to listen again, so we don't
+         touch the events here */
+      return 1;
+    else return 0;}
+  else if ((events&POLLNVAL)&&(client->socket<0)) {
+    pfd->fd=-1;
+    if (!(client->queued>0))
+      push_task(server,client,"server_handle_pool/inval");
+    return 0;}
+  else if ((events&POLLNVAL)||
+           ((events&POLLIN)&&(!(socket_peek(client->socket))))) {
+    /* No real data, so we close it (probably the other side closed)
+       the connection. */
+    if (((client->server->flags)&(U8_SERVER_LOG_CONNECT))&&
+        (client->socket>=0))
+      u8_logf(LOG_INFO,"server_listen",
+              "Other end closed (%s) @x%lx#%d.%d[%s/%d](%s%:hs)",
+              ((events&POLLNVAL)?("closed/invalid"):("no data")),
+              ((unsigned long)client),client->clientid,client->socket,
+              get_client_state(client,statebuf),
+              client->n_trans,u8_client_idstring(client),client->status);
+    if (client->started>0) {client->started=0; SERVER_DECR(server->n_busy);}
+    client->threadnum=-1;
+    close_client_core(client,1,"server_handle_poll/POLLINVAL");
+    return 0;}
+  else if (events&POLLIN) {
+    if (dispatch_client(server,client,"server_listen/?")) return 1;
+    else return 0;}
+#else
+  else if (events&POLLIN) {
+    server->servefn(client);
+    return 1;}
+#endif
+  else if (events&POLLOUT) {
+    listen_for(server,client,POLLIN|HUPFLAGS);
+    return 0;}
+  else return 0;
 }
 
 static int server_handle_poll(struct U8_SERVER *server,
                               struct pollfd *sockets,
                               int n_socks)
 {
-  struct U8_CLIENT **clients;
   int i=0, n_actions=0;
-  char statebuf[16];
   /* Iterate over the range of sockets */
   u8_lock_mutex(&(server->lock));
-  clients=server->clients;
   i=0; while (i < n_socks) {
-    u8_client client; short events;
-    int local_loglevel = -1;
+    /* Accepting a connection can grow (and move) server->sockets, but
+       the revents are copied along with everything else. */
+    if (!(DESTRUCTIVE_POLL)) sockets=server->sockets;
     if (sockets[i].fd<0) {i++; continue;}
     else if (sockets[i].revents==0) {
       i++; continue;}
-    else {
-      client=clients[i];
-      events=sockets[i].revents;}
-    if ( (client) && (client->client_loglevel>0) )
-      local_loglevel = client->client_loglevel;
-    if ((client==NULL)&&(events&POLLIN)) {
-      /* Server connection */
-      int retval=server_accept(server,sockets[i].fd);
-      if (retval<0) u8_clear_errors(1);}
-    else if (client==NULL) {
-      /* Error on server socket? */}
-#if U8_THREADS_ENABLED
-    else if (client->active>0) {
-      /* A thread is working on this client.  Don't touch it. */}
-    else if (events&(HUPFLAGS)) {
-      if ((client->server->flags)&(U8_SERVER_LOG_CONNECT)&&
-          (client->socket>=0))
-        u8_logf(LOG_INFO,"server_handle_poll",
-                "Other end closed (HUP) @x%lx#%d.%d[%s/%d](%s%:hs)",
-                ((unsigned long)client),client->clientid,client->socket,
-                get_client_state(client,statebuf),
-                client->n_trans,client->idstring,client->status);
-      if (client->started>0) {client->started=0; server->n_busy--;}
-      close_client_core(client,1,"server_handle_poll/HUP");
-      i++; continue;}
-    else if (((events&POLLOUT)&&((client->writing)>0))||
-             ((events&POLLIN)&&((client->reading)>0))) {
-      if (push_task(server,client,
-                    (((client->writing)>0)?
-                     ("server_listen/write"):
-                     ("server_listen/read")))) {
-        sockets[i].events=
-          ((short)(((short)(sockets[i].events))&
-                   ((short)(~(POLLIN|POLLOUT)))));
-        n_actions++;}}
-    else if ((events&POLLNVAL)&&(client->socket<0)) {
-      sockets[i].fd=-1;
-      if (!(client->queued>0))
-        push_task(server,client,"server_handle_pool/inval");
-      i++; continue;}
-    else if ((events&POLLNVAL)||
-             ((events&POLLIN)&&(!(socket_peek(client->socket))))) {
-      /* No real data, so we close it (probably the other side closed)
-         the connection. */
-      if (((client->server->flags)&(U8_SERVER_LOG_CONNECT))&&
-          (client->socket>=0))
-        u8_logf(LOG_INFO,"server_listen",
-                "Other end closed (%s) @x%lx#%d.%d[%s/%d](%s%:hs)",
-                ((events&POLLNVAL)?("closed/invalid"):("no data")),
-                ((unsigned long)client),client->clientid,client->socket,
-                get_client_state(client,statebuf),
-                client->n_trans,client->idstring,client->status);
-      if (client->started>0) {client->started=0; server->n_busy--;}
-      client->threadnum=-1;
-      close_client_core(client,1,"server_handle_poll/POLLINVAL");
-      i++; continue;}
-    else if (events&POLLIN) {
-      if (push_task(server,client,"server_listen/?")) n_actions++;}
-#else
-    else if (events&POLLIN) {
-      server->servefn(client);
-      n_actions++;}
-#endif
-    else if (events&POLLOUT) {
-      sockets[i].events=((short)(POLLIN|HUPFLAGS));}
-    else NO_ELSE;
+    else n_actions+=handle_socket_event(server,i,sockets[i].revents);
     i++;}
   if (server->xserverfn) server->xserverfn(server);
   u8_unlock_mutex(&(server->lock));
   return n_actions;
 }
 
+#if U8_USE_EPOLL
+/* This waits on the epoll set, only looking at sockets which are
+   actually ready. */
+static int server_listen_epoll(struct U8_SERVER *server)
+{
+  struct epoll_event events[U8_SERVER_MAX_EVENTS];
+  int i=0, n_events, n_actions=0;
+  int local_loglevel = server->server_loglevel;
+  check_pool(server); check_slots(server);
+  n_events=epoll_wait(server->epoll_fd,events,U8_SERVER_MAX_EVENTS,
+                      check_timers(server,check_paused(server)));
+  if (server->shutdown) {
+    do_shutdown(server,server->shutdown);
+    return 0;}
+  else if (server->flags&U8_SERVER_CLOSED) return 0;
+  else if (n_events<0) {
+    if (errno!=EINTR)
+      u8_logf(LOG_ERR,"server_listen","Error (%s) from epoll_wait on %d",
+              strerror(errno),server->epoll_fd);
+    errno=0;
+    return -1;}
+  else if (n_events==0) {
+    if (server->xserverfn) {
+      u8_lock_mutex(&(server->lock));
+      server->xserverfn(server);
+      u8_unlock_mutex(&(server->lock));}
+    return 0;}
+  u8_lock_mutex(&(server->lock));
+  while (i<n_events) {
+    uint64_t data=events[i].data.u64;
+    int slot=(int)(data&0xFFFFFFFF), fd=(int)(data>>32);
+    short revents=get_poll_events(events[i].events);
+    u8_client client;
+    i++;
+    /* Ignore events for sockets which have since been dropped */
+    if ((slot<0)||(slot>=server->max_slot)) continue;
+    else if (server->sockets[slot].fd!=fd) continue;
+    else client=server->clients[slot];
+    /* A client's one-shot registration is used up by being reported */
+    if (client) server->sockets[slot].events=0;
+    n_actions+=handle_socket_event(server,slot,revents);
+    /* If nobody took the client (for instance, because the queue was
+       full), we start listening for it again.  Clients which are
+       queued or active are re-armed when they're done, and paused
+       clients when they're resumed. */
+    client=server->clients[slot];
+    if ((client)&&(client->queued<=0)&&(client->active<=0)&&
+        (server->sockets[slot].events==0)&&
+        (!((client->flags)&
+           (U8_CLIENT_CLOSED|U8_CLIENT_CLOSING|U8_CLIENT_URING|
+            U8_CLIENT_PAUSED))))
+      listen_for(server,client,
+                 ((((client->writing)>0)||
+                   ((client->len>0)&&(client->off>=client->len)))?
+                  (POLLOUT_EVENTS):(POLLIN_EVENTS)));}
+  if (server->xserverfn) server->xserverfn(server);
+  u8_unlock_mutex(&(server->lock));
+  if (server->flags&U8_SERVER_INLINE) run_inline(server);
+  return n_actions;
+}
+#endif
 
 U8_EXPORT
 int u8_push_task(struct U8_SERVER *server,u8_client cl,u8_context cxt)
 {
   int retval;
+  if (server->n_shards>0) server=cl->server;
   u8_lock_mutex(&(server->lock));
   retval=push_task(server,cl,cxt);
   u8_unlock_mutex(&(server->lock));
@@ -1694,16 +4995,604 @@ int u8_push_task(struct U8_SERVER *server,u8_client cl,u8_context cxt)
 U8_EXPORT
 void u8_server_loop(struct U8_SERVER *server)
 {
+#if U8_THREADS_ENABLED
+  if (server->n_shards>0) {
+    run_shards(server);
+    return;}
+#ifdef CPU_SET
+  if (server->topology) place_listener(server);
+#endif
+#endif
   while ((server->flags&U8_SERVER_CLOSED)==0) server_listen(server);
 }
 
+/* Latency histograms */
+
+/* Bucket i<2^(SUB_BITS+1) holds the value i; after that, each run of
+   2^SUB_BITS buckets covers one power of two, with buckets 2^shift
+   wide. */
+
+static int histogram_bucket(long long value)
+{
+  unsigned long long v=(value<0) ? (0) : (value);
+  int high_bit, shift;
+  if (v < (1ULL<<U8_HISTOGRAM_SUB_BITS)) return (int)v;
+  high_bit=63-__builtin_clzll(v);
+  if (high_bit>=U8_HISTOGRAM_MAX_BITS) return U8_HISTOGRAM_BUCKETS-1;
+  shift=high_bit-U8_HISTOGRAM_SUB_BITS;
+  return (shift<<U8_HISTOGRAM_SUB_BITS)+((int)(v>>shift));
+}
+
+/* The largest value which goes into a bucket */
+static long long histogram_value(int bucket)
+{
+  int shift, sub;
+  if (bucket < (2<<U8_HISTOGRAM_SUB_BITS)) return bucket;
+  shift=(bucket>>U8_HISTOGRAM_SUB_BITS)-1;
+  sub=bucket-(shift<<U8_HISTOGRAM_SUB_BITS);
+  return (((long long)(sub+1))<<shift)-1;
+}
+
+U8_EXPORT void u8_histogram_record(struct U8_HISTOGRAM *h,long long value)
+{
+  __atomic_fetch_add(&(h->buckets[histogram_bucket(value)]),1,
+                     __ATOMIC_RELAXED);
+}
+
+U8_EXPORT void u8_histogram_merge(struct U8_HISTOGRAM *into,
+                                  struct U8_HISTOGRAM *from)
+{
+  int i=0; while (i<U8_HISTOGRAM_BUCKETS) {
+    long long n=__atomic_load_n(&(from->buckets[i]),__ATOMIC_RELAXED);
+    if (n) __atomic_fetch_add(&(into->buckets[i]),n,__ATOMIC_RELAXED);
+    i++;}
+}
+
+U8_EXPORT long long u8_histogram_count(struct U8_HISTOGRAM *h)
+{
+  long long count=0;
+  int i=0; while (i<U8_HISTOGRAM_BUCKETS)
+    count+=__atomic_load_n(&(h->buckets[i++]),__ATOMIC_RELAXED);
+  return count;
+}
+
+U8_EXPORT long long u8_histogram_percentile(struct U8_HISTOGRAM *h,double pct)
+{
+  long long counts[U8_HISTOGRAM_BUCKETS], total=0, target, seen=0;
+  double rank; int i=0;
+  /* Take a snapshot, since other threads may be recording */
+  while (i<U8_HISTOGRAM_BUCKETS) {
+    counts[i]=__atomic_load_n(&(h->buckets[i]),__ATOMIC_RELAXED);
+    total+=counts[i++];}
+  if (total==0) return 0;
+  if (pct<0) pct=0; else if (pct>100) pct=100;
+  rank=(pct/100.0)*((double)total);
+  target=(long long)rank;
+  if (((double)target)<rank) target++;
+  if (target<1) target=1;
+  i=0; while (i<U8_HISTOGRAM_BUCKETS) {
+    seen+=counts[i];
+    if (seen>=target) return histogram_value(i);
+    i++;}
+  return histogram_value(U8_HISTOGRAM_BUCKETS-1);
+}
+
+static void gather_latencies(struct U8_SERVER *server,int phase,
+                             struct U8_HISTOGRAM *into)
+{
+  struct U8_SERVER_THREAD *pool=server->thread_pool;
+  int i=0;
+  if (server->n_shards>0) {
+    while (i<server->n_shards)
+      gather_latencies(&(server->shards[i++]),phase,into);
+    return;}
+  u8_histogram_merge(into,&(server->latencies[phase]));
+  if (pool) while (i<server->max_threads)
+              u8_histogram_merge(into,&(pool[i++].u8st_latencies[phase]));
+}
+
+U8_EXPORT u8_histogram u8_server_latencies
+(u8_server server,int phase,struct U8_HISTOGRAM *into)
+{
+  if ((phase<0)||(phase>=U8_N_LATENCIES)) return NULL;
+  if (into==NULL) into=u8_alloc(struct U8_HISTOGRAM);
+  memset(into,0,sizeof(struct U8_HISTOGRAM));
+  gather_latencies(server,phase,into);
+  return into;
+}
+
+U8_EXPORT long long u8_server_percentile(u8_server server,int phase,double pct)
+{
+  struct U8_HISTOGRAM h;
+  if (u8_server_latencies(server,phase,&h))
+    return u8_histogram_percentile(&h,pct);
+  else return -1;
+}
+
+/* Metrics */
+
+/* Each pool thread adds to the U8_SERVER_METRICS (and latency
+   histograms) in its own U8_SERVER_THREAD, and the listener and any
+   other threads add to the server's. Metrics only ever grow, with
+   relaxed atomic operations (which cost little on a thread's own
+   shard), so readers can just add up the shards, locking nothing.
+   The thread pool has a slot (and shard) for every thread it might
+   grow to, and shards stay put when their threads retire. */
+
+static struct U8_SERVER_METRICS *metrics_shard(struct U8_SERVER *server)
+{
+#if U8_THREADS_ENABLED
+  if ((current_worker)&&(current_worker->u8st_server==server))
+    return &(current_worker->u8st_metrics);
+#endif
+  return &(server->metrics);
+}
+
+static void record_latency(struct U8_SERVER *server,int phase,long long value)
+{
+  struct U8_SERVER_METRICS *m=metrics_shard(server);
+  long long max=__atomic_load_n(&(m->maxes[phase]),__ATOMIC_RELAXED);
+#if U8_THREADS_ENABLED
+  if ((current_worker)&&(current_worker->u8st_server==server)) {
+    /* Only this thread writes its histograms, so there's no need
+       for a locked add */
+    long long *bucket=
+      &(current_worker->u8st_latencies[phase].buckets[histogram_bucket(value)]);
+    __atomic_store_n(bucket,__atomic_load_n(bucket,__ATOMIC_RELAXED)+1,
+                     __ATOMIC_RELAXED);}
+  else u8_histogram_record(&(server->latencies[phase]),value);
+#else
+  u8_histogram_record(&(server->latencies[phase]),value);
+#endif
+  __atomic_add_fetch(&(m->counts[phase]),1,__ATOMIC_RELAXED);
+  __atomic_add_fetch(&(m->sums[phase]),value,__ATOMIC_RELAXED);
+  /* The listener's shard may be shared, so the max is swapped in */
+  while ((value>max)&&
+         (!(__atomic_compare_exchange_n(&(m->maxes[phase]),&max,value,1,
+                                        __ATOMIC_RELAXED,__ATOMIC_RELAXED))))
+    {}
+}
+
+static void add_metrics(struct U8_SERVER_METRICS *into,
+                        struct U8_SERVER_METRICS *from)
+{
+  int i=0;
+  into->n_accepted+=__atomic_load_n(&(from->n_accepted),__ATOMIC_RELAXED);
+  into->n_trans+=__atomic_load_n(&(from->n_trans),__ATOMIC_RELAXED);
+  into->n_errs+=__atomic_load_n(&(from->n_errs),__ATOMIC_RELAXED);
+  while (i<U8_N_LATENCIES) {
+    long long max=__atomic_load_n(&(from->maxes[i]),__ATOMIC_RELAXED);
+    into->counts[i]+=__atomic_load_n(&(from->counts[i]),__ATOMIC_RELAXED);
+    into->sums[i]+=__atomic_load_n(&(from->sums[i]),__ATOMIC_RELAXED);
+    if (max>into->maxes[i]) into->maxes[i]=max;
+    i++;}
+}
+
+static void gather_metrics(struct U8_SERVER *server,
+                           struct U8_SERVER_METRICS *into)
+{
+  struct U8_SERVER_THREAD *pool=server->thread_pool;
+  int i=0;
+  if (server->n_shards>0) {
+    while (i<server->n_shards)
+      gather_metrics(&(server->shards[i++]),into);
+    return;}
+  add_metrics(into,&(server->metrics));
+  if (pool) while (i<server->max_threads)
+              add_metrics(into,&(pool[i++].u8st_metrics));
+  into->n_busy+=__atomic_load_n(&(server->n_busy),__ATOMIC_RELAXED);
+  into->n_queued+=__atomic_load_n(&(server->n_queued),__ATOMIC_RELAXED);
+  into->n_clients+=__atomic_load_n(&(server->n_clients),__ATOMIC_RELAXED);
+  into->n_threads+=__atomic_load_n(&(server->n_threads),__ATOMIC_RELAXED);
+}
+
+U8_EXPORT u8_metrics u8_server_metrics
+  (u8_server server,struct U8_SERVER_METRICS *into)
+{
+  if (into==NULL) into=u8_alloc(struct U8_SERVER_METRICS);
+  memset(into,0,sizeof(struct U8_SERVER_METRICS));
+  gather_metrics(server,into);
+  return into;
+}
+
+static u8_string latency_names[U8_N_LATENCIES]=
+  {"transact","queue","read","write","exec"};
+
+/* Writes a string quoted for Prometheus labels or JSON */
+static void output_quoted(struct U8_OUTPUT *out,u8_string string)
+{
+  const u8_byte *scan=(string)?(string):((u8_string)"");
+  int c;
+  u8_putc(out,'"');
+  while ((c=u8_sgetc(&scan))>0) {
+    if ((c=='"')||(c=='\\')) {u8_putc(out,'\\'); u8_putc(out,c);}
+    else if (c=='\n') u8_puts(out,"\\n");
+    else if (c<0x20) u8_printf(out,"\\u%04x",c);
+    else u8_putc(out,c);}
+  u8_putc(out,'"');
+}
+
+#define PROMETHEUS_HEAD(out,name,type,help) \
+  u8_printf(out,"# HELP u8_server_%s %s\n# TYPE u8_server_%s %s\n", \
+            name,help,name,type)
+
+static void output_prometheus(struct U8_OUTPUT *out,u8_string id,
+                              struct U8_SERVER_METRICS *m,
+                              long long (*pcts)[3])
+{
+  static double quantiles[3]={0.5,0.99,0.999};
+  int phase=0;
+  PROMETHEUS_HEAD(out,"accepted_total","counter","Connections accepted");
+  u8_puts(out,"u8_server_accepted_total{server=");
+  output_quoted(out,id); u8_printf(out,"} %lld\n",m->n_accepted);
+  PROMETHEUS_HEAD(out,"transactions_total","counter",
+                  "Transactions completed");
+  u8_puts(out,"u8_server_transactions_total{server=");
+  output_quoted(out,id); u8_printf(out,"} %lld\n",m->n_trans);
+  PROMETHEUS_HEAD(out,"errors_total","counter","Transactions which failed");
+  u8_puts(out,"u8_server_errors_total{server=");
+  output_quoted(out,id); u8_printf(out,"} %lld\n",m->n_errs);
+  PROMETHEUS_HEAD(out,"busy","gauge","Clients being served");
+  u8_puts(out,"u8_server_busy{server=");
+  output_quoted(out,id); u8_printf(out,"} %d\n",m->n_busy);
+  PROMETHEUS_HEAD(out,"queued","gauge","Tasks waiting to be served");
+  u8_puts(out,"u8_server_queued{server=");
+  output_quoted(out,id); u8_printf(out,"} %d\n",m->n_queued);
+  PROMETHEUS_HEAD(out,"clients","gauge","Open client connections");
+  u8_puts(out,"u8_server_clients{server=");
+  output_quoted(out,id); u8_printf(out,"} %d\n",m->n_clients);
+  PROMETHEUS_HEAD(out,"threads","gauge","Threads in the pool");
+  u8_puts(out,"u8_server_threads{server=");
+  output_quoted(out,id); u8_printf(out,"} %d\n",m->n_threads);
+  PROMETHEUS_HEAD(out,"latency_microseconds","summary",
+                  "Latency of each phase of a transaction");
+  while (phase<U8_N_LATENCIES) {
+    int i=0; while (i<3) {
+      u8_puts(out,"u8_server_latency_microseconds{server=");
+      output_quoted(out,id);
+      u8_printf(out,",phase=\"%s\",quantile=\"%g\"} %lld\n",
+                latency_names[phase],quantiles[i],pcts[phase][i]);
+      i++;}
+    u8_puts(out,"u8_server_latency_microseconds_sum{server=");
+    output_quoted(out,id);
+    u8_printf(out,",phase=\"%s\"} %lld\n",
+              latency_names[phase],m->sums[phase]);
+    u8_puts(out,"u8_server_latency_microseconds_count{server=");
+    output_quoted(out,id);
+    u8_printf(out,",phase=\"%s\"} %lld\n",
+              latency_names[phase],m->counts[phase]);
+    phase++;}
+  PROMETHEUS_HEAD(out,"latency_max_microseconds","gauge",
+                  "Longest latency of each phase of a transaction");
+  phase=0; while (phase<U8_N_LATENCIES) {
+    u8_puts(out,"u8_server_latency_max_microseconds{server=");
+    output_quoted(out,id);
+    u8_printf(out,",phase=\"%s\"} %lld\n",
+              latency_names[phase],m->maxes[phase]);
+    phase++;}
+}
+
+static void output_json(struct U8_OUTPUT *out,u8_string id,
+                        struct U8_SERVER_METRICS *m,
+                        long long (*pcts)[3])
+{
+  int phase=0;
+  u8_puts(out,"{\"server\":"); output_quoted(out,id);
+  u8_printf(out,",\"accepted\":%lld,\"transactions\":%lld,\"errors\":%lld",
+            m->n_accepted,m->n_trans,m->n_errs);
+  u8_printf(out,",\"busy\":%d,\"queued\":%d,\"clients\":%d,\"threads\":%d",
+            m->n_busy,m->n_queued,m->n_clients,m->n_threads);
+  u8_puts(out,",\"latency\":{");
+  while (phase<U8_N_LATENCIES) {
+    u8_printf(out,"%s\"%s\":{\"count\":%lld,\"sum\":%lld,\"max\":%lld,"
+              "\"p50\":%lld,\"p99\":%lld,\"p999\":%lld}",
+              ((phase)?(","):("")),latency_names[phase],
+              m->counts[phase],m->sums[phase],m->maxes[phase],
+              pcts[phase][0],pcts[phase][1],pcts[phase][2]);
+    phase++;}
+  u8_puts(out,"}}\n");
+}
+
+U8_EXPORT u8_string u8_server_metrics_text
+  (u8_server server,int format,u8_byte *buf,int buflen)
+{
+  struct U8_OUTPUT out;
+  struct U8_SERVER_METRICS m;
+  long long pcts[U8_N_LATENCIES][3];
+  struct U8_SERVER *info_server=
+    (server->n_shards>0) ? (&(server->shards[0])) : (server);
+  u8_string id=((info_server->server_info) ?
+                (info_server->server_info->idstring) :
+                (server->serverid));
+  int phase=0;
+  if (buf) {U8_INIT_FIXED_OUTPUT(&out,buflen,buf);}
+  else {U8_INIT_STATIC_OUTPUT(out,2048);}
+  u8_server_metrics(server,&m);
+  while (phase<U8_N_LATENCIES) {
+    struct U8_HISTOGRAM h;
+    u8_server_latencies(server,phase,&h);
+    pcts[phase][0]=u8_histogram_percentile(&h,50);
+    pcts[phase][1]=u8_histogram_percentile(&h,99);
+    pcts[phase][2]=u8_histogram_percentile(&h,99.9);
+    phase++;}
+  if (format==U8_METRICS_JSON)
+    output_json(&out,id,&m,pcts);
+  else output_prometheus(&out,id,&m,pcts);
+  return out.u8_outbuf;
+}
+
+/* Tracing transactions */
+
+/* A trace ring is an array of records (a power of two of them)
+   which writers claim in turn by bumping next. A record's seq is
+   zero while it's being written and then the number of the write
+   (counting from 1), so a reader copying a record can tell if it
+   wasn't finished or was overwritten while being copied, and skip
+   it. Nothing locks, so any thread (or a signal handler) can read
+   the ring at any time. Sharded servers share a single ring. */
+
+struct U8_TRACE_RING {
+  unsigned long long next;
+  unsigned int size; long long threshold;
+  struct U8_TRACE_RECORD *records;};
+
+static struct U8_TRACE_RING *new_trace_ring(int size,long long threshold)
+{
+  struct U8_TRACE_RING *ring=u8_alloc(struct U8_TRACE_RING);
+  unsigned int n=1; while (n<size) n=n*2;
+  ring->next=0; ring->size=n; ring->threshold=threshold;
+  ring->records=u8_alloc_n(n,struct U8_TRACE_RECORD);
+  memset(ring->records,0,sizeof(struct U8_TRACE_RECORD)*n);
+  return ring;
+}
+
+static void free_trace_ring(struct U8_TRACE_RING *ring)
+{
+  u8_free(ring->records);
+  u8_free(ring);
+}
+
+static void trace_write(struct U8_TRACE_RING *ring,
+                        struct U8_TRACE_RECORD *rec)
+{
+  unsigned long long seq=
+    __atomic_fetch_add(&(ring->next),1,__ATOMIC_RELAXED)+1;
+  struct U8_TRACE_RECORD *slot=&(ring->records[(seq-1)&(ring->size-1)]);
+  __atomic_store_n(&(slot->seq),0,__ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->clientid=rec->clientid; slot->threadnum=rec->threadnum;
+  slot->result=rec->result; slot->n_trans=rec->n_trans;
+  slot->started=rec->started; slot->bytes=rec->bytes;
+  memcpy(slot->durations,rec->durations,sizeof(rec->durations));
+  __atomic_store_n(&(slot->seq),seq,__ATOMIC_RELEASE);
+}
+
+/* Copies out the nth record, returning 0 if it's unfinished or gone */
+static int trace_read(struct U8_TRACE_RING *ring,unsigned long long seq,
+                      struct U8_TRACE_RECORD *into)
+{
+  struct U8_TRACE_RECORD *slot=&(ring->records[(seq-1)&(ring->size-1)]);
+  if (__atomic_load_n(&(slot->seq),__ATOMIC_ACQUIRE)!=seq) return 0;
+  memcpy(into,slot,sizeof(struct U8_TRACE_RECORD));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (__atomic_load_n(&(slot->seq),__ATOMIC_RELAXED)==seq);
+}
+
+/* Called from u8_client_done(), after the client's stats include the
+   transaction */
+static void trace_client(struct U8_SERVER *server,u8_client cl,u8_utime now)
+{
+  struct U8_TRACE_RING *ring=server->trace;
+  struct U8_TRACE_RECORD rec;
+  if ((cl->started<=0)||((now-cl->started)<ring->threshold)) return;
+  /* A pipelining client's requests are traced by trace_request() */
+  else if ((cl->framing)&&((server->flags)&(U8_SERVER_PIPELINE))) return;
+  rec.clientid=cl->clientid; rec.threadnum=cl->threadnum;
+  rec.result=((cl->n_errs>cl->trace_errs)?(-1):(0));
+  rec.n_trans=cl->n_trans; rec.started=cl->started;
+  rec.durations[U8_LATENCY_TRANSACT]=now-cl->started;
+  rec.durations[U8_LATENCY_QUEUE]=cl->stats.qsum-cl->trace_marks[0];
+  rec.durations[U8_LATENCY_READ]=cl->stats.rsum-cl->trace_marks[1];
+  rec.durations[U8_LATENCY_WRITE]=cl->stats.wsum-cl->trace_marks[2];
+  rec.durations[U8_LATENCY_EXEC]=cl->stats.xsum-cl->trace_marks[3];
+  rec.bytes=cl->n_moved;
+  trace_write(ring,&rec);
+}
+
+/* Called when a pipelined request's servefn returns, with the times
+   it started and finished running */
+static void trace_request(struct U8_SERVER *server,struct U8_SERVER_THREAD *st,
+                          struct U8_CLIENT_REQUEST *req,
+                          u8_utime cur,u8_utime now,int result)
+{
+  struct U8_TRACE_RING *ring=server->trace;
+  struct U8_TRACE_RECORD rec;
+  if ((now-req->queued)<ring->threshold) return;
+  memset(&rec,0,sizeof(rec));
+  rec.clientid=req->client->clientid; rec.threadnum=st->u8st_slotno;
+  rec.result=((result<0)?(-1):(0));
+  rec.n_trans=req->client->n_trans; rec.started=req->queued;
+  rec.durations[U8_LATENCY_TRANSACT]=now-req->queued;
+  rec.durations[U8_LATENCY_QUEUE]=cur-req->queued;
+  rec.durations[U8_LATENCY_EXEC]=now-cur;
+  rec.bytes=req->len+req->response_len;
+  trace_write(ring,&rec);
+}
+
+U8_EXPORT int u8_server_trace(u8_server server,struct U8_TRACE_RECORD *into,int n)
+{
+  struct U8_TRACE_RING *ring=server->trace;
+  unsigned long long seq, end; int count=0;
+  if (ring==NULL) return -1;
+  else if (n<=0) return 0;
+  end=__atomic_load_n(&(ring->next),__ATOMIC_ACQUIRE);
+  if (n>((int)ring->size)) n=ring->size;
+  seq=((end>n)?(end-n):(0))+1;
+  while (seq<=end) {
+    if (trace_read(ring,seq,&(into[count]))) count++;
+    seq++;}
+  return count;
+}
+
+/* Formats a number into buf (which must have room for 21 bytes),
+   returning its length */
+static int trace_number(char *buf,long long value)
+{
+  char digits[24]; int n=0, len=0;
+  unsigned long long v=(value<0)?(-((unsigned long long)value)):(value);
+  do {digits[n++]='0'+(v%10); v=v/10;} while (v);
+  if (value<0) buf[len++]='-';
+  while (n>0) buf[len++]=digits[--n];
+  return len;
+}
+
+static int trace_output(int fd,const char *buf,size_t len)
+{
+  while (len>0) {
+    ssize_t delta=write(fd,buf,len);
+    if (delta>0) {buf+=delta; len-=delta;}
+    else if ((delta<0)&&(errno==EINTR)) continue;
+    else return -1;}
+  return 0;
+}
+
+#define TRACE_HEADER \
+  "#seq\tclient\tthread\ttrans\tstarted\ttransact\tqueue\tread\twrite" \
+  "\texec\tbytes\tresult\n"
+
+/* This only uses async-signal-safe functions */
+U8_EXPORT int u8_server_trace_dump(u8_server server,int fd)
+{
+  struct U8_TRACE_RING *ring=server->trace;
+  unsigned long long seq, end; int count=0, saved_errno=errno;
+  if (ring==NULL) return -1;
+  end=__atomic_load_n(&(ring->next),__ATOMIC_ACQUIRE);
+  seq=((end>ring->size)?(end-ring->size):(0))+1;
+  if (trace_output(fd,TRACE_HEADER,strlen(TRACE_HEADER))<0) {
+    errno=saved_errno; return -1;}
+  while (seq<=end) {
+    struct U8_TRACE_RECORD rec;
+    if (trace_read(ring,seq++,&rec)) {
+      char line[256]; int len=0, i=0;
+      long long fields[5];
+      fields[0]=rec.seq; fields[1]=rec.clientid; fields[2]=rec.threadnum;
+      fields[3]=rec.n_trans; fields[4]=rec.started;
+      while (i<5) {
+        len+=trace_number(line+len,fields[i++]); line[len++]='\t';}
+      i=0; while (i<U8_N_LATENCIES) {
+        len+=trace_number(line+len,rec.durations[i++]); line[len++]='\t';}
+      len+=trace_number(line+len,rec.bytes); line[len++]='\t';
+      len+=trace_number(line+len,rec.result); line[len++]='\n';
+      if (trace_output(fd,line,len)<0) break;
+      count++;}}
+  errno=saved_errno;
+  return count;
+}
+
+static u8_server trace_signal_server=NULL;
+static int trace_signal_fd=-1;
+
+static void trace_signal_handler(int signum)
+{
+  u8_server server=__atomic_load_n(&trace_signal_server,__ATOMIC_ACQUIRE);
+  if (server) u8_server_trace_dump(server,trace_signal_fd);
+}
+
+U8_EXPORT int u8_server_trace_signal(u8_server server,int signum,int fd)
+{
+  struct sigaction action;
+  memset(&action,0,sizeof(action));
+  sigemptyset(&(action.sa_mask));
+  if (server) {
+    trace_signal_fd=fd;
+    __atomic_store_n(&trace_signal_server,server,__ATOMIC_RELEASE);
+    action.sa_handler=trace_signal_handler;
+    action.sa_flags=SA_RESTART;}
+  else {
+    __atomic_store_n(&trace_signal_server,NULL,__ATOMIC_RELEASE);
+    action.sa_handler=SIG_DFL;}
+  return sigaction(signum,&action,NULL);
+}
+
 /* Getting server status */
 
+/* Counts which u8_server_status() and u8_server_status_raw() report,
+   summed over the shards of a sharded server */
+struct SERVER_COUNTS {
+  int n_threads, max_queued, max_backlog, n_busy, n_clients, n_queued;
+  int overload, n_paused;
+  long n_accepted, n_trans, n_overloads, n_rejected, n_shed, n_timeouts;
+  int timers, min_threads, max_threads; long n_grown, n_retired;};
+
+static void add_server_counts(struct U8_SERVER *server,
+                              struct SERVER_COUNTS *counts)
+{
+  if (server->n_shards>0) {
+    int i=0; while (i<server->n_shards)
+      add_server_counts(&(server->shards[i++]),counts);
+    return;}
+  u8_lock_mutex(&(server->lock));
+  counts->n_threads+=server->n_threads;
+  counts->max_queued+=server->max_queued;
+  counts->max_backlog=server->max_backlog;
+  counts->n_busy+=server->n_busy;
+  counts->n_clients+=server->n_clients;
+  counts->n_queued+=server->n_queued;
+  counts->n_accepted+=server->n_accepted;
+  counts->n_trans+=server->n_trans;
+  counts->overload|=server->overload;
+  counts->n_paused+=server->n_paused;
+  counts->n_overloads+=server->n_overloads;
+  counts->n_rejected+=server->n_rejected;
+  counts->n_shed+=server->n_shed;
+  counts->n_timeouts+=server->n_timeouts;
+  if (server->timers) counts->timers=1;
+  counts->min_threads+=server->min_threads;
+  counts->max_threads+=server->max_threads;
+  counts->n_grown+=server->n_grown;
+  counts->n_retired+=server->n_retired;
+  u8_unlock_mutex(&(server->lock));
+}
+
+#define MERGE_PHASE_STATS(into,from,phase)			\
+  into->phase##sum+=from.phase##sum;				\
+  into->phase##sum2+=from.phase##sum2;				\
+  into->phase##count+=from.phase##count;			\
+  if (from.phase##max>into->phase##max) into->phase##max=from.phase##max
+
+/* Combines the statistics for all the shards of a server */
+static u8_server_stats get_shard_stats
+  (u8_server server,struct U8_SERVER_STATS *stats,
+   u8_server_stats (*getstats)(u8_server,struct U8_SERVER_STATS *))
+{
+  int i=0;
+  if (stats==NULL) stats=u8_alloc(struct U8_SERVER_STATS);
+  memset(stats,0,sizeof(struct U8_SERVER_STATS));
+  while (i<server->n_shards) {
+    struct U8_SERVER_STATS shard_stats;
+    getstats(&(server->shards[i++]),&shard_stats);
+    stats->n_reqs+=shard_stats.n_reqs;
+    stats->n_errs+=shard_stats.n_errs;
+    stats->n_complete+=shard_stats.n_complete;
+    stats->n_busy+=shard_stats.n_busy;
+    stats->n_active+=shard_stats.n_active;
+    stats->n_reading+=shard_stats.n_reading;
+    stats->n_writing+=shard_stats.n_writing;
+    MERGE_PHASE_STATS(stats,shard_stats,t);
+    MERGE_PHASE_STATS(stats,shard_stats,q);
+    MERGE_PHASE_STATS(stats,shard_stats,r);
+    MERGE_PHASE_STATS(stats,shard_stats,w);
+    MERGE_PHASE_STATS(stats,shard_stats,x);}
+  return stats;
+}
+
 U8_EXPORT u8_server_stats u8_server_statistics
   (u8_server server,struct U8_SERVER_STATS *stats)
 {
   int i=0, lim;
   struct U8_CLIENT **clients;
+  if (server->n_shards>0)
+    return get_shard_stats(server,stats,u8_server_statistics);
   if (stats==NULL) stats=u8_alloc(struct U8_SERVER_STATS);
   memset(stats,0,sizeof(struct U8_SERVER_STATS));
   u8_lock_mutex(&(server->lock));
@@ -1767,6 +5656,8 @@ U8_EXPORT u8_server_stats u8_server_livestats
 {
   int i=0, lim;
   struct U8_CLIENT **clients;
+  if (server->n_shards>0)
+    return get_shard_stats(server,stats,u8_server_livestats);
   if (stats==NULL) stats=u8_alloc(struct U8_SERVER_STATS);
   memset(stats,0,sizeof(struct U8_SERVER_STATS));
   u8_lock_mutex(&(server->lock));
@@ -1828,6 +5719,8 @@ U8_EXPORT u8_server_stats u8_server_curstats
 {
   int i=0, lim;
   struct U8_CLIENT **clients; long long cur, start;
+  if (server->n_shards>0)
+    return get_shard_stats(server,stats,u8_server_curstats);
   if (stats==NULL) stats=u8_alloc(struct U8_SERVER_STATS);
   memset(stats,0,sizeof(struct U8_SERVER_STATS));
   u8_lock_mutex(&(server->lock));
@@ -1879,19 +5772,36 @@ u8_string u8_server_status(struct U8_SERVER *server,u8_byte *buf,int buflen)
   struct U8_OUTPUT out;
   if (buf) {U8_INIT_FIXED_OUTPUT(&out,buflen,buf);}
   else {U8_INIT_STATIC_OUTPUT(out,256);}
+  struct SERVER_COUNTS counts;
+  struct U8_SERVER *info_server=
+    (server->n_shards>0) ? (&(server->shards[0])) : (server);
   out.u8_streaminfo |= U8_HUMAN_OUTPUT;
-  u8_lock_mutex(&(server->lock));
+  memset(&counts,0,sizeof(counts));
+  add_server_counts(server,&counts);
   u8_printf
     (&out,
      "%s Config: %d/%d/%d threads/maxqueue/backlog; "
      "Clients: %d/%d/%d busy/active/ever; "
-     "Requests: %d/%d/%d live/queued/total;\n",
-     ( (server->server_info) ? (server->server_info->idstring) :
+     "Requests: %d/%d/%d live/queued/total;",
+     ( (info_server->server_info) ? (info_server->server_info->idstring) :
        (server->serverid) ),
-     server->n_threads,server->max_queued,server->max_backlog,
-     server->n_busy,server->n_clients,server->n_accepted,
-     server->n_busy,server->n_queued,server->n_trans);
-  u8_unlock_mutex(&(server->lock));
+     counts.n_threads,counts.max_queued,counts.max_backlog,
+     counts.n_busy,counts.n_clients,counts.n_accepted,
+     counts.n_busy,counts.n_queued,counts.n_trans);
+  if (server->n_shards>0)
+    u8_printf(&out," Shards: %d;",server->n_shards);
+  if ((counts.overload)||(counts.n_overloads))
+    u8_printf(&out," Overload: %ld/%ld/%ld/%d full/rejected/shed/paused;",
+              counts.n_overloads,counts.n_rejected,counts.n_shed,
+              counts.n_paused);
+  if (counts.timers)
+    u8_printf(&out," Timeouts: %ld;",counts.n_timeouts);
+  if (counts.min_threads<counts.max_threads)
+    u8_printf(&out," Pool: %d/%d/%ld/%ld min/max/grown/retired;",
+              counts.min_threads,counts.max_threads,
+              counts.n_grown,counts.n_retired);
+  output_placement(&out,server);
+  u8_putc(&out,'\n');
   return out.u8_outbuf;
 }
 
@@ -1899,17 +5809,32 @@ U8_EXPORT
 u8_string u8_server_status_raw(struct U8_SERVER *server,u8_byte *buf,int buflen)
 {
   struct U8_OUTPUT out;
+  int phase=0;
   if (buf) {U8_INIT_FIXED_OUTPUT(&out,buflen,buf);}
   else {U8_INIT_STATIC_OUTPUT(out,256);}
+  struct SERVER_COUNTS counts;
+  struct U8_SERVER *info_server=
+    (server->n_shards>0) ? (&(server->shards[0])) : (server);
   out.u8_streaminfo |= U8_HUMAN_OUTPUT;
-  u8_lock_mutex(&(server->lock));
+  memset(&counts,0,sizeof(counts));
+  add_server_counts(server,&counts);
   u8_printf
-    (&out,"%s\t%d\%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n",
-     server->server_info->idstring,
-     server->n_threads,server->max_queued,server->max_backlog,
-     server->n_busy,server->n_clients,server->n_accepted,
-     server->n_busy,server->n_queued,server->n_trans);
-  u8_unlock_mutex(&(server->lock));
+    (&out,"%s\t%d\%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d",
+     info_server->server_info->idstring,
+     counts.n_threads,counts.max_queued,counts.max_backlog,
+     counts.n_busy,counts.n_clients,counts.n_accepted,
+     counts.n_busy,counts.n_queued,counts.n_trans);
+  u8_printf(&out,"\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld",
+            counts.n_overloads,counts.n_rejected,counts.n_shed,
+            counts.n_timeouts,counts.n_grown,counts.n_retired);
+  while (phase<U8_N_LATENCIES) {
+    struct U8_HISTOGRAM h;
+    u8_server_latencies(server,phase++,&h);
+    u8_printf(&out,"\t%lld\t%lld\t%lld",
+              u8_histogram_percentile(&h,50),
+              u8_histogram_percentile(&h,99),
+              u8_histogram_percentile(&h,99.9));}
+  u8_putc(&out,'\n');
   return out.u8_outbuf;
 }
 
@@ -1929,6 +5854,9 @@ u8_string u8_list_clients(struct U8_OUTPUT *out,struct U8_SERVER *server)
   struct U8_SERVER_THREAD *threads;
   struct pollfd *sockets;
   long long cur; int i=0, lim;
+  if (server->n_shards>0) {
+    while (i<server->n_shards) u8_list_clients(out,&(server->shards[i++]));
+    return out->u8_outbuf;}
   u8_lock_mutex(&(server->lock));
   clients=server->clients; threads=server->thread_pool;
   sockets=server->sockets;
@@ -1977,7 +5905,7 @@ u8_string u8_list_clients(struct U8_OUTPUT *out,struct U8_SERVER *server)
     u8_printf
       (out,"%5d   %s%s   %s  %s %s\t %s\t %s   \t %?s\n",
        cl->clientid,idle,state,intervalinfo,sockinfo,
-       bufinfo,threadinfo,cl->idstring,cl->status);}
+       bufinfo,threadinfo,u8_client_idstring(cl),cl->status);}
   u8_unlock_mutex(&(server->lock));
   return out->u8_outbuf;
 }
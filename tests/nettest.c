@@ -0,0 +1,203 @@
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libu8/libu8.h"
+#include "libu8/u8netfns.h"
+#include "libu8/u8elapsed.h"
+
+/* Exercises opening connections: giving up on unreachable addresses
+   within the time allowed and trying each address a name resolves
+   to, along with the cache of host lookups. Connections go to a
+   listener opened here. */
+
+static int failures=0;
+
+#define CHECK(cond,...)                                 \
+  if (!(cond)) {                                        \
+    fprintf(stderr,"nettest: FAILED: " __VA_ARGS__);    \
+    fprintf(stderr,"\n");                               \
+    failures++;}
+
+/* A listener on the IPv4 loopback address only, returning its port */
+static int open_listener(int *sockp,int backlog)
+{
+  struct sockaddr_in addr; socklen_t len=sizeof(addr);
+  int lsock=socket(AF_INET,SOCK_STREAM,0);
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  addr.sin_port=0;
+  if ((bind(lsock,(struct sockaddr *)&addr,sizeof(addr))<0)||
+      (listen(lsock,backlog)<0)||
+      (getsockname(lsock,(struct sockaddr *)&addr,&len)<0)) {
+    perror("nettest");
+    exit(1);}
+  *sockp=lsock;
+  return ntohs(addr.sin_port);
+}
+
+static long long elapsed_msecs(long long start)
+{
+  return (u8_microtime()-start)/1000;
+}
+
+/* Connecting */
+
+static void test_connect()
+{
+  u8_byte spec[64]; u8_string addr=NULL;
+  int lsock, port=open_listener(&lsock,16);
+  long long start; long long msecs; u8_socket c;
+  /* Nothing answers this (private, unassigned) address, so it either
+     times out or fails right away if there's no route to it */
+  start=u8_microtime();
+  c=u8_connect_within("80@10.255.255.1",NULL,500);
+  msecs=elapsed_msecs(start);
+  CHECK(c<0,"connected to an unreachable address");
+  CHECK(msecs<1500,"took %lldms to give up after 500ms",msecs);
+  if (c>=0) close(c);
+  u8_clear_errors(0);
+  /* Once a listener's queue is full, new connections to it are left
+     waiting rather than refused */
+  {
+    int full, full_port=open_listener(&full,0), queued[4], i=0;
+    sprintf(spec,"%d@127.0.0.1",full_port);
+    while (i<4) {queued[i]=u8_connect_within(spec,NULL,100); i++;}
+    u8_clear_errors(0);
+    start=u8_microtime();
+    c=u8_connect_within(spec,NULL,500);
+    msecs=elapsed_msecs(start);
+    CHECK(c<0,"connected to %s with a full queue",spec);
+    CHECK(msecs>=400,"gave up on %s after only %lldms",spec,msecs);
+    CHECK(msecs<1500,"took %lldms to give up on %s after 500ms",msecs,spec);
+    if (c>=0) close(c);
+    u8_clear_errors(0);
+    i=0; while (i<4) {if (queued[i]>=0) close(queued[i]); i++;}
+    close(full);
+  }
+  /* Names are tried at each of their addresses, so this works even
+     if localhost resolves to ::1 first */
+  sprintf(spec,"%d@localhost",port);
+  c=u8_connect_within(spec,&addr,2000);
+  CHECK(c>=0,"couldn't connect to %s",spec);
+  if (c>=0) {
+    int sock=accept(lsock,NULL,NULL);
+    CHECK(sock>=0,"connection to %s wasn't accepted",spec);
+    CHECK((addr)&&(strstr(addr,"127.0.0.1")),"connected to %s rather than %s",
+          (addr)?(addr):((u8_string)"nothing"),"127.0.0.1");
+    if (sock>=0) close(sock);
+    close(c);}
+  if (addr) u8_free(addr);
+  u8_clear_errors(0);
+  /* A closed port is refused without waiting out the timeout */
+  close(lsock);
+  start=u8_microtime();
+  c=u8_connect_within(spec,NULL,5000);
+  msecs=elapsed_msecs(start);
+  CHECK(c<0,"connected to closed port %d",port);
+  CHECK(msecs<2500,"took %lldms to be refused",msecs);
+  if (c>=0) close(c);
+  u8_clear_errors(0);
+}
+
+/* Looking up hosts */
+
+/* Looks up a name, returning whether it resolved */
+static int lookup(u8_string name)
+{
+  int len=0; char **addrs=u8_lookup_host(name,&len,NULL);
+  if (addrs) {u8_free(addrs); return 1;}
+  else {u8_clear_errors(0); return 0;}
+}
+
+static void test_dns_cache()
+{
+  struct U8_DNS_STATS before, after;
+  int ttl=u8_dns_ttl, refresh=u8_dns_refresh, i=0;
+  u8_dns_flush(NULL);
+  CHECK(u8_dns_stats(&before)==0,"%d entries left after flushing",
+        before.n_entries);
+  /* The first lookup goes to the resolver and the second doesn't */
+  CHECK(lookup("localhost"),"couldn't look up localhost");
+  CHECK(lookup("localhost"),"couldn't look up localhost again");
+  u8_dns_stats(&after);
+  CHECK(after.misses==before.misses+1,"%lld misses rather than 1",
+        after.misses-before.misses);
+  CHECK(after.hits==before.hits+1,"%lld hits rather than 1",
+        after.hits-before.hits);
+  CHECK(after.n_entries==1,"%d entries rather than 1",after.n_entries);
+  /* Failures are remembered too, unless the resolver couldn't say
+     (this name is malformed, so no nameserver needs to be asked) */
+  before=after;
+  CHECK(!(lookup("nonexistent..invalid")),"looked up nonexistent..invalid");
+  CHECK(!(lookup("nonexistent..invalid")),"looked up nonexistent..invalid");
+  u8_dns_stats(&after);
+  if (after.temp_failures==before.temp_failures) {
+    CHECK(after.negative_hits==before.negative_hits+1,
+          "%lld negative hits rather than 1",
+          after.negative_hits-before.negative_hits);
+    CHECK(after.misses==before.misses+1,"%lld misses rather than 1",
+          after.misses-before.misses);}
+  else fprintf(stdout,"nettest: no negative entry (resolver unavailable)\n");
+  /* Flushed names are looked up again */
+  CHECK(u8_dns_flush("localhost")==1,"didn't flush localhost");
+  before=after;
+  lookup("localhost");
+  u8_dns_stats(&after);
+  CHECK(after.misses==before.misses+1,"flushed localhost wasn't a miss");
+  /* A refresh window longer than the TTL is cut to half of it, so a
+     fresh entry isn't renewed on every hit... */
+  u8_dns_ttl=2; u8_dns_refresh=10;
+  u8_dns_flush(NULL);
+  lookup("localhost");
+  u8_dns_stats(&before);
+  lookup("localhost"); lookup("localhost");
+  usleep(100000);
+  u8_dns_stats(&after);
+  CHECK(after.refreshes==before.refreshes,
+        "%lld refreshes of a fresh entry",after.refreshes-before.refreshes);
+  CHECK(after.hits==before.hits+2,"%lld hits rather than 2",
+        after.hits-before.hits);
+  /* ...but one used in the second half of its life is */
+  usleep(1200000);
+  lookup("localhost");
+  while ((i<50)&&(u8_dns_stats(&after)>=0)&&
+         (after.refreshes==before.refreshes)) {
+    usleep(20000); i++;}
+  CHECK(after.refreshes==before.refreshes+1,
+        "%lld refreshes of an aging entry",after.refreshes-before.refreshes);
+  /* Without a TTL nothing is cached */
+  u8_dns_ttl=0;
+  u8_dns_flush(NULL);
+  u8_dns_stats(&before);
+  lookup("localhost"); lookup("localhost");
+  u8_dns_stats(&after);
+  CHECK(after.misses==before.misses+2,"uncached lookups weren't misses");
+  CHECK(after.n_entries==0,"%d entries cached without a TTL",
+        after.n_entries);
+  u8_dns_ttl=ttl; u8_dns_refresh=refresh;
+}
+
+int main(int argc,char **argv)
+{
+  signal(SIGPIPE,SIG_IGN);
+  /* Fail rather than hang if a connection never gives up */
+  alarm(60);
+  u8_initialize();
+  u8_loglevel=LOG_ERR;
+  test_connect();
+  test_dns_cache();
+  if (failures) {
+    fprintf(stderr,"nettest: %d failures\n",failures);
+    return 1;}
+  else {
+    fprintf(stdout,"nettest: ok\n");
+    return 0;}
+}
@@ -0,0 +1,313 @@
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libu8/libu8.h"
+#include "libu8/u8netfns.h"
+
+/* Exercises connection pools from many threads at once: the free
+   stack, thread caches, waiting at the cap, and maintenance passes
+   running alongside checkouts. Connections go to an echo listener
+   started here. */
+
+#define NTHREADS 16
+#define NITERS 2000
+#define CAP 8
+#define WARM 12
+
+static int failures=0;
+
+#define CHECK(cond,...)                                 \
+  if (!(cond)) {                                        \
+    fprintf(stderr,"pooltest: FAILED: " __VA_ARGS__);   \
+    fprintf(stderr,"\n");                               \
+    __atomic_add_fetch(&failures,1,__ATOMIC_SEQ_CST);}
+
+/* The echo listener */
+
+static void *echo_conn(void *arg)
+{
+  int sock=(int)(long)arg; char buf[256]; ssize_t n;
+  while ((n=recv(sock,buf,sizeof(buf),0))>0)
+    if (send(sock,buf,n,0)!=n) break;
+  close(sock);
+  return NULL;
+}
+
+static void *echo_listener(void *arg)
+{
+  int lsock=(int)(long)arg;
+  while (1) {
+    pthread_t thread;
+    int sock=accept(lsock,NULL,NULL);
+    if (sock<0) continue;
+    pthread_create(&thread,NULL,echo_conn,(void *)(long)sock);
+    pthread_detach(thread);}
+  return NULL;
+}
+
+static int start_echo()
+{
+  struct sockaddr_in addr; socklen_t len=sizeof(addr);
+  pthread_t thread;
+  int lsock=socket(AF_INET,SOCK_STREAM,0);
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  addr.sin_port=0;
+  if ((bind(lsock,(struct sockaddr *)&addr,sizeof(addr))<0)||
+      (listen(lsock,256)<0)||
+      (getsockname(lsock,(struct sockaddr *)&addr,&len)<0)) {
+    perror("pooltest");
+    exit(1);}
+  pthread_create(&thread,NULL,echo_listener,(void *)(long)lsock);
+  return ntohs(addr.sin_port);
+}
+
+/* Checking out connections */
+
+static u8_connpool pool;
+/* Which thread (plus one) has each socket */
+static int holders[65536];
+static int max_open=0;
+/* Whether workers sometimes hold two connections, which could leave
+   them all waiting on a capped pool */
+static int hold_two=0;
+/* How many workers haven't finished */
+static int running=0;
+
+static int use_connection(u8_socket c)
+{
+  char byte='x';
+  return ((send(c,&byte,1,0)==1)&&(recv(c,&byte,1,0)==1));
+}
+
+static u8_socket checkout(long id)
+{
+  u8_socket c=u8_get_connection(pool);
+  int expect=0, n_open;
+  if (c<0) {
+    CHECK(0,"thread %ld couldn't get a connection",id);
+    u8_clear_errors(0);
+    return c;}
+  CHECK(c<65536,"socket %d out of range",c);
+  if (!(__atomic_compare_exchange_n(&(holders[c]),&expect,(int)id+1,0,
+                                    __ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST))) {
+    CHECK(0,"socket %d given to %ld while %d has it",c,id,expect-1);}
+  n_open=__atomic_load_n(&(pool->u8cp_n_open),__ATOMIC_SEQ_CST);
+  if (n_open>__atomic_load_n(&max_open,__ATOMIC_RELAXED))
+    __atomic_store_n(&max_open,n_open,__ATOMIC_RELAXED);
+  CHECK(use_connection(c),"socket %d doesn't work",c);
+  return c;
+}
+
+static void checkin(u8_socket c,int discard)
+{
+  __atomic_store_n(&(holders[c]),0,__ATOMIC_SEQ_CST);
+  if (discard) u8_discard_connection(pool,c);
+  else u8_return_connection(pool,c);
+}
+
+/* Takes and returns connections, sometimes discarding them and
+   (with hold_two) sometimes holding two at once */
+static void *worker(void *arg)
+{
+  long id=(long)arg; int i=0;
+  while (i<NITERS) {
+    u8_socket c=checkout(id), extra=-1;
+    if ((hold_two)&&((i%5)==0)) extra=checkout(id);
+    if (c>=0) checkin(c,((i%97)==0));
+    if (extra>=0) checkin(extra,0);
+    i++;}
+  return NULL;
+}
+
+static void run_workers(int n)
+{
+  pthread_t threads[NTHREADS];
+  long i=0;
+  max_open=0;
+  while (i<n) {
+    pthread_create(&(threads[i]),NULL,worker,(void *)i);
+    i++;}
+  i=0; while (i<n) pthread_join(threads[i++],NULL);
+}
+
+static void *counted_worker(void *arg)
+{
+  worker(arg);
+  __atomic_sub_fetch(&running,1,__ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+/* Takes every idle connection, returning how many there were */
+static int reclaim_all()
+{
+  u8_socket got[256]; int n=0, i=0, n_open=pool->u8cp_n_open;
+  while ((n<n_open)&&(n<256)&&((got[n]=u8_get_connection(pool))>=0)) n++;
+  while (i<n) u8_return_connection(pool,got[i++]);
+  return n;
+}
+
+static void test_capped(u8_string id)
+{
+  int n;
+  pool=u8_open_connpool(id,CAP,CAP,2);
+  run_workers(NTHREADS);
+  CHECK(max_open<=CAP,"capped pool opened %d connections (cap %d)",
+        max_open,CAP);
+  CHECK(pool->u8cp_n_inuse==0,"%d connections still in use",
+        pool->u8cp_n_inuse);
+  CHECK(pool->u8cp_n_waiting==0,"%d requests still waiting",
+        pool->u8cp_n_waiting);
+  /* Exiting threads put back what they cached */
+  CHECK(pool->u8cp_n_cached==0,"%d connections still cached",
+        pool->u8cp_n_cached);
+  n=reclaim_all();
+  CHECK(n==pool->u8cp_n_open,"reclaimed %d of %d idle connections",
+        n,pool->u8cp_n_open);
+  u8_close_connpool(pool,0);
+}
+
+static void test_thread_cache(u8_string id)
+{
+  u8_connpool other;
+  u8_socket c, again;
+  pool=u8_open_connpool(id,4,0,0);
+  /* Another (unregistered) pool for the same address */
+  other=u8_init_connpool(NULL,id,4,0,0);
+  c=u8_get_connection(pool);
+  u8_return_connection(pool,c);
+  CHECK(pool->u8cp_n_cached==1,"returned connection wasn't cached");
+  again=u8_get_connection(other);
+  u8_return_connection(other,again);
+  /* Closing another pool leaves this one's cached connection alone */
+  u8_free(u8_close_connpool(other,0));
+  again=u8_get_connection(pool);
+  CHECK(again==c,"got %d rather than the cached %d",again,c);
+  CHECK(pool->u8cp_n_cached==0,"taken connection still counted as cached");
+  u8_return_connection(pool,again);
+  /* Returning twice is refused */
+  c=u8_get_connection(pool);
+  u8_return_connection(pool,c);
+  CHECK(u8_return_connection(pool,c)<0,"returned %d twice",c);
+  u8_clear_errors(0);
+  u8_close_connpool(pool,0);
+}
+
+static void test_maintained(u8_string id)
+{
+  u8_socket got[32]; int i=0, n_open;
+  pool=u8_open_connpool(id,4,0,0);
+  while (i<32) {got[i]=u8_get_connection(pool); i++;}
+  i=0; while (i<32) u8_return_connection(pool,got[i++]);
+  n_open=pool->u8cp_n_open;
+  max_open=0; hold_two=1;
+  {
+    pthread_t threads[NTHREADS/2]; long j=0; int passes=0;
+    __atomic_store_n(&running,NTHREADS/2,__ATOMIC_SEQ_CST);
+    while (j<NTHREADS/2) {
+      pthread_create(&(threads[j]),NULL,counted_worker,(void *)j);
+      j++;}
+    while (__atomic_load_n(&running,__ATOMIC_SEQ_CST)>0) {
+      u8_connpool_maintain(pool); passes++;}
+    j=0; while (j<NTHREADS/2) pthread_join(threads[j++],NULL);
+    CHECK(passes>0,"no maintenance passes");
+  }
+  /* Connections being checked are still handed out, so the pool
+     doesn't grow past what its users hold */
+  CHECK(max_open<=n_open+2,"pool grew from %d to %d while maintained",
+        n_open,max_open);
+  CHECK(pool->u8cp_n_checking==0,"%d connections still being checked",
+        pool->u8cp_n_checking);
+  CHECK(pool->u8cp_n_inuse==0,"%d connections still in use",
+        pool->u8cp_n_inuse);
+  u8_close_connpool(pool,0);
+}
+
+static void *open_pool(void *id)
+{
+  pool=u8_open_connpool((u8_string)id,WARM,WARM,1);
+  u8_clear_errors(0);
+  return NULL;
+}
+
+/* Pools opened (or grown) with connections already made */
+static void test_warmed(u8_string id,int closed_port)
+{
+  u8_socket got[WARM]; int i=0;
+  u8_byte refused[64];
+  pool=u8_open_connpool(id,WARM,WARM,WARM/2);
+  CHECK(pool!=NULL,"couldn't open a pool warmed with %d connections",WARM/2);
+  if (pool==NULL) {u8_clear_errors(0); return;}
+  CHECK(pool->u8cp_n_open==WARM/2,"warmed pool opened %d connections, not %d",
+        pool->u8cp_n_open,WARM/2);
+  /* Growing the pool warms it up to the new count */
+  CHECK(u8_open_connpool(id,WARM,WARM*2,WARM)==pool,"reopened another pool");
+  CHECK(pool->u8cp_n_open==WARM,"grown pool has %d connections, not %d",
+        pool->u8cp_n_open,WARM);
+  /* All of them work and are handed out without opening more */
+  while (i<WARM) {got[i]=checkout(i); i++;}
+  CHECK(pool->u8cp_n_open==WARM,"pool opened %d more connections",
+        pool->u8cp_n_open-WARM);
+  i=0; while (i<WARM) {if (got[i]>=0) checkin(got[i],0); i++;}
+  u8_close_connpool(pool,0);
+  /* A pool which can't be warmed isn't opened (or left locked) */
+  sprintf(refused,"%d@127.0.0.1",closed_port);
+  CHECK(u8_open_connpool(refused,WARM,WARM,WARM/2)==NULL,
+        "opened a pool to closed port %d",closed_port);
+  u8_clear_errors(0);
+  {
+    /* From another thread, since this one may be let relock it */
+    pthread_t thread;
+    pthread_create(&thread,NULL,open_pool,(void *)id);
+    pthread_join(thread,NULL);
+    CHECK(pool!=NULL,"couldn't open a pool after one failed to warm");
+    if (pool) u8_close_connpool(pool,0);
+  }
+}
+
+/* A port nothing is listening on */
+static int closed_port()
+{
+  struct sockaddr_in addr; socklen_t len=sizeof(addr);
+  int sock=socket(AF_INET,SOCK_STREAM,0);
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  addr.sin_port=0;
+  if ((bind(sock,(struct sockaddr *)&addr,sizeof(addr))<0)||
+      (getsockname(sock,(struct sockaddr *)&addr,&len)<0)) {
+    perror("pooltest");
+    exit(1);}
+  close(sock);
+  return ntohs(addr.sin_port);
+}
+
+int main(int argc,char **argv)
+{
+  u8_byte id[64];
+  signal(SIGPIPE,SIG_IGN);
+  /* Fail rather than hang if a waiter is never woken */
+  alarm(120);
+  u8_initialize();
+  /* Leave out the notices and warnings the pools are expected to log */
+  u8_loglevel=LOG_ERR;
+  sprintf(id,"%d@127.0.0.1",start_echo());
+  test_capped(id);
+  test_thread_cache(id);
+  test_maintained(id);
+  test_warmed(id,closed_port());
+  if (failures) {
+    fprintf(stderr,"pooltest: %d failures\n",failures);
+    return 1;}
+  else {
+    fprintf(stdout,"pooltest: ok\n");
+    return 0;}
+}
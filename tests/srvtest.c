@@ -0,0 +1,1304 @@
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "libu8/libu8.h"
+#include "libu8/libu8io.h"
+#include "libu8/u8elapsed.h"
+#include "libu8/u8netfns.h"
+#include "libu8/u8srvfns.h"
+
+/* Checks latency histograms, the framing of client input (fed to a
+   server a few bytes at a time), the parsing of U8_SERVER_CPUS
+   lists, and servers answering clients with each of their options. */
+
+static int failures=0;
+
+#define CHECK(cond,...)                                 \
+  if (!(cond)) {                                        \
+    fprintf(stderr,"srvtest: FAILED: " __VA_ARGS__);    \
+    fprintf(stderr,"\n");                               \
+    failures++;}
+
+/* Histograms */
+
+/* The value a histogram reports for a single recorded value */
+static long long bucket_of(long long value)
+{
+  struct U8_HISTOGRAM h;
+  memset(&h,0,sizeof(h));
+  u8_histogram_record(&h,value);
+  return u8_histogram_percentile(&h,100);
+}
+
+static void test_histograms()
+{
+  struct U8_HISTOGRAM h, both;
+  long long v, last=0;
+  int i;
+  /* Small values are exact */
+  v=0; while (v<(2<<U8_HISTOGRAM_SUB_BITS)) {
+    CHECK(bucket_of(v)==v,"%lld reported as %lld",v,bucket_of(v));
+    v++;}
+  /* Larger ones are reported as the top of their bucket, which is
+     within 1/2^SUB_BITS of the value */
+  v=(2<<U8_HISTOGRAM_SUB_BITS); while (v<(1LL<<U8_HISTOGRAM_MAX_BITS)) {
+    long long probes[3]={v-1,v,v+(v/3)};
+    i=0; while (i<3) {
+      long long p=probes[i++], top=bucket_of(p);
+      CHECK((top>=p)&&((top-p)<=(p>>U8_HISTOGRAM_SUB_BITS)),
+            "%lld reported as %lld",p,top);}
+    CHECK(bucket_of(v)>=last,"buckets out of order at %lld",v);
+    last=bucket_of(v);
+    v=v*2;}
+  /* Negative values count as zero and huge ones share the last bucket */
+  CHECK(bucket_of(-5)==0,"-5 reported as %lld",bucket_of(-5));
+  CHECK(bucket_of(1LL<<U8_HISTOGRAM_MAX_BITS)==bucket_of(1LL<<62),
+        "values past the last bucket aren't lumped together");
+  /* Percentiles */
+  memset(&h,0,sizeof(h));
+  CHECK(u8_histogram_percentile(&h,50)==0,"empty histogram has a median");
+  v=1; while (v<=1000) u8_histogram_record(&h,v++);
+  CHECK(u8_histogram_count(&h)==1000,"counted %lld of 1000",
+        u8_histogram_count(&h));
+  v=u8_histogram_percentile(&h,50);
+  CHECK((v>=500)&&(v<=516),"median of 1..1000 is %lld",v);
+  v=u8_histogram_percentile(&h,99);
+  CHECK((v>=990)&&(v<=1022),"99th percentile of 1..1000 is %lld",v);
+  CHECK(u8_histogram_percentile(&h,0)==1,"minimum of 1..1000 is %lld",
+        u8_histogram_percentile(&h,0));
+  memset(&both,0,sizeof(both));
+  u8_histogram_merge(&both,&h);
+  u8_histogram_merge(&both,&h);
+  CHECK(u8_histogram_count(&both)==2000,"merged %lld of 2000",
+        u8_histogram_count(&both));
+  CHECK(u8_histogram_percentile(&both,50)==u8_histogram_percentile(&h,50),
+        "merging copies changed the median");
+}
+
+/* Framing */
+
+/* The framing of the next accepted client */
+static int next_framing=U8_CLIENT_FRAME_NONE;
+static size_t next_size=0;
+static const char *next_delim=NULL;
+#define MAX_FRAME 64
+
+static u8_client frame_accept(u8_server srv,u8_socket sock,
+                              struct sockaddr *addr,size_t addr_len)
+{
+  u8_client cl=u8_client_init(NULL,sizeof(struct U8_CLIENT),
+                              addr,addr_len,sock,srv);
+  u8_client_framing(cl,next_framing,next_size,next_delim,MAX_FRAME);
+  return cl;
+}
+
+/* Answers each frame with its length (as four bytes) and contents */
+static int frame_serve(u8_client cl)
+{
+  size_t len; unsigned char *data=u8_client_frame(cl,&len);
+  unsigned char header[4];
+  if (data==NULL) return -1;
+  header[0]=(len>>24)&0xFF; header[1]=(len>>16)&0xFF;
+  header[2]=(len>>8)&0xFF; header[3]=len&0xFF;
+  if ((send(cl->socket,header,4,0)<0)||
+      ((len)&&(send(cl->socket,data,len,0)<0)))
+    return -1;
+  return 0;
+}
+
+static int frame_close(u8_client cl)
+{
+  close(cl->socket);
+  cl->socket=-1;
+  return 1;
+}
+
+static int read_all(int sock,unsigned char *buf,size_t len)
+{
+  size_t got=0;
+  while (got<len) {
+    ssize_t n=recv(sock,buf+got,len-got,0);
+    /* A server's io_uring can interrupt the thread which set it up */
+    if ((n<0)&&(errno==EINTR)) continue;
+    else if (n<=0) return 0;
+    got+=n;}
+  return 1;
+}
+
+static int frame_client(int port,int framing,size_t size,const char *delim)
+{
+  struct sockaddr_in addr; int sock=socket(AF_INET,SOCK_STREAM,0), on=1;
+  struct timeval timeout={10,0};
+  next_framing=framing; next_size=size; next_delim=delim;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  addr.sin_port=htons(port);
+  if (connect(sock,(struct sockaddr *)&addr,sizeof(addr))<0) {
+    perror("srvtest");
+    exit(1);}
+  setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+  setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+  return sock;
+}
+
+/* Sends input in pieces (of the lengths in a zero-terminated array),
+   pausing between them so that frames (and delimiters and length
+   prefixes) arrive split across reads */
+static void send_input(int sock,const char *input,const int *pieces)
+{
+  while (*pieces) {
+    if (send(sock,input,*pieces,0)<0) return;
+    input+=*pieces++;
+    if (*pieces) usleep(100000);}
+}
+
+static void expect_frame(int sock,const char *what,const char *frame,
+                         size_t len)
+{
+  unsigned char header[4], buf[MAX_FRAME+1];
+  size_t got;
+  if (!(read_all(sock,header,4))) {
+    CHECK(0,"%s: no response for a %d byte frame",what,(int)len);
+    return;}
+  got=(header[0]<<24)|(header[1]<<16)|(header[2]<<8)|header[3];
+  CHECK(got==len,"%s: got a %d byte frame rather than %d",
+        what,(int)got,(int)len);
+  if ((got!=len)||(got>MAX_FRAME)) return;
+  CHECK(read_all(sock,buf,got)&&(memcmp(buf,frame,len)==0),
+        "%s: wrong contents for a %d byte frame",what,(int)len);
+}
+
+static void expect_closed(int sock,const char *what)
+{
+  unsigned char byte;
+  CHECK(recv(sock,&byte,1,0)==0,"%s: connection not closed",what);
+}
+
+static struct U8_SERVER frame_server;
+
+static void *run_server(void *arg)
+{
+  u8_server_loop((u8_server)arg);
+  return NULL;
+}
+
+static int free_port()
+{
+  struct sockaddr_in addr; socklen_t len=sizeof(addr);
+  int sock=socket(AF_INET,SOCK_STREAM,0), port;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  bind(sock,(struct sockaddr *)&addr,sizeof(addr));
+  getsockname(sock,(struct sockaddr *)&addr,&len);
+  port=ntohs(addr.sin_port);
+  close(sock);
+  return port;
+}
+
+static void test_framing()
+{
+  pthread_t thread; char spec[64]; int port=free_port(), sock;
+  /* "hello\r" "\nwor\r" "ld\r" "\n\r" "\n" */
+  static const char delimited[]="hello\r\nwor\rld\r\n\r\n";
+  static const int delimited_pieces[]={6,5,3,2,1,0};
+  /* "\0" "\5hel" "lo\0" "\0\0\3abc" */
+  static const char prefixed[]="\0\5hello\0\0\0\3abc";
+  static const int prefixed_pieces[]={1,4,3,6,0};
+  static const char oversize[]="\0\101";
+  static const int oversize_pieces[]={1,1,0};
+  static const int fixed_pieces[]={10,0}, fixed_rest[]={1,1,0};
+  u8_init_server(&frame_server,frame_accept,frame_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_END_INIT);
+  sprintf(spec,"127.0.0.1:%d",port);
+  if (u8_add_server(&frame_server,spec,0)<=0) {
+    CHECK(0,"couldn't listen on %s",spec);
+    return;}
+  pthread_create(&thread,NULL,run_server,(void *)&frame_server);
+
+  /* Delimited frames, with the delimiter split across reads and a
+     partial delimiter inside a frame */
+  sock=frame_client(port,U8_CLIENT_FRAME_DELIM,0,"\r\n");
+  send_input(sock,delimited,delimited_pieces);
+  expect_frame(sock,"delim","hello",5);
+  expect_frame(sock,"delim","wor\rld",6);
+  expect_frame(sock,"delim","",0);
+  close(sock);
+
+  /* Length prefixed frames, with the prefix split, an empty frame,
+     and then one which is too big */
+  sock=frame_client(port,U8_CLIENT_FRAME_LENGTH,2,NULL);
+  send_input(sock,prefixed,prefixed_pieces);
+  expect_frame(sock,"length","hello",5);
+  expect_frame(sock,"length","",0);
+  expect_frame(sock,"length","abc",3);
+  send_input(sock,oversize,oversize_pieces);
+  expect_closed(sock,"length");
+  close(sock);
+
+  /* Fixed size frames, several in one write */
+  sock=frame_client(port,U8_CLIENT_FRAME_FIXED,4,NULL);
+  send_input(sock,"abcdefghij",fixed_pieces);
+  expect_frame(sock,"fixed","abcd",4);
+  expect_frame(sock,"fixed","efgh",4);
+  send_input(sock,"kl",fixed_rest);
+  expect_frame(sock,"fixed","ijkl",4);
+  close(sock);
+
+  u8_server_shutdown(&frame_server,100000);
+  pthread_join(thread,NULL);
+}
+
+/* Serving blobs */
+
+/* Starts a server listening on a free port of the loopback address,
+   returning the port or 0 */
+static int start_server(struct U8_SERVER *srv,pthread_t *thread)
+{
+  char spec[64]; int port=free_port();
+  sprintf(spec,"127.0.0.1:%d",port);
+  if (u8_add_server(srv,spec,0)<=0) {
+    CHECK(0,"couldn't listen on %s",spec);
+    return 0;}
+  pthread_create(thread,NULL,run_server,(void *)srv);
+  return port;
+}
+
+/* Waits for the server to close its clients, returning 1 if it has */
+static int await_no_clients(struct U8_SERVER *srv)
+{
+  int i=0;
+  while ((srv->n_clients>0)&&(i<100)) {usleep(20000); i++;}
+  return (srv->n_clients==0);
+}
+
+/* Shuts down a server started by start_server(), once it has closed
+   its clients (those still queued when it shuts down would be forced
+   closed) */
+static void stop_server(struct U8_SERVER *srv,pthread_t thread)
+{
+  CHECK(await_no_clients(srv),"%d clients left open at shutdown",
+        srv->n_clients);
+  u8_server_shutdown(srv,100000);
+  pthread_join(thread,NULL);
+}
+
+static unsigned char blob_byte(size_t i,size_t size)
+{
+  return (unsigned char)((i*7+size)&0xFF);
+}
+
+/* Answers each request (a four byte frame giving a size) with a
+   blob of that many bytes, written by the event loop */
+static int blob_serve(u8_client cl)
+{
+  unsigned char *data, *blob; size_t len, size, i=0;
+  /* Called again once the blob has been written */
+  if (cl->writing>0) {
+    u8_client_finished(cl);
+    return 0;}
+  data=u8_client_frame(cl,&len);
+  if ((data==NULL)||(len!=4)) return -1;
+  size=(data[0]<<24)|(data[1]<<16)|(data[2]<<8)|data[3];
+  if (size==0) return -1;
+  blob=u8_malloc(size);
+  while (i<size) {blob[i]=blob_byte(i,size); i++;}
+  u8_client_write_x(cl,blob,size,0,U8_CLIENT_WRITE_OWNBUF);
+  return 1;
+}
+
+static int blob_client(int port)
+{
+  return frame_client(port,U8_CLIENT_FRAME_FIXED,4,NULL);
+}
+
+static void ask_blob(int sock,size_t size)
+{
+  unsigned char request[4];
+  request[0]=(size>>24)&0xFF; request[1]=(size>>16)&0xFF;
+  request[2]=(size>>8)&0xFF; request[3]=size&0xFF;
+  send(sock,request,4,0);
+}
+
+/* Reads a blob, returning 1 if it's all there and intact */
+static int read_blob(int sock,size_t size)
+{
+  unsigned char *buf=u8_malloc(size); size_t i=0; int ok;
+  ok=read_all(sock,buf,size);
+  while ((ok)&&(i<size)) {
+    if (buf[i]!=blob_byte(i,size)) ok=0;
+    i++;}
+  u8_free(buf);
+  return ok;
+}
+
+/* Asks several clients for blobs of various sizes in turn, with
+   some requests sent before the previous answer has been read */
+static void exchange_blobs(const char *what,int port,int n_clients,
+                           int n_rounds)
+{
+  int socks[16], c=0, round=0;
+  while (c<n_clients) socks[c++]=blob_client(port);
+  while (round<n_rounds) {
+    c=0; while (c<n_clients) {
+      size_t size=1+round*1000+c*37;
+      ask_blob(socks[c],size);
+      if (round%2) ask_blob(socks[c],size+1);
+      CHECK(read_blob(socks[c],size),
+            "%s: client %d didn't get a %d byte blob",what,c,(int)size);
+      if (round%2)
+        CHECK(read_blob(socks[c],size+1),
+              "%s: client %d didn't get a %d byte blob",
+              what,c,(int)size+1);
+      c++;}
+    round++;}
+  c=0; while (c<n_clients) close(socks[c++]);
+}
+
+static void test_epoll()
+{
+  struct U8_SERVER srv; pthread_t thread; int port;
+  u8_init_server(&srv,frame_accept,blob_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_FLAGS,U8_SERVER_EPOLL,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  exchange_blobs("epoll",port,4,6);
+  /* The flag is cleared if epoll isn't available */
+  CHECK((!((srv.flags)&(U8_SERVER_EPOLL)))||(srv.epoll_fd>=0),
+        "epoll server has no epoll descriptor");
+  stop_server(&srv,thread);
+}
+
+/* A blob client with a small receive buffer, so that big blobs
+   can only be written a piece at a time */
+static int slow_blob_client(int port)
+{
+  struct sockaddr_in addr; int sock=socket(AF_INET,SOCK_STREAM,0);
+  int rcvbuf=4096; struct timeval timeout={10,0};
+  next_framing=U8_CLIENT_FRAME_FIXED; next_size=4; next_delim=NULL;
+  setsockopt(sock,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  addr.sin_port=htons(port);
+  if (connect(sock,(struct sockaddr *)&addr,sizeof(addr))<0) {
+    perror("srvtest");
+    exit(1);}
+  setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+  return sock;
+}
+
+static void test_uring()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, socks[3], i=0;
+  size_t size=4*1024*1024;
+  u8_init_server(&srv,frame_accept,blob_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 /* Writes to blocking sockets are never partial */
+                 U8_SERVER_FLAGS,U8_SERVER_IO_URING|U8_SERVER_NONBLOCK,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  exchange_blobs("io_uring",port,4,4);
+  /* Blobs which don't fit in the socket buffers, so that the rest of
+     each write is handed to the ring while the clients wait */
+  while (i<3) {
+    socks[i]=slow_blob_client(port);
+    ask_blob(socks[i],size+i);
+    i++;}
+  usleep(200000);
+  i=0; while (i<3) {
+    CHECK(read_blob(socks[i],size+i),
+          "io_uring: client %d didn't get a %d byte blob",i,(int)(size+i));
+    close(socks[i++]);}
+  /* The flag is cleared if io_uring isn't available */
+  CHECK((!((srv.flags)&(U8_SERVER_IO_URING)))||(srv.uring!=NULL),
+        "io_uring server has no ring");
+  stop_server(&srv,thread);
+}
+
+static void test_shards()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, i=0;
+  u8_init_server(&srv,frame_accept,blob_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_SHARDS,2,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  CHECK(srv.n_shards==2,"sharded server has %d shards",srv.n_shards);
+  exchange_blobs("shards",port,16,2);
+  /* The kernel spreads connections over the shards' listeners */
+  while (i<srv.n_shards) {
+    CHECK(srv.shards[i].n_accepted>0,"shard %d accepted no connections",i);
+    i++;}
+  stop_server(&srv,thread);
+}
+
+static int n_blocking=0;
+
+/* Counts clients accepted with blocking sockets */
+static u8_client nonblock_accept(u8_server srv,u8_socket sock,
+                                 struct sockaddr *addr,size_t addr_len)
+{
+  if (!((fcntl(sock,F_GETFL))&(O_NONBLOCK)))
+    __atomic_add_fetch(&n_blocking,1,__ATOMIC_SEQ_CST);
+  return frame_accept(srv,sock,addr,addr_len);
+}
+
+static void test_accept()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, socks[64], i=0;
+  u8_init_server(&srv,nonblock_accept,blob_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_FLAGS,U8_SERVER_NONBLOCK,
+                 U8_SERVER_BACKLOG,16,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  /* Connections arriving together are taken in batches */
+  while (i<64) socks[i++]=blob_client(port);
+  i=0; while (i<64) ask_blob(socks[i++],100);
+  i=0; while (i<64) {
+    CHECK(read_blob(socks[i],100),"accept: client %d not answered",i);
+    i++;}
+  CHECK(srv.n_accepted==64,"accept: accepted %ld of 64 clients",
+        srv.n_accepted);
+  CHECK(n_blocking==0,"accept: %d clients accepted with blocking sockets",
+        n_blocking);
+  i=0; while (i<64) close(socks[i++]);
+  stop_server(&srv,thread);
+}
+
+/* The threads which have called inline_serve */
+static pthread_t serving_threads[8];
+static int n_serving_threads=0;
+static pthread_mutex_t serving_lock=PTHREAD_MUTEX_INITIALIZER;
+
+static int inline_serve(u8_client cl)
+{
+  pthread_t self=pthread_self(); int i=0;
+  pthread_mutex_lock(&serving_lock);
+  while ((i<n_serving_threads)&&(!(pthread_equal(serving_threads[i],self))))
+    i++;
+  if ((i==n_serving_threads)&&(i<8))
+    serving_threads[n_serving_threads++]=self;
+  pthread_mutex_unlock(&serving_lock);
+  return blob_serve(cl);
+}
+
+static void test_inline()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, i=0;
+  /* The listener (here the thread running the server) serves clients */
+  n_serving_threads=0;
+  u8_init_server(&srv,frame_accept,inline_serve,NULL,frame_close,
+                 U8_SERVER_FLAGS,U8_SERVER_INLINE,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  CHECK(srv.n_threads==1,"inline: server has %d threads",srv.n_threads);
+  exchange_blobs("inline",port,4,4);
+  CHECK((n_serving_threads==1)&&(pthread_equal(serving_threads[0],thread)),
+        "inline: served by %d threads other than the listener",
+        n_serving_threads);
+  stop_server(&srv,thread);
+  /* Each inline shard is its own single thread */
+  n_serving_threads=0;
+  u8_init_server(&srv,frame_accept,inline_serve,NULL,frame_close,
+                 U8_SERVER_FLAGS,U8_SERVER_INLINE,
+                 U8_SERVER_SHARDS,2,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  exchange_blobs("inline shards",port,16,2);
+  while (i<srv.n_shards) {
+    CHECK(srv.shards[i].n_accepted>0,
+          "inline: shard %d accepted no connections",i);
+    i++;}
+  CHECK(n_serving_threads==srv.n_shards,
+        "inline: %d shards served by %d threads",
+        srv.n_shards,n_serving_threads);
+  stop_server(&srv,thread);
+}
+
+static u8_client last_accepted=NULL;
+
+static u8_client pool_accept(u8_server srv,u8_socket sock,
+                             struct sockaddr *addr,size_t addr_len)
+{
+  return (last_accepted=frame_accept(srv,sock,addr,addr_len));
+}
+
+static void test_pooling()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, sock;
+  u8_client first; unsigned char *buf, *again;
+  u8_init_server(&srv,pool_accept,blob_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  sock=blob_client(port);
+  ask_blob(sock,100);
+  CHECK(read_blob(sock,100),"pooling: first client not answered");
+  first=last_accepted;
+  CHECK((first->flags)&(U8_CLIENT_POOLED),
+        "pooling: consed client can't go back to the pool");
+  close(sock);
+  CHECK(await_no_clients(&srv),"pooling: first client not closed");
+  /* The next client reuses the first one's struct */
+  sock=blob_client(port);
+  ask_blob(sock,100);
+  CHECK(read_blob(sock,100),"pooling: second client not answered");
+  CHECK(last_accepted==first,"pooling: client struct wasn't reused");
+  /* A returned buffer is handed out again for a similar size */
+  buf=u8_client_getbuf(last_accepted,100000);
+  CHECK(buf!=NULL,"pooling: couldn't get a buffer");
+  u8_client_putbuf(last_accepted,buf);
+  again=u8_client_getbuf(last_accepted,70000);
+  CHECK(again==buf,"pooling: returned buffer wasn't reused");
+  u8_client_putbuf(last_accepted,again);
+  close(sock);
+  stop_server(&srv,thread);
+}
+
+#define N_SLOT_CLIENTS 40
+
+/* Connects and serves N_SLOT_CLIENTS clients at once, returning how
+   many were answered */
+static int fill_slots(int *socks,int port)
+{
+  int c=0, n_answered=0;
+  while (c<N_SLOT_CLIENTS) socks[c++]=blob_client(port);
+  c=0; while (c<N_SLOT_CLIENTS) {
+    ask_blob(socks[c],10+c);
+    if (read_blob(socks[c],10+c)) n_answered++;
+    c++;}
+  return n_answered;
+}
+
+static void test_slots()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, c, max_slot;
+  int socks[N_SLOT_CLIENTS];
+  u8_init_server(&srv,frame_accept,blob_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_INIT_CLIENTS,2,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  c=fill_slots(socks,port);
+  CHECK(c==N_SLOT_CLIENTS,"slots: %d of %d clients answered",
+        c,N_SLOT_CLIENTS);
+  CHECK(srv.n_clients==N_SLOT_CLIENTS,"slots: %d clients rather than %d",
+        srv.n_clients,N_SLOT_CLIENTS);
+  CHECK(srv.clients_len>=N_SLOT_CLIENTS,"slots: tables didn't grow (%d)",
+        srv.clients_len);
+  max_slot=srv.max_slot;
+  c=0; while (c<N_SLOT_CLIENTS) close(socks[c++]);
+  CHECK(await_no_clients(&srv),"slots: %d clients left open",srv.n_clients);
+  /* New clients take the freed slots */
+  c=fill_slots(socks,port);
+  CHECK(c==N_SLOT_CLIENTS,"slots: %d of %d new clients answered",
+        c,N_SLOT_CLIENTS);
+  CHECK(srv.max_slot<=max_slot,"slots: used range grew from %d to %d",
+        max_slot,srv.max_slot);
+  c=0; while (c<N_SLOT_CLIENTS) close(socks[c++]);
+  CHECK(await_no_clients(&srv),"slots: %d new clients left open",
+        srv.n_clients);
+  stop_server(&srv,thread);
+}
+
+/* Sending files */
+
+#define SEND_FILE_SIZE (8*1024*1024)
+#define SEND_FILE_OFFSET 7
+static char send_file[64];
+
+/* Answers each request (a four byte frame giving a size) by sending
+   that many bytes of send_file, starting at SEND_FILE_OFFSET */
+static int file_serve(u8_client cl)
+{
+  unsigned char *data; size_t len, size; int fd;
+  if (cl->writing>0) {
+    u8_client_finished(cl);
+    return 0;}
+  data=u8_client_frame(cl,&len);
+  if ((data==NULL)||(len!=4)) return -1;
+  size=(data[0]<<24)|(data[1]<<16)|(data[2]<<8)|data[3];
+  if ((fd=open(send_file,O_RDONLY))<0) return -1;
+  if (u8_client_sendfile(cl,fd,SEND_FILE_OFFSET,size)>0) return 1;
+  close(fd);
+  return -1;
+}
+
+/* Reads a piece of send_file, returning 1 if it's all there and intact */
+static int read_file_piece(int sock,size_t size)
+{
+  unsigned char *buf=u8_malloc(size); size_t i=0; int ok;
+  ok=read_all(sock,buf,size);
+  while ((ok)&&(i<size)) {
+    if (buf[i]!=blob_byte(SEND_FILE_OFFSET+i,0)) ok=0;
+    i++;}
+  u8_free(buf);
+  return ok;
+}
+
+static void test_sendfile()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, sock, fd;
+  size_t i=0, size=SEND_FILE_SIZE-SEND_FILE_OFFSET;
+  unsigned char *contents=u8_malloc(SEND_FILE_SIZE);
+  strcpy(send_file,"/tmp/srvtestXXXXXX");
+  if ((fd=mkstemp(send_file))<0) {
+    CHECK(0,"sendfile: couldn't make a file to send");
+    u8_free(contents);
+    return;}
+  while (i<SEND_FILE_SIZE) {contents[i]=blob_byte(i,0); i++;}
+  CHECK(write(fd,contents,SEND_FILE_SIZE)==SEND_FILE_SIZE,
+        "sendfile: couldn't write the file to send");
+  close(fd); u8_free(contents);
+  u8_init_server(&srv,frame_accept,file_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_FLAGS,U8_SERVER_NONBLOCK,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) {
+    unlink(send_file);
+    return;}
+  sock=blob_client(port);
+  ask_blob(sock,100);
+  CHECK(read_file_piece(sock,100),"sendfile: didn't get 100 bytes");
+  /* A client slow to read gets the rest of the file a piece at a time */
+  close(sock); sock=slow_blob_client(port);
+  ask_blob(sock,size); usleep(200000);
+  CHECK(read_file_piece(sock,size),"sendfile: didn't get %d bytes",
+        (int)size);
+  /* Asking for more than the file holds gets what it has and EOF */
+  ask_blob(sock,size+10);
+  CHECK(read_file_piece(sock,size),"sendfile: didn't get the whole file");
+  expect_closed(sock,"sendfile");
+  close(sock);
+  stop_server(&srv,thread);
+  unlink(send_file);
+}
+
+/* Writing segment chains */
+
+static int n_segs_freed=0;
+
+static void free_seg(unsigned char *data,void *state)
+{
+  u8_free(data);
+  __atomic_add_fetch(&n_segs_freed,1,__ATOMIC_SEQ_CST);
+}
+
+/* Answers each request (a four byte frame giving a size) with a blob
+   in four segments (the third of them empty) */
+static int chain_serve(u8_client cl)
+{
+  struct U8_CLIENT_SEGMENT segs[4];
+  unsigned char *data; size_t len, size, bounds[5], i=0;
+  int j=0;
+  if (cl->writing>0) {
+    u8_client_finished(cl);
+    return 0;}
+  data=u8_client_frame(cl,&len);
+  if ((data==NULL)||(len!=4)) return -1;
+  size=(data[0]<<24)|(data[1]<<16)|(data[2]<<8)|data[3];
+  bounds[0]=0; bounds[1]=size/3; bounds[2]=bounds[3]=size/2;
+  bounds[4]=size;
+  while (j<4) {
+    size_t seg_len=bounds[j+1]-bounds[j];
+    segs[j].data=u8_malloc(seg_len+1); segs[j].len=seg_len;
+    segs[j].freefn=free_seg; segs[j].freestate=NULL;
+    i=0; while (i<seg_len) {
+      segs[j].data[i]=blob_byte(bounds[j]+i,size); i++;}
+    j++;}
+  if (u8_client_writev(cl,segs,4)>0) return 1;
+  else return -1;
+}
+
+static void test_writev()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, sock;
+  size_t size=8*1024*1024;
+  u8_init_server(&srv,frame_accept,chain_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_FLAGS,U8_SERVER_NONBLOCK,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  exchange_blobs("writev",port,2,3);
+  /* A client slow to read gets the chain a piece at a time, with
+     segments split between writes */
+  sock=slow_blob_client(port);
+  ask_blob(sock,size); usleep(200000);
+  CHECK(read_blob(sock,size),"writev: didn't get a %d byte chain",
+        (int)size);
+  close(sock);
+  stop_server(&srv,thread);
+  /* Every segment of the nine chains was freed once, including the
+     empty ones */
+  CHECK(n_segs_freed==4*9,"writev: freed %d of %d segments",
+        n_segs_freed,4*9);
+}
+
+/* Sleeping */
+
+/* Answers each line ("sleep <msecs>") with "ok" after sleeping */
+static int sleep_serve(u8_client cl)
+{
+  size_t len; char *data=(char *)u8_client_frame(cl,&len);
+  if ((data==NULL)||(len<7)||(strncmp(data,"sleep ",6)))
+    return -1;
+  usleep(atoi(data+6)*1000);
+  if (send(cl->socket,"ok\n",3,0)!=3) return -1;
+  return 0;
+}
+
+static int sleep_client(int port)
+{
+  return frame_client(port,U8_CLIENT_FRAME_DELIM,0,"\n");
+}
+
+static void ask_sleep(int sock,int msecs)
+{
+  char request[32];
+  sprintf(request,"sleep %d\n",msecs);
+  send(sock,request,strlen(request),0);
+}
+
+static int read_ok(int sock)
+{
+  unsigned char buf[3];
+  return ((read_all(sock,buf,3))&&(memcmp(buf,"ok\n",3)==0));
+}
+
+static long long msecs_since(u8_utime start)
+{
+  return (u8_microtime()-start)/1000;
+}
+
+static void test_stealing()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, slow, slower, i=0;
+  int quick[4]; u8_utime start;
+  u8_init_server(&srv,frame_accept,sleep_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  /* Both threads are kept busy, one for much longer than the other */
+  slower=sleep_client(port); slow=sleep_client(port);
+  ask_sleep(slower,2000); usleep(50000);
+  ask_sleep(slow,300); usleep(50000);
+  /* Some of these are queued for the thread which is busy for longer,
+     so the other has to steal them to answer them all in time */
+  while (i<4) quick[i++]=sleep_client(port);
+  start=u8_microtime();
+  i=0; while (i<4) ask_sleep(quick[i++],0);
+  i=0; while (i<4) {
+    CHECK(read_ok(quick[i]),"stealing: quick request %d not answered",i);
+    i++;}
+  CHECK(msecs_since(start)<1000,
+        "stealing: quick requests took %lldms behind a slow one",
+        msecs_since(start));
+  CHECK(read_ok(slow),"stealing: slow request not answered");
+  CHECK(read_ok(slower),"stealing: slower request not answered");
+  i=0; while (i<4) close(quick[i++]);
+  close(slow); close(slower);
+  stop_server(&srv,thread);
+}
+
+static void test_overload()
+{
+  struct U8_SERVER srv; pthread_t thread;
+  int port, busy, queued, paused, rejected;
+  unsigned char byte;
+  u8_init_server(&srv,frame_accept,sleep_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,1,
+                 U8_SERVER_MAX_QUEUE,1,
+                 U8_SERVER_OVERLOAD,U8_OVERLOAD_REJECT|U8_OVERLOAD_PAUSE,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  /* One request keeps the only thread busy and another fills the
+     queue, so the next is paused and new connections are refused */
+  busy=sleep_client(port); queued=sleep_client(port);
+  paused=sleep_client(port);
+  ask_sleep(busy,1000); usleep(100000);
+  ask_sleep(queued,0); usleep(100000);
+  ask_sleep(paused,0); usleep(100000);
+  rejected=sleep_client(port);
+  CHECK(recv(rejected,&byte,1,0)==0,"overload: new connection not closed");
+  CHECK(srv.n_rejected>=1,"overload: no connections rejected");
+  CHECK(srv.n_overloads>=1,"overload: queue never full");
+  /* The queued and paused requests are answered once it drains */
+  CHECK(read_ok(busy),"overload: busy request not answered");
+  CHECK(read_ok(queued),"overload: queued request not answered");
+  CHECK(read_ok(paused),"overload: paused request not answered");
+  close(busy); close(queued); close(paused); close(rejected);
+  stop_server(&srv,thread);
+}
+
+static void test_timeouts()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, idle, busy, i=0;
+  unsigned char byte; u8_utime start;
+  u8_init_server(&srv,frame_accept,sleep_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_IDLE_TIMEOUT,300,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  idle=sleep_client(port); busy=sleep_client(port);
+  start=u8_microtime();
+  /* A client which keeps making requests isn't idle */
+  while (i<8) {
+    ask_sleep(busy,0);
+    CHECK(read_ok(busy),"timeouts: request %d not answered",i);
+    usleep(100000);
+    i++;}
+  CHECK(recv(idle,&byte,1,0)==0,"timeouts: idle client not closed");
+  CHECK(msecs_since(start)<3000,"timeouts: idle client closed after %lldms",
+        msecs_since(start));
+  CHECK(srv.n_timeouts>=1,"timeouts: no timeouts counted");
+  ask_sleep(busy,0);
+  CHECK(read_ok(busy),"timeouts: busy client closed");
+  close(idle); close(busy);
+  stop_server(&srv,thread);
+}
+
+static void test_adaptive()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, socks[6], i=0;
+  u8_init_server(&srv,frame_accept,sleep_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,1,
+                 U8_SERVER_MIN_THREADS,1,
+                 U8_SERVER_MAX_THREADS,4,
+                 U8_SERVER_QUEUE_TARGET,1000,
+                 U8_SERVER_THREAD_IDLE,200,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  CHECK(srv.n_threads==1,"adaptive: started with %d threads",srv.n_threads);
+  /* Requests waiting in the queue make the pool grow */
+  while (i<6) socks[i++]=sleep_client(port);
+  i=0; while (i<6) ask_sleep(socks[i++],500);
+  i=0; while (i<6) {
+    CHECK(read_ok(socks[i]),"adaptive: request %d not answered",i);
+    i++;}
+  CHECK(srv.n_grown>0,"adaptive: the pool never grew");
+  /* And threads left idle are retired */
+  i=0; while ((srv.n_threads>1)&&(i<100)) {usleep(50000); i++;}
+  CHECK(srv.n_threads==1,"adaptive: %d threads left after idling",
+        srv.n_threads);
+  CHECK(srv.n_retired==srv.n_grown,"adaptive: grew %ld threads but retired %ld",
+        srv.n_grown,srv.n_retired);
+  /* The one thread left still answers */
+  ask_sleep(socks[0],0);
+  CHECK(read_ok(socks[0]),"adaptive: not answered after shrinking");
+  i=0; while (i<6) close(socks[i++]);
+  stop_server(&srv,thread);
+}
+
+static int n_parked=0;
+
+/* Reads a line from an unframed client itself, waiting for the rest
+   of it with u8_client_await_read(), and answers it with "ok" */
+static int await_serve(u8_client cl)
+{
+  char buf[64]; size_t got=0;
+  while ((got==0)||(buf[got-1]!='\n')) {
+    ssize_t n=recv(cl->socket,buf+got,sizeof(buf)-got,MSG_DONTWAIT);
+    if (n>0) got+=n;
+    else if ((n<0)&&((errno==EAGAIN)||(errno==EWOULDBLOCK))) {
+      errno=0; n_parked++;
+      if (u8_client_await_read(cl)<=0) return -1;}
+    else return -1;
+    if (got==sizeof(buf)) return -1;}
+  if (send(cl->socket,"ok\n",3,0)!=3) return -1;
+  return 0;
+}
+
+static void test_coroutines()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, waiting, quick;
+  u8_utime start;
+  u8_init_server(&srv,frame_accept,await_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,1,
+                 U8_SERVER_MAX_THREADS,1,
+                 U8_SERVER_FLAGS,U8_SERVER_COROUTINES,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  /* Without coroutines, the waiting client would tie up the thread */
+  if (!((srv.flags)&(U8_SERVER_COROUTINES))) {
+    stop_server(&srv,thread);
+    return;}
+  waiting=frame_client(port,U8_CLIENT_FRAME_NONE,0,NULL);
+  send(waiting,"half",4,0);
+  usleep(100000);
+  /* Another client is answered while the first one's servefn waits */
+  quick=frame_client(port,U8_CLIENT_FRAME_NONE,0,NULL);
+  start=u8_microtime();
+  send(quick,"quick\n",6,0);
+  CHECK(read_ok(quick),"coroutines: quick client not answered");
+  CHECK(msecs_since(start)<1000,
+        "coroutines: quick client waited %lldms",msecs_since(start));
+  CHECK(n_parked>0,"coroutines: servefn never waited");
+  /* And the first one finishes once the rest of its line arrives */
+  send(waiting," done\n",6,0);
+  CHECK(read_ok(waiting),"coroutines: waiting client not answered");
+  close(waiting); close(quick);
+  stop_server(&srv,thread);
+}
+
+#define N_PIPELINED 8
+
+/* Answers each line ("<n> <msecs>") with "<n>" after sleeping */
+static int pipeline_serve(u8_client cl)
+{
+  size_t len; char *data=(char *)u8_client_frame(cl,&len);
+  char line[32]; unsigned char response[2];
+  if ((data==NULL)||(len<3)||(len>=sizeof(line))||(data[1]!=' '))
+    return -1;
+  /* A request's frame isn't followed by its delimiter */
+  memcpy(line,data,len); line[len]='\0';
+  usleep(atoi(line+2)*1000);
+  response[0]=line[0]; response[1]='\n';
+  return u8_client_respond(cl,response,2,0);
+}
+
+static void test_pipeline()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, sock, i=0;
+  char requests[N_PIPELINED*16]="", *write=requests;
+  unsigned char responses[N_PIPELINED*2];
+  u8_utime start; long long msecs, total=0;
+  u8_init_server(&srv,frame_accept,pipeline_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,4,
+                 U8_SERVER_FLAGS,U8_SERVER_PIPELINE,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  /* Later requests finish sooner, but are answered in order */
+  while (i<N_PIPELINED) {
+    int sleep=(N_PIPELINED-i)*30;
+    write+=sprintf(write,"%d %d\n",i,sleep);
+    total+=sleep; i++;}
+  sock=sleep_client(port);
+  start=u8_microtime();
+  send(sock,requests,strlen(requests),0);
+  CHECK(read_all(sock,responses,sizeof(responses)),
+        "pipeline: responses missing");
+  msecs=msecs_since(start);
+  i=0; while (i<N_PIPELINED) {
+    CHECK((responses[i*2]=='0'+i)&&(responses[i*2+1]=='\n'),
+          "pipeline: response %d was '%c'",i,responses[i*2]);
+    i++;}
+  /* The requests were handled at the same time */
+  CHECK(msecs<total,"pipeline: took %lldms for %lldms of requests",
+        msecs,total);
+  close(sock);
+  stop_server(&srv,thread);
+}
+
+/* Metrics */
+
+/* Waits for a server to count some transactions, returning how many
+   it has counted */
+static long long await_trans(struct U8_SERVER *srv,long long n_trans)
+{
+  struct U8_SERVER_METRICS m; int i=0;
+  u8_server_metrics(srv,&m);
+  while ((m.n_trans<n_trans)&&(i<50)) {
+    usleep(20000); u8_server_metrics(srv,&m); i++;}
+  return m.n_trans;
+}
+
+/* Whether a line of Prometheus text is a comment or a sample of one
+   of the server's metrics ("name{labels} value") */
+static int sample_ok(const char *line,size_t len)
+{
+  char copy[512], *brace, *end; size_t i=0;
+  if ((len==0)||(len>=sizeof(copy))) return 0;
+  memcpy(copy,line,len); copy[len]='\0';
+  if ((strncmp(copy,"# HELP u8_server_",17)==0)||
+      (strncmp(copy,"# TYPE u8_server_",17)==0))
+    return 1;
+  if ((strncmp(copy,"u8_server_",10))||
+      ((brace=strchr(copy,'{'))==NULL)||
+      ((end=strrchr(copy,'}'))==NULL)||(end[1]!=' '))
+    return 0;
+  while (copy+i<brace) {
+    if (!((copy[i]=='_')||((copy[i]>='a')&&(copy[i]<='z'))||
+          ((copy[i]>='0')&&(copy[i]<='9'))))
+      return 0;
+    i++;}
+  strtod(end+2,&end);
+  return (*end=='\0');
+}
+
+/* Whether every line of Prometheus text is well formed */
+static int prometheus_ok(const char *text)
+{
+  while (*text) {
+    const char *eol=strchr(text,'\n');
+    if ((eol==NULL)||(!(sample_ok(text,eol-text)))) return 0;
+    text=eol+1;}
+  return 1;
+}
+
+/* Whether text is a single JSON object (followed by a newline) */
+static int json_ok(const char *text)
+{
+  int depth=0, quoted=0; const char *scan=text;
+  if (*scan!='{') return 0;
+  while (*scan) {
+    char c=*scan++;
+    if (quoted) {
+      if (c=='\\') {if (*scan) scan++;}
+      else if (c=='"') quoted=0;}
+    else if (c=='"') quoted=1;
+    else if (c=='{') depth++;
+    else if (c=='}') {
+      if (--depth==0) break;}}
+  return ((depth==0)&&(strcmp(scan,"\n")==0));
+}
+
+/* The value of a metric's sample in Prometheus text, or -1 */
+static long long sample_value(const char *text,const char *name)
+{
+  const char *scan=text; size_t len=strlen(name);
+  while ((scan=strstr(scan,name))) {
+    if (((scan==text)||(scan[-1]=='\n'))&&(scan[len]=='{')) {
+      const char *end=strchr(scan,'}');
+      return ((end)?(atoll(end+2)):(-1));}
+    scan=scan+len;}
+  return -1;
+}
+
+static void test_metrics()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, sock, i=0;
+  u8_string text; u8_byte buf[64];
+  u8_init_server(&srv,frame_accept,blob_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  sock=blob_client(port);
+  while (i<5) {
+    ask_blob(sock,100+i);
+    CHECK(read_blob(sock,100+i),"metrics: request %d not answered",i);
+    i++;}
+  CHECK(await_trans(&srv,5)==5,"metrics: counted %lld of 5 transactions",
+        await_trans(&srv,5));
+  text=u8_server_metrics_text(&srv,U8_METRICS_PROMETHEUS,NULL,0);
+  CHECK(prometheus_ok(text),"metrics: malformed Prometheus text:\n%s",text);
+  CHECK(sample_value(text,"u8_server_transactions_total")==5,
+        "metrics: Prometheus text gives %lld transactions",
+        sample_value(text,"u8_server_transactions_total"));
+  CHECK(sample_value(text,"u8_server_clients")==1,
+        "metrics: Prometheus text gives %lld clients",
+        sample_value(text,"u8_server_clients"));
+  u8_free(text);
+  text=u8_server_metrics_text(&srv,U8_METRICS_JSON,NULL,0);
+  CHECK(json_ok(text),"metrics: malformed JSON:\n%s",text);
+  CHECK(strstr(text,"\"transactions\":5,")!=NULL,
+        "metrics: JSON doesn't give 5 transactions:\n%s",text);
+  u8_free(text);
+  /* Output to a buffer is cut off to fit */
+  text=u8_server_metrics_text(&srv,U8_METRICS_JSON,buf,sizeof(buf));
+  CHECK((text==buf)&&(strlen(text)<sizeof(buf)),
+        "metrics: output overran its buffer");
+  close(sock);
+  stop_server(&srv,thread);
+  /* Each pipelined request counts as a transaction */
+  u8_init_server(&srv,frame_accept,pipeline_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_FLAGS,U8_SERVER_PIPELINE,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  sock=sleep_client(port);
+  send(sock,"0 0\n1 0\n2 0\n",12,0);
+  CHECK(read_all(sock,buf,6),"metrics: pipelined requests not answered");
+  CHECK(await_trans(&srv,3)==3,
+        "metrics: counted %lld transactions for 3 pipelined requests",
+        await_trans(&srv,3));
+  close(sock);
+  stop_server(&srv,thread);
+}
+
+/* Tracing */
+
+#define TRACE_HEADER \
+  "#seq\tclient\tthread\ttrans\tstarted\ttransact\tqueue\tread\twrite" \
+  "\texec\tbytes\tresult\n"
+
+/* Reads a trace dump (through a pipe), returning it (mallocd) */
+static char *read_dump(struct U8_SERVER *srv,int use_signal)
+{
+  int fds[2]; char *dump=u8_malloc(16384); size_t got=0; ssize_t n;
+  if (pipe(fds)<0) {u8_free(dump); return NULL;}
+  if (use_signal) {
+    u8_server_trace_signal(srv,SIGUSR2,fds[1]);
+    raise(SIGUSR2);
+    u8_server_trace_signal(NULL,SIGUSR2,-1);}
+  else u8_server_trace_dump(srv,fds[1]);
+  close(fds[1]);
+  while ((got<16383)&&((n=read(fds[0],dump+got,16383-got))>0)) got+=n;
+  close(fds[0]);
+  dump[got]='\0';
+  return dump;
+}
+
+/* Checks that a trace dump has a line for each record, with all of
+   its fields */
+static void check_dump(const char *what,const char *dump,
+                       struct U8_TRACE_RECORD *recs,int n)
+{
+  const char *line; int i=0;
+  if (dump==NULL) {CHECK(0,"%s: couldn't read the dump",what); return;}
+  CHECK(strncmp(dump,TRACE_HEADER,strlen(TRACE_HEADER))==0,
+        "%s: dump has no header",what);
+  line=dump+strlen(TRACE_HEADER);
+  while ((i<n)&&(*line)) {
+    const char *eol=strchr(line,'\n'), *scan=line; int n_fields=1;
+    if (eol==NULL) break;
+    while (scan<eol) if (*scan++=='\t') n_fields++;
+    CHECK(n_fields==12,"%s: line %d has %d fields",what,i,n_fields);
+    CHECK(strtoull(line,NULL,10)==recs[i].seq,
+          "%s: line %d is for record %llu rather than %llu",what,i,
+          strtoull(line,NULL,10),recs[i].seq);
+    line=eol+1; i++;}
+  CHECK((i==n)&&(*line=='\0'),"%s: dumped %d lines for %d records",
+        what,i,n);
+}
+
+static void test_trace()
+{
+  struct U8_SERVER srv; pthread_t thread; int port, sock, n, i=0;
+  struct U8_TRACE_RECORD recs[32]; char *dump;
+  u8_init_server(&srv,frame_accept,blob_serve,NULL,frame_close,
+                 U8_SERVER_NTHREADS,2,
+                 U8_SERVER_TRACE,16,
+                 U8_SERVER_END_INIT);
+  if ((port=start_server(&srv,&thread))==0) return;
+  sock=blob_client(port);
+  while (i<5) {
+    ask_blob(sock,100+i);
+    CHECK(read_blob(sock,100+i),"trace: request %d not answered",i);
+    i++;}
+  await_trans(&srv,5);
+  n=u8_server_trace(&srv,recs,32);
+  CHECK(n==5,"trace: %d records for 5 transactions",n);
+  i=0; while (i<n) {
+    CHECK(recs[i].seq==i+1,"trace: record %d has seq %llu",i,recs[i].seq);
+    CHECK(recs[i].bytes>=100+i,"trace: record %d has %d bytes",
+          i,(int)recs[i].bytes);
+    CHECK(recs[i].result>=0,"trace: record %d failed",i);
+    i++;}
+  dump=read_dump(&srv,0);
+  check_dump("trace",dump,recs,n);
+  u8_free(dump);
+  /* The ring keeps the most recent records */
+  i=0; while (i<20) {
+    ask_blob(sock,10);
+    CHECK(read_blob(sock,10),"trace: request %d not answered",i+5);
+    i++;}
+  await_trans(&srv,25);
+  n=u8_server_trace(&srv,recs,32);
+  CHECK((n==16)&&(recs[0].seq==10)&&(recs[15].seq==25),
+        "trace: kept %d records (%llu to %llu) of 25",
+        n,recs[0].seq,recs[n-1].seq);
+  /* And can be dumped from a signal handler */
+  dump=read_dump(&srv,1);
+  check_dump("trace signal",dump,recs,n);
+  u8_free(dump);
+  close(sock);
+  stop_server(&srv,thread);
+}
+
+/* CPU lists */
+
+static u8_client cpus_accept(u8_server srv,u8_socket sock,
+                             struct sockaddr *addr,size_t addr_len)
+{
+  return u8_client_init(NULL,sizeof(struct U8_CLIENT),
+                        addr,addr_len,sock,srv);
+}
+
+static int cpus_serve(u8_client cl)
+{
+  return 0;
+}
+
+/* Returns how many CPUs a server reports placing its threads over
+   for a U8_SERVER_CPUS list, or -1 if it doesn't place them */
+static int count_cpus(const char *spec)
+{
+  struct U8_SERVER server;
+  u8_string status; const char *over;
+  int n=-1;
+  u8_init_server(&server,cpus_accept,cpus_serve,NULL,NULL,
+                 U8_SERVER_NTHREADS,1,
+                 U8_SERVER_CPUS,spec,
+                 U8_SERVER_END_INIT);
+  status=u8_server_status(&server,NULL,0);
+  if ((over=strstr(status," over "))) n=atoi(over+6);
+  u8_free(status);
+  /* The loop sees it's been shut down and frees everything */
+  u8_server_shutdown(&server,0);
+  u8_server_loop(&server);
+  return n;
+}
+
+static void test_cpulists()
+{
+#if defined(CPU_SET)
+  static struct {const char *spec; int n;} cases[]=
+    {{"0",1},{"0,0",2},{"0-0, 0\n",2},{"0-0,0-0,0",3},
+     {"1-0",-1},{"x",-1},{"0-",-1},{"-1",-1}};
+  int i=0, n_cases=sizeof(cases)/sizeof(cases[0]);
+  while (i<n_cases) {
+    int n=count_cpus(cases[i].spec);
+    CHECK(n==cases[i].n,"CPU list \"%s\" names %d CPUs rather than %d",
+          cases[i].spec,n,cases[i].n);
+    i++;}
+#endif
+}
+
+int main(int argc,char **argv)
+{
+  signal(SIGPIPE,SIG_IGN);
+  alarm(120);
+  u8_initialize();
+  /* Leave out the notices and warnings the servers are expected to log */
+  u8_loglevel=LOG_ERR;
+  test_histograms();
+  test_framing();
+  test_cpulists();
+  test_epoll();
+  test_uring();
+  test_shards();
+  test_accept();
+  test_pooling();
+  test_slots();
+  test_inline();
+  test_stealing();
+  test_overload();
+  test_timeouts();
+  test_adaptive();
+  test_coroutines();
+  test_pipeline();
+  test_metrics();
+  test_trace();
+  test_sendfile();
+  test_writev();
+  if (failures) {
+    fprintf(stderr,"srvtest: %d failures\n",failures);
+    return 1;}
+  else {
+    fprintf(stdout,"srvtest: ok\n");
+    return 0;}
+}